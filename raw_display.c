@@ -1,9 +1,52 @@
 
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS, madvise & posix_memalign
 #include <errno.h>
 #include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#if defined(_WIN32)
+#include <malloc.h>
+// Just ansi for now
+#ifdef UNICODE
+#undef UNICODE
+#endif
+// Keep windows.h from defining min/max, which are defined below
+#define NOMINMAX
+#include <windows.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+/* Pixel kernels for other instruction sets, picked between at run time */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+/* MinGW doesn't align the stack for spills of 32 & 64 byte registers */
+#if !defined(_WIN32)
+#define HAVE_AVX_KERNELS 1
+#endif
+#endif
+/* The NEON kernels are only built on request (make NEON=1) until they have
+ * been checked against the reference routines on arm64 as often as the x86
+ * ones have */
+#if defined(__ARM_NEON) && CONFIG_RAW_DISPLAY_NEON
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+#if !defined(_WIN32)
+#include <pthread.h>
+#define HAVE_THREADS 1
+#endif
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "raw_display.h"
 
@@ -21,537 +64,1207 @@
         _a < _b ? _a : _b;                                                   \
     })
 
-/* If the configuration hasn't been specified, try and determine it */
-#ifndef CONFIG_RAW_DISPLAY
-#if __APPLE__ == 1
-#define CONFIG_RAW_DISPLAY RAW_DISPLAY_MODE_MACOS
-#elif __linux__ == 1
-#define CONFIG_RAW_DISPLAY RAW_DISPLAY_MODE_LINUX_XCB
-#elif defined(_WIN32)
-#define CONFIG_RAW_DISPLAY RAW_DISPLAY_MODE_WIN32
-#endif
-#endif
+/* Frame pacing state, see raw_display_set_target_fps. Times are in ns */
+struct frame_pacer {
+    int64_t period; // Time between frames, 0 if not pacing
+    enum raw_display_pacing mode;
+    int64_t spin;       // Time to busy-wait for before each deadline
+    int64_t deadline;   // When the next frame is due to be shown
+    int64_t draw_start; // When drawing of the current frame could begin
+    int64_t draw_avg;   // Smoothed time taken to draw a frame
+    int64_t draw_dev;   // Smoothed deviation of the drawing time
+};
 
-#if CONFIG_RAW_DISPLAY == RAW_DISPLAY_MODE_LINUX_XCB
-#include <xcb/xcb.h>
-#include <xcb/xcb_icccm.h>
-#include <xcb/xcb_image.h>
+/* Drawing state common to all of the backends, see the helper routines */
+struct draw_state {
+    struct raw_display_stats stats;
+    struct frame_pacer pacer;
+
+    bool clip_set;
+    int clip_x0;
+    int clip_y0;
+    int clip_x1;
+    int clip_y1;
+
+    struct raw_display_surface *target;   // NULL when drawing to the frame
+    struct raw_display_surface *surfaces; // All surfaces, in use or pooled
+    struct sprite_atlas *atlas;           // Created by the first sprite load
+    int threads; // Maximum number of threads for large operations
+    struct thread_pool *pool; // Started by the first operation to use it
+    struct colourmap_lut *colourmaps; // Built on first use of each map
+    struct trace *trace; // Recording of the calls made, NULL if not tracing
+};
 
-#define FRAME_COUNT 3
-struct raw_display {
-    xcb_connection_t *conn;
-    xcb_screen_t *screen;
-    xcb_window_t window;
-    xcb_gcontext_t gcontext;
-    xcb_intern_atom_reply_t *delete_atom;
+static void free_draw_state(struct draw_state *draw);
+static void select_kernels(void);
+static void thread_pool_destroy(struct thread_pool *pool);
+static void trace_flip(struct raw_display *rd);
+static int trace_close(struct trace *trace);
+static void trace_from_environment(struct raw_display *rd);
+static void trace_surface(struct raw_display *rd,
+                          struct raw_display_surface *surface, int y0,
+                          int y1);
+static void stream_copy(uint8_t *dst, int dst_stride, const uint8_t *src,
+                        int src_stride, int bytes, int rows);
+
+/* Set up what every backend shares, once the display is ready to draw on */
+static struct raw_display *finish_init(struct raw_display *rd)
+{
+    select_kernels();
+    trace_from_environment(rd);
+    return rd;
+}
 
-    int width;
-    int height;
-    int stride;
-    int bpp;
+#define DEFAULT_FRAME_COUNT 3
 
-    uint8_t *frames[FRAME_COUNT];
-    xcb_image_t *images[FRAME_COUNT];
-    xcb_size_hints_t hints;
-    int cur_frame;
+/* Tracks when each frame was last presented, for buffer age queries */
+struct frame_ages {
+    unsigned long flips;                             // Flips so far
+    unsigned long presented[RAW_DISPLAY_MAX_FRAMES]; // 0 if never shown
 };
 
-struct raw_display *raw_display_init(const char *title, int width, int height)
+static inline void note_flip(struct frame_ages *ages, int frame)
 {
-    struct raw_display *rd = calloc(sizeof *rd, 1);
-    uint32_t values[2];
-    uint32_t mask;
+    ages->presented[frame] = ++ages->flips;
+}
 
-    if (!rd)
-        return NULL;
+static int config_frame_count(const struct raw_display_config *config)
+{
+    if (!config || config->frame_count <= 0)
+        return DEFAULT_FRAME_COUNT;
+    return min(config->frame_count, RAW_DISPLAY_MAX_FRAMES);
+}
 
-    rd->width = width;
-    rd->height = height;
+static int config_scale(const struct raw_display_config *config)
+{
+    if (!config || config->scale <= 1)
+        return 1;
+    return config->scale;
+}
 
-    rd->conn = xcb_connect(NULL, NULL);
-    if (xcb_connection_has_error(rd->conn)) {
-        fprintf(stderr, "Cannot open display\n");
-        free(rd);
-        return NULL;
-    }
+__attribute__((unused)) static int
+config_tile_size(const struct raw_display_config *config)
+{
+    if (!config || config->tile_size <= 0)
+        return 0;
+    return config->tile_size;
+}
 
-    rd->screen = xcb_setup_roots_iterator(xcb_get_setup(rd->conn)).data;
-    rd->gcontext = xcb_generate_id(rd->conn);
+__attribute__((unused)) static int
+config_rotation(const struct raw_display_config *config)
+{
+    if (!config || config->rotation % 90)
+        return 0;
+    return (config->rotation % 360 + 360) % 360;
+}
 
-    printf("root_depth: %d\n", rd->screen->root_depth);
-    rd->bpp = 32;                     // rd->screen->root_depth; // FIXME
-    rd->stride = width * rd->bpp / 8; // FIXME
+/* Frames are aligned, and their rows padded, to this many bytes so that
+ * vector loops never have to deal with a partial row.
+ * The framebuffer backend maps its frames from the device instead, hence
+ * these being marked as possibly unused */
+#define FRAME_ALIGN 64
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
-    /* create black graphics context */
-    rd->gcontext = xcb_generate_id(rd->conn);
-    rd->window = rd->screen->root;
-    mask = XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES;
-    values[0] = rd->screen->black_pixel;
-    values[1] = 0;
-    xcb_create_gc(rd->conn, rd->gcontext, rd->window, mask, values);
+__attribute__((unused)) static int frame_stride(int width, int bpp)
+{
+    return (width * bpp / 8 + FRAME_ALIGN - 1) & ~(FRAME_ALIGN - 1);
+}
 
-    /* create window */
-    rd->window = xcb_generate_id(rd->conn);
-    mask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
-    values[0] = rd->screen->white_pixel;
-    values[1] = XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS |
-                XCB_EVENT_MASK_KEY_RELEASE | XCB_EVENT_MASK_BUTTON_PRESS |
-                XCB_EVENT_MASK_BUTTON_RELEASE;
+/**
+ * Allocate size bytes of zeroed, FRAME_ALIGN aligned memory to hold all of
+ * the frames. On Linux large allocations are placed on 2MB huge pages
+ * where possible, to cut TLB misses when sweeping over a frame
+ * @param size Number of bytes required
+ * @param alloc_size Area to store the real size, to pass to free_frames
+ * @return Allocated memory, NULL on failure
+ */
+__attribute__((unused)) static uint8_t *alloc_frames(size_t size,
+                                                    size_t *alloc_size)
+{
+#if defined(__linux__)
+    uint8_t *block;
+
+    if (size >= HUGE_PAGE_SIZE) {
+        size_t huge =
+            (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+        block = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (block != MAP_FAILED) {
+            *alloc_size = huge;
+            return block;
+        }
+#endif
+        /* No reserved huge pages, so ask for transparent ones instead.
+         * These need a 2MB aligned region, so trim an oversized mapping */
+        block = mmap(NULL, huge + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED)
+            return NULL;
+        size_t head = -(uintptr_t)block & (HUGE_PAGE_SIZE - 1);
+        if (head)
+            munmap(block, head);
+        munmap(block + head + huge, HUGE_PAGE_SIZE - head);
+        block += head;
+#ifdef MADV_HUGEPAGE
+        madvise(block, huge, MADV_HUGEPAGE);
+#endif
+        *alloc_size = huge;
+        return block;
+    }
 
-    xcb_create_window(rd->conn, rd->screen->root_depth, rd->window,
-                      rd->screen->root, 0, 0, width, height, 0,
-                      XCB_WINDOW_CLASS_INPUT_OUTPUT, rd->screen->root_visual,
-                      mask, values);
+    block = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED)
+        return NULL;
+    *alloc_size = size;
+    return block;
+#elif defined(_WIN32)
+    uint8_t *block = _aligned_malloc(size, FRAME_ALIGN);
 
-    /* Restrict the size of the window */
-    xcb_icccm_size_hints_set_max_size(&rd->hints, rd->width, rd->height);
-    xcb_icccm_size_hints_set_min_size(&rd->hints, rd->width, rd->height);
-    xcb_icccm_set_wm_size_hints(rd->conn, rd->window,
-                                XCB_ATOM_WM_NORMAL_HINTS, &rd->hints);
+    if (block)
+        memset(block, 0, size);
+    *alloc_size = size;
+    return block;
+#else
+    void *block;
 
-    /* Monitor for quit events */
-    xcb_intern_atom_cookie_t cookie =
-        xcb_intern_atom(rd->conn, 1, 12, "WM_PROTOCOLS");
-    xcb_intern_atom_reply_t *reply =
-        xcb_intern_atom_reply(rd->conn, cookie, 0);
+    if (posix_memalign(&block, FRAME_ALIGN, size))
+        return NULL;
+    memset(block, 0, size);
+    *alloc_size = size;
+    return block;
+#endif
+}
 
-    xcb_intern_atom_cookie_t cookie2 =
-        xcb_intern_atom(rd->conn, 0, 16, "WM_DELETE_WINDOW");
-    rd->delete_atom = xcb_intern_atom_reply(rd->conn, cookie2, 0);
-    xcb_change_property(rd->conn, XCB_PROP_MODE_REPLACE, rd->window,
-                        reply->atom, 4, 32, 1, &rd->delete_atom->atom);
+__attribute__((unused)) static void free_frames(uint8_t *block,
+                                                size_t alloc_size)
+{
+    if (!block)
+        return;
+#if defined(__linux__)
+    munmap(block, alloc_size);
+#elif defined(_WIN32)
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+}
 
-    /* show the window */
-    xcb_map_window(rd->conn, rd->window);
-    xcb_flush(rd->conn);
+/* Copy one row, repeating each pixel scale times */
+static void upscale_row(uint8_t *dst, const uint8_t *src, int width, int bpp,
+                        int scale)
+{
+    switch (bpp) {
+    case 32: {
+        uint32_t *dst32 = (uint32_t *)dst;
+        const uint32_t *src32 = (const uint32_t *)src;
+        int x = 0;
+
+#if defined(__SSE2__)
+        if (scale == 2) {
+            for (; x + 4 <= width; x += 4) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(src32 + x));
+                _mm_storeu_si128((__m128i *)(dst32 + x * 2),
+                                 _mm_unpacklo_epi32(v, v));
+                _mm_storeu_si128((__m128i *)(dst32 + x * 2 + 4),
+                                 _mm_unpackhi_epi32(v, v));
+            }
+        }
+#endif
+        for (; x < width; x++)
+            for (int i = 0; i < scale; i++)
+                dst32[x * scale + i] = src32[x];
+        break;
+    }
+    case 16: {
+        uint16_t *dst16 = (uint16_t *)dst;
+        const uint16_t *src16 = (const uint16_t *)src;
+        for (int x = 0; x < width; x++)
+            for (int i = 0; i < scale; i++)
+                dst16[x * scale + i] = src16[x];
+        break;
+    }
+    case 24:
+        for (int x = 0; x < width; x++)
+            for (int i = 0; i < scale; i++)
+                memcpy(dst + (x * scale + i) * 3, src + x * 3, 3);
+        break;
+    }
+}
 
-    for (int i = 0; i < FRAME_COUNT; i++) {
-        rd->frames[i] = calloc(rd->height, rd->stride * rd->bpp / 8);
-        rd->images[i] = xcb_image_create_native(
-            rd->conn, rd->width, rd->height, XCB_IMAGE_FORMAT_Z_PIXMAP,
-            rd->screen->root_depth, NULL, ~0, NULL);
-        rd->images[i]->data = rd->frames[i];
+/**
+ * Enlarge a frame by an integer factor, by pixel replication.
+ * Each row is widened once and then copied for the repeated rows
+ */
+__attribute__((unused)) static void
+upscale_frame(uint8_t *dst, int dst_stride, const uint8_t *src,
+              int src_stride, int width, int height, int bpp, int scale)
+{
+    size_t row_bytes = (size_t)width * scale * bpp / 8;
+
+    for (int y = 0; y < height; y++) {
+        uint8_t *row = dst + (size_t)y * scale * dst_stride;
+
+        upscale_row(row, src + (size_t)y * src_stride, width, bpp, scale);
+        for (int i = 1; i < scale; i++)
+            memcpy(row + (size_t)i * dst_stride, row, row_bytes);
     }
+}
 
-    // rd->symbols = xcb_key_symbols_alloc(rd->conn);
+/* Rotations are done in square blocks of this many pixels, so that both
+ * the rows read and the rows written stay in the L1 cache */
+#define ROTATE_BLOCK 32
 
-    return rd;
+static inline void copy_pixel(uint8_t *dst, const uint8_t *src, int bytes)
+{
+    switch (bytes) {
+    case 4:
+        *(uint32_t *)dst = *(const uint32_t *)src;
+        break;
+    case 2:
+        *(uint16_t *)dst = *(const uint16_t *)src;
+        break;
+    default:
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        break;
+    }
 }
 
-void raw_display_info(const struct raw_display *rd, int *width, int *height,
-                      int *bpp, int *stride)
+#if defined(__SSE2__)
+/* Reverse the order of the pixels in a vector of 16 or 32bpp pixels */
+static inline __m128i reverse_pixels(__m128i v, int bpp)
 {
-    if (!rd)
-        return;
-    if (width)
-        *width = rd->width;
-    if (height)
-        *height = rd->height;
-    if (bpp)
-        *bpp = rd->bpp;
-    if (stride)
-        *stride = rd->stride;
+    if (bpp == 16) {
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        return _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+    }
+    return _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
 }
 
-uint8_t *raw_display_get_frame(const struct raw_display *rd)
+/**
+ * Rotate one vector's worth of pixels square (4x4 at 32bpp, 8x8 at 16bpp)
+ * by transposing it, with source & steps as for rotate_block
+ */
+static void rotate_tile(uint8_t *dst, int dst_stride, const uint8_t *src,
+                        ptrdiff_t step_i, ptrdiff_t step_j, int bpp)
 {
-    return rd->frames[rd->cur_frame];
+    int lanes = 128 / bpp;
+    __m128i v[8], t[8];
+
+    /* Each destination column is a run of source pixels, going either
+     * forwards or backwards */
+    for (int k = 0; k < lanes; k++) {
+        const uint8_t *pos = src + k * step_i;
+
+        if (step_j > 0)
+            v[k] = _mm_loadu_si128((const __m128i *)pos);
+        else
+            v[k] = reverse_pixels(
+                _mm_loadu_si128(
+                    (const __m128i *)(pos + (lanes - 1) * step_j)),
+                bpp);
+    }
+
+    if (bpp == 32) {
+        t[0] = _mm_unpacklo_epi32(v[0], v[1]);
+        t[1] = _mm_unpacklo_epi32(v[2], v[3]);
+        t[2] = _mm_unpackhi_epi32(v[0], v[1]);
+        t[3] = _mm_unpackhi_epi32(v[2], v[3]);
+        v[0] = _mm_unpacklo_epi64(t[0], t[1]);
+        v[1] = _mm_unpackhi_epi64(t[0], t[1]);
+        v[2] = _mm_unpacklo_epi64(t[2], t[3]);
+        v[3] = _mm_unpackhi_epi64(t[2], t[3]);
+    } else {
+        for (int k = 0; k < 4; k++) {
+            t[k] = _mm_unpacklo_epi16(v[k * 2], v[k * 2 + 1]);
+            t[k + 4] = _mm_unpackhi_epi16(v[k * 2], v[k * 2 + 1]);
+        }
+        for (int k = 0; k < 2; k++) {
+            v[k * 2] = _mm_unpacklo_epi32(t[k * 4], t[k * 4 + 1]);
+            v[k * 2 + 1] = _mm_unpackhi_epi32(t[k * 4], t[k * 4 + 1]);
+            v[k * 2 + 4] = _mm_unpacklo_epi32(t[k * 4 + 2], t[k * 4 + 3]);
+            v[k * 2 + 5] = _mm_unpackhi_epi32(t[k * 4 + 2], t[k * 4 + 3]);
+        }
+        for (int k = 0; k < 4; k++) {
+            t[k * 2] = _mm_unpacklo_epi64(v[k], v[k + 4]);
+            t[k * 2 + 1] = _mm_unpackhi_epi64(v[k], v[k + 4]);
+        }
+        for (int k = 0; k < 8; k++)
+            v[k] = t[k];
+    }
+
+    for (int k = 0; k < lanes; k++)
+        _mm_storeu_si128((__m128i *)(dst + (size_t)k * dst_stride), v[k]);
 }
+#endif
 
-void raw_display_get_frame_details(const struct raw_display *rd,
-                                   int *frame_index, int *frame_count)
+/**
+ * Fill destination columns [i0, i1) of rows [j0, j1), where pixel (i, j)
+ * comes from origin + i * step_i + j * step_j
+ */
+static void rotate_block(uint8_t *dst, int dst_stride, const uint8_t *origin,
+                         ptrdiff_t step_i, ptrdiff_t step_j, int i0, int i1,
+                         int j0, int j1, int bpp)
 {
-    if (frame_index)
-        *frame_index = rd->cur_frame;
-    if (frame_count)
-        *frame_count = FRAME_COUNT;
+    int bytes = bpp / 8;
+    int j = j0;
+
+#if defined(__SSE2__)
+    if (bpp == 32 || bpp == 16) {
+        int lanes = 128 / bpp;
+
+        for (; j + lanes <= j1; j += lanes) {
+            int i = i0;
+
+            for (; i + lanes <= i1; i += lanes)
+                rotate_tile(dst + (size_t)j * dst_stride + i * bytes,
+                            dst_stride, origin + i * step_i + j * step_j,
+                            step_i, step_j, bpp);
+            for (; i < i1; i++)
+                for (int m = j; m < j + lanes; m++)
+                    copy_pixel(dst + (size_t)m * dst_stride + i * bytes,
+                               origin + i * step_i + m * step_j, bytes);
+        }
+    }
+#endif
+    for (; j < j1; j++)
+        for (int i = i0; i < i1; i++)
+            copy_pixel(dst + (size_t)j * dst_stride + i * bytes,
+                       origin + i * step_i + j * step_j, bytes);
 }
 
-void raw_display_flip(struct raw_display *rd)
+/* Copy a row of pixels, reversing their order */
+static void reverse_row(uint8_t *dst, const uint8_t *src, int width, int bpp)
 {
-    xcb_image_put(rd->conn, rd->window, rd->gcontext,
-                  rd->images[rd->cur_frame], 0, 0, 0);
-    xcb_flush(rd->conn);
-    rd->cur_frame = (rd->cur_frame + 1) % FRAME_COUNT;
+    int bytes = bpp / 8;
+    int x = 0;
+
+#if defined(__SSE2__)
+    if (bpp == 32 || bpp == 16) {
+        int lanes = 128 / bpp;
+
+        for (; x + lanes <= width; x += lanes)
+            _mm_storeu_si128(
+                (__m128i *)(dst + x * bytes),
+                reverse_pixels(_mm_loadu_si128((const __m128i *)(
+                                   src + (width - x - lanes) * bytes)),
+                               bpp));
+    }
+#endif
+    for (; x < width; x++)
+        copy_pixel(dst + x * bytes, src + (width - 1 - x) * bytes, bytes);
 }
 
-void raw_display_shutdown(struct raw_display *rd)
+/**
+ * Rotate a rectangle of pixels clockwise by 90, 180 or 270 degrees.
+ * The quarter turns are a transpose, which is done in blocks so that
+ * neither side is walked down a column for more than ROTATE_BLOCK pixels
+ * @param dst Top-left of the rotated rectangle, which is height pixels
+ * wide & width tall for a quarter turn
+ * @param src Top-left of the rectangle to rotate
+ */
+__attribute__((unused)) static void
+rotate_pixels(uint8_t *dst, int dst_stride, const uint8_t *src,
+              int src_stride, int width, int height, int bpp, int rotation)
 {
-    xcb_disconnect(rd->conn);
-    free(rd);
+    const uint8_t *origin;
+    ptrdiff_t step_i, step_j;
+
+    if (rotation == 180) {
+        for (int y = 0; y < height; y++)
+            reverse_row(dst + (size_t)y * dst_stride,
+                        src + (size_t)(height - 1 - y) * src_stride, width,
+                        bpp);
+        return;
+    }
+
+    /* Work out where in the source destination pixel (i, j) comes from.
+     * A quarter turn clockwise takes destination rows from the source's
+     * columns going down, and the columns from its rows going up */
+    if (rotation == 90) {
+        origin = src + (size_t)(height - 1) * src_stride;
+        step_i = -(ptrdiff_t)src_stride;
+        step_j = bpp / 8;
+    } else {
+        origin = src + (size_t)(width - 1) * (bpp / 8);
+        step_i = src_stride;
+        step_j = -(ptrdiff_t)(bpp / 8);
+    }
+
+    for (int jb = 0; jb < width; jb += ROTATE_BLOCK)
+        for (int ib = 0; ib < height; ib += ROTATE_BLOCK)
+            rotate_block(dst, dst_stride, origin, step_i, step_j, ib,
+                         min(ib + ROTATE_BLOCK, height), jb,
+                         min(jb + ROTATE_BLOCK, width), bpp);
 }
 
-bool raw_display_process_event(struct raw_display *rd,
-                               struct raw_display_event *event)
+#define TILE_HASH_K0 0x9e3779b97f4a7c15ull
+#define TILE_HASH_K1 0xc2b2ae3d27d4eb4full
+
+/* Hashes of the tiles of the last frame shown, to find what has changed */
+struct tile_diff {
+    int size; // Tile width & height in pixels, 0 if not in use
+    int cols;
+    int rows;
+    bool valid; // Set once hashes describes a frame that was shown
+    uint64_t *hashes;
+    uint8_t *dirty; // Per tile, set by tile_diff_update if it changed
+};
+
+static inline uint64_t rotl64(uint64_t x, int r)
 {
-    xcb_generic_event_t *e;
-    int last_frame = (rd->cur_frame + FRAME_COUNT - 1) % FRAME_COUNT;
+    return x << r | x >> (64 - r);
+}
 
-    while ((e = xcb_poll_for_event(rd->conn))) {
-        int type = e->response_type & ~0x80;
+#if defined(__SSE2__)
+/* One step of the tile hash, on two 64-bit lanes at once */
+static inline __m128i hash_step(__m128i acc, __m128i data, __m128i key)
+{
+    __m128i mixed = _mm_xor_si128(_mm_xor_si128(data, key), acc);
+    __m128i product = _mm_mul_epu32(mixed, _mm_srli_epi64(mixed, 32));
 
-        switch (type) {
-        case XCB_EXPOSE:
-            xcb_image_put(rd->conn, rd->window, rd->gcontext,
-                          rd->images[last_frame], 0, 0, 0);
-            xcb_flush(rd->conn);
-            break;
+    acc = _mm_or_si128(_mm_slli_epi64(acc, 23), _mm_srli_epi64(acc, 41));
+    return _mm_add_epi64(acc, _mm_add_epi64(data, product));
+}
+#else
+/* One step of the tile hash, on one 64-bit lane */
+static inline uint64_t hash_step(uint64_t acc, uint64_t data, uint64_t key)
+{
+    uint64_t mixed = data ^ key ^ acc;
 
-        case XCB_CLIENT_MESSAGE: {
-            xcb_client_message_event_t *client =
-                (xcb_client_message_event_t *)e;
-            if (client->data.data32[0] == rd->delete_atom->atom) {
-                printf("Should be quitting\n");
-            }
-            break;
-        }
+    return rotl64(acc, 23) + data + (uint32_t)mixed * (mixed >> 32);
+}
+#endif
 
-            /* TODO: Get key presses */
+/**
+ * Hash rows of bytes (a multiple of 16) bytes each.
+ * Each step mixes the accumulator into a multiply, so that moving content
+ * around within the tile changes the result. Two accumulators are run
+ * side by side to hide the multiply latency
+ */
+static uint64_t hash_tile(const uint8_t *pos, int stride, int bytes,
+                          int rows)
+{
+    uint64_t lanes[4];
+
+#if defined(__SSE2__)
+    const __m128i key = _mm_set_epi64x(TILE_HASH_K1, TILE_HASH_K0);
+    __m128i acc0 = _mm_set_epi64x(rows, bytes);
+    __m128i acc1 = _mm_set_epi64x(TILE_HASH_K0, TILE_HASH_K1);
+
+    for (int row = 0; row < rows; row++, pos += stride) {
+        int i = 0;
+        for (; i + 32 <= bytes; i += 32) {
+            acc0 = hash_step(
+                acc0, _mm_loadu_si128((const __m128i *)(pos + i)), key);
+            acc1 = hash_step(
+                acc1, _mm_loadu_si128((const __m128i *)(pos + i + 16)), key);
         }
-
-        free(e);
+        if (i < bytes)
+            acc0 = hash_step(
+                acc0, _mm_loadu_si128((const __m128i *)(pos + i)), key);
     }
+    _mm_storeu_si128((__m128i *)lanes, acc0);
+    _mm_storeu_si128((__m128i *)(lanes + 2), acc1);
+#else
+    lanes[0] = bytes;
+    lanes[1] = rows;
+    lanes[2] = TILE_HASH_K1;
+    lanes[3] = TILE_HASH_K0;
+    for (int row = 0; row < rows; row++, pos += stride) {
+        for (int i = 0; i < bytes; i += 16) {
+            uint64_t d[2];
+            int acc = (i & 16) ? 2 : 0;
+
+            memcpy(d, pos + i, sizeof(d));
+            lanes[acc] = hash_step(lanes[acc], d[0], TILE_HASH_K0);
+            lanes[acc + 1] = hash_step(lanes[acc + 1], d[1], TILE_HASH_K1);
+        }
+    }
+#endif
 
-    if (event)
-        memset(event, 0, sizeof(*event));
-    return false;
+    /* Fold the lanes together, then finalise as splitmix64 does */
+    uint64_t h = lanes[0] + rotl64(lanes[1], 17) * TILE_HASH_K1 +
+                 rotl64(lanes[2], 31) + rotl64(lanes[3], 47) * TILE_HASH_K0;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
 }
 
-#elif CONFIG_RAW_DISPLAY == RAW_DISPLAY_MODE_LINUX_FB
-#include <fcntl.h>
-#include <linux/fb.h>
-#include <linux/input.h>
-#include <linux/kd.h>
-#include <poll.h>
-#include <sys/ioctl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
+/* Set up to compare tiles of size pixels square, or none if size is 0 */
+__attribute__((unused)) static int tile_diff_init(struct tile_diff *tiles,
+                                                  int size, int width,
+                                                  int height)
+{
+    if (size <= 0)
+        return 0;
+
+    tiles->size = (size + 15) & ~15;
+    tiles->cols = (width + tiles->size - 1) / tiles->size;
+    tiles->rows = (height + tiles->size - 1) / tiles->size;
+    tiles->hashes = calloc(tiles->cols * tiles->rows, sizeof(uint64_t));
+    tiles->dirty = calloc(tiles->cols * tiles->rows, 1);
+    if (!tiles->hashes || !tiles->dirty)
+        return -ENOMEM;
+    return 0;
+}
 
-struct raw_display {
-    int fbdev;
-    int inputdev;
-    int width;
-    int height;
-    int stride;
-    int bpp;
-    int smem_len;
-    int cur_frame;
-    int max_frames;
-    uint8_t *base;
+__attribute__((unused)) static void tile_diff_free(struct tile_diff *tiles)
+{
+    free(tiles->hashes);
+    free(tiles->dirty);
+}
 
-    int last_x;
-    int last_y;
-    int last_touch;
-};
+/**
+ * Hash each tile of a frame which is about to be shown, and mark the ones
+ * which differ from the last frame shown in tiles->dirty.
+ * Rows are padded to FRAME_ALIGN, so the hashed width of the last column
+ * of tiles can be rounded up to 16 bytes without leaving the row
+ * @return Number of dirty tiles
+ */
+__attribute__((unused)) static int
+tile_diff_update(struct tile_diff *tiles, const uint8_t *frame, int stride,
+                 int width, int height, int bpp,
+                 struct raw_display_stats *stats)
+{
+    int dirty = 0;
+
+    for (int row = 0; row < tiles->rows; row++) {
+        int y = row * tiles->size;
+        int rows = min(tiles->size, height - y);
+
+        for (int col = 0; col < tiles->cols; col++) {
+            int x = col * tiles->size;
+            int bytes = (min(tiles->size, width - x) * bpp / 8 + 15) & ~15;
+            int index = row * tiles->cols + col;
+            uint64_t hash =
+                hash_tile(frame + (size_t)y * stride + x * bpp / 8, stride,
+                          bytes, rows);
+
+            tiles->dirty[index] =
+                !tiles->valid || tiles->hashes[index] != hash;
+            tiles->hashes[index] = hash;
+            dirty += tiles->dirty[index];
+        }
+    }
+    tiles->valid = true;
 
-struct raw_display *raw_display_init(const char *title, int width, int height)
+    stats->tiles += tiles->cols * tiles->rows;
+    stats->tiles_skipped += tiles->cols * tiles->rows - dirty;
+    return dirty;
+}
+
+static int64_t pacer_now(void)
 {
-    struct raw_display *rd;
-    int fd, inputdev, tty_fd;
-    struct fb_var_screeninfo fvsi;
-    struct fb_fix_screeninfo ffsi;
+#if defined(_WIN32)
+    LARGE_INTEGER count, freq;
 
-    fd = open("/dev/fb0", O_RDWR);
-    if (fd < 0) {
-        perror("open");
-        return NULL;
-    }
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (int64_t)((double)count.QuadPart * 1e9 / freq.QuadPart);
+#else
+    struct timespec ts;
 
-    if (ioctl(fd, FBIOBLANK, 0) < 0) {
-        fprintf(stderr, "Unable to unblank framebuffer: %s\n",
-                strerror(errno));
-    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
 
-    tty_fd = open("/dev/tty0", O_RDWR | O_SYNC);
+/**
+ * Sleep until the given time, busy-waiting for the final spin ns of it to
+ * avoid oversleeping because of the scheduler
+ */
+static void pacer_sleep_until(int64_t when, int64_t spin)
+{
+    int64_t wake = when - spin;
 
-    if (tty_fd != -1) {
-        if (ioctl(tty_fd, KDSETMODE, KD_GRAPHICS) < 0)
-            fprintf(stderr, "Unable to go into graphics mode: %s\n",
-                    strerror(errno));
-    }
+#if defined(__linux__)
+    struct timespec ts = {
+        .tv_sec = wake / 1000000000,
+        .tv_nsec = wake % 1000000000,
+    };
 
-    inputdev = open("/dev/input/event5", O_RDONLY | O_NONBLOCK);
-    if (inputdev < 0) {
-        perror("inputdev");
-    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR)
+        ;
+#elif defined(_WIN32)
+    int64_t remaining = wake - pacer_now();
 
-    if (ioctl(fd, FBIOGET_VSCREENINFO, &fvsi) < 0) {
-        perror("vscreeninfo");
-        close(fd);
-        return NULL;
+    /* Only millisecond resolution, so a spin is worthwhile */
+    if (remaining >= 1000000)
+        Sleep(remaining / 1000000);
+#else
+    int64_t remaining = wake - pacer_now();
+
+    if (remaining > 0) {
+        struct timespec ts = {
+            .tv_sec = remaining / 1000000000,
+            .tv_nsec = remaining % 1000000000,
+        };
+        nanosleep(&ts, NULL);
     }
+#endif
 
-    if (ioctl(fd, FBIOGET_FSCREENINFO, &ffsi) < 0) {
-        perror("fscreeninfo");
-        close(fd);
-        return NULL;
-    }
+    while (spin && pacer_now() < when)
+        ;
+}
 
-    rd = calloc(sizeof(struct raw_display), 1);
-    if (!rd) {
-        close(fd);
-        return NULL;
-    }
+/* Called by each backend's flip before showing the frame */
+static void pace_before_present(struct frame_pacer *pacer)
+{
+    int64_t now;
 
-    rd->fbdev = fd;
-    rd->inputdev = inputdev;
-    rd->width = fvsi.xres;
-    rd->height = fvsi.yres;
-    rd->stride = ffsi.line_length;
-    rd->bpp = fvsi.bits_per_pixel;
-    rd->max_frames = fvsi.yres_virtual / fvsi.yres;
-    rd->smem_len = ffsi.smem_len;
-    rd->base =
-        mmap(NULL, ffsi.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (rd->base == MAP_FAILED) {
-        perror("mmap");
-        free(rd);
-        close(fd);
-        return NULL;
+    if (!pacer->period)
+        return;
+
+    now = pacer_now();
+    if (pacer->draw_start) {
+        /* Track the drawing time like TCP tracks round trip times */
+        int64_t draw = now - pacer->draw_start;
+        int64_t error = draw - pacer->draw_avg;
+
+        pacer->draw_avg += error / 8;
+        pacer->draw_dev +=
+            ((error < 0 ? -error : error) - pacer->draw_dev) / 4;
     }
 
-    return rd;
+    /* Show the first frame straight away, and give up on catching up if
+     * we've fallen more than a frame behind */
+    if (!pacer->deadline || now > pacer->deadline + pacer->period)
+        pacer->deadline = now;
+    else
+        pacer_sleep_until(pacer->deadline, pacer->spin);
 }
 
-void raw_display_shutdown(struct raw_display *rd)
+/* Margin left for the scheduler when starting drawing late */
+#define PACER_SLACK 500000
+
+/* Called by each backend's flip once the frame has been shown */
+static void pace_after_present(struct frame_pacer *pacer)
 {
-    close(rd->fbdev);
-    if (rd->inputdev >= 0)
-        close(rd->inputdev);
-    munmap(rd->base, rd->smem_len);
-    free(rd);
+    if (!pacer->period)
+        return;
+
+    pacer->deadline += pacer->period;
+    if (pacer->mode == RAW_DISPLAY_PACING_low_latency) {
+        /* Hold off handing out the next frame, so that it is drawn as
+         * close as possible to when it will be shown */
+        int64_t budget =
+            pacer->draw_avg + 4 * pacer->draw_dev + PACER_SLACK;
+
+        if (budget < pacer->period)
+            pacer_sleep_until(pacer->deadline - budget, 0);
+    }
+    pacer->draw_start = pacer_now();
 }
 
-void raw_display_info(const struct raw_display *rd, int *width, int *height,
-                      int *bpp, int *stride)
+/* If the configuration hasn't been specified, try and determine it */
+#ifndef CONFIG_RAW_DISPLAY
+#if __APPLE__ == 1
+#define CONFIG_RAW_DISPLAY RAW_DISPLAY_MODE_MACOS
+#elif __linux__ == 1
+#define CONFIG_RAW_DISPLAY RAW_DISPLAY_MODE_LINUX_XCB
+#elif defined(_WIN32)
+#define CONFIG_RAW_DISPLAY RAW_DISPLAY_MODE_WIN32
+#endif
+#endif
+
+#if CONFIG_RAW_DISPLAY == RAW_DISPLAY_MODE_LINUX_FB ||                       \
+    CONFIG_RAW_DISPLAY == RAW_DISPLAY_MODE_LINUX_DRM
+#include <linux/input.h>
+#include <poll.h>
+
+/* Pointer input read straight from the kernel, for the backends which
+ * have no window system to deliver events */
+struct evdev_input {
+    int fd;
+    int last_x;
+    int last_y;
+    int last_touch;
+};
+
+static void evdev_open(struct evdev_input *input)
 {
-    if (width)
-        *width = rd->width;
-    if (height)
-        *height = rd->height;
-    if (bpp)
-        *bpp = rd->bpp;
-    if (stride)
-        *stride = rd->stride;
+    input->fd = open("/dev/input/event5", O_RDONLY | O_NONBLOCK);
+    if (input->fd < 0) {
+        perror("inputdev");
+    }
 }
 
-bool raw_display_process_event(struct raw_display *rd,
-                               struct raw_display_event *event)
+static void evdev_close(struct evdev_input *input)
+{
+    if (input->fd >= 0)
+        close(input->fd);
+}
+
+/* Read the next event, if there is one, with positions divided by scale */
+static bool evdev_read(struct evdev_input *input, int scale,
+                       struct raw_display_event *event)
 {
     struct pollfd pfd;
     int ready;
     struct input_event ev;
 
-    if (rd->inputdev < 0)
+    if (input->fd < 0)
         return false;
 
-    pfd.fd = rd->inputdev;
+    pfd.fd = input->fd;
     pfd.events = POLLIN;
     ready = poll(&pfd, 1, 0);
     if (ready < 0) {
         return false;
     }
-    ssize_t r = read(rd->inputdev, &ev, sizeof(ev));
+    ssize_t r = read(input->fd, &ev, sizeof(ev));
     if (r != sizeof(ev))
         return false;
 
     switch (ev.type) {
     case EV_ABS:
         if (ev.code == ABS_X)
-            rd->last_x = ev.value;
+            input->last_x = ev.value;
         if (ev.code == ABS_Y)
-            rd->last_y = ev.value;
+            input->last_y = ev.value;
         if (ev.code == BTN_TOUCH)
-            rd->last_touch = ev.value;
+            input->last_touch = ev.value;
 
     case EV_SYN:
         event->type = RAW_DISPLAY_EVENT_mouse_move;
-        event->mouse.x = rd->last_x;
-        event->mouse.y = rd->last_y;
+        event->mouse.x = input->last_x / scale;
+        event->mouse.y = input->last_y / scale;
         return true;
     }
 
     return false;
 }
+#endif
 
-uint8_t *raw_display_get_frame(const struct raw_display *rd)
-{
-    return rd->base + (rd->stride * rd->height) * rd->cur_frame;
-}
+#if CONFIG_RAW_DISPLAY == RAW_DISPLAY_MODE_LINUX_XCB
+#include <xcb/xcb.h>
+#include <xcb/xcb_icccm.h>
+#include <xcb/xcb_image.h>
+#if CONFIG_RAW_DISPLAY_PRESENT
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <xcb/present.h>
+#include <xcb/shm.h>
+#endif
 
-void raw_display_flip(struct raw_display *rd)
+struct raw_display {
+    xcb_connection_t *conn;
+    xcb_screen_t *screen;
+    xcb_window_t window;
+    xcb_gcontext_t gcontext;
+    xcb_intern_atom_reply_t *delete_atom;
+
+    int width;
+    int height;
+    int stride;
+    int bpp;
+    int scanline_pad;
+
+    uint8_t *frame_block;
+    size_t frame_block_size;
+    uint8_t *frames[RAW_DISPLAY_MAX_FRAMES];
+    xcb_image_t *images[RAW_DISPLAY_MAX_FRAMES];
+    xcb_size_hints_t hints;
+    int frame_count;
+    int cur_frame;
+    struct frame_ages ages;
+
+    /* When scaling, frames are enlarged into this image to be shown */
+    int scale;
+    int present_stride;
+    uint8_t *present_block;
+    size_t present_block_size;
+    xcb_image_t *present;
+
+    /* When diffing, changed tiles are packed in here to be sent */
+    struct tile_diff tiles;
+    uint8_t *tile_buffer;
+
+#if CONFIG_RAW_DISPLAY_PRESENT
+    /* When using the Present extension the frames are in shared memory,
+     * with a pixmap on each. A frame is busy from being presented until
+     * the server says it is idle again */
+    bool use_present;
+    xcb_shm_seg_t shm_seg;
+    uint8_t *shm_addr;
+    xcb_pixmap_t pixmaps[RAW_DISPLAY_MAX_FRAMES];
+    bool busy[RAW_DISPLAY_MAX_FRAMES];
+    xcb_present_event_t present_eid;
+    xcb_special_event_t *present_events;
+    uint32_t present_serial;
+    uint64_t last_msc;
+#endif
+
+    struct draw_state draw;
+};
+
+/**
+ * Work out the pixel layout the X server uses for the root visual, so the
+ * frames can be drawn in exactly that format and sent without conversion
+ */
+static int xcb_negotiate_format(struct raw_display *rd)
 {
-    struct fb_var_screeninfo fvsi;
-    uint32_t dummy;
-    if (ioctl(rd->fbdev, FBIOGET_VSCREENINFO, &fvsi) < 0) {
-        perror("vscreeninfo");
-        return;
+    const xcb_setup_t *setup = xcb_get_setup(rd->conn);
+    const uint16_t endian_test = 1;
+    int host_order = *(const uint8_t *)&endian_test
+                         ? XCB_IMAGE_ORDER_LSB_FIRST
+                         : XCB_IMAGE_ORDER_MSB_FIRST;
+    xcb_visualtype_t *visual = NULL;
+    int bpp = 0, pad = 0;
+
+    for (xcb_format_iterator_t fmt = xcb_setup_pixmap_formats_iterator(setup);
+         fmt.rem; xcb_format_next(&fmt)) {
+        if (fmt.data->depth == rd->screen->root_depth) {
+            bpp = fmt.data->bits_per_pixel;
+            pad = fmt.data->scanline_pad;
+            break;
+        }
     }
-    fvsi.yoffset = rd->cur_frame * fvsi.yres;
-    if (ioctl(rd->fbdev, FBIOPAN_DISPLAY, &fvsi) < 0) {
-        perror("fbiopan_display");
+
+    for (xcb_depth_iterator_t depth =
+             xcb_screen_allowed_depths_iterator(rd->screen);
+         depth.rem && !visual; xcb_depth_next(&depth)) {
+        for (xcb_visualtype_iterator_t vis =
+                 xcb_depth_visuals_iterator(depth.data);
+             vis.rem; xcb_visualtype_next(&vis)) {
+            if (vis.data->visual_id == rd->screen->root_visual) {
+                visual = vis.data;
+                break;
+            }
+        }
     }
-    if (ioctl(rd->fbdev, FBIO_WAITFORVSYNC, &dummy) < 0) {
-        perror("vsync");
+
+    if (!bpp || !pad || !visual) {
+        fprintf(stderr, "Cannot determine format of depth %d\n",
+                rd->screen->root_depth);
+        return -ENODEV;
     }
 
-    rd->cur_frame = (rd->cur_frame + 1) % rd->max_frames;
+    if (!((bpp == 32 || bpp == 24) && visual->red_mask == 0xff0000 &&
+          visual->green_mask == 0x00ff00 && visual->blue_mask == 0x0000ff) &&
+        !(bpp == 16 && visual->red_mask == 0xf800 &&
+          visual->green_mask == 0x07e0 && visual->blue_mask == 0x001f)) {
+        fprintf(stderr, "Unsupported visual: %dbpp r=%#x g=%#x b=%#x\n", bpp,
+                visual->red_mask, visual->green_mask, visual->blue_mask);
+        return -ENOTSUP;
+    }
+
+    if (bpp > 8 && setup->image_byte_order != host_order) {
+        fprintf(stderr, "Unsupported X server byte order\n");
+        return -ENOTSUP;
+    }
+
+    rd->bpp = bpp;
+    rd->scanline_pad = pad;
+    /* FRAME_ALIGN is a multiple of any scanline pad the server can ask for
+     */
+    rd->stride = frame_stride(rd->width, bpp);
+
+    return 0;
 }
 
-void raw_display_get_frame_details(const struct raw_display *rd,
-                                   int *frame_index, int *frame_count)
+#if CONFIG_RAW_DISPLAY_PRESENT
+/**
+ * Put the frames in shared memory with a pixmap on each, so they can be
+ * shown with PresentPixmap rather than copied over the socket.
+ * Fails if either extension is missing, or the server is remote
+ */
+static int xcb_present_init(struct raw_display *rd)
 {
-    if (frame_index)
-        *frame_index = rd->cur_frame;
-    if (frame_count)
-        *frame_count = rd->max_frames;
-}
+    const xcb_query_extension_reply_t *shm_ext, *present_ext;
+    size_t frame_size = (size_t)rd->stride * rd->height;
+    xcb_generic_error_t *error;
+    int shm_id;
+
+    shm_ext = xcb_get_extension_data(rd->conn, &xcb_shm_id);
+    present_ext = xcb_get_extension_data(rd->conn, &xcb_present_id);
+    if (!shm_ext || !shm_ext->present || !present_ext ||
+        !present_ext->present)
+        return -ENOTSUP;
+
+    shm_id = shmget(IPC_PRIVATE, frame_size * rd->frame_count,
+                    IPC_CREAT | 0600);
+    if (shm_id < 0)
+        return -errno;
+    rd->shm_addr = shmat(shm_id, NULL, 0);
+    if (rd->shm_addr == (void *)-1) {
+        rd->shm_addr = NULL;
+        shmctl(shm_id, IPC_RMID, NULL);
+        return -errno;
+    }
 
-#elif CONFIG_RAW_DISPLAY == RAW_DISPLAY_MODE_WIN32
+    rd->shm_seg = xcb_generate_id(rd->conn);
+    error = xcb_request_check(
+        rd->conn, xcb_shm_attach_checked(rd->conn, rd->shm_seg, shm_id, 0));
+    /* Once both sides are attached the segment can be marked for removal,
+     * so it doesn't outlive us */
+    shmctl(shm_id, IPC_RMID, NULL);
+    if (error) {
+        free(error);
+        shmdt(rd->shm_addr);
+        rd->shm_addr = NULL;
+        return -ENOTSUP;
+    }
 
-// Just ansi for now
-#ifdef UNICODE
-#undef UNICODE
-#endif
+    for (int i = 0; i < rd->frame_count; i++) {
+        rd->frames[i] = rd->shm_addr + frame_size * i;
+        rd->pixmaps[i] = xcb_generate_id(rd->conn);
+        xcb_shm_create_pixmap(rd->conn, rd->pixmaps[i], rd->window,
+                              rd->stride * 8 / rd->bpp, rd->height,
+                              rd->screen->root_depth, rd->shm_seg,
+                              frame_size * i);
+    }
 
-#include <windows.h>
-#define FRAME_COUNT 3
-struct raw_display {
-    WNDCLASSEXA wc;
-    HWND hwnd;
-    int width;
-    int height;
-    int stride;
-    uint8_t *frames[FRAME_COUNT];
-    int cur_frame;
-};
+    rd->present_eid = xcb_generate_id(rd->conn);
+    xcb_present_select_input(rd->conn, rd->present_eid, rd->window,
+                             XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY |
+                                 XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY);
+    rd->present_events = xcb_register_for_special_xge(
+        rd->conn, &xcb_present_id, rd->present_eid, NULL);
+    rd->use_present = true;
 
-static LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam,
-                                   LPARAM lParam)
-{
-    printf("WindowProc %d\n", uMsg);
-    switch (uMsg) {
-    case WM_DESTROY:
-        PostQuitMessage(0);
-        break;
+    return 0;
+}
 
-    case WM_PAINT: {
-        PAINTSTRUCT ps;
-        HDC hdc;
-        HDC hdcMem;
-        HBITMAP bitmap;
-        struct raw_display *rd;
+static void xcb_present_handle(struct raw_display *rd,
+                               xcb_generic_event_t *e)
+{
+    xcb_present_generic_event_t *ge = (xcb_present_generic_event_t *)e;
 
-        rd = (struct raw_display *)GetWindowLongPtrA(hwnd, GWLP_USERDATA);
-        if (!rd) {
-            printf("no raw display");
-            return 0;
-        }
+    switch (ge->evtype) {
+    case XCB_PRESENT_COMPLETE_NOTIFY: {
+        xcb_present_complete_notify_event_t *ce =
+            (xcb_present_complete_notify_event_t *)e;
 
-        printf("redrawing\n");
-        hdc = BeginPaint(hwnd, &ps);
+        if (ce->kind != XCB_PRESENT_COMPLETE_KIND_PIXMAP)
+            break;
+        /* Each frame asks for the vblank after the previous one */
+        if (rd->last_msc && ce->msc > rd->last_msc + 1)
+            rd->draw.stats.missed_vblanks += ce->msc - rd->last_msc - 1;
+        rd->last_msc = ce->msc;
+        rd->draw.stats.present_time_us = ce->ust;
+        break;
+    }
 
-        hdcMem = CreateCompatibleDC(hdc);
-        bitmap = CreateBitmap(rd->width, rd->height, 1, 32,
-                              rd->frames[rd->cur_frame]);
-        SelectObject(hdcMem, bitmap);
-        BitBlt(hdc, 0, 0, rd->width, rd->height, hdcMem, 0, 0, SRCCOPY);
+    case XCB_PRESENT_IDLE_NOTIFY: {
+        xcb_present_idle_notify_event_t *ie =
+            (xcb_present_idle_notify_event_t *)e;
 
-        DeleteObject(bitmap);
-        DeleteDC(hdcMem);
-        EndPaint(hwnd, &ps);
+        for (int i = 0; i < rd->frame_count; i++)
+            if (rd->pixmaps[i] == ie->pixmap)
+                rd->busy[i] = false;
         break;
     }
-    default:
-        return DefWindowProc(hwnd, uMsg, wParam, lParam);
     }
-    return 0;
+    free(e);
 }
 
-struct raw_display *raw_display_init(const char *title, int width, int height)
+static void xcb_present_flip(struct raw_display *rd)
 {
-    struct raw_display *rd;
-    const char classname[] = "Class Name";
-    HINSTANCE hInstance = GetModuleHandle(NULL);
-    // const wchar_t title2[] = L"title"; // todo: convert title to wchar
+    xcb_generic_event_t *e;
 
-    rd = calloc(sizeof(struct raw_display), 1);
-    if (!rd)
-        return NULL;
+    /* Leaving the target as 0 shows it at the next vblank */
+    xcb_present_pixmap(rd->conn, rd->window, rd->pixmaps[rd->cur_frame],
+                       ++rd->present_serial, 0, 0, 0, 0, 0, 0, 0,
+                       XCB_PRESENT_OPTION_NONE, 0, 0, 0, 0, NULL);
+    xcb_flush(rd->conn);
+    rd->busy[rd->cur_frame] = true;
+
+    note_flip(&rd->ages, rd->cur_frame);
+    rd->cur_frame = (rd->cur_frame + 1) % rd->frame_count;
+
+    /* The next frame can't be drawn into until the server is done with
+     * it, which is what paces us to the display */
+    while ((e = xcb_poll_for_special_event(rd->conn, rd->present_events)))
+        xcb_present_handle(rd, e);
+    while (rd->busy[rd->cur_frame] &&
+           (e = xcb_wait_for_special_event(rd->conn, rd->present_events)))
+        xcb_present_handle(rd, e);
+}
 
-    // Step 1: Registering the Window Class
-    rd->wc.cbSize = sizeof(WNDCLASSEX);
-    rd->wc.style = 0;
-    rd->wc.lpfnWndProc = WindowProc;
-    rd->wc.cbClsExtra = 0;
-    rd->wc.cbWndExtra = 0;
-    rd->wc.hInstance = hInstance;
-    rd->wc.hIcon = LoadIcon(NULL, IDI_APPLICATION);
-    rd->wc.hCursor = LoadCursor(NULL, IDC_ARROW);
-    rd->wc.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
-    rd->wc.lpszMenuName = NULL;
-    rd->wc.lpszClassName = classname;
-    rd->wc.hIconSm = LoadIcon(NULL, IDI_APPLICATION);
+static void xcb_present_shutdown(struct raw_display *rd)
+{
+    if (!rd->use_present)
+        return;
+    for (int i = 0; i < rd->frame_count; i++)
+        xcb_free_pixmap(rd->conn, rd->pixmaps[i]);
+    xcb_unregister_for_special_event(rd->conn, rd->present_events);
+    xcb_shm_detach(rd->conn, rd->shm_seg);
+    xcb_flush(rd->conn);
+    shmdt(rd->shm_addr);
+}
+#endif
 
-    if (!RegisterClassExA(&rd->wc)) {
-        free(rd);
+struct raw_display *raw_display_init_config(
+    const char *title, int width, int height,
+    const struct raw_display_config *config)
+{
+    struct raw_display *rd = calloc(sizeof *rd, 1);
+    uint32_t values[2];
+    uint32_t mask;
+
+    if (!rd)
         return NULL;
-    }
 
-    // Step 2: Creating the Window
-    // rd->hwnd =
-    // CreateWindowEx(WS_EX_CLIENTEDGE, classname, title2,
-    // WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, CW_USEDEFAULT,
-    // width, height, NULL, NULL, hInstance, NULL);
+    rd->width = width;
+    rd->height = height;
+    rd->frame_count = config_frame_count(config);
+    rd->scale = config_scale(config);
 
-    rd->hwnd = CreateWindowExA(WS_EX_CLIENTEDGE, classname, title,
-                               WS_OVERLAPPED | WS_MINIMIZEBOX | WS_SYSMENU,
-                               CW_USEDEFAULT, CW_USEDEFAULT, width, height,
-                               NULL, NULL, hInstance, NULL
+    rd->conn = xcb_connect(NULL, NULL);
+    if (xcb_connection_has_error(rd->conn)) {
+        fprintf(stderr, "Cannot open display\n");
+        free(rd);
+        return NULL;
+    }
 
-    );
+    rd->screen = xcb_setup_roots_iterator(xcb_get_setup(rd->conn)).data;
+    rd->gcontext = xcb_generate_id(rd->conn);
 
-    printf("hwnd: %p\n", rd->hwnd);
-    if (rd->hwnd == NULL) {
+    if (xcb_negotiate_format(rd) < 0) {
+        xcb_disconnect(rd->conn);
         free(rd);
         return NULL;
     }
+    printf("root_depth: %d bpp: %d stride: %d\n", rd->screen->root_depth,
+           rd->bpp, rd->stride);
+
+    /* create black graphics context */
+    rd->gcontext = xcb_generate_id(rd->conn);
+    rd->window = rd->screen->root;
+    mask = XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES;
+    values[0] = rd->screen->black_pixel;
+    values[1] = 0;
+    xcb_create_gc(rd->conn, rd->gcontext, rd->window, mask, values);
+
+    /* create window */
+    rd->window = xcb_generate_id(rd->conn);
+    mask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
+    values[0] = rd->screen->white_pixel;
+    values[1] = XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS |
+                XCB_EVENT_MASK_KEY_RELEASE | XCB_EVENT_MASK_BUTTON_PRESS |
+                XCB_EVENT_MASK_BUTTON_RELEASE;
+
+    xcb_create_window(rd->conn, rd->screen->root_depth, rd->window,
+                      rd->screen->root, 0, 0, width * rd->scale,
+                      height * rd->scale, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                      rd->screen->root_visual, mask, values);
+
+    /* Restrict the size of the window */
+    xcb_icccm_size_hints_set_max_size(&rd->hints, width * rd->scale,
+                                      height * rd->scale);
+    xcb_icccm_size_hints_set_min_size(&rd->hints, width * rd->scale,
+                                      height * rd->scale);
+    xcb_icccm_set_wm_size_hints(rd->conn, rd->window,
+                                XCB_ATOM_WM_NORMAL_HINTS, &rd->hints);
+
+    /* Monitor for quit events */
+    xcb_intern_atom_cookie_t cookie =
+        xcb_intern_atom(rd->conn, 1, 12, "WM_PROTOCOLS");
+    xcb_intern_atom_reply_t *reply =
+        xcb_intern_atom_reply(rd->conn, cookie, 0);
+
+    xcb_intern_atom_cookie_t cookie2 =
+        xcb_intern_atom(rd->conn, 0, 16, "WM_DELETE_WINDOW");
+    rd->delete_atom = xcb_intern_atom_reply(rd->conn, cookie2, 0);
+    xcb_change_property(rd->conn, XCB_PROP_MODE_REPLACE, rd->window,
+                        reply->atom, 4, 32, 1, &rd->delete_atom->atom);
+    free(reply);
+
+    /* show the window */
+    xcb_map_window(rd->conn, rd->window);
+    xcb_flush(rd->conn);
+
+#if CONFIG_RAW_DISPLAY_PRESENT
+    /* Scaling & tile diffing both assume the frames are sent as images.
+     * A single frame can't be used either, as the server may keep the
+     * pixmap shown until another replaces it, so it never goes idle */
+    if (rd->scale == 1 && !(config && config->tile_size > 0) &&
+        rd->frame_count >= 2 && xcb_present_init(rd) == 0)
+        return finish_init(rd);
+#endif
 
-    for (int i = 0; i < FRAME_COUNT; i++) {
-        rd->frames[i] = calloc(width * height, 4);
-        if (!rd->frames[i]) {
-            for (int j = 0; j < i; j++)
-                free(rd->frames[j]);
-            free(rd);
+    rd->frame_block = alloc_frames((size_t)rd->stride * rd->height *
+                                       rd->frame_count,
+                                   &rd->frame_block_size);
+    if (!rd->frame_block) {
+        raw_display_shutdown(rd);
+        return NULL;
+    }
+    for (int i = 0; i < rd->frame_count; i++) {
+        /* The images are made wide enough to cover the row padding, with
+         * the extra columns falling outside of the window */
+        rd->frames[i] = rd->frame_block + (size_t)rd->stride * rd->height * i;
+        rd->images[i] = xcb_image_create_native(
+            rd->conn, rd->stride * 8 / rd->bpp, rd->height,
+            XCB_IMAGE_FORMAT_Z_PIXMAP, rd->screen->root_depth, NULL, ~0,
+            NULL);
+        if (!rd->images[i]) {
+            raw_display_shutdown(rd);
             return NULL;
         }
+        rd->images[i]->data = rd->frames[i];
     }
 
-    SetWindowLongPtrA(rd->hwnd, GWLP_USERDATA, (LONG_PTR)rd);
+    if (rd->scale > 1) {
+        int height = rd->height * rd->scale;
+
+        rd->present_stride = frame_stride(rd->width * rd->scale, rd->bpp);
+        rd->present_block =
+            alloc_frames((size_t)rd->present_stride * height,
+                         &rd->present_block_size);
+        if (rd->present_block)
+            rd->present = xcb_image_create_native(
+                rd->conn, rd->present_stride * 8 / rd->bpp, height,
+                XCB_IMAGE_FORMAT_Z_PIXMAP, rd->screen->root_depth, NULL, ~0,
+                NULL);
+        if (!rd->present) {
+            raw_display_shutdown(rd);
+            return NULL;
+        }
+        rd->present->data = rd->present_block;
+    }
 
-    rd->width = width;
-    rd->height = height;
-    rd->stride = width * 4; // TODO: Correct?
+    if (tile_diff_init(&rd->tiles, config_tile_size(config), rd->width,
+                       rd->height) < 0) {
+        raw_display_shutdown(rd);
+        return NULL;
+    }
+    if (rd->tiles.size) {
+        /* Big enough for a full row of tiles, once scaled */
+        rd->tile_buffer =
+            malloc((size_t)frame_stride(rd->width * rd->scale, rd->bpp) *
+                   rd->tiles.size * rd->scale);
+        if (!rd->tile_buffer) {
+            raw_display_shutdown(rd);
+            return NULL;
+        }
+    }
 
-    ShowWindow(rd->hwnd, SW_SHOWNORMAL);
-    UpdateWindow(rd->hwnd);
+    // rd->symbols = xcb_key_symbols_alloc(rd->conn);
 
-    return rd;
+    return finish_init(rd);
 }
 
 void raw_display_info(const struct raw_display *rd, int *width, int *height,
                       int *bpp, int *stride)
 {
+    if (!rd)
+        return;
     if (width)
         *width = rd->width;
     if (height)
         *height = rd->height;
     if (bpp)
-        *bpp = 32;
+        *bpp = rd->bpp;
     if (stride)
-        *stride = rd->width * 4;
+        *stride = rd->stride;
 }
 
 uint8_t *raw_display_get_frame(const struct raw_display *rd)
@@ -565,139 +1278,362 @@ void raw_display_get_frame_details(const struct raw_display *rd,
     if (frame_index)
         *frame_index = rd->cur_frame;
     if (frame_count)
-        *frame_count = FRAME_COUNT;
+        *frame_count = rd->frame_count;
 }
 
-bool raw_display_process_event(struct raw_display *rd,
-                               struct raw_display_event *event)
+/* Send a rectangle of an image, packing its rows together first */
+static void xcb_put_region(struct raw_display *rd, const uint8_t *data,
+                           int stride, int x, int y, int width, int height)
 {
-    MSG Msg;
-    int count = 0;
+    int pad = rd->scanline_pad / 8;
+    int row_bytes = (width * rd->bpp / 8 + pad - 1) / pad * pad;
+
+    for (int row = 0; row < height; row++)
+        memcpy(rd->tile_buffer + (size_t)row * row_bytes,
+               data + (size_t)(y + row) * stride + x * rd->bpp / 8,
+               width * rd->bpp / 8);
+    xcb_put_image(rd->conn, XCB_IMAGE_FORMAT_Z_PIXMAP, rd->window,
+                  rd->gcontext, width, height, x, y, 0,
+                  rd->screen->root_depth, row_bytes * height,
+                  rd->tile_buffer);
+}
 
-    while (GetQueueStatus(QS_MOUSEBUTTON | QS_KEY) != 0) {
-        if (GetMessage(&Msg, NULL, 0, 0) > 0) {
-            printf("message %d, %d\n", count++, Msg.message);
-            TranslateMessage(&Msg);
-            DispatchMessage(&Msg);
+/* Send only the tiles which changed, merging neighbours on the same row */
+static void xcb_flip_tiles(struct raw_display *rd)
+{
+    const uint8_t *frame = rd->frames[rd->cur_frame];
+    struct tile_diff *tiles = &rd->tiles;
+    int scale = rd->scale;
+
+    if (!tile_diff_update(tiles, frame, rd->stride, rd->width, rd->height,
+                          rd->bpp, &rd->draw.stats))
+        return;
+
+    for (int row = 0; row < tiles->rows; row++) {
+        const uint8_t *dirty = tiles->dirty + row * tiles->cols;
+        int y = row * tiles->size;
+        int height = min(tiles->size, rd->height - y);
+
+        for (int col = 0; col < tiles->cols; col++) {
+            int end = col, x, width;
+
+            if (!dirty[col])
+                continue;
+            while (end < tiles->cols && dirty[end])
+                end++;
+            x = col * tiles->size;
+            width = min(end * tiles->size, rd->width) - x;
+            col = end;
+
+            if (!rd->present) {
+                xcb_put_region(rd, frame, rd->stride, x, y, width, height);
+                continue;
+            }
+            upscale_frame(rd->present_block +
+                              (size_t)y * scale * rd->present_stride +
+                              x * scale * rd->bpp / 8,
+                          rd->present_stride,
+                          frame + (size_t)y * rd->stride + x * rd->bpp / 8,
+                          rd->stride, width, height, rd->bpp, scale);
+            xcb_put_region(rd, rd->present_block, rd->present_stride,
+                           x * scale, y * scale, width * scale,
+                           height * scale);
         }
     }
-
-    return false;
 }
 
 void raw_display_flip(struct raw_display *rd)
 {
-    printf("flip: %d -> %d\n", rd->cur_frame,
-           (rd->cur_frame + 1) % FRAME_COUNT);
-    rd->cur_frame = (rd->cur_frame + 1) % FRAME_COUNT;
-    RedrawWindow(rd->hwnd, NULL, NULL, RDW_INVALIDATE | RDW_UPDATENOW);
-    // InvalidateRect(rd->hwnd, NULL, false);
+    trace_flip(rd);
+    pace_before_present(&rd->draw.pacer);
+#if CONFIG_RAW_DISPLAY_PRESENT
+    if (rd->use_present) {
+        xcb_present_flip(rd);
+        pace_after_present(&rd->draw.pacer);
+        return;
+    }
+#endif
+    if (rd->tiles.size) {
+        xcb_flip_tiles(rd);
+    } else if (rd->present) {
+        upscale_frame(rd->present_block, rd->present_stride,
+                      rd->frames[rd->cur_frame], rd->stride, rd->width,
+                      rd->height, rd->bpp, rd->scale);
+        xcb_image_put(rd->conn, rd->window, rd->gcontext, rd->present, 0, 0,
+                      0);
+    } else {
+        xcb_image_put(rd->conn, rd->window, rd->gcontext,
+                      rd->images[rd->cur_frame], 0, 0, 0);
+    }
+    xcb_flush(rd->conn);
+    note_flip(&rd->ages, rd->cur_frame);
+    rd->cur_frame = (rd->cur_frame + 1) % rd->frame_count;
+    pace_after_present(&rd->draw.pacer);
 }
 
 void raw_display_shutdown(struct raw_display *rd)
 {
-    DestroyWindow(rd->hwnd);
+    for (int i = 0; i < rd->frame_count; i++) {
+        if (rd->images[i])
+            xcb_image_destroy(rd->images[i]);
+    }
+    if (rd->present)
+        xcb_image_destroy(rd->present);
+    tile_diff_free(&rd->tiles);
+    free(rd->tile_buffer);
+#if CONFIG_RAW_DISPLAY_PRESENT
+    xcb_present_shutdown(rd);
+#endif
+    free_frames(rd->present_block, rd->present_block_size);
+    free_frames(rd->frame_block, rd->frame_block_size);
+    free(rd->delete_atom);
+    xcb_disconnect(rd->conn);
+    free_draw_state(&rd->draw);
     free(rd);
 }
-#elif CONFIG_RAW_DISPLAY == RAW_DISPLAY_MODE_MACOS
 
-#define _DARWIN_C_SOURCE
-#ifndef NSIG
-#define NSIG __DARWIN_NSIG
+bool raw_display_process_event(struct raw_display *rd,
+                               struct raw_display_event *event)
+{
+    xcb_generic_event_t *e;
+    int last_frame =
+        (rd->cur_frame + rd->frame_count - 1) % rd->frame_count;
+
+#if CONFIG_RAW_DISPLAY_PRESENT
+    if (rd->use_present)
+        while ((e = xcb_poll_for_special_event(rd->conn,
+                                               rd->present_events)))
+            xcb_present_handle(rd, e);
 #endif
-#import <Cocoa/Cocoa.h>
+
+    while ((e = xcb_poll_for_event(rd->conn))) {
+        int type = e->response_type & ~0x80;
+
+        switch (type) {
+        case XCB_EXPOSE:
+#if CONFIG_RAW_DISPLAY_PRESENT
+            if (rd->use_present) {
+                xcb_copy_area(rd->conn, rd->pixmaps[last_frame], rd->window,
+                              rd->gcontext, 0, 0, 0, 0, rd->width,
+                              rd->height);
+                xcb_flush(rd->conn);
+                break;
+            }
+#endif
+            /* The present image still holds the last frame shown */
+            xcb_image_put(rd->conn, rd->window, rd->gcontext,
+                          rd->present ? rd->present : rd->images[last_frame],
+                          0, 0, 0);
+            xcb_flush(rd->conn);
+            break;
+
+        case XCB_CLIENT_MESSAGE: {
+            xcb_client_message_event_t *client =
+                (xcb_client_message_event_t *)e;
+            if (client->data.data32[0] == rd->delete_atom->atom) {
+                printf("Should be quitting\n");
+            }
+            break;
+        }
+
+            /* TODO: Get key presses */
+        }
+
+        free(e);
+    }
+
+    if (event)
+        memset(event, 0, sizeof(*event));
+    return false;
+}
+
+#elif CONFIG_RAW_DISPLAY == RAW_DISPLAY_MODE_LINUX_FB
+#include <fcntl.h>
+#include <linux/fb.h>
+#include <linux/kd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+/* Tile size used to find the changes to a shadow frame, unless the
+ * configuration gives one */
+#define FB_SHADOW_TILE_SIZE 64
 
-#define FRAME_COUNT 3
 struct raw_display {
-    NSApplication *nsapp;
-    NSWindow *window;
-    NSView *view;
+    int fbdev;
+    struct evdev_input input;
     int width;
     int height;
-    int bpp;
     int stride;
+    int bpp;
+    int smem_len;
     int cur_frame;
-    uint8_t *frames[FRAME_COUNT];
-    CGDataProviderRef frame_data[FRAME_COUNT];
-    CGImageRef frame_images[FRAME_COUNT];
-    CGColorSpaceRef colorspace;
-    NSAutoreleasePool *pool;
+    int max_frames;
+    uint8_t *base;
+    struct frame_ages ages;
+
+    /* When scaling, drawing happens in these smaller frames, which are
+     * enlarged into the framebuffer page of the same index on flip */
+    int scale;
+    int fb_stride;
+    uint8_t *frame_block;
+    size_t frame_block_size;
+
+    /* With only one page there is nowhere to draw out of sight, so drawing
+     * happens in a shadow frame in RAM (frame_block) instead. The tiles of
+     * it which changed are copied across on flip */
+    struct tile_diff tiles;
+
+    /* When rotating, drawing also happens in frame_block, which is turned
+     * onto the screen on flip. If scaling too it is turned into the
+     * rotated frame first, then enlarged from there */
+    int rotation;
+    int rotated_stride;
+    uint8_t *rotated;
+    size_t rotated_size;
+
+    struct draw_state draw;
 };
 
-@interface RawView : NSView {
-}
-- (void)drawRect:(NSRect)rect; // instance method interface
-@end
+struct raw_display *raw_display_init_config(
+    const char *title, int width, int height,
+    const struct raw_display_config *config)
+{
+    struct raw_display *rd;
+    struct evdev_input input = {0};
+    int fd, tty_fd, frame_count;
+    struct fb_var_screeninfo fvsi;
+    struct fb_fix_screeninfo ffsi;
 
-@implementation RawView
+    fd = open("/dev/fb0", O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return NULL;
+    }
 
-static struct raw_display *rd_global = NULL;
+    if (ioctl(fd, FBIOBLANK, 0) < 0) {
+        fprintf(stderr, "Unable to unblank framebuffer: %s\n",
+                strerror(errno));
+    }
 
-- (void)drawRect:(NSRect)rect
-{
-    struct raw_display *rd = rd_global;
-    int frame = (rd->cur_frame - 1 + FRAME_COUNT) % FRAME_COUNT;
-    CGContextRef ctx = NSGraphicsContext.currentContext.CGContext;
+    tty_fd = open("/dev/tty0", O_RDWR | O_SYNC);
 
-    NSRect drawRect = NSMakeRect(0, 0, rd->width, rd->height);
+    if (tty_fd != -1) {
+        if (ioctl(tty_fd, KDSETMODE, KD_GRAPHICS) < 0)
+            fprintf(stderr, "Unable to go into graphics mode: %s\n",
+                    strerror(errno));
+    }
 
-    CGContextDrawImage(ctx, drawRect, rd->frame_images[frame]);
-}
-@end
+    evdev_open(&input);
 
-struct raw_display *raw_display_init(const char *title, int width, int height)
-{
-    struct raw_display *rd;
+    if (ioctl(fd, FBIOGET_VSCREENINFO, &fvsi) < 0) {
+        perror("vscreeninfo");
+        close(fd);
+        return NULL;
+    }
 
-    rd = calloc(sizeof(*rd), 1);
-    if (!rd)
+    if (ioctl(fd, FBIOGET_FSCREENINFO, &ffsi) < 0) {
+        perror("fscreeninfo");
+        close(fd);
         return NULL;
+    }
 
-    rd_global = rd;
+    /* Try and grow the virtual resolution to fit the requested frames */
+    frame_count = config_frame_count(config);
+    if (config && config->frame_count > 0 &&
+        fvsi.yres_virtual < fvsi.yres * frame_count) {
+        struct fb_var_screeninfo want = fvsi;
+
+        want.yres_virtual = fvsi.yres * frame_count;
+        if (ioctl(fd, FBIOPUT_VSCREENINFO, &want) < 0 ||
+            ioctl(fd, FBIOGET_VSCREENINFO, &fvsi) < 0 ||
+            ioctl(fd, FBIOGET_FSCREENINFO, &ffsi) < 0)
+            fprintf(stderr, "Unable to allocate %d frames: %s\n",
+                    frame_count, strerror(errno));
+    }
 
-    // create the application object
-    rd->nsapp = [NSApplication sharedApplication];
+    rd = calloc(sizeof(struct raw_display), 1);
+    if (!rd) {
+        close(fd);
+        return NULL;
+    }
 
-    rd->width = width;
-    rd->height = height;
-    rd->stride = width * 4;
-    rd->bpp = 32;
-
-    NSRect frame = NSMakeRect(0, 0, width, height);
-    NSUInteger style_mask = NSWindowStyleMaskClosable |
-                            NSWindowStyleMaskTitled |
-                            NSWindowStyleMaskMiniaturizable;
-    rd->window = [[[NSWindow alloc] initWithContentRect:frame
-                                              styleMask:style_mask
-                                                backing:NSBackingStoreBuffered
-                                                  defer:NO] autorelease];
-    [rd->window setAcceptsMouseMovedEvents:YES];
+    rd->fbdev = fd;
+    rd->input = input;
+    rd->scale = config_scale(config);
+    rd->rotation = config_rotation(config);
+    rd->width = fvsi.xres / rd->scale;
+    rd->height = fvsi.yres / rd->scale;
+    if (rd->rotation == 90 || rd->rotation == 270) {
+        rd->width = fvsi.yres / rd->scale;
+        rd->height = fvsi.xres / rd->scale;
+    }
+    rd->fb_stride = ffsi.line_length;
+    rd->stride = ffsi.line_length;
+    rd->bpp = fvsi.bits_per_pixel;
+    rd->max_frames = max(fvsi.yres_virtual / fvsi.yres, 1u);
+    if (config && config->frame_count > 0)
+        rd->max_frames = min(rd->max_frames, frame_count);
+    rd->smem_len = ffsi.smem_len;
+    rd->base =
+        mmap(NULL, ffsi.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (rd->base == MAP_FAILED) {
+        perror("mmap");
+        free(rd);
+        close(fd);
+        return NULL;
+    }
 
-    NSString *nstitle = [[NSString alloc] initWithUTF8String:title];
-    [rd->window setTitle:nstitle];
+    if (rd->max_frames == 1) {
+        int tile_size = config_tile_size(config);
 
-    rd->view = [[[RawView alloc] initWithFrame:frame] autorelease];
+        if (tile_diff_init(&rd->tiles,
+                           tile_size ? tile_size : FB_SHADOW_TILE_SIZE,
+                           rd->width, rd->height) < 0) {
+            raw_display_shutdown(rd);
+            return NULL;
+        }
+    }
 
-    [rd->window setContentView:rd->view];
+    if (rd->rotation && rd->scale > 1) {
+        int width = fvsi.xres / rd->scale;
 
-    [rd->window makeKeyAndOrderFront:NSApp];
+        rd->rotated_stride = frame_stride(width, rd->bpp);
+        rd->rotated = alloc_frames((size_t)rd->rotated_stride *
+                                       (fvsi.yres / rd->scale),
+                                   &rd->rotated_size);
+        if (!rd->rotated) {
+            raw_display_shutdown(rd);
+            return NULL;
+        }
+    }
 
-    rd->colorspace = CGColorSpaceCreateDeviceRGB();
-    int size = rd_global->stride * rd_global->height;
-    for (int i = 0; i < FRAME_COUNT; i++) {
-        rd->frames[i] = calloc(rd->height, rd->stride);
-        rd->frame_data[i] = CGDataProviderCreateWithData(
-            NULL, rd_global->frames[i], size, NULL);
-        rd->frame_images[i] = CGImageCreate(
-            rd_global->width, rd_global->height, 8, 32, rd_global->stride,
-            rd->colorspace,
-            kCGBitmapByteOrder32Little | kCGImageAlphaNoneSkipFirst,
-            rd->frame_data[i], NULL, true, kCGRenderingIntentDefault);
+    if (rd->scale > 1 || rd->tiles.size || rd->rotation) {
+        rd->stride = frame_stride(rd->width, rd->bpp);
+        rd->frame_block =
+            alloc_frames((size_t)rd->stride * rd->height * rd->max_frames,
+                         &rd->frame_block_size);
+        if (!rd->frame_block) {
+            raw_display_shutdown(rd);
+            return NULL;
+        }
     }
-    rd->pool = [[NSAutoreleasePool alloc] init];
 
-    return rd;
+    return finish_init(rd);
+}
+
+void raw_display_shutdown(struct raw_display *rd)
+{
+    close(rd->fbdev);
+    evdev_close(&rd->input);
+    munmap(rd->base, rd->smem_len);
+    tile_diff_free(&rd->tiles);
+    free_frames(rd->rotated, rd->rotated_size);
+    free_frames(rd->frame_block, rd->frame_block_size);
+    free_draw_state(&rd->draw);
+    free(rd);
 }
 
 void raw_display_info(const struct raw_display *rd, int *width, int *height,
@@ -713,145 +1649,172 @@ void raw_display_info(const struct raw_display *rd, int *width, int *height,
         *stride = rd->stride;
 }
 
-uint8_t *raw_display_get_frame(const struct raw_display *rd)
-{
-    return rd->frames[rd->cur_frame];
-}
-
-void raw_display_get_frame_details(const struct raw_display *rd,
-                                   int *frame_index, int *frame_count)
-{
-    if (frame_index)
-        *frame_index = rd->cur_frame;
-    if (frame_count)
-        *frame_count = FRAME_COUNT;
-}
-
 bool raw_display_process_event(struct raw_display *rd,
                                struct raw_display_event *event)
 {
-    NSEvent *nevent = [rd->nsapp nextEventMatchingMask:NSEventMaskAny
-                                             untilDate:[NSDate distantPast]
-                                                inMode:NSDefaultRunLoopMode
-                                               dequeue:YES];
-    [rd->pool release];
-    rd->pool = [[NSAutoreleasePool alloc] init];
-    if (!nevent)
+    int x, y;
+
+    if (!evdev_read(&rd->input, rd->scale, event))
         return false;
-    memset(event, 0, sizeof(*event));
-    // NSEventTypeLeftMouseDown);
-    switch ([nevent type]) {
-    case NSEventTypeLeftMouseDown: {
-        NSPoint location = [nevent locationInWindow];
-        event->type = RAW_DISPLAY_EVENT_mouse_down;
-        event->mouse.button = RAW_DISPLAY_MOUSE_left;
-        event->mouse.x = location.x;
-        event->mouse.y = rd->height - location.y;
-        // If the click is in the title bar, just ignore it
-        if (event->mouse.y < 0)
-            event->type = RAW_DISPLAY_EVENT_unknown;
-        break;
-    }
 
-    case NSEventTypeLeftMouseUp: {
-        NSPoint location = [nevent locationInWindow];
-        event->type = RAW_DISPLAY_EVENT_mouse_up;
-        event->mouse.button = RAW_DISPLAY_MOUSE_left;
-        event->mouse.x = location.x;
-        event->mouse.y = rd->height - location.y;
-        // If the click is in the title bar, just ignore it
-        if (event->mouse.y < 0)
-            event->type = RAW_DISPLAY_EVENT_unknown;
-        break;
-    }
-    case NSEventTypeMouseMoved: {
-        NSPoint location = [nevent locationInWindow];
-        event->type = RAW_DISPLAY_EVENT_mouse_move;
-        event->mouse.x = location.x;
-        event->mouse.y = rd->height - location.y;
-        break;
-    }
-    case NSEventTypeAppKitDefined: {
-        // NSEventSubtype subtype = [nevent subtype];
-        // printf("appkit subtype: %d\n", subtype);
-        event->type = RAW_DISPLAY_EVENT_unknown;
+    /* Turn the position on the screen back to where it is in the frame */
+    x = event->mouse.x;
+    y = event->mouse.y;
+    switch (rd->rotation) {
+    case 90:
+        event->mouse.x = y;
+        event->mouse.y = rd->height - 1 - x;
         break;
-    }
-    case NSEventTypeScrollWheel: {
-        NSPoint location = [nevent locationInWindow];
-        event->type = RAW_DISPLAY_EVENT_mouse_up;
-        event->mouse.x = location.x;
-        event->mouse.y = rd->height - location.y;
-        event->mouse.button = [nevent scrollingDeltaY] < 0
-                                  ? RAW_DISPLAY_MOUSE_scroll_up
-                                  : RAW_DISPLAY_MOUSE_scroll_down;
+    case 180:
+        event->mouse.x = rd->width - 1 - x;
+        event->mouse.y = rd->height - 1 - y;
         break;
-    }
-    default:
-        printf("unhandled event type: %lu\n", (unsigned long)[nevent type]);
+    case 270:
+        event->mouse.x = rd->width - 1 - y;
+        event->mouse.y = x;
         break;
     }
-    [rd->nsapp sendEvent:nevent];
-    [rd->nsapp updateWindows];
-
     return true;
 }
 
-void raw_display_flip(struct raw_display *rd)
+uint8_t *raw_display_get_frame(const struct raw_display *rd)
 {
-    rd->cur_frame = (rd->cur_frame + 1) % FRAME_COUNT;
-    [rd->view display];
+    if (rd->frame_block)
+        return rd->frame_block +
+               (size_t)rd->stride * rd->height * rd->cur_frame;
+    return rd->base + (rd->stride * rd->height) * rd->cur_frame;
 }
 
-void raw_display_shutdown(struct raw_display *rd)
+/**
+ * Show a rectangle of the current frame, which is in RAM, on a page of the
+ * framebuffer, turning and enlarging it as needed
+ */
+static void fb_present_region(struct raw_display *rd, uint8_t *page, int x,
+                              int y, int width, int height)
 {
-    if (!rd)
-        return;
-    for (int i = 0; i < FRAME_COUNT; i++) {
-        free(rd->frames[i]);
-        CFRelease(rd->frame_data[i]);
-        CFRelease(rd->frame_images[i]);
+    const uint8_t *src = raw_display_get_frame(rd);
+    int src_stride = rd->stride;
+    int bytes = rd->bpp / 8;
+    int scale = rd->scale;
+
+    src += (size_t)y * src_stride + x * bytes;
+    if (rd->rotation) {
+        uint8_t *dst = scale > 1 ? rd->rotated : page;
+        int dst_stride = scale > 1 ? rd->rotated_stride : rd->fb_stride;
+        int turned_x = x, turned_y = y;
+
+        /* Find where the rectangle ends up once turned */
+        switch (rd->rotation) {
+        case 90:
+            turned_x = rd->height - y - height;
+            turned_y = x;
+            break;
+        case 180:
+            turned_x = rd->width - x - width;
+            turned_y = rd->height - y - height;
+            break;
+        case 270:
+            turned_x = y;
+            turned_y = rd->width - x - width;
+            break;
+        }
+        dst += (size_t)turned_y * dst_stride + turned_x * bytes;
+        rotate_pixels(dst, dst_stride, src, src_stride, width, height,
+                      rd->bpp, rd->rotation);
+        if (scale == 1)
+            return;
+
+        src = dst;
+        src_stride = dst_stride;
+        x = turned_x;
+        y = turned_y;
+        if (rd->rotation != 180) {
+            int swap = width;
+
+            width = height;
+            height = swap;
+        }
     }
-    CFRelease(rd->colorspace);
-    free(rd);
+
+    page += (size_t)y * scale * rd->fb_stride + x * scale * bytes;
+    if (scale > 1)
+        upscale_frame(page, rd->fb_stride, src, src_stride, width, height,
+                      rd->bpp, scale);
+    else
+        stream_copy(page, rd->fb_stride, src, src_stride, width * bytes,
+                    height);
 }
-#elif CONFIG_RAW_DISPLAY == RAW_DISPLAY_MODE_DUMMY
-#define FRAME_COUNT 3
-struct raw_display {
-    int width;
-    int height;
 
-    uint8_t *frames[FRAME_COUNT];
-    int cur_frame;
-};
-struct raw_display *raw_display_init(const char *title, int width, int height)
+/* Copy the tiles of the shadow frame which changed onto the screen,
+ * merging neighbours on the same row */
+static void fb_flip_tiles(struct raw_display *rd)
 {
-    struct raw_display *rd;
+    const uint8_t *frame = rd->frame_block;
+    struct tile_diff *tiles = &rd->tiles;
 
-    rd = calloc(sizeof(*rd), 1);
-    if (!rd)
-        return NULL;
+    if (!tile_diff_update(tiles, frame, rd->stride, rd->width, rd->height,
+                          rd->bpp, &rd->draw.stats))
+        return;
 
-    rd->width = width;
-    rd->height = height;
+    for (int row = 0; row < tiles->rows; row++) {
+        const uint8_t *dirty = tiles->dirty + row * tiles->cols;
+        int y = row * tiles->size;
+        int height = min(tiles->size, rd->height - y);
 
-    for (int i = 0; i < FRAME_COUNT; i++) {
-        rd->frames[i] = calloc(width * height * 4, 1);
-        if (!rd->frames[i]) {
-            for (int j = 0; j < i; j++) {
-                free(rd->frames[j]);
-            }
-            free(rd);
-            return NULL;
+        for (int col = 0; col < tiles->cols; col++) {
+            int end = col, x, width;
+
+            if (!dirty[col])
+                continue;
+            while (end < tiles->cols && dirty[end])
+                end++;
+            x = col * tiles->size;
+            width = min(end * tiles->size, rd->width) - x;
+            col = end;
+
+            fb_present_region(rd, rd->base, x, y, width, height);
         }
     }
-
-    return rd;
 }
 
-uint8_t *raw_display_get_frame(const struct raw_display *rd)
+void raw_display_flip(struct raw_display *rd)
 {
-    return rd->frames[rd->cur_frame];
+    struct fb_var_screeninfo fvsi;
+    uint32_t dummy;
+    trace_flip(rd);
+    pace_before_present(&rd->draw.pacer);
+    if (rd->tiles.size) {
+        /* Copy straight after the vblank, to get as far as possible
+         * ahead of the scan out before it reaches the changes */
+        if (ioctl(rd->fbdev, FBIO_WAITFORVSYNC, &dummy) < 0) {
+            perror("vsync");
+        }
+        fb_flip_tiles(rd);
+        note_flip(&rd->ages, rd->cur_frame);
+        pace_after_present(&rd->draw.pacer);
+        return;
+    }
+    if (ioctl(rd->fbdev, FBIOGET_VSCREENINFO, &fvsi) < 0) {
+        perror("vscreeninfo");
+        return;
+    }
+    if (rd->frame_block)
+        fb_present_region(rd,
+                          rd->base +
+                              (size_t)rd->fb_stride * fvsi.yres *
+                                  rd->cur_frame,
+                          0, 0, rd->width, rd->height);
+    fvsi.yoffset = rd->cur_frame * fvsi.yres;
+    if (ioctl(rd->fbdev, FBIOPAN_DISPLAY, &fvsi) < 0) {
+        perror("fbiopan_display");
+    }
+    if (ioctl(rd->fbdev, FBIO_WAITFORVSYNC, &dummy) < 0) {
+        perror("vsync");
+    }
+
+    note_flip(&rd->ages, rd->cur_frame);
+    rd->cur_frame = (rd->cur_frame + 1) % rd->max_frames;
+    pace_after_present(&rd->draw.pacer);
 }
 
 void raw_display_get_frame_details(const struct raw_display *rd,
@@ -860,176 +1823,3088 @@ void raw_display_get_frame_details(const struct raw_display *rd,
     if (frame_index)
         *frame_index = rd->cur_frame;
     if (frame_count)
-        *frame_count = FRAME_COUNT;
+        *frame_count = rd->max_frames;
 }
 
-void raw_display_info(const struct raw_display *rd, int *width, int *height,
-                      int *bpp, int *stride)
-{
-    if (!rd)
-        return;
-    if (width)
-        *width = rd->width;
-    if (height)
-        *height = rd->height;
-    if (bpp)
-        *bpp = 32;
-    if (stride)
-        *stride = rd->width * 4;
-}
+#elif CONFIG_RAW_DISPLAY == RAW_DISPLAY_MODE_WIN32
 
-void raw_display_flip(struct raw_display *rd)
-{
-    rd->cur_frame = (rd->cur_frame + 1) % FRAME_COUNT;
-}
+struct raw_display {
+    WNDCLASSEXA wc;
+    HWND hwnd;
+    int width;
+    int height;
+    int stride;
+    uint8_t *frame_block;
+    size_t frame_block_size;
+    uint8_t *frames[RAW_DISPLAY_MAX_FRAMES];
+    int frame_count;
+    int cur_frame;
+    struct frame_ages ages;
+    int scale; // GDI enlarges the frame by this much when painting
 
-void raw_display_shutdown(struct raw_display *rd)
-{
-    free(rd);
-}
+    struct draw_state draw;
+};
 
-bool raw_display_process_event(struct raw_display *rd,
-                               struct raw_display_event *event)
+static LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam,
+                                   LPARAM lParam)
 {
-    return false;
-}
+    printf("WindowProc %d\n", uMsg);
+    switch (uMsg) {
+    case WM_DESTROY:
+        PostQuitMessage(0);
+        break;
 
-#else
-#error "Unable to determine CONFIG_RAW_DISPLAY"
-#endif
+    case WM_PAINT: {
+        PAINTSTRUCT ps;
+        HDC hdc;
+        HDC hdcMem;
+        HBITMAP bitmap;
+        struct raw_display *rd;
 
-/*************** HELPER ROUTINES *****************/
+        rd = (struct raw_display *)GetWindowLongPtrA(hwnd, GWLP_USERDATA);
+        if (!rd) {
+            printf("no raw display");
+            return 0;
+        }
 
-/**
- * 8x8 monochrome bitmap fonts for rendering
- * Author: Daniel Hepper <daniel@hepper.net>
- *
- * License: Public Domain
- *
- * Based on:
- * // Summary: font8x8.h
- * // 8x8 monochrome bitmap fonts for rendering
- * //
- * // Author:
- * //     Marcel Sondaar
- * //     International Business Machines (public domain VGA fonts)
- * //
- * // License:
- * //     Public Domain
- *
- * Fetched from:
- *http://dimensionalrift.homelinux.net/combuster/mos3/?p=viewsource&file=/modules/gfx/font8_8.asm
- **/
+        printf("redrawing\n");
+        hdc = BeginPaint(hwnd, &ps);
 
-// Constant: font8x8_basic
-// Contains an 8x8 font map for unicode points U+0020 - U+007F (basic latin)
-static const uint8_t font8x8[96][8] = {
-    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+0020 (space)
-    {0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00}, // U+0021 (!)
-    {0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+0022 (")
-    {0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00}, // U+0023 (#)
-    {0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00}, // U+0024 ($)
-    {0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00}, // U+0025 (%)
-    {0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00}, // U+0026 (&)
-    {0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+0027 (')
-    {0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00}, // U+0028 (()
-    {0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00}, // U+0029 ())
-    {0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00}, // U+002A (*)
-    {0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00}, // U+002B (+)
-    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06}, // U+002C (,)
-    {0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00}, // U+002D (-)
-    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00}, // U+002E (.)
-    {0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00}, // U+002F (/)
-    {0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00}, // U+0030 (0)
-    {0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00}, // U+0031 (1)
-    {0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00}, // U+0032 (2)
-    {0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00}, // U+0033 (3)
-    {0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00}, // U+0034 (4)
-    {0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00}, // U+0035 (5)
-    {0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00}, // U+0036 (6)
-    {0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00}, // U+0037 (7)
-    {0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00}, // U+0038 (8)
-    {0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00}, // U+0039 (9)
-    {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00}, // U+003A (:)
-    {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06}, // U+003B (;)
-    {0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00}, // U+003C (<)
-    {0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00}, // U+003D (=)
-    {0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00}, // U+003E (>)
-    {0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00}, // U+003F (?)
-    {0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00}, // U+0040 (@)
-    {0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00}, // U+0041 (A)
-    {0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00}, // U+0042 (B)
-    {0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00}, // U+0043 (C)
-    {0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00}, // U+0044 (D)
-    {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00}, // U+0045 (E)
-    {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00}, // U+0046 (F)
-    {0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00}, // U+0047 (G)
-    {0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00}, // U+0048 (H)
-    {0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // U+0049 (I)
-    {0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00}, // U+004A (J)
-    {0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00}, // U+004B (K)
-    {0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00}, // U+004C (L)
-    {0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00}, // U+004D (M)
-    {0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00}, // U+004E (N)
-    {0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00}, // U+004F (O)
-    {0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00}, // U+0050 (P)
-    {0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00}, // U+0051 (Q)
-    {0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00}, // U+0052 (R)
-    {0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00}, // U+0053 (S)
-    {0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // U+0054 (T)
-    {0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00}, // U+0055 (U)
-    {0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00}, // U+0056 (V)
-    {0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00}, // U+0057 (W)
-    {0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00}, // U+0058 (X)
-    {0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00}, // U+0059 (Y)
-    {0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00}, // U+005A (Z)
-    {0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00}, // U+005B ([)
-    {0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00}, // U+005C (\)
-    {0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00}, // U+005D (])
-    {0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00}, // U+005E (^)
-    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF}, // U+005F (_)
-    {0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+0060 (`)
-    {0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00}, // U+0061 (a)
-    {0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00}, // U+0062 (b)
-    {0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00}, // U+0063 (c)
-    {0x38, 0x30, 0x30, 0x3e, 0x33, 0x33, 0x6E, 0x00}, // U+0064 (d)
-    {0x00, 0x00, 0x1E, 0x33, 0x3f, 0x03, 0x1E, 0x00}, // U+0065 (e)
-    {0x1C, 0x36, 0x06, 0x0f, 0x06, 0x06, 0x0F, 0x00}, // U+0066 (f)
-    {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F}, // U+0067 (g)
-    {0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00}, // U+0068 (h)
-    {0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // U+0069 (i)
-    {0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E}, // U+006A (j)
-    {0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00}, // U+006B (k)
-    {0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // U+006C (l)
-    {0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00}, // U+006D (m)
-    {0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00}, // U+006E (n)
-    {0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00}, // U+006F (o)
-    {0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F}, // U+0070 (p)
-    {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78}, // U+0071 (q)
-    {0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00}, // U+0072 (r)
-    {0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00}, // U+0073 (s)
-    {0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00}, // U+0074 (t)
-    {0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00}, // U+0075 (u)
-    {0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00}, // U+0076 (v)
-    {0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00}, // U+0077 (w)
-    {0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00}, // U+0078 (x)
-    {0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F}, // U+0079 (y)
-    {0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00}, // U+007A (z)
-    {0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00}, // U+007B ({)
-    {0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00}, // U+007C (|)
-    {0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00}, // U+007D (})
-    {0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+007E (~)
-    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}  // U+007F
+        hdcMem = CreateCompatibleDC(hdc);
+        /* The bitmap covers the row padding, which BitBlt then skips */
+        bitmap = CreateBitmap(
+            rd->stride / 4, rd->height, 1, 32,
+            rd->frames[(rd->cur_frame + rd->frame_count - 1) %
+                       rd->frame_count]);
+        SelectObject(hdcMem, bitmap);
+        if (rd->scale > 1) {
+            SetStretchBltMode(hdc, COLORONCOLOR);
+            StretchBlt(hdc, 0, 0, rd->width * rd->scale,
+                       rd->height * rd->scale, hdcMem, 0, 0, rd->width,
+                       rd->height, SRCCOPY);
+        } else {
+            BitBlt(hdc, 0, 0, rd->width, rd->height, hdcMem, 0, 0, SRCCOPY);
+        }
+
+        DeleteObject(bitmap);
+        DeleteDC(hdcMem);
+        EndPaint(hwnd, &ps);
+        break;
+    }
+    default:
+        return DefWindowProc(hwnd, uMsg, wParam, lParam);
+    }
+    return 0;
+}
+
+struct raw_display *raw_display_init_config(
+    const char *title, int width, int height,
+    const struct raw_display_config *config)
+{
+    struct raw_display *rd;
+    const char classname[] = "Class Name";
+    HINSTANCE hInstance = GetModuleHandle(NULL);
+    int scale = config_scale(config);
+    // const wchar_t title2[] = L"title"; // todo: convert title to wchar
+
+    rd = calloc(sizeof(struct raw_display), 1);
+    if (!rd)
+        return NULL;
+
+    // Step 1: Registering the Window Class
+    rd->wc.cbSize = sizeof(WNDCLASSEX);
+    rd->wc.style = 0;
+    rd->wc.lpfnWndProc = WindowProc;
+    rd->wc.cbClsExtra = 0;
+    rd->wc.cbWndExtra = 0;
+    rd->wc.hInstance = hInstance;
+    rd->wc.hIcon = LoadIcon(NULL, IDI_APPLICATION);
+    rd->wc.hCursor = LoadCursor(NULL, IDC_ARROW);
+    rd->wc.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
+    rd->wc.lpszMenuName = NULL;
+    rd->wc.lpszClassName = classname;
+    rd->wc.hIconSm = LoadIcon(NULL, IDI_APPLICATION);
+
+    if (!RegisterClassExA(&rd->wc)) {
+        free(rd);
+        return NULL;
+    }
+
+    // Step 2: Creating the Window
+    // rd->hwnd =
+    // CreateWindowEx(WS_EX_CLIENTEDGE, classname, title2,
+    // WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, CW_USEDEFAULT,
+    // width, height, NULL, NULL, hInstance, NULL);
+
+    rd->hwnd = CreateWindowExA(WS_EX_CLIENTEDGE, classname, title,
+                               WS_OVERLAPPED | WS_MINIMIZEBOX | WS_SYSMENU,
+                               CW_USEDEFAULT, CW_USEDEFAULT, width * scale,
+                               height * scale, NULL, NULL, hInstance, NULL
+
+    );
+
+    printf("hwnd: %p\n", rd->hwnd);
+    if (rd->hwnd == NULL) {
+        free(rd);
+        return NULL;
+    }
+
+    rd->width = width;
+    rd->height = height;
+    rd->stride = frame_stride(width, 32);
+    rd->frame_count = config_frame_count(config);
+    rd->scale = scale;
+
+    rd->frame_block = alloc_frames(
+        (size_t)rd->stride * height * rd->frame_count, &rd->frame_block_size);
+    if (!rd->frame_block) {
+        DestroyWindow(rd->hwnd);
+        free(rd);
+        return NULL;
+    }
+    for (int i = 0; i < rd->frame_count; i++)
+        rd->frames[i] = rd->frame_block + (size_t)rd->stride * height * i;
+
+    SetWindowLongPtrA(rd->hwnd, GWLP_USERDATA, (LONG_PTR)rd);
+
+    ShowWindow(rd->hwnd, SW_SHOWNORMAL);
+    UpdateWindow(rd->hwnd);
+
+    return finish_init(rd);
+}
+
+void raw_display_info(const struct raw_display *rd, int *width, int *height,
+                      int *bpp, int *stride)
+{
+    if (width)
+        *width = rd->width;
+    if (height)
+        *height = rd->height;
+    if (bpp)
+        *bpp = 32;
+    if (stride)
+        *stride = rd->stride;
+}
+
+uint8_t *raw_display_get_frame(const struct raw_display *rd)
+{
+    return rd->frames[rd->cur_frame];
+}
+
+void raw_display_get_frame_details(const struct raw_display *rd,
+                                   int *frame_index, int *frame_count)
+{
+    if (frame_index)
+        *frame_index = rd->cur_frame;
+    if (frame_count)
+        *frame_count = rd->frame_count;
+}
+
+bool raw_display_process_event(struct raw_display *rd,
+                               struct raw_display_event *event)
+{
+    MSG Msg;
+    int count = 0;
+
+    while (GetQueueStatus(QS_MOUSEBUTTON | QS_KEY) != 0) {
+        if (GetMessage(&Msg, NULL, 0, 0) > 0) {
+            printf("message %d, %d\n", count++, Msg.message);
+            TranslateMessage(&Msg);
+            DispatchMessage(&Msg);
+        }
+    }
+
+    return false;
+}
+
+void raw_display_flip(struct raw_display *rd)
+{
+    trace_flip(rd);
+    printf("flip: %d -> %d\n", rd->cur_frame,
+           (rd->cur_frame + 1) % rd->frame_count);
+    pace_before_present(&rd->draw.pacer);
+    note_flip(&rd->ages, rd->cur_frame);
+    rd->cur_frame = (rd->cur_frame + 1) % rd->frame_count;
+    RedrawWindow(rd->hwnd, NULL, NULL, RDW_INVALIDATE | RDW_UPDATENOW);
+    // InvalidateRect(rd->hwnd, NULL, false);
+    pace_after_present(&rd->draw.pacer);
+}
+
+void raw_display_shutdown(struct raw_display *rd)
+{
+    DestroyWindow(rd->hwnd);
+    free_frames(rd->frame_block, rd->frame_block_size);
+    free_draw_state(&rd->draw);
+    free(rd);
+}
+#elif CONFIG_RAW_DISPLAY == RAW_DISPLAY_MODE_MACOS
+
+#define _DARWIN_C_SOURCE
+#ifndef NSIG
+#define NSIG __DARWIN_NSIG
+#endif
+#import <Cocoa/Cocoa.h>
+#include <sys/types.h>
+
+struct raw_display {
+    NSApplication *nsapp;
+    NSWindow *window;
+    NSView *view;
+    int width;
+    int height;
+    int bpp;
+    int stride;
+    int frame_count;
+    int cur_frame;
+    struct frame_ages ages;
+    uint8_t *frame_block;
+    size_t frame_block_size;
+    uint8_t *frames[RAW_DISPLAY_MAX_FRAMES];
+    CGDataProviderRef frame_data[RAW_DISPLAY_MAX_FRAMES];
+    CGImageRef frame_images[RAW_DISPLAY_MAX_FRAMES];
+    CGColorSpaceRef colorspace;
+    NSAutoreleasePool *pool;
+    int scale; // Quartz enlarges the frame by this much when drawing
+
+    struct draw_state draw;
 };
 
-// https://github.com/PinguinoIDE/pinguino-libraries/blob/master/p8/include/pinguino/libraries/fonts/font16x16.h
-static const uint8_t
-    font16x16[96]
-             [32] = {
-                 {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-                  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-                  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-                  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, //  <Space>
+@interface RawView : NSView {
+}
+- (void)drawRect:(NSRect)rect; // instance method interface
+@end
+
+@implementation RawView
+
+static struct raw_display *rd_global = NULL;
+
+- (void)drawRect:(NSRect)rect
+{
+    struct raw_display *rd = rd_global;
+    int frame = (rd->cur_frame - 1 + rd->frame_count) % rd->frame_count;
+    CGContextRef ctx = NSGraphicsContext.currentContext.CGContext;
+
+    NSRect drawRect =
+        NSMakeRect(0, 0, rd->width * rd->scale, rd->height * rd->scale);
+
+    /* Keep enlarged pixels as sharp blocks */
+    CGContextSetInterpolationQuality(ctx, kCGInterpolationNone);
+    CGContextDrawImage(ctx, drawRect, rd->frame_images[frame]);
+}
+@end
+
+struct raw_display *raw_display_init_config(
+    const char *title, int width, int height,
+    const struct raw_display_config *config)
+{
+    struct raw_display *rd;
+
+    rd = calloc(sizeof(*rd), 1);
+    if (!rd)
+        return NULL;
+
+    rd_global = rd;
+
+    // create the application object
+    rd->nsapp = [NSApplication sharedApplication];
+
+    rd->width = width;
+    rd->height = height;
+    rd->stride = frame_stride(width, 32);
+    rd->bpp = 32;
+    rd->frame_count = config_frame_count(config);
+    rd->scale = config_scale(config);
+
+    NSRect frame = NSMakeRect(0, 0, width * rd->scale, height * rd->scale);
+    NSUInteger style_mask = NSWindowStyleMaskClosable |
+                            NSWindowStyleMaskTitled |
+                            NSWindowStyleMaskMiniaturizable;
+    rd->window = [[[NSWindow alloc] initWithContentRect:frame
+                                              styleMask:style_mask
+                                                backing:NSBackingStoreBuffered
+                                                  defer:NO] autorelease];
+    [rd->window setAcceptsMouseMovedEvents:YES];
+
+    NSString *nstitle = [[NSString alloc] initWithUTF8String:title];
+    [rd->window setTitle:nstitle];
+
+    rd->view = [[[RawView alloc] initWithFrame:frame] autorelease];
+
+    [rd->window setContentView:rd->view];
+
+    [rd->window makeKeyAndOrderFront:NSApp];
+
+    rd->colorspace = CGColorSpaceCreateDeviceRGB();
+    int size = rd_global->stride * rd_global->height;
+    rd->frame_block = alloc_frames((size_t)size * rd->frame_count,
+                                   &rd->frame_block_size);
+    if (!rd->frame_block) {
+        free(rd);
+        return NULL;
+    }
+    for (int i = 0; i < rd->frame_count; i++) {
+        rd->frames[i] = rd->frame_block + (size_t)size * i;
+        rd->frame_data[i] = CGDataProviderCreateWithData(
+            NULL, rd_global->frames[i], size, NULL);
+        rd->frame_images[i] = CGImageCreate(
+            rd_global->width, rd_global->height, 8, 32, rd_global->stride,
+            rd->colorspace,
+            kCGBitmapByteOrder32Little | kCGImageAlphaNoneSkipFirst,
+            rd->frame_data[i], NULL, true, kCGRenderingIntentDefault);
+    }
+    rd->pool = [[NSAutoreleasePool alloc] init];
+
+    return finish_init(rd);
+}
+
+void raw_display_info(const struct raw_display *rd, int *width, int *height,
+                      int *bpp, int *stride)
+{
+    if (width)
+        *width = rd->width;
+    if (height)
+        *height = rd->height;
+    if (bpp)
+        *bpp = rd->bpp;
+    if (stride)
+        *stride = rd->stride;
+}
+
+uint8_t *raw_display_get_frame(const struct raw_display *rd)
+{
+    return rd->frames[rd->cur_frame];
+}
+
+void raw_display_get_frame_details(const struct raw_display *rd,
+                                   int *frame_index, int *frame_count)
+{
+    if (frame_index)
+        *frame_index = rd->cur_frame;
+    if (frame_count)
+        *frame_count = rd->frame_count;
+}
+
+bool raw_display_process_event(struct raw_display *rd,
+                               struct raw_display_event *event)
+{
+    NSEvent *nevent = [rd->nsapp nextEventMatchingMask:NSEventMaskAny
+                                             untilDate:[NSDate distantPast]
+                                                inMode:NSDefaultRunLoopMode
+                                               dequeue:YES];
+    [rd->pool release];
+    rd->pool = [[NSAutoreleasePool alloc] init];
+    if (!nevent)
+        return false;
+    memset(event, 0, sizeof(*event));
+    // NSEventTypeLeftMouseDown);
+    switch ([nevent type]) {
+    case NSEventTypeLeftMouseDown: {
+        NSPoint location = [nevent locationInWindow];
+        event->type = RAW_DISPLAY_EVENT_mouse_down;
+        event->mouse.button = RAW_DISPLAY_MOUSE_left;
+        event->mouse.x = location.x / rd->scale;
+        event->mouse.y = rd->height - location.y / rd->scale;
+        // If the click is in the title bar, just ignore it
+        if (event->mouse.y < 0)
+            event->type = RAW_DISPLAY_EVENT_unknown;
+        break;
+    }
+
+    case NSEventTypeLeftMouseUp: {
+        NSPoint location = [nevent locationInWindow];
+        event->type = RAW_DISPLAY_EVENT_mouse_up;
+        event->mouse.button = RAW_DISPLAY_MOUSE_left;
+        event->mouse.x = location.x / rd->scale;
+        event->mouse.y = rd->height - location.y / rd->scale;
+        // If the click is in the title bar, just ignore it
+        if (event->mouse.y < 0)
+            event->type = RAW_DISPLAY_EVENT_unknown;
+        break;
+    }
+    case NSEventTypeMouseMoved: {
+        NSPoint location = [nevent locationInWindow];
+        event->type = RAW_DISPLAY_EVENT_mouse_move;
+        event->mouse.x = location.x / rd->scale;
+        event->mouse.y = rd->height - location.y / rd->scale;
+        break;
+    }
+    case NSEventTypeAppKitDefined: {
+        // NSEventSubtype subtype = [nevent subtype];
+        // printf("appkit subtype: %d\n", subtype);
+        event->type = RAW_DISPLAY_EVENT_unknown;
+        break;
+    }
+    case NSEventTypeScrollWheel: {
+        NSPoint location = [nevent locationInWindow];
+        event->type = RAW_DISPLAY_EVENT_mouse_up;
+        event->mouse.x = location.x / rd->scale;
+        event->mouse.y = rd->height - location.y / rd->scale;
+        event->mouse.button = [nevent scrollingDeltaY] < 0
+                                  ? RAW_DISPLAY_MOUSE_scroll_up
+                                  : RAW_DISPLAY_MOUSE_scroll_down;
+        break;
+    }
+    default:
+        printf("unhandled event type: %lu\n", (unsigned long)[nevent type]);
+        break;
+    }
+    [rd->nsapp sendEvent:nevent];
+    [rd->nsapp updateWindows];
+
+    return true;
+}
+
+void raw_display_flip(struct raw_display *rd)
+{
+    trace_flip(rd);
+    pace_before_present(&rd->draw.pacer);
+    note_flip(&rd->ages, rd->cur_frame);
+    rd->cur_frame = (rd->cur_frame + 1) % rd->frame_count;
+    [rd->view display];
+    pace_after_present(&rd->draw.pacer);
+}
+
+void raw_display_shutdown(struct raw_display *rd)
+{
+    if (!rd)
+        return;
+    for (int i = 0; i < rd->frame_count; i++) {
+        CFRelease(rd->frame_data[i]);
+        CFRelease(rd->frame_images[i]);
+    }
+    free_frames(rd->frame_block, rd->frame_block_size);
+    CFRelease(rd->colorspace);
+    free_draw_state(&rd->draw);
+    free(rd);
+}
+#elif CONFIG_RAW_DISPLAY == RAW_DISPLAY_MODE_DUMMY
+struct raw_display {
+    int width;
+    int height;
+    int stride;
+
+    uint8_t *frame_block;
+    size_t frame_block_size;
+    uint8_t *frames[RAW_DISPLAY_MAX_FRAMES];
+    int frame_count;
+    int cur_frame;
+    struct frame_ages ages;
+
+    /* Stands in for the screen when scaling, so the cost is the same */
+    int scale;
+    int present_stride;
+    uint8_t *present;
+    size_t present_size;
+    struct tile_diff tiles; // Only for the statistics, nothing is sent
+
+    struct draw_state draw;
+};
+struct raw_display *raw_display_init_config(
+    const char *title, int width, int height,
+    const struct raw_display_config *config)
+{
+    struct raw_display *rd;
+
+    rd = calloc(sizeof(*rd), 1);
+    if (!rd)
+        return NULL;
+
+    rd->width = width;
+    rd->height = height;
+    rd->stride = frame_stride(width, 32);
+    rd->frame_count = config_frame_count(config);
+    rd->scale = config_scale(config);
+
+    rd->frame_block = alloc_frames(
+        (size_t)rd->stride * height * rd->frame_count, &rd->frame_block_size);
+    if (!rd->frame_block) {
+        free(rd);
+        return NULL;
+    }
+    for (int i = 0; i < rd->frame_count; i++)
+        rd->frames[i] = rd->frame_block + (size_t)rd->stride * height * i;
+
+    if (rd->scale > 1) {
+        rd->present_stride = frame_stride(width * rd->scale, 32);
+        rd->present =
+            alloc_frames((size_t)rd->present_stride * height * rd->scale,
+                         &rd->present_size);
+        if (!rd->present) {
+            raw_display_shutdown(rd);
+            return NULL;
+        }
+    }
+
+    if (tile_diff_init(&rd->tiles, config_tile_size(config), width,
+                       height) < 0) {
+        raw_display_shutdown(rd);
+        return NULL;
+    }
+
+    return finish_init(rd);
+}
+
+uint8_t *raw_display_get_frame(const struct raw_display *rd)
+{
+    return rd->frames[rd->cur_frame];
+}
+
+void raw_display_get_frame_details(const struct raw_display *rd,
+                                   int *frame_index, int *frame_count)
+{
+    if (frame_index)
+        *frame_index = rd->cur_frame;
+    if (frame_count)
+        *frame_count = rd->frame_count;
+}
+
+void raw_display_info(const struct raw_display *rd, int *width, int *height,
+                      int *bpp, int *stride)
+{
+    if (!rd)
+        return;
+    if (width)
+        *width = rd->width;
+    if (height)
+        *height = rd->height;
+    if (bpp)
+        *bpp = 32;
+    if (stride)
+        *stride = rd->stride;
+}
+
+void raw_display_flip(struct raw_display *rd)
+{
+    trace_flip(rd);
+    pace_before_present(&rd->draw.pacer);
+    if (rd->tiles.size)
+        tile_diff_update(&rd->tiles, rd->frames[rd->cur_frame], rd->stride,
+                         rd->width, rd->height, 32, &rd->draw.stats);
+    if (rd->present)
+        upscale_frame(rd->present, rd->present_stride,
+                      rd->frames[rd->cur_frame], rd->stride, rd->width,
+                      rd->height, 32, rd->scale);
+    note_flip(&rd->ages, rd->cur_frame);
+    rd->cur_frame = (rd->cur_frame + 1) % rd->frame_count;
+    pace_after_present(&rd->draw.pacer);
+}
+
+void raw_display_shutdown(struct raw_display *rd)
+{
+    free_frames(rd->present, rd->present_size);
+    tile_diff_free(&rd->tiles);
+    free_frames(rd->frame_block, rd->frame_block_size);
+    free_draw_state(&rd->draw);
+    free(rd);
+}
+
+bool raw_display_process_event(struct raw_display *rd,
+                               struct raw_display_event *event)
+{
+    return false;
+}
+
+#elif CONFIG_RAW_DISPLAY == RAW_DISPLAY_MODE_LINUX_DRM
+#include <drm/drm.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_mode.h>
+#include <sys/ioctl.h>
+
+/* Values from the kernel which only libdrm gives names to */
+#define KMS_CONNECTED 1     // drm_mode_get_connector.connection
+#define KMS_PRIMARY_PLANE 1 // Value of a plane's "type" property
+
+#define KMS_MAX_CARDS 8       // Number of /dev/dri/cardN to try
+#define KMS_FLIP_TIMEOUT 1000 // ms to wait for a flip event before giving up
+
+/* Properties set by the atomic commits, grouped by the object they are on
+ * (as each commit must list them) and looked up by name at start up */
+enum kms_prop {
+    KMS_PROP_connector_crtc_id,
+    KMS_PROP_crtc_mode_id,
+    KMS_PROP_crtc_active,
+    KMS_PROP_plane_fb_id,
+    KMS_PROP_plane_crtc_id,
+    KMS_PROP_plane_src_x,
+    KMS_PROP_plane_src_y,
+    KMS_PROP_plane_src_w,
+    KMS_PROP_plane_src_h,
+    KMS_PROP_plane_crtc_x,
+    KMS_PROP_plane_crtc_y,
+    KMS_PROP_plane_crtc_w,
+    KMS_PROP_plane_crtc_h,
+    KMS_PROP_COUNT,
+};
+
+static const struct {
+    uint32_t type;
+    const char *name;
+} kms_props[KMS_PROP_COUNT] = {
+    [KMS_PROP_connector_crtc_id] = {DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID"},
+    [KMS_PROP_crtc_mode_id] = {DRM_MODE_OBJECT_CRTC, "MODE_ID"},
+    [KMS_PROP_crtc_active] = {DRM_MODE_OBJECT_CRTC, "ACTIVE"},
+    [KMS_PROP_plane_fb_id] = {DRM_MODE_OBJECT_PLANE, "FB_ID"},
+    [KMS_PROP_plane_crtc_id] = {DRM_MODE_OBJECT_PLANE, "CRTC_ID"},
+    [KMS_PROP_plane_src_x] = {DRM_MODE_OBJECT_PLANE, "SRC_X"},
+    [KMS_PROP_plane_src_y] = {DRM_MODE_OBJECT_PLANE, "SRC_Y"},
+    [KMS_PROP_plane_src_w] = {DRM_MODE_OBJECT_PLANE, "SRC_W"},
+    [KMS_PROP_plane_src_h] = {DRM_MODE_OBJECT_PLANE, "SRC_H"},
+    [KMS_PROP_plane_crtc_x] = {DRM_MODE_OBJECT_PLANE, "CRTC_X"},
+    [KMS_PROP_plane_crtc_y] = {DRM_MODE_OBJECT_PLANE, "CRTC_Y"},
+    [KMS_PROP_plane_crtc_w] = {DRM_MODE_OBJECT_PLANE, "CRTC_W"},
+    [KMS_PROP_plane_crtc_h] = {DRM_MODE_OBJECT_PLANE, "CRTC_H"},
+};
+
+struct raw_display {
+    int fd;
+    struct evdev_input input;
+    int width;
+    int height;
+    int stride;
+    int frame_count;
+    int cur_frame;
+    struct frame_ages ages;
+
+    /* Each frame is a dumb buffer mapped from the device, with a
+     * framebuffer object on it so that it can be shown */
+    uint32_t handles[RAW_DISPLAY_MAX_FRAMES];
+    uint32_t fb_ids[RAW_DISPLAY_MAX_FRAMES];
+    uint8_t *maps[RAW_DISPLAY_MAX_FRAMES];
+    size_t map_size;
+    int fb_stride;
+
+    /* When scaling, drawing happens in these smaller frames, which are
+     * enlarged into the dumb buffer of the same index on flip */
+    int scale;
+    uint8_t *frame_block;
+    size_t frame_block_size;
+
+    uint32_t connector_id;
+    uint32_t crtc_id;
+    uint32_t plane_id;
+    struct drm_mode_modeinfo mode;
+    uint32_t mode_blob;
+    uint32_t props[KMS_PROP_COUNT];
+
+    /* Only one flip can be queued at a time. Until it completes both it
+     * and the frame on screen are busy, so mustn't be drawn into */
+    int shown;
+    int pending; // -1 if no flip is queued
+    uint64_t flip_serial; // Identifies the latest flip in its event
+    uint32_t last_sequence;
+    /* Set once a flip event fails to arrive, after which each commit waits
+     * for its flip rather than sending an event */
+    bool flip_blocking;
+
+    struct draw_state draw;
+};
+
+static int kms_ioctl(int fd, unsigned long request, void *arg)
+{
+    int ret;
+
+    do {
+        ret = ioctl(fd, request, arg);
+    } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+    return ret < 0 ? -errno : 0;
+}
+
+/**
+ * Look up one of an object's properties by name
+ * @param value Area to store the property's current value in, or NULL
+ * @return Id of the property, 0 if the object doesn't have it
+ */
+static uint32_t kms_property(int fd, uint32_t object, uint32_t type,
+                             const char *name, uint64_t *value)
+{
+    struct drm_mode_obj_get_properties props = {
+        .obj_id = object,
+        .obj_type = type,
+    };
+    uint32_t *ids = NULL, found = 0, count;
+    uint64_t *values = NULL;
+
+    if (kms_ioctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &props) < 0)
+        return 0;
+    count = props.count_props;
+    ids = calloc(count + 1, sizeof(*ids));
+    values = calloc(count + 1, sizeof(*values));
+    props.props_ptr = (uintptr_t)ids;
+    props.prop_values_ptr = (uintptr_t)values;
+    if (ids && values &&
+        kms_ioctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &props) == 0) {
+        for (uint32_t i = 0; i < min(count, props.count_props) && !found;
+             i++) {
+            struct drm_mode_get_property prop = {.prop_id = ids[i]};
+
+            if (kms_ioctl(fd, DRM_IOCTL_MODE_GETPROPERTY, &prop) == 0 &&
+                !strncmp(prop.name, name, sizeof(prop.name))) {
+                found = ids[i];
+                if (value)
+                    *value = values[i];
+            }
+        }
+    }
+    free(ids);
+    free(values);
+    return found;
+}
+
+/* Find the primary plane of the CRTC at index crtc in the resources */
+static uint32_t kms_primary_plane(int fd, int crtc)
+{
+    struct drm_mode_get_plane_res res = {0};
+    uint32_t *planes, found = 0, count;
+
+    if (kms_ioctl(fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &res) < 0)
+        return 0;
+    count = res.count_planes;
+    planes = calloc(count + 1, sizeof(*planes));
+    if (!planes)
+        return 0;
+    res.plane_id_ptr = (uintptr_t)planes;
+    if (kms_ioctl(fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &res) == 0) {
+        for (uint32_t i = 0; i < min(count, res.count_planes) && !found;
+             i++) {
+            struct drm_mode_get_plane plane = {.plane_id = planes[i]};
+            uint64_t type = 0;
+
+            if (kms_ioctl(fd, DRM_IOCTL_MODE_GETPLANE, &plane) == 0 &&
+                plane.possible_crtcs & (1u << crtc) &&
+                kms_property(fd, planes[i], DRM_MODE_OBJECT_PLANE, "type",
+                             &type) &&
+                type == KMS_PRIMARY_PLANE)
+                found = planes[i];
+        }
+    }
+    free(planes);
+    return found;
+}
+
+/**
+ * Pick a CRTC which can drive the connector, preferring the one it is
+ * already on
+ * @return Index of the CRTC in crtcs, < 0 if there isn't one
+ */
+static int kms_pick_crtc(int fd, const struct drm_mode_get_connector *conn,
+                         const uint32_t *encoders, const uint32_t *crtcs,
+                         int crtc_count)
+{
+    struct drm_mode_get_encoder encoder = {.encoder_id = conn->encoder_id};
+
+    if (conn->encoder_id &&
+        kms_ioctl(fd, DRM_IOCTL_MODE_GETENCODER, &encoder) == 0 &&
+        encoder.crtc_id) {
+        for (int i = 0; i < crtc_count; i++)
+            if (crtcs[i] == encoder.crtc_id)
+                return i;
+    }
+    for (uint32_t e = 0; e < conn->count_encoders; e++) {
+        encoder = (struct drm_mode_get_encoder){.encoder_id = encoders[e]};
+        if (kms_ioctl(fd, DRM_IOCTL_MODE_GETENCODER, &encoder) < 0)
+            continue;
+        for (int i = 0; i < crtc_count && i < 32; i++)
+            if (encoder.possible_crtcs & (1u << i))
+                return i;
+    }
+    return -1;
+}
+
+/**
+ * Set up to show on the connector, if it has a screen attached, in the
+ * mode of the given size if it has one, otherwise its preferred mode
+ * @return 0 on success, < 0 if the connector can't be used
+ */
+static int kms_try_connector(struct raw_display *rd, uint32_t id,
+                             const uint32_t *crtcs, int crtc_count,
+                             int width, int height)
+{
+    struct drm_mode_get_connector conn = {.connector_id = id};
+    struct drm_mode_modeinfo *modes;
+    uint32_t *encoders;
+    uint32_t mode_count, encoder_count;
+    int mode = -1, crtc = -1;
+
+    /* The first call also probes the connector for its modes */
+    if (kms_ioctl(rd->fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) < 0 ||
+        conn.connection != KMS_CONNECTED || !conn.count_modes)
+        return -ENODEV;
+
+    mode_count = conn.count_modes;
+    encoder_count = conn.count_encoders;
+    modes = calloc(mode_count, sizeof(*modes));
+    encoders = calloc(encoder_count + 1, sizeof(*encoders));
+    conn.modes_ptr = (uintptr_t)modes;
+    conn.encoders_ptr = (uintptr_t)encoders;
+    conn.count_props = 0;
+    if (modes && encoders &&
+        kms_ioctl(rd->fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) == 0 &&
+        conn.count_modes <= mode_count &&
+        conn.count_encoders <= encoder_count) {
+        for (uint32_t i = 0; i < conn.count_modes; i++) {
+            if (modes[i].hdisplay == width && modes[i].vdisplay == height) {
+                mode = i;
+                break;
+            }
+            if (mode < 0 || modes[i].type & DRM_MODE_TYPE_PREFERRED)
+                mode = i;
+        }
+        crtc = kms_pick_crtc(rd->fd, &conn, encoders, crtcs, crtc_count);
+    }
+
+    if (mode >= 0 && crtc >= 0) {
+        rd->plane_id = kms_primary_plane(rd->fd, crtc);
+        if (rd->plane_id) {
+            rd->connector_id = id;
+            rd->crtc_id = crtcs[crtc];
+            rd->mode = modes[mode];
+        }
+    }
+    free(modes);
+    free(encoders);
+    return rd->plane_id ? 0 : -ENODEV;
+}
+
+/* Find a connector with a screen attached, and a CRTC & plane to drive it */
+static int kms_find_output(struct raw_display *rd, int width, int height)
+{
+    struct drm_mode_card_res res = {0};
+    uint32_t *crtcs, *connectors, crtc_count, connector_count;
+    int ret;
+
+    ret = kms_ioctl(rd->fd, DRM_IOCTL_MODE_GETRESOURCES, &res);
+    if (ret < 0)
+        return ret;
+    crtc_count = res.count_crtcs;
+    connector_count = res.count_connectors;
+    crtcs = calloc(crtc_count + 1, sizeof(*crtcs));
+    connectors = calloc(connector_count + 1, sizeof(*connectors));
+    res.crtc_id_ptr = (uintptr_t)crtcs;
+    res.connector_id_ptr = (uintptr_t)connectors;
+    res.count_fbs = res.count_encoders = 0;
+    if (!crtcs || !connectors)
+        ret = -ENOMEM;
+    else
+        ret = kms_ioctl(rd->fd, DRM_IOCTL_MODE_GETRESOURCES, &res);
+    /* Nothing is copied if more have appeared since they were counted */
+    if (ret == 0 && (res.count_crtcs > crtc_count ||
+                     res.count_connectors > connector_count))
+        ret = -EAGAIN;
+
+    for (uint32_t i = 0; ret == 0 && i < res.count_connectors; i++)
+        if (kms_try_connector(rd, connectors[i], crtcs, res.count_crtcs,
+                              width, height) == 0)
+            break;
+    if (ret == 0 && !rd->plane_id)
+        ret = -ENODEV;
+    free(crtcs);
+    free(connectors);
+    return ret;
+}
+
+static uint32_t kms_object(const struct raw_display *rd, enum kms_prop prop)
+{
+    switch (kms_props[prop].type) {
+    case DRM_MODE_OBJECT_CONNECTOR:
+        return rd->connector_id;
+    case DRM_MODE_OBJECT_CRTC:
+        return rd->crtc_id;
+    default:
+        return rd->plane_id;
+    }
+}
+
+/**
+ * Open a DRM device, and check that it supports everything needed and has
+ * a screen attached
+ * @return 0 on success, < 0 on failure, leaving rd->fd as -1
+ */
+static int kms_open(struct raw_display *rd, const char *path, int width,
+                    int height)
+{
+    struct drm_get_cap dumb = {.capability = DRM_CAP_DUMB_BUFFER};
+    struct drm_set_client_cap planes = {
+        .capability = DRM_CLIENT_CAP_UNIVERSAL_PLANES,
+        .value = 1,
+    };
+    struct drm_set_client_cap atomic = {
+        .capability = DRM_CLIENT_CAP_ATOMIC,
+        .value = 1,
+    };
+    int ret;
+
+    rd->connector_id = rd->crtc_id = rd->plane_id = 0;
+    rd->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (rd->fd < 0)
+        return -errno;
+
+    if (kms_ioctl(rd->fd, DRM_IOCTL_GET_CAP, &dumb) < 0 || !dumb.value ||
+        kms_ioctl(rd->fd, DRM_IOCTL_SET_CLIENT_CAP, &planes) < 0 ||
+        kms_ioctl(rd->fd, DRM_IOCTL_SET_CLIENT_CAP, &atomic) < 0)
+        ret = -ENOTSUP;
+    else
+        ret = kms_find_output(rd, width, height);
+
+    for (int i = 0; ret == 0 && i < KMS_PROP_COUNT; i++) {
+        rd->props[i] = kms_property(rd->fd, kms_object(rd, i),
+                                    kms_props[i].type, kms_props[i].name,
+                                    NULL);
+        if (!rd->props[i])
+            ret = -ENOTSUP;
+    }
+
+    if (ret < 0) {
+        close(rd->fd);
+        rd->fd = -1;
+    }
+    return ret;
+}
+
+/**
+ * Create a dumb buffer for a frame, with a framebuffer on it, and map it.
+ * Its rows are padded to FRAME_ALIGN like the other backends' frames
+ */
+static int kms_create_frame(struct raw_display *rd, int frame)
+{
+    struct drm_mode_create_dumb create = {
+        .width = frame_stride(rd->mode.hdisplay, 32) / 4,
+        .height = rd->mode.vdisplay,
+        .bpp = 32,
+    };
+    struct drm_mode_fb_cmd2 fb = {
+        .width = rd->mode.hdisplay,
+        .height = rd->mode.vdisplay,
+        .pixel_format = DRM_FORMAT_XRGB8888,
+    };
+    struct drm_mode_map_dumb map = {0};
+    int ret;
+
+    ret = kms_ioctl(rd->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create);
+    if (ret < 0)
+        return ret;
+    rd->handles[frame] = create.handle;
+    rd->fb_stride = create.pitch;
+    rd->map_size = create.size;
+
+    fb.handles[0] = create.handle;
+    fb.pitches[0] = create.pitch;
+    ret = kms_ioctl(rd->fd, DRM_IOCTL_MODE_ADDFB2, &fb);
+    if (ret < 0)
+        return ret;
+    rd->fb_ids[frame] = fb.fb_id;
+
+    map.handle = create.handle;
+    ret = kms_ioctl(rd->fd, DRM_IOCTL_MODE_MAP_DUMB, &map);
+    if (ret < 0)
+        return ret;
+    rd->maps[frame] = mmap(NULL, create.size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, rd->fd, map.offset);
+    if (rd->maps[frame] == MAP_FAILED) {
+        rd->maps[frame] = NULL;
+        return -errno;
+    }
+    return 0;
+}
+
+/* An atomic commit being built up. Properties must be added grouped by
+ * their object, as in enum kms_prop */
+struct kms_request {
+    uint32_t objects[3];
+    uint32_t counts[3];
+    uint32_t props[KMS_PROP_COUNT];
+    uint64_t values[KMS_PROP_COUNT];
+    int object_count;
+    int prop_count;
+};
+
+static void kms_request_add(struct kms_request *req,
+                            const struct raw_display *rd, enum kms_prop prop,
+                            uint64_t value)
+{
+    uint32_t object = kms_object(rd, prop);
+
+    if (!req->object_count || req->objects[req->object_count - 1] != object)
+        req->objects[req->object_count++] = object;
+    req->counts[req->object_count - 1]++;
+    req->props[req->prop_count] = rd->props[prop];
+    req->values[req->prop_count++] = value;
+}
+
+static int kms_commit(struct raw_display *rd, const struct kms_request *req,
+                      uint32_t flags, uint64_t user_data)
+{
+    struct drm_mode_atomic atomic = {
+        .flags = flags,
+        .count_objs = req->object_count,
+        .objs_ptr = (uintptr_t)req->objects,
+        .count_props_ptr = (uintptr_t)req->counts,
+        .props_ptr = (uintptr_t)req->props,
+        .prop_values_ptr = (uintptr_t)req->values,
+        .user_data = user_data,
+    };
+
+    return kms_ioctl(rd->fd, DRM_IOCTL_MODE_ATOMIC, &atomic);
+}
+
+/* Light up the output, showing the given frame */
+static int kms_modeset(struct raw_display *rd, int frame)
+{
+    struct drm_mode_create_blob blob = {
+        .data = (uintptr_t)&rd->mode,
+        .length = sizeof(rd->mode),
+    };
+    struct kms_request req = {0};
+    int ret;
+
+    ret = kms_ioctl(rd->fd, DRM_IOCTL_MODE_CREATEPROPBLOB, &blob);
+    if (ret < 0)
+        return ret;
+    rd->mode_blob = blob.blob_id;
+
+    kms_request_add(&req, rd, KMS_PROP_connector_crtc_id, rd->crtc_id);
+    kms_request_add(&req, rd, KMS_PROP_crtc_mode_id, rd->mode_blob);
+    kms_request_add(&req, rd, KMS_PROP_crtc_active, 1);
+    kms_request_add(&req, rd, KMS_PROP_plane_fb_id, rd->fb_ids[frame]);
+    kms_request_add(&req, rd, KMS_PROP_plane_crtc_id, rd->crtc_id);
+    kms_request_add(&req, rd, KMS_PROP_plane_src_x, 0);
+    kms_request_add(&req, rd, KMS_PROP_plane_src_y, 0);
+    /* The source rectangle is in 16.16 fixed point */
+    kms_request_add(&req, rd, KMS_PROP_plane_src_w,
+                    (uint64_t)rd->mode.hdisplay << 16);
+    kms_request_add(&req, rd, KMS_PROP_plane_src_h,
+                    (uint64_t)rd->mode.vdisplay << 16);
+    kms_request_add(&req, rd, KMS_PROP_plane_crtc_x, 0);
+    kms_request_add(&req, rd, KMS_PROP_plane_crtc_y, 0);
+    kms_request_add(&req, rd, KMS_PROP_plane_crtc_w, rd->mode.hdisplay);
+    kms_request_add(&req, rd, KMS_PROP_plane_crtc_h, rd->mode.vdisplay);
+    ret = kms_commit(rd, &req, DRM_MODE_ATOMIC_ALLOW_MODESET, 0);
+    if (ret == 0)
+        rd->shown = frame;
+    return ret;
+}
+
+/* Handle the events waiting on the device, which must be at least one */
+static void kms_read_events(struct raw_display *rd)
+{
+    uint64_t buffer[128]; // Aligned for the events' 64-bit fields
+    ssize_t len = read(rd->fd, buffer, sizeof(buffer));
+
+    for (ssize_t pos = 0; pos + (ssize_t)sizeof(struct drm_event) <= len;) {
+        const struct drm_event *event =
+            (const struct drm_event *)((uint8_t *)buffer + pos);
+
+        /* A flip which timed out was taken as shown already, so its
+         * event turning up late is ignored */
+        if (event->type == DRM_EVENT_FLIP_COMPLETE && rd->pending >= 0 &&
+            ((const struct drm_event_vblank *)event)->user_data ==
+                rd->flip_serial) {
+            const struct drm_event_vblank *vblank =
+                (const struct drm_event_vblank *)event;
+
+            rd->shown = rd->pending;
+            rd->pending = -1;
+            /* Each flip is queued for the vblank after the last one */
+            if (rd->last_sequence &&
+                vblank->sequence > rd->last_sequence + 1)
+                rd->draw.stats.missed_vblanks +=
+                    vblank->sequence - rd->last_sequence - 1;
+            rd->last_sequence = vblank->sequence;
+            rd->draw.stats.present_time_us =
+                (uint64_t)vblank->tv_sec * 1000000 + vblank->tv_usec;
+        }
+        if (!event->length)
+            break;
+        pos += event->length;
+    }
+}
+
+/* Wait for the queued flip, if any, to complete */
+static void kms_wait_flip(struct raw_display *rd)
+{
+    struct pollfd pfd = {.fd = rd->fd, .events = POLLIN};
+
+    while (rd->pending >= 0) {
+        int ready = poll(&pfd, 1, KMS_FLIP_TIMEOUT);
+
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0) {
+            fprintf(stderr, "Timed out waiting for a page flip, so no "
+                            "longer waiting for flip events\n");
+            /* Assume it happened, so the frame on screen isn't drawn on,
+             * and don't keep stalling every frame on events that have
+             * stopped coming */
+            rd->shown = rd->pending;
+            rd->pending = -1;
+            rd->flip_blocking = true;
+            break;
+        }
+        kms_read_events(rd);
+    }
+}
+
+struct raw_display *raw_display_init_config(
+    const char *title, int width, int height,
+    const struct raw_display_config *config)
+{
+    const char *device = getenv("RAW_DISPLAY_DRM_DEVICE");
+    struct raw_display *rd = calloc(sizeof(*rd), 1);
+    int scale = config_scale(config);
+    int ret;
+
+    if (!rd)
+        return NULL;
+    rd->fd = -1;
+    rd->input.fd = -1;
+    rd->pending = -1;
+    rd->frame_count = config_frame_count(config);
+    rd->scale = scale;
+
+    /* Use the first card with a screen attached, unless told which */
+    if (device) {
+        ret = kms_open(rd, device, width * scale, height * scale);
+        if (ret < 0)
+            fprintf(stderr, "Unable to use %s: %s\n", device,
+                    strerror(-ret));
+    }
+    for (int i = 0; !device && rd->fd < 0 && i < KMS_MAX_CARDS; i++) {
+        char path[32];
+
+        snprintf(path, sizeof(path), "/dev/dri/card%d", i);
+        kms_open(rd, path, width * scale, height * scale);
+    }
+    if (rd->fd < 0) {
+        if (!device)
+            fprintf(stderr, "No DRM device with a screen attached\n");
+        free(rd);
+        return NULL;
+    }
+
+    rd->width = rd->mode.hdisplay / scale;
+    rd->height = rd->mode.vdisplay / scale;
+    for (int i = 0; i < rd->frame_count; i++) {
+        ret = kms_create_frame(rd, i);
+        if (ret < 0) {
+            fprintf(stderr, "Unable to create frame %d: %s\n", i,
+                    strerror(-ret));
+            raw_display_shutdown(rd);
+            return NULL;
+        }
+    }
+    rd->stride = rd->fb_stride;
+
+    if (scale > 1) {
+        rd->stride = frame_stride(rd->width, 32);
+        rd->frame_block =
+            alloc_frames((size_t)rd->stride * rd->height * rd->frame_count,
+                         &rd->frame_block_size);
+        if (!rd->frame_block) {
+            raw_display_shutdown(rd);
+            return NULL;
+        }
+    }
+
+    /* Start by showing the last frame, leaving the first to draw into */
+    ret = kms_modeset(rd, rd->frame_count - 1);
+    if (ret < 0) {
+        fprintf(stderr, "Unable to set the mode: %s\n", strerror(-ret));
+        raw_display_shutdown(rd);
+        return NULL;
+    }
+
+    evdev_open(&rd->input);
+    return finish_init(rd);
+}
+
+void raw_display_shutdown(struct raw_display *rd)
+{
+    struct drm_mode_destroy_blob blob = {.blob_id = rd->mode_blob};
+
+    /* Removing the framebuffers turns the output off, which lets the
+     * console take it back once the device is closed */
+    kms_wait_flip(rd);
+    for (int i = 0; i < rd->frame_count; i++) {
+        struct drm_mode_destroy_dumb dumb = {.handle = rd->handles[i]};
+
+        if (rd->maps[i])
+            munmap(rd->maps[i], rd->map_size);
+        if (rd->fb_ids[i])
+            kms_ioctl(rd->fd, DRM_IOCTL_MODE_RMFB, &rd->fb_ids[i]);
+        if (rd->handles[i])
+            kms_ioctl(rd->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dumb);
+    }
+    if (rd->mode_blob)
+        kms_ioctl(rd->fd, DRM_IOCTL_MODE_DESTROYPROPBLOB, &blob);
+    close(rd->fd);
+    evdev_close(&rd->input);
+    free_frames(rd->frame_block, rd->frame_block_size);
+    free_draw_state(&rd->draw);
+    free(rd);
+}
+
+void raw_display_info(const struct raw_display *rd, int *width, int *height,
+                      int *bpp, int *stride)
+{
+    if (!rd)
+        return;
+    if (width)
+        *width = rd->width;
+    if (height)
+        *height = rd->height;
+    if (bpp)
+        *bpp = 32;
+    if (stride)
+        *stride = rd->stride;
+}
+
+bool raw_display_process_event(struct raw_display *rd,
+                               struct raw_display_event *event)
+{
+    struct pollfd pfd = {.fd = rd->fd, .events = POLLIN};
+
+    /* Keep track of flips completing while the caller is drawing */
+    if (poll(&pfd, 1, 0) > 0)
+        kms_read_events(rd);
+    return evdev_read(&rd->input, rd->scale, event);
+}
+
+uint8_t *raw_display_get_frame(const struct raw_display *rd)
+{
+    if (rd->frame_block)
+        return rd->frame_block +
+               (size_t)rd->stride * rd->height * rd->cur_frame;
+    return rd->maps[rd->cur_frame];
+}
+
+void raw_display_flip(struct raw_display *rd)
+{
+    struct kms_request req = {0};
+    int ret;
+
+    trace_flip(rd);
+    pace_before_present(&rd->draw.pacer);
+    if (rd->frame_block)
+        upscale_frame(rd->maps[rd->cur_frame], rd->fb_stride,
+                      raw_display_get_frame(rd), rd->stride, rd->width,
+                      rd->height, 32, rd->scale);
+
+    /* The kernel refuses a flip while another is still queued */
+    kms_wait_flip(rd);
+    kms_request_add(&req, rd, KMS_PROP_plane_fb_id,
+                    rd->fb_ids[rd->cur_frame]);
+    ret = kms_commit(rd, &req,
+                     rd->flip_blocking ? 0
+                                       : DRM_MODE_ATOMIC_NONBLOCK |
+                                             DRM_MODE_PAGE_FLIP_EVENT,
+                     ++rd->flip_serial);
+    if (ret < 0)
+        fprintf(stderr, "Unable to flip: %s\n", strerror(-ret));
+    else if (rd->flip_blocking)
+        rd->shown = rd->cur_frame;
+    else
+        rd->pending = rd->cur_frame;
+
+    note_flip(&rd->ages, rd->cur_frame);
+    rd->cur_frame = (rd->cur_frame + 1) % rd->frame_count;
+
+    /* The next frame can't be drawn into until it is off the screen,
+     * which is what paces us to the display */
+    if (rd->cur_frame == rd->pending || rd->cur_frame == rd->shown)
+        kms_wait_flip(rd);
+    pace_after_present(&rd->draw.pacer);
+}
+
+void raw_display_get_frame_details(const struct raw_display *rd,
+                                   int *frame_index, int *frame_count)
+{
+    if (frame_index)
+        *frame_index = rd->cur_frame;
+    if (frame_count)
+        *frame_count = rd->frame_count;
+}
+
+#else
+#error "Unable to determine CONFIG_RAW_DISPLAY"
+#endif
+
+/*************** HELPER ROUTINES *****************/
+
+struct raw_display *raw_display_init(const char *title, int width, int height)
+{
+    return raw_display_init_config(title, width, height, NULL);
+}
+
+int raw_display_set_target_fps(struct raw_display *rd, double fps)
+{
+    if (!rd || fps < 0)
+        return -EINVAL;
+    rd->draw.pacer.period = fps > 0 ? (int64_t)(1e9 / fps) : 0;
+    rd->draw.pacer.deadline = 0;
+    rd->draw.pacer.draw_start = 0;
+    return 0;
+}
+
+int raw_display_set_pacing(struct raw_display *rd,
+                           enum raw_display_pacing mode, int spin_us)
+{
+    if (!rd || spin_us < 0 || (mode != RAW_DISPLAY_PACING_throughput &&
+                               mode != RAW_DISPLAY_PACING_low_latency))
+        return -EINVAL;
+    rd->draw.pacer.mode = mode;
+    rd->draw.pacer.spin = (int64_t)spin_us * 1000;
+    return 0;
+}
+
+void raw_display_get_stats(const struct raw_display *rd,
+                           struct raw_display_stats *stats)
+{
+    if (!rd || !stats)
+        return;
+    *stats = rd->draw.stats;
+    stats->flips = rd->ages.flips;
+}
+
+int raw_display_get_buffer_age(const struct raw_display *rd)
+{
+    int frame = 0;
+
+    if (!rd)
+        return 0;
+    raw_display_get_frame_details(rd, &frame, NULL);
+    if (!rd->ages.presented[frame])
+        return 0;
+    return rd->ages.flips + 1 - rd->ages.presented[frame];
+}
+
+/**
+ * Snapshot of the surface the drawing routines render into, so that the
+ * inner loops don't need to query the backend for every pixel
+ */
+struct draw_target {
+    uint8_t *pixels;
+    int width;
+    int height;
+    int stride;
+    int bpp;
+    /* Region which may be drawn to, with the right/bottom edges exclusive.
+     * Always lies within the surface */
+    int clip_x0;
+    int clip_y0;
+    int clip_x1;
+    int clip_y1;
+};
+
+/**
+ * Off-screen image which can be drawn to in place of the frame.
+ * Released surfaces stay on the display's list so their memory can be
+ * handed out again by the next raw_display_surface_create
+ */
+struct raw_display_surface {
+    uint8_t *pixels;
+    size_t capacity; // Size in bytes of the pixels allocation
+    int width;
+    int height;
+    int stride;
+    int bpp;
+    bool in_use;
+    uint8_t *trace_shadow; // What recorded calls drew, while tracing
+    struct raw_display_surface *next;
+};
+
+struct sprite {
+    int x; // Location within the atlas
+    int y;
+    int width;
+    int height;
+    bool keyed;
+    uint32_t key; // Colour key in the atlas pixel format
+};
+
+/**
+ * All of the sprites, shelf-packed into one image in the display's pixel
+ * format (premultiplied by alpha), plus a parallel plane of alpha values
+ */
+struct sprite_atlas {
+    uint8_t *pixels;
+    uint8_t *alpha;
+    int width;
+    int height;
+    int stride;
+    int bpp;
+
+    int shelf_x; // Next free column in the current shelf
+    int shelf_y; // Top of the current shelf
+    int shelf_height;
+
+    struct sprite *sprites;
+    int sprite_count;
+    int sprite_capacity;
+};
+
+static void free_draw_state(struct draw_state *draw)
+{
+    while (draw->surfaces) {
+        struct raw_display_surface *next = draw->surfaces->next;
+        free(draw->surfaces->pixels);
+        free(draw->surfaces->trace_shadow);
+        free(draw->surfaces);
+        draw->surfaces = next;
+    }
+    draw->target = NULL;
+    thread_pool_destroy(draw->pool);
+    draw->pool = NULL;
+    trace_close(draw->trace);
+    draw->trace = NULL;
+    free(draw->colourmaps);
+    draw->colourmaps = NULL;
+    if (draw->atlas) {
+        free(draw->atlas->pixels);
+        free(draw->atlas->alpha);
+        free(draw->atlas->sprites);
+        free(draw->atlas);
+        draw->atlas = NULL;
+    }
+}
+
+static uint16_t colour_to_16(uint32_t colour)
+{
+    return ((colour & 0xf80000) >> 8) | ((colour & 0x00fc00) >> 5) |
+           ((colour & 0x0000ff) >> 3);
+}
+
+static uint32_t colour_from_16(uint16_t pixel)
+{
+    uint32_t r = (pixel >> 11) & 0x1f;
+    uint32_t g = (pixel >> 5) & 0x3f;
+    uint32_t b = pixel & 0x1f;
+
+    return 0xff000000 | ((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) |
+           (b << 3 | b >> 2);
+}
+
+/**
+ * Convert a 0xAARRGGBB colour into the pixel value stored in the frame.
+ * Supported layouts are 32bpp xRGB, 24bpp packed RGB and 16bpp RGB565, all
+ * in host byte order. The conversion itself is inline in the header, so
+ * that user pixel loops get exactly the same values
+ */
+static uint32_t native_colour(int bpp, uint32_t colour)
+{
+    const struct raw_display_view view = {.bpp = bpp};
+
+    return raw_display_native_colour(&view, colour);
+}
+
+/* Convert a stored pixel back into a 0xAARRGGBB colour */
+static uint32_t read_colour(const uint8_t *pos, int bpp)
+{
+    switch (bpp) {
+    case 32:
+        return *(const uint32_t *)pos;
+    case 24:
+        return 0xff000000 | pos[2] << 16 | pos[1] << 8 | pos[0];
+    case 16:
+        return colour_from_16(*(const uint16_t *)pos);
+    default:
+        return 0;
+    }
+}
+
+static inline void store_24(uint8_t *pos, uint32_t pixel)
+{
+    pos[0] = pixel;
+    pos[1] = pixel >> 8;
+    pos[2] = pixel >> 16;
+}
+
+/* Fills larger than this use streaming stores, since the pixels will have
+ * left the cache long before anything reads them back */
+#define STREAM_THRESHOLD (256 * 1024)
+
+/*
+ * Pixel kernels: the inner loops that touch the most pixels, built for
+ * several instruction sets. select_kernels picks the best one the CPU
+ * supports when a display is created, or the one named by the
+ * RAW_DISPLAY_ISA environment variable, so each can be benchmarked. Every
+ * variant must give exactly the same pixels as the scalar one
+ */
+struct pixel_kernels {
+    const char *isa;
+    /**
+     * Fill a 16 or 32bpp region with a repeating 32-bit pattern
+     * @param dst Start of the region, aligned to at least 2 bytes
+     * @param bytes Size of the region, a multiple of 2 bytes
+     * @param pattern Pixel value, replicated to 32-bits for 16bpp
+     * @param stream Use non-temporal stores which bypass the cache
+     */
+    void (*fill)(uint8_t *dst, size_t bytes, uint32_t pattern, bool stream);
+    /* Copy bytes, optionally with non-temporal stores as fill does */
+    void (*copy)(uint8_t *dst, const uint8_t *src, size_t bytes, bool stream);
+    /* Blend premultiplied 32bpp pixels over dst, using a plane of alphas */
+    void (*blend)(uint32_t *dst, const uint32_t *src, const uint8_t *alpha,
+                  int count);
+    /* Copy 32bpp pixels, except for those whose RGB matches the colour key
+     * (which has no alpha) */
+    void (*copy_keyed)(uint32_t *dst, const uint32_t *src, uint32_t key,
+                       int count);
+    /* Convert 32bpp xRGB pixels to RGB565 */
+    void (*convert_16)(uint16_t *dst, const uint32_t *src, int count);
+    /* Look up 32bpp pixels by index, for nearest neighbour scaling */
+    void (*gather)(uint32_t *dst, const uint32_t *src, const int *index,
+                   int count);
+    /* Blend 32bpp pixels (alpha too) frac/256ths of the way from row a to
+     * row b, as lerp_colour does, for bilinear scaling */
+    void (*lerp_rows)(uint32_t *dst, const uint32_t *a, const uint32_t *b,
+                      uint32_t frac, int count);
+    /* Blend each pair of pixels src[col0[i]] & src[col1[i]] by frac[i] */
+    void (*lerp_columns)(uint32_t *dst, const uint32_t *src, const int *col0,
+                         const int *col1, const uint8_t *frac, int count);
+};
+
+/* Step dst up to an align byte boundary, returning the pattern rotated to
+ * suit if that took half a word */
+static uint32_t fill_head(uint8_t **dst, const uint8_t *end,
+                          uint32_t pattern, uintptr_t align)
+{
+    if (((uintptr_t)*dst & 2) && *dst < end) {
+        *(uint16_t *)*dst = pattern;
+        *dst += 2;
+        pattern = pattern >> 16 | pattern << 16;
+    }
+    while (((uintptr_t)*dst & (align - 1)) && end - *dst >= 4) {
+        *(uint32_t *)*dst = pattern;
+        *dst += 4;
+    }
+    return pattern;
+}
+
+static void fill_tail(uint8_t *dst, const uint8_t *end, uint32_t pattern)
+{
+    for (; end - dst >= 4; dst += 4)
+        *(uint32_t *)dst = pattern;
+    if (end - dst >= 2)
+        *(uint16_t *)dst = pattern;
+}
+
+/* Blend a premultiplied colour channel over a destination channel */
+static inline uint32_t blend_channel(uint32_t src, uint32_t dst, uint32_t inv)
+{
+    uint32_t t = dst * inv + 128;
+    return src + ((t + (t >> 8)) >> 8);
+}
+
+/* Blend two colours, by frac/256ths of the way from a to b, working on two
+ * channels at a time */
+static inline uint32_t lerp_colour(uint32_t a, uint32_t b, uint32_t frac)
+{
+    uint32_t inv = 256 - frac;
+    uint32_t rb =
+        (((a & 0xff00ff) * inv + (b & 0xff00ff) * frac) >> 8) & 0xff00ff;
+    uint32_t ag =
+        (((a >> 8) & 0xff00ff) * inv + ((b >> 8) & 0xff00ff) * frac) &
+        0xff00ff00;
+    return rb | ag;
+}
+
+static void fill_scalar(uint8_t *dst, size_t bytes, uint32_t pattern,
+                        bool stream)
+{
+    uint8_t *end = dst + bytes;
+    uint64_t value;
+
+    (void)stream;
+    pattern = fill_head(&dst, end, pattern, 8);
+    value = (uint64_t)pattern << 32 | pattern;
+    for (; end - dst >= 8; dst += 8)
+        *(uint64_t *)dst = value;
+    fill_tail(dst, end, pattern);
+}
+
+static void copy_scalar(uint8_t *dst, const uint8_t *src, size_t bytes,
+                        bool stream)
+{
+    (void)stream;
+    memcpy(dst, src, bytes);
+}
+
+static void blend_scalar(uint32_t *dst, const uint32_t *src,
+                         const uint8_t *alpha, int count)
+{
+    for (int i = 0; i < count; i++) {
+        uint32_t inv = 255 - alpha[i];
+        uint32_t d = dst[i], p = src[i];
+
+        dst[i] = 0xff000000 |
+                 blend_channel(p >> 16 & 0xff, d >> 16 & 0xff, inv) << 16 |
+                 blend_channel(p >> 8 & 0xff, d >> 8 & 0xff, inv) << 8 |
+                 blend_channel(p & 0xff, d & 0xff, inv);
+    }
+}
+
+static void copy_keyed_scalar(uint32_t *dst, const uint32_t *src,
+                              uint32_t key, int count)
+{
+    for (int i = 0; i < count; i++)
+        if ((src[i] & 0xffffff) != key)
+            dst[i] = src[i];
+}
+
+static void convert_16_scalar(uint16_t *dst, const uint32_t *src, int count)
+{
+    for (int i = 0; i < count; i++)
+        dst[i] = colour_to_16(src[i]);
+}
+
+static void gather_scalar(uint32_t *dst, const uint32_t *src,
+                          const int *index, int count)
+{
+    for (int i = 0; i < count; i++)
+        dst[i] = src[index[i]];
+}
+
+static void lerp_rows_scalar(uint32_t *dst, const uint32_t *a,
+                             const uint32_t *b, uint32_t frac, int count)
+{
+    for (int i = 0; i < count; i++)
+        dst[i] = lerp_colour(a[i], b[i], frac);
+}
+
+static void lerp_columns_scalar(uint32_t *dst, const uint32_t *src,
+                                const int *col0, const int *col1,
+                                const uint8_t *frac, int count)
+{
+    for (int i = 0; i < count; i++)
+        dst[i] = lerp_colour(src[col0[i]], src[col1[i]], frac[i]);
+}
+
+#if HAVE_X86_KERNELS
+__attribute__((target("sse2"))) static void
+fill_sse2(uint8_t *dst, size_t bytes, uint32_t pattern, bool stream)
+{
+    uint8_t *end = dst + bytes;
+    __m128i value;
+
+    pattern = fill_head(&dst, end, pattern, 16);
+    value = _mm_set1_epi32(pattern);
+    if (stream) {
+        for (; end - dst >= 64; dst += 64) {
+            _mm_stream_si128((__m128i *)dst, value);
+            _mm_stream_si128((__m128i *)(dst + 16), value);
+            _mm_stream_si128((__m128i *)(dst + 32), value);
+            _mm_stream_si128((__m128i *)(dst + 48), value);
+        }
+        _mm_sfence();
+    }
+    for (; end - dst >= 16; dst += 16)
+        _mm_store_si128((__m128i *)dst, value);
+    fill_tail(dst, end, pattern);
+}
+
+__attribute__((target("sse2"))) static void
+copy_sse2(uint8_t *dst, const uint8_t *src, size_t bytes, bool stream)
+{
+    size_t i = 0;
+
+    if (stream) {
+        size_t head = min(-(uintptr_t)dst & 15, bytes);
+
+        memcpy(dst, src, head);
+        for (i = head; i + 64 <= bytes; i += 64) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i v1 = _mm_loadu_si128((const __m128i *)(src + i + 16));
+            __m128i v2 = _mm_loadu_si128((const __m128i *)(src + i + 32));
+            __m128i v3 = _mm_loadu_si128((const __m128i *)(src + i + 48));
+
+            _mm_stream_si128((__m128i *)(dst + i), v0);
+            _mm_stream_si128((__m128i *)(dst + i + 16), v1);
+            _mm_stream_si128((__m128i *)(dst + i + 32), v2);
+            _mm_stream_si128((__m128i *)(dst + i + 48), v3);
+        }
+        for (; i + 16 <= bytes; i += 16)
+            _mm_stream_si128((__m128i *)(dst + i),
+                             _mm_loadu_si128((const __m128i *)(src + i)));
+        _mm_sfence();
+    }
+    memcpy(dst + i, src + i, bytes - i);
+}
+
+/* Blend two 8-bit channels per 16-bit lane: p + (d * inv) / 255 */
+__attribute__((target("sse2"))) static inline __m128i
+blend_lanes_sse2(__m128i d, __m128i inv)
+{
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(d, inv), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse2"))) static void
+blend_sse2(uint32_t *dst, const uint32_t *src, const uint8_t *alpha,
+           int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i opaque = _mm_set1_epi32(0xff000000);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+        uint32_t a4;
+        __m128i inv;
+
+        /* Spread each alpha across its pixel, and invert it */
+        memcpy(&a4, alpha + i, sizeof(a4));
+        inv = _mm_cvtsi32_si128(~a4);
+        inv = _mm_unpacklo_epi8(inv, inv);
+        inv = _mm_unpacklo_epi16(inv, inv);
+
+        /* Premultiplied channels can't overflow, so a byte add will do */
+        d = _mm_packus_epi16(
+            blend_lanes_sse2(_mm_unpacklo_epi8(d, zero),
+                             _mm_unpacklo_epi8(inv, zero)),
+            blend_lanes_sse2(_mm_unpackhi_epi8(d, zero),
+                             _mm_unpackhi_epi8(inv, zero)));
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_or_si128(_mm_add_epi8(d, p), opaque));
+    }
+    blend_scalar(dst + i, src + i, alpha + i, count - i);
+}
+
+/* Blend two 8-bit channels per 16-bit lane: (a * (256 - f) + b * f) / 256,
+ * with the 256 split as 255 + 1 so every multiplier fits in a byte */
+__attribute__((target("sse2"))) static inline __m128i
+lerp_lanes_sse2(__m128i a, __m128i b, __m128i f, __m128i inv)
+{
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(a, inv), _mm_mullo_epi16(b, f));
+    return _mm_srli_epi16(_mm_add_epi16(t, a), 8);
+}
+
+/* Blend 4 pairs of pixels, by a fraction repeated across each pixel in f */
+__attribute__((target("sse2"))) static inline __m128i
+lerp_pixels_sse2(__m128i a, __m128i b, __m128i f)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i inv = _mm_xor_si128(f, _mm_set1_epi8(-1));
+
+    return _mm_packus_epi16(lerp_lanes_sse2(_mm_unpacklo_epi8(a, zero),
+                                            _mm_unpacklo_epi8(b, zero),
+                                            _mm_unpacklo_epi8(f, zero),
+                                            _mm_unpacklo_epi8(inv, zero)),
+                            lerp_lanes_sse2(_mm_unpackhi_epi8(a, zero),
+                                            _mm_unpackhi_epi8(b, zero),
+                                            _mm_unpackhi_epi8(f, zero),
+                                            _mm_unpackhi_epi8(inv, zero)));
+}
+
+__attribute__((target("sse2"))) static void
+lerp_rows_sse2(uint32_t *dst, const uint32_t *a, const uint32_t *b,
+               uint32_t frac, int count)
+{
+    const __m128i f = _mm_set1_epi8((char)frac);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_si128(
+            (__m128i *)(dst + i),
+            lerp_pixels_sse2(_mm_loadu_si128((const __m128i *)(a + i)),
+                             _mm_loadu_si128((const __m128i *)(b + i)), f));
+    lerp_rows_scalar(dst + i, a + i, b + i, frac, count - i);
+}
+
+/* There is no gather, so the pixels are loaded one at a time */
+__attribute__((target("sse2"))) static void
+lerp_columns_sse2(uint32_t *dst, const uint32_t *src, const int *col0,
+                  const int *col1, const uint8_t *frac, int count)
+{
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i a = _mm_set_epi32(src[col0[i + 3]], src[col0[i + 2]],
+                                  src[col0[i + 1]], src[col0[i]]);
+        __m128i b = _mm_set_epi32(src[col1[i + 3]], src[col1[i + 2]],
+                                  src[col1[i + 1]], src[col1[i]]);
+        uint32_t f4;
+        __m128i f;
+
+        /* Spread each fraction across its pixel */
+        memcpy(&f4, frac + i, sizeof(f4));
+        f = _mm_cvtsi32_si128(f4);
+        f = _mm_unpacklo_epi8(f, f);
+        f = _mm_unpacklo_epi16(f, f);
+        _mm_storeu_si128((__m128i *)(dst + i), lerp_pixels_sse2(a, b, f));
+    }
+    lerp_columns_scalar(dst + i, src, col0 + i, col1 + i, frac + i,
+                        count - i);
+}
+
+__attribute__((target("sse2"))) static void
+copy_keyed_sse2(uint32_t *dst, const uint32_t *src, uint32_t key, int count)
+{
+    const __m128i keys = _mm_set1_epi32(key);
+    const __m128i rgb = _mm_set1_epi32(0xffffff);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i keyed = _mm_cmpeq_epi32(_mm_and_si128(p, rgb), keys);
+
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_or_si128(_mm_and_si128(keyed, d),
+                                      _mm_andnot_si128(keyed, p)));
+    }
+    copy_keyed_scalar(dst + i, src + i, key, count - i);
+}
+
+/* RGB565 value of each 32-bit lane, sign extended so it packs exactly */
+__attribute__((target("sse2"))) static inline __m128i
+rgb565_sse2(__m128i c)
+{
+    __m128i v = _mm_or_si128(
+        _mm_or_si128(
+            _mm_srli_epi32(_mm_and_si128(c, _mm_set1_epi32(0xf80000)), 8),
+            _mm_srli_epi32(_mm_and_si128(c, _mm_set1_epi32(0xfc00)), 5)),
+        _mm_srli_epi32(_mm_and_si128(c, _mm_set1_epi32(0xff)), 3));
+    return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+__attribute__((target("sse2"))) static void
+convert_16_sse2(uint16_t *dst, const uint32_t *src, int count)
+{
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i lo = rgb565_sse2(_mm_loadu_si128((const __m128i *)(src + i)));
+        __m128i hi =
+            rgb565_sse2(_mm_loadu_si128((const __m128i *)(src + i + 4)));
+
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+    }
+    convert_16_scalar(dst + i, src + i, count - i);
+}
+#endif
+
+#if HAVE_AVX_KERNELS
+__attribute__((target("avx2"))) static void
+fill_avx2(uint8_t *dst, size_t bytes, uint32_t pattern, bool stream)
+{
+    uint8_t *end = dst + bytes;
+    __m256i value;
+
+    pattern = fill_head(&dst, end, pattern, 32);
+    value = _mm256_set1_epi32(pattern);
+    if (stream) {
+        for (; end - dst >= 64; dst += 64) {
+            _mm256_stream_si256((__m256i *)dst, value);
+            _mm256_stream_si256((__m256i *)(dst + 32), value);
+        }
+        _mm_sfence();
+    }
+    for (; end - dst >= 32; dst += 32)
+        _mm256_store_si256((__m256i *)dst, value);
+    fill_tail(dst, end, pattern);
+}
+
+__attribute__((target("avx2"))) static void
+copy_avx2(uint8_t *dst, const uint8_t *src, size_t bytes, bool stream)
+{
+    size_t i = 0;
+
+    if (stream) {
+        size_t head = min(-(uintptr_t)dst & 31, bytes);
+
+        memcpy(dst, src, head);
+        for (i = head; i + 64 <= bytes; i += 64) {
+            __m256i v0 = _mm256_loadu_si256((const __m256i *)(src + i));
+            __m256i v1 = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+
+            _mm256_stream_si256((__m256i *)(dst + i), v0);
+            _mm256_stream_si256((__m256i *)(dst + i + 32), v1);
+        }
+        _mm_sfence();
+    }
+    memcpy(dst + i, src + i, bytes - i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+blend_lanes_avx2(__m256i d, __m256i inv)
+{
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(d, inv),
+                                 _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)),
+                             8);
+}
+
+__attribute__((target("avx2"))) static void
+blend_avx2(uint32_t *dst, const uint32_t *src, const uint8_t *alpha,
+           int count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i opaque = _mm256_set1_epi32(0xff000000);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i p = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i inv = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i *)(alpha + i)));
+
+        /* Invert each alpha, and spread it across its pixel */
+        inv = _mm256_xor_si256(inv, _mm256_set1_epi32(255));
+        inv = _mm256_mullo_epi32(inv, _mm256_set1_epi32(0x01010101));
+        /* Unpacking & packing both work within 128-bit halves, so the
+         * pixels come back out in order */
+        d = _mm256_packus_epi16(
+            blend_lanes_avx2(_mm256_unpacklo_epi8(d, zero),
+                             _mm256_unpacklo_epi8(inv, zero)),
+            blend_lanes_avx2(_mm256_unpackhi_epi8(d, zero),
+                             _mm256_unpackhi_epi8(inv, zero)));
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_or_si256(_mm256_add_epi8(d, p), opaque));
+    }
+    blend_scalar(dst + i, src + i, alpha + i, count - i);
+}
+
+__attribute__((target("avx2"))) static void
+gather_avx2(uint32_t *dst, const uint32_t *src, const int *index, int count)
+{
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_si256(
+            (__m256i *)(dst + i),
+            _mm256_i32gather_epi32(
+                (const int *)src,
+                _mm256_loadu_si256((const __m256i *)(index + i)), 4));
+    gather_scalar(dst + i, src, index + i, count - i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+lerp_lanes_avx2(__m256i a, __m256i b, __m256i f, __m256i inv)
+{
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(a, inv),
+                                 _mm256_mullo_epi16(b, f));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, a), 8);
+}
+
+/* Blend 8 pairs of pixels, by a fraction repeated across each pixel in f */
+__attribute__((target("avx2"))) static inline __m256i
+lerp_pixels_avx2(__m256i a, __m256i b, __m256i f)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i inv = _mm256_xor_si256(f, _mm256_set1_epi8(-1));
+
+    return _mm256_packus_epi16(
+        lerp_lanes_avx2(_mm256_unpacklo_epi8(a, zero),
+                        _mm256_unpacklo_epi8(b, zero),
+                        _mm256_unpacklo_epi8(f, zero),
+                        _mm256_unpacklo_epi8(inv, zero)),
+        lerp_lanes_avx2(_mm256_unpackhi_epi8(a, zero),
+                        _mm256_unpackhi_epi8(b, zero),
+                        _mm256_unpackhi_epi8(f, zero),
+                        _mm256_unpackhi_epi8(inv, zero)));
+}
+
+__attribute__((target("avx2"))) static void
+lerp_rows_avx2(uint32_t *dst, const uint32_t *a, const uint32_t *b,
+               uint32_t frac, int count)
+{
+    const __m256i f = _mm256_set1_epi8((char)frac);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_si256(
+            (__m256i *)(dst + i),
+            lerp_pixels_avx2(_mm256_loadu_si256((const __m256i *)(a + i)),
+                             _mm256_loadu_si256((const __m256i *)(b + i)),
+                             f));
+    lerp_rows_scalar(dst + i, a + i, b + i, frac, count - i);
+}
+
+__attribute__((target("avx2"))) static void
+lerp_columns_avx2(uint32_t *dst, const uint32_t *src, const int *col0,
+                  const int *col1, const uint8_t *frac, int count)
+{
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i a = _mm256_i32gather_epi32(
+            (const int *)src,
+            _mm256_loadu_si256((const __m256i *)(col0 + i)), 4);
+        __m256i b = _mm256_i32gather_epi32(
+            (const int *)src,
+            _mm256_loadu_si256((const __m256i *)(col1 + i)), 4);
+        __m256i f = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i *)(frac + i)));
+
+        /* Spread each fraction across its pixel */
+        f = _mm256_mullo_epi32(f, _mm256_set1_epi32(0x01010101));
+        _mm256_storeu_si256((__m256i *)(dst + i), lerp_pixels_avx2(a, b, f));
+    }
+    lerp_columns_scalar(dst + i, src, col0 + i, col1 + i, frac + i,
+                        count - i);
+}
+
+__attribute__((target("avx2"))) static void
+copy_keyed_avx2(uint32_t *dst, const uint32_t *src, uint32_t key, int count)
+{
+    const __m256i keys = _mm256_set1_epi32(key);
+    const __m256i rgb = _mm256_set1_epi32(0xffffff);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i keyed = _mm256_cmpeq_epi32(_mm256_and_si256(p, rgb), keys);
+
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_blendv_epi8(p, d, keyed));
+    }
+    copy_keyed_scalar(dst + i, src + i, key, count - i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i rgb565_avx2(__m256i c)
+{
+    __m256i v = _mm256_or_si256(
+        _mm256_or_si256(_mm256_srli_epi32(
+                            _mm256_and_si256(c, _mm256_set1_epi32(0xf80000)),
+                            8),
+                        _mm256_srli_epi32(
+                            _mm256_and_si256(c, _mm256_set1_epi32(0xfc00)),
+                            5)),
+        _mm256_srli_epi32(_mm256_and_si256(c, _mm256_set1_epi32(0xff)), 3));
+    return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+__attribute__((target("avx2"))) static void
+convert_16_avx2(uint16_t *dst, const uint32_t *src, int count)
+{
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i lo =
+            rgb565_avx2(_mm256_loadu_si256((const __m256i *)(src + i)));
+        __m256i hi =
+            rgb565_avx2(_mm256_loadu_si256((const __m256i *)(src + i + 8)));
+
+        /* Packing interleaves the 128-bit halves, so put them back */
+        _mm256_storeu_si256(
+            (__m256i *)(dst + i),
+            _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8));
+    }
+    convert_16_scalar(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx512f"))) static void
+fill_avx512(uint8_t *dst, size_t bytes, uint32_t pattern, bool stream)
+{
+    uint8_t *end = dst + bytes;
+    __m512i value;
+
+    pattern = fill_head(&dst, end, pattern, 64);
+    value = _mm512_set1_epi32(pattern);
+    if (stream) {
+        for (; end - dst >= 64; dst += 64)
+            _mm512_stream_si512((void *)dst, value);
+        _mm_sfence();
+    }
+    for (; end - dst >= 64; dst += 64)
+        _mm512_store_si512((void *)dst, value);
+    fill_tail(dst, end, pattern);
+}
+
+__attribute__((target("avx512f"))) static void
+copy_avx512(uint8_t *dst, const uint8_t *src, size_t bytes, bool stream)
+{
+    size_t i = 0;
+
+    if (stream) {
+        size_t head = min(-(uintptr_t)dst & 63, bytes);
+
+        memcpy(dst, src, head);
+        for (i = head; i + 64 <= bytes; i += 64)
+            _mm512_stream_si512((void *)(dst + i),
+                                _mm512_loadu_si512(src + i));
+        _mm_sfence();
+    }
+    memcpy(dst + i, src + i, bytes - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static inline __m512i
+blend_lanes_avx512(__m512i d, __m512i inv)
+{
+    __m512i t = _mm512_add_epi16(_mm512_mullo_epi16(d, inv),
+                                 _mm512_set1_epi16(128));
+    return _mm512_srli_epi16(_mm512_add_epi16(t, _mm512_srli_epi16(t, 8)),
+                             8);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+blend_avx512(uint32_t *dst, const uint32_t *src, const uint8_t *alpha,
+             int count)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i opaque = _mm512_set1_epi32(0xff000000);
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m512i d = _mm512_loadu_si512(dst + i);
+        __m512i p = _mm512_loadu_si512(src + i);
+        __m512i inv = _mm512_cvtepu8_epi32(
+            _mm_loadu_si128((const __m128i *)(alpha + i)));
+
+        /* Invert each alpha, and spread it across its pixel */
+        inv = _mm512_xor_si512(inv, _mm512_set1_epi32(255));
+        inv = _mm512_mullo_epi32(inv, _mm512_set1_epi32(0x01010101));
+        d = _mm512_packus_epi16(
+            blend_lanes_avx512(_mm512_unpacklo_epi8(d, zero),
+                               _mm512_unpacklo_epi8(inv, zero)),
+            blend_lanes_avx512(_mm512_unpackhi_epi8(d, zero),
+                               _mm512_unpackhi_epi8(inv, zero)));
+        _mm512_storeu_si512(dst + i,
+                            _mm512_or_si512(_mm512_add_epi8(d, p), opaque));
+    }
+    blend_scalar(dst + i, src + i, alpha + i, count - i);
+}
+
+__attribute__((target("avx512f"))) static void
+gather_avx512(uint32_t *dst, const uint32_t *src, const int *index,
+              int count)
+{
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+        _mm512_storeu_si512(dst + i,
+                            _mm512_i32gather_epi32(
+                                _mm512_loadu_si512(index + i), src, 4));
+    gather_scalar(dst + i, src, index + i, count - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static inline __m512i
+lerp_lanes_avx512(__m512i a, __m512i b, __m512i f, __m512i inv)
+{
+    __m512i t = _mm512_add_epi16(_mm512_mullo_epi16(a, inv),
+                                 _mm512_mullo_epi16(b, f));
+    return _mm512_srli_epi16(_mm512_add_epi16(t, a), 8);
+}
+
+/* Blend 16 pairs of pixels, by a fraction repeated across each pixel in
+ * f */
+__attribute__((target("avx512f,avx512bw"))) static inline __m512i
+lerp_pixels_avx512(__m512i a, __m512i b, __m512i f)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i inv = _mm512_xor_si512(f, _mm512_set1_epi8(-1));
+
+    return _mm512_packus_epi16(
+        lerp_lanes_avx512(_mm512_unpacklo_epi8(a, zero),
+                          _mm512_unpacklo_epi8(b, zero),
+                          _mm512_unpacklo_epi8(f, zero),
+                          _mm512_unpacklo_epi8(inv, zero)),
+        lerp_lanes_avx512(_mm512_unpackhi_epi8(a, zero),
+                          _mm512_unpackhi_epi8(b, zero),
+                          _mm512_unpackhi_epi8(f, zero),
+                          _mm512_unpackhi_epi8(inv, zero)));
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+lerp_rows_avx512(uint32_t *dst, const uint32_t *a, const uint32_t *b,
+                 uint32_t frac, int count)
+{
+    const __m512i f = _mm512_set1_epi8((char)frac);
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+        _mm512_storeu_si512(dst + i,
+                            lerp_pixels_avx512(_mm512_loadu_si512(a + i),
+                                               _mm512_loadu_si512(b + i), f));
+    lerp_rows_scalar(dst + i, a + i, b + i, frac, count - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+lerp_columns_avx512(uint32_t *dst, const uint32_t *src, const int *col0,
+                    const int *col1, const uint8_t *frac, int count)
+{
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m512i a =
+            _mm512_i32gather_epi32(_mm512_loadu_si512(col0 + i), src, 4);
+        __m512i b =
+            _mm512_i32gather_epi32(_mm512_loadu_si512(col1 + i), src, 4);
+        __m512i f = _mm512_cvtepu8_epi32(
+            _mm_loadu_si128((const __m128i *)(frac + i)));
+
+        /* Spread each fraction across its pixel */
+        f = _mm512_mullo_epi32(f, _mm512_set1_epi32(0x01010101));
+        _mm512_storeu_si512(dst + i, lerp_pixels_avx512(a, b, f));
+    }
+    lerp_columns_scalar(dst + i, src, col0 + i, col1 + i, frac + i,
+                        count - i);
+}
+
+__attribute__((target("avx512f"))) static void
+copy_keyed_avx512(uint32_t *dst, const uint32_t *src, uint32_t key,
+                  int count)
+{
+    const __m512i keys = _mm512_set1_epi32(key);
+    const __m512i rgb = _mm512_set1_epi32(0xffffff);
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m512i p = _mm512_loadu_si512(src + i);
+        __mmask16 copy =
+            _mm512_cmpneq_epi32_mask(_mm512_and_si512(p, rgb), keys);
+
+        _mm512_mask_storeu_epi32(dst + i, copy, p);
+    }
+    copy_keyed_scalar(dst + i, src + i, key, count - i);
+}
+
+__attribute__((target("avx512f"))) static void
+convert_16_avx512(uint16_t *dst, const uint32_t *src, int count)
+{
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m512i c = _mm512_loadu_si512(src + i);
+        __m512i v = _mm512_or_si512(
+            _mm512_or_si512(
+                _mm512_srli_epi32(
+                    _mm512_and_si512(c, _mm512_set1_epi32(0xf80000)), 8),
+                _mm512_srli_epi32(
+                    _mm512_and_si512(c, _mm512_set1_epi32(0xfc00)), 5)),
+            _mm512_srli_epi32(_mm512_and_si512(c, _mm512_set1_epi32(0xff)),
+                              3));
+
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm512_cvtepi32_epi16(v));
+    }
+    convert_16_scalar(dst + i, src + i, count - i);
+}
+#endif
+
+#if HAVE_NEON_KERNELS
+static void fill_neon(uint8_t *dst, size_t bytes, uint32_t pattern,
+                      bool stream)
+{
+    uint8_t *end = dst + bytes;
+    uint32x4_t value;
+
+    (void)stream;
+    pattern = fill_head(&dst, end, pattern, 16);
+    value = vdupq_n_u32(pattern);
+    for (; end - dst >= 16; dst += 16)
+        vst1q_u32((uint32_t *)dst, value);
+    fill_tail(dst, end, pattern);
+}
+
+static inline uint8x8_t blend_lanes_neon(uint8x8_t p, uint8x8_t d,
+                                         uint8x8_t inv)
+{
+    uint16x8_t t = vaddq_u16(vmull_u8(d, inv), vdupq_n_u16(128));
+    return vadd_u8(p, vshrn_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8));
+}
+
+static void blend_neon(uint32_t *dst, const uint32_t *src,
+                       const uint8_t *alpha, int count)
+{
+    int i = 0;
+
+    /* Loading 4 ways splits the pixels into planes of b, g, r & a */
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t d = vld4_u8((const uint8_t *)(dst + i));
+        uint8x8x4_t p = vld4_u8((const uint8_t *)(src + i));
+        uint8x8_t inv = vmvn_u8(vld1_u8(alpha + i));
+
+        for (int c = 0; c < 3; c++)
+            d.val[c] = blend_lanes_neon(p.val[c], d.val[c], inv);
+        d.val[3] = vdup_n_u8(255);
+        vst4_u8((uint8_t *)(dst + i), d);
+    }
+    blend_scalar(dst + i, src + i, alpha + i, count - i);
+}
+
+/* Blend 8 pairs of pixels (split into channels) by the 8 fractions in f */
+static inline uint8x8x4_t lerp_pixels_neon(uint8x8x4_t a, uint8x8x4_t b,
+                                           uint8x8_t f)
+{
+    uint8x8_t inv = vmvn_u8(f);
+
+    /* a * (256 - f) + b * f, with the 256 split as 255 + 1 */
+    for (int c = 0; c < 4; c++) {
+        uint16x8_t t = vmull_u8(a.val[c], inv);
+
+        t = vmlal_u8(t, b.val[c], f);
+        a.val[c] = vshrn_n_u16(vaddw_u8(t, a.val[c]), 8);
+    }
+    return a;
+}
+
+static void lerp_rows_neon(uint32_t *dst, const uint32_t *a,
+                           const uint32_t *b, uint32_t frac, int count)
+{
+    const uint8x8_t f = vdup_n_u8(frac);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+        vst4_u8((uint8_t *)(dst + i),
+                lerp_pixels_neon(vld4_u8((const uint8_t *)(a + i)),
+                                 vld4_u8((const uint8_t *)(b + i)), f));
+    lerp_rows_scalar(dst + i, a + i, b + i, frac, count - i);
+}
+
+/* There is no gather, so the pixels are looked up one at a time */
+static void lerp_columns_neon(uint32_t *dst, const uint32_t *src,
+                              const int *col0, const int *col1,
+                              const uint8_t *frac, int count)
+{
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        uint32_t a[8], b[8];
+
+        gather_scalar(a, src, col0 + i, 8);
+        gather_scalar(b, src, col1 + i, 8);
+        vst4_u8((uint8_t *)(dst + i),
+                lerp_pixels_neon(vld4_u8((const uint8_t *)a),
+                                 vld4_u8((const uint8_t *)b),
+                                 vld1_u8(frac + i)));
+    }
+    lerp_columns_scalar(dst + i, src, col0 + i, col1 + i, frac + i,
+                        count - i);
+}
+
+static void copy_keyed_neon(uint32_t *dst, const uint32_t *src, uint32_t key,
+                            int count)
+{
+    const uint32x4_t keys = vdupq_n_u32(key);
+    const uint32x4_t rgb = vdupq_n_u32(0xffffff);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        uint32x4_t p = vld1q_u32(src + i);
+        uint32x4_t keyed = vceqq_u32(vandq_u32(p, rgb), keys);
+
+        vst1q_u32(dst + i, vbslq_u32(keyed, vld1q_u32(dst + i), p));
+    }
+    copy_keyed_scalar(dst + i, src + i, key, count - i);
+}
+
+static inline uint16x4_t rgb565_neon(uint32x4_t c)
+{
+    uint32x4_t v = vorrq_u32(
+        vorrq_u32(vshrq_n_u32(vandq_u32(c, vdupq_n_u32(0xf80000)), 8),
+                  vshrq_n_u32(vandq_u32(c, vdupq_n_u32(0xfc00)), 5)),
+        vshrq_n_u32(vandq_u32(c, vdupq_n_u32(0xff)), 3));
+    return vmovn_u32(v);
+}
+
+static void convert_16_neon(uint16_t *dst, const uint32_t *src, int count)
+{
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+        vst1q_u16(dst + i, vcombine_u16(rgb565_neon(vld1q_u32(src + i)),
+                                        rgb565_neon(vld1q_u32(src + i + 4))));
+    convert_16_scalar(dst + i, src + i, count - i);
+}
+#endif
+
+/* In order of preference, with a NULL name for those not built */
+enum kernel_isa {
+    KERNEL_scalar,
+    KERNEL_sse2,
+    KERNEL_avx2,
+    KERNEL_avx512,
+    KERNEL_neon,
+    KERNEL_COUNT,
+};
+
+static const struct pixel_kernels kernel_sets[KERNEL_COUNT] = {
+    [KERNEL_scalar] = {"scalar", fill_scalar, copy_scalar, blend_scalar,
+                       copy_keyed_scalar, convert_16_scalar, gather_scalar,
+                       lerp_rows_scalar, lerp_columns_scalar},
+    /* SSE2 & NEON have no gather, so use the scalar loop for that */
+#if HAVE_X86_KERNELS
+    [KERNEL_sse2] = {"sse2", fill_sse2, copy_sse2, blend_sse2,
+                     copy_keyed_sse2, convert_16_sse2, gather_scalar,
+                     lerp_rows_sse2, lerp_columns_sse2},
+#endif
+#if HAVE_AVX_KERNELS
+    [KERNEL_avx2] = {"avx2", fill_avx2, copy_avx2, blend_avx2,
+                     copy_keyed_avx2, convert_16_avx2, gather_avx2,
+                     lerp_rows_avx2, lerp_columns_avx2},
+    [KERNEL_avx512] = {"avx512", fill_avx512, copy_avx512, blend_avx512,
+                       copy_keyed_avx512, convert_16_avx512, gather_avx512,
+                       lerp_rows_avx512, lerp_columns_avx512},
+#endif
+    /* NEON has no non-temporal stores, so its copies are plain memcpys */
+#if HAVE_NEON_KERNELS
+    [KERNEL_neon] = {"neon", fill_neon, copy_scalar, blend_neon,
+                     copy_keyed_neon, convert_16_neon, gather_scalar,
+                     lerp_rows_neon, lerp_columns_neon},
+#endif
+};
+
+/* Kernels in use, only ever pointing at a complete set */
+static const struct pixel_kernels *kernels = &kernel_sets[KERNEL_scalar];
+
+static bool kernels_supported(enum kernel_isa isa)
+{
+    if (!kernel_sets[isa].isa)
+        return false;
+#if HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    switch (isa) {
+    case KERNEL_sse2:
+        return __builtin_cpu_supports("sse2");
+    case KERNEL_avx2:
+        return __builtin_cpu_supports("avx2");
+    case KERNEL_avx512:
+        return __builtin_cpu_supports("avx512f") &&
+               __builtin_cpu_supports("avx512bw");
+    default:
+        break;
+    }
+#endif
+    /* NEON is only built when the compiler can assume it is there */
+    return true;
+}
+
+static void select_kernels(void)
+{
+    const char *name = getenv("RAW_DISPLAY_ISA");
+    int best = KERNEL_scalar;
+
+    for (int isa = 0; isa < KERNEL_COUNT; isa++)
+        if (kernels_supported(isa))
+            best = isa;
+    if (name && *name) {
+        int isa = 0;
+
+        while (isa < KERNEL_COUNT && (!kernel_sets[isa].isa ||
+                                      strcmp(kernel_sets[isa].isa, name)))
+            isa++;
+        if (isa < KERNEL_COUNT && kernels_supported(isa))
+            best = isa;
+        else
+            fprintf(stderr, "RAW_DISPLAY_ISA=%s is not supported, using %s\n",
+                    name, kernel_sets[best].isa);
+    }
+    kernels = &kernel_sets[best];
+}
+
+const char *raw_display_isa(void)
+{
+    return kernels->isa;
+}
+
+/**
+ * Copy a rectangle of bytes into memory which is written but never read
+ * back, such as a mapped framebuffer. Non-temporal stores are used where
+ * the kernels have them: they go out in whole lines through the
+ * write-combining buffers, without reading the destination in or evicting
+ * anything from the cache
+ */
+__attribute__((unused)) static void stream_copy(uint8_t *dst, int dst_stride,
+                                                const uint8_t *src,
+                                                int src_stride, int bytes,
+                                                int rows)
+{
+    for (int y = 0; y < rows; y++)
+        kernels->copy(dst + (size_t)y * dst_stride,
+                      src + (size_t)y * src_stride, bytes, true);
+}
+
+/* Write count copies of an already converted pixel value */
+static void fill_span(uint8_t *dst, int bpp, int count, uint32_t pixel)
+{
+    /* Below this the call costs more than the vectors save */
+    const int kernel_min = 32;
+
+    switch (bpp) {
+    case 32: {
+        uint32_t *pos32 = (uint32_t *)dst;
+        if (count >= kernel_min) {
+            kernels->fill(dst, (size_t)count * 4, pixel, false);
+            break;
+        }
+        for (int i = 0; i < count; i++)
+            pos32[i] = pixel;
+        break;
+    }
+    case 24:
+        for (int i = 0; i < count; i++)
+            store_24(dst + i * 3, pixel);
+        break;
+    case 16: {
+        uint16_t *pos16 = (uint16_t *)dst;
+        if (count >= kernel_min) {
+            kernels->fill(dst, (size_t)count * 2, pixel | pixel << 16, false);
+            break;
+        }
+        for (int i = 0; i < count; i++)
+            pos16[i] = pixel;
+        break;
+    }
+    }
+}
+
+static bool get_draw_target(const struct raw_display *rd,
+                            struct draw_target *target)
+{
+    const struct raw_display_surface *surface = rd->draw.target;
+
+    if (surface) {
+        target->width = surface->width;
+        target->height = surface->height;
+        target->bpp = surface->bpp;
+        target->stride = surface->stride;
+        target->pixels = surface->pixels;
+    } else {
+        target->width = target->height = target->stride = target->bpp = 0;
+        raw_display_info(rd, &target->width, &target->height, &target->bpp,
+                         &target->stride);
+        target->pixels = raw_display_get_frame(rd);
+    }
+
+    target->clip_x0 = target->clip_y0 = 0;
+    target->clip_x1 = target->width;
+    target->clip_y1 = target->height;
+    if (rd->draw.clip_set) {
+        target->clip_x0 = max(target->clip_x0, rd->draw.clip_x0);
+        target->clip_y0 = max(target->clip_y0, rd->draw.clip_y0);
+        target->clip_x1 = min(target->clip_x1, rd->draw.clip_x1 + 1);
+        target->clip_y1 = min(target->clip_y1, rd->draw.clip_y1 + 1);
+    }
+
+    return target->pixels && target->clip_x0 < target->clip_x1 &&
+           target->clip_y0 < target->clip_y1;
+}
+
+static inline uint8_t *pixel_address(const struct draw_target *target, int x,
+                                     int y)
+{
+    return target->pixels + y * target->stride + x * (target->bpp / 8);
+}
+
+/* Store an already converted pixel value, without any clipping */
+static inline void put_pixel(const struct draw_target *target, int x, int y,
+                             uint32_t pixel)
+{
+    uint8_t *pos = pixel_address(target, x, y);
+
+    switch (target->bpp) {
+    case 32:
+        *(uint32_t *)pos = pixel;
+        break;
+    case 24:
+        store_24(pos, pixel);
+        break;
+    case 16:
+        *(uint16_t *)pos = pixel;
+        break;
+    }
+}
+
+/* Store an already converted pixel value, if it is inside the clip */
+static inline void plot_pixel(const struct draw_target *target, int x, int y,
+                              uint32_t pixel)
+{
+    if (x >= target->clip_x0 && x < target->clip_x1 &&
+        y >= target->clip_y0 && y < target->clip_y1)
+        put_pixel(target, x, y, pixel);
+}
+
+/*
+ * Trace recording, see raw_display_trace_start.
+ * Each call is recorded before it is made, so a replay makes the same calls
+ * in the same order. Direct writes to the frame & surfaces are found by
+ * comparing them with shadow copies, which follow what the recorded calls
+ * drew: the rows a call may have drawn on are copied to the shadow by
+ * trace_done once it has drawn
+ */
+struct trace {
+    FILE *fp;
+    uint8_t *shadow;
+    uint32_t *row; // One row of the frame as colours, for frame_rows
+    int width;
+    int height;
+    int bpp;
+    int stride;
+    /* Rows drawn on by the current call, not yet in the shadow of the frame
+     * or of dirty_surface */
+    struct raw_display_surface *dirty_surface;
+    int dirty_y0;
+    int dirty_y1;
+    bool compare; // Compare the whole frame at the next call
+    int padding;  // Bytes needed to finish the last record
+};
+
+static inline bool tracing(const struct raw_display *rd)
+{
+    return rd && rd->draw.trace;
+}
+
+/* Start a record, after padding the previous one to a whole word */
+static void trace_header(struct trace *trace, uint32_t op, size_t size)
+{
+    uint32_t header[2] = {op, (uint32_t)size};
+
+    fwrite("\0\0\0", 1, trace->padding, trace->fp);
+    fwrite(header, sizeof(header), 1, trace->fp);
+    trace->padding = -size & 3;
+}
+
+/* Count the rows from y on which differ from their shadow */
+static int changed_rows(const uint8_t *pixels, const uint8_t *shadow,
+                        size_t row_bytes, int stride, int y, int height)
+{
+    int rows;
+
+    for (rows = 0; y + rows < height; rows++) {
+        size_t pos = (size_t)(y + rows) * stride;
+        if (!memcmp(pixels + pos, shadow + pos, row_bytes))
+            break;
+    }
+    return rows;
+}
+
+/* Record each run of rows from y0 to y1 where the frame differs from the
+ * shadow */
+static void trace_compare(struct trace *trace, const uint8_t *frame, int y0,
+                          int y1)
+{
+    size_t row_bytes = (size_t)trace->width * trace->bpp / 8;
+
+    for (int y = y0; y < y1;) {
+        size_t offset = (size_t)y * trace->stride;
+        int rows = changed_rows(frame, trace->shadow, row_bytes,
+                                trace->stride, y, y1);
+
+        if (!rows) {
+            y++;
+            continue;
+        }
+
+        int32_t words[2] = {y, rows};
+        trace_header(trace, RAW_DISPLAY_TRACE_frame_rows,
+                     sizeof(words) + (size_t)rows * trace->width * 4);
+        fwrite(words, sizeof(words), 1, trace->fp);
+        for (int r = 0; r < rows; r++) {
+            const uint8_t *src = frame + offset + (size_t)r * trace->stride;
+            for (int x = 0; x < trace->width; x++)
+                trace->row[x] = read_colour(src + x * trace->bpp / 8,
+                                            trace->bpp);
+            fwrite(trace->row, 4, trace->width, trace->fp);
+        }
+        memcpy(trace->shadow + offset, frame + offset,
+               (size_t)rows * trace->stride);
+        y += rows;
+    }
+}
+
+/**
+ * Record anything written directly to the frame, before recording a call
+ * @param compare Compare the frame even if nothing has asked for it
+ */
+static void trace_sync(struct raw_display *rd, struct trace *trace,
+                       bool compare)
+{
+    const uint8_t *frame = raw_display_get_frame(rd);
+
+    if (!frame)
+        return;
+    if (compare || trace->compare)
+        trace_compare(trace, frame, 0, trace->height);
+    trace->compare = false;
+}
+
+/**
+ * Start recording a call
+ * @param y0 First row the call may draw on
+ * @param y1 Row after the last one the call may draw on
+ * @param size Number of bytes of arguments which follow the words
+ * @param words Number of word arguments, which follow as int or uint32_t
+ *              values (cast anything wider)
+ * @return File to write the remaining arguments to, NULL if not tracing
+ */
+static FILE *trace_call(struct raw_display *rd, enum raw_display_trace_op op,
+                        int64_t y0, int64_t y1, size_t size, int words, ...)
+{
+    struct draw_target target;
+    struct trace *trace;
+    va_list ap;
+
+    if (!tracing(rd))
+        return NULL;
+    trace = rd->draw.trace;
+    /* A call which returned early, without trace_done, leaves its rows to
+     * be recorded as direct writes, which is redundant but still right */
+    trace->dirty_y0 = trace->dirty_y1 = 0;
+    if (get_draw_target(rd, &target)) {
+        if (!rd->draw.target)
+            trace_sync(rd, trace, false);
+        /* Clip before narrowing, as an empty call may pass y0 > y1 */
+        y0 = max(y0, (int64_t)target.clip_y0);
+        y1 = min(y1, (int64_t)target.clip_y1);
+        if (y1 > y0 &&
+            (!rd->draw.target || rd->draw.target->trace_shadow)) {
+            /* Record direct writes to the rows first, as they are about
+             * to be drawn over and copied to the shadow */
+            if (rd->draw.target)
+                trace_surface(rd, rd->draw.target, y0, y1);
+            else
+                trace_compare(trace, target.pixels, y0, y1);
+            trace->dirty_surface = rd->draw.target;
+            trace->dirty_y0 = y0;
+            trace->dirty_y1 = y1;
+        }
+    }
+
+    trace_header(trace, op, words * sizeof(uint32_t) + size);
+    va_start(ap, words);
+    for (int i = 0; i < words; i++) {
+        uint32_t word = va_arg(ap, uint32_t);
+        fwrite(&word, sizeof(word), 1, trace->fp);
+    }
+    va_end(ap);
+    return trace->fp;
+}
+
+/* Copy the rows the call drew on to the shadow, once it has drawn */
+static void trace_done(struct raw_display *rd)
+{
+    struct raw_display_surface *surface;
+    struct trace *trace;
+    const uint8_t *pixels;
+    uint8_t *shadow;
+    size_t offset;
+    int stride;
+
+    if (!tracing(rd))
+        return;
+    trace = rd->draw.trace;
+    if (trace->dirty_y1 <= trace->dirty_y0)
+        return;
+    surface = trace->dirty_surface;
+    pixels = surface ? surface->pixels : raw_display_get_frame(rd);
+    shadow = surface ? surface->trace_shadow : trace->shadow;
+    stride = surface ? surface->stride : trace->stride;
+    offset = (size_t)trace->dirty_y0 * stride;
+    if (pixels)
+        memcpy(shadow + offset, pixels + offset,
+               (size_t)(trace->dirty_y1 - trace->dirty_y0) * stride);
+    trace->dirty_y0 = trace->dirty_y1 = 0;
+}
+
+/* Record a pointer, which identifies an object across records */
+static void trace_handle(FILE *fp, const void *handle)
+{
+    uint64_t value = (uintptr_t)handle;
+    uint32_t words[2] = {(uint32_t)value, (uint32_t)(value >> 32)};
+
+    fwrite(words, sizeof(words), 1, fp);
+}
+
+/* Record rows of an image or field, without any padding between them */
+static void trace_rows(FILE *fp, const void *data, size_t row_bytes,
+                       int height, int stride)
+{
+    for (int y = 0; y < height; y++)
+        fwrite((const uint8_t *)data + (size_t)y * stride, row_bytes, 1,
+               fp);
+}
+
+/* Record rows of a surface, as if written directly to the target */
+static void trace_target_rows(struct raw_display *rd,
+                              const struct raw_display_surface *surface,
+                              int y0, int rows)
+{
+    int bytes = surface->bpp / 8;
+    FILE *fp = trace_call(rd, RAW_DISPLAY_TRACE_target_rows, 0, 0,
+                          (size_t)surface->width * rows * 4, 4, 0, y0,
+                          surface->width, rows);
+
+    for (int y = y0; y < y0 + rows; y++) {
+        const uint8_t *row = surface->pixels + (size_t)y * surface->stride;
+        for (int x = 0; x < surface->width; x++) {
+            uint32_t colour = read_colour(row + x * bytes, surface->bpp);
+            fwrite(&colour, sizeof(colour), 1, fp);
+        }
+    }
+}
+
+/*
+ * Record the rows from y0 to y1 of a surface which differ from its shadow,
+ * as if written directly. This is done whenever the surface is made the
+ * target, stops being it, is blitted or is about to be drawn on, so direct
+ * writes are replayed before anything else uses them
+ */
+static void trace_surface(struct raw_display *rd,
+                          struct raw_display_surface *surface, int y0,
+                          int y1)
+{
+    struct raw_display_surface *target;
+    size_t row_bytes;
+    bool switched = false;
+
+    if (!tracing(rd) || !surface || !surface->trace_shadow)
+        return;
+    target = rd->draw.target;
+    row_bytes = (size_t)surface->width * surface->bpp / 8;
+    for (int y = y0; y < y1;) {
+        size_t offset = (size_t)y * surface->stride;
+        int rows = changed_rows(surface->pixels, surface->trace_shadow,
+                                row_bytes, surface->stride, y, y1);
+
+        if (!rows) {
+            y++;
+            continue;
+        }
+        /* target_rows records go to whatever the target is */
+        if (surface != target && !switched) {
+            trace_handle(trace_call(rd, RAW_DISPLAY_TRACE_target, 0, 0, 8,
+                                    0),
+                         surface);
+            switched = true;
+        }
+        trace_target_rows(rd, surface, y, rows);
+        memcpy(surface->trace_shadow + offset, surface->pixels + offset,
+               (size_t)rows * surface->stride);
+        y += rows;
+    }
+    if (switched)
+        trace_handle(trace_call(rd, RAW_DISPLAY_TRACE_target, 0, 0, 8, 0),
+                     target);
+}
+
+static void trace_flip(struct raw_display *rd)
+{
+    struct trace *trace;
+
+    if (!tracing(rd))
+        return;
+    trace = rd->draw.trace;
+    trace_sync(rd, trace, true);
+    trace_header(trace, RAW_DISPLAY_TRACE_flip, 0);
+    /* The next frame may start with anything, depending on the backend */
+    trace->compare = true;
+}
+
+static int trace_close(struct trace *trace)
+{
+    int ret = 0;
+
+    if (!trace)
+        return 0;
+    fwrite("\0\0\0", 1, trace->padding, trace->fp);
+    if (fclose(trace->fp) != 0)
+        ret = -EIO;
+    free(trace->shadow);
+    free(trace->row);
+    free(trace);
+    return ret;
+}
+
+int raw_display_trace_start(struct raw_display *rd, const char *filename)
+{
+    struct trace *trace;
+    int ret;
+
+    if (!rd || !filename)
+        return -EINVAL;
+    if (rd->draw.trace)
+        return -EBUSY;
+    trace = calloc(1, sizeof(*trace));
+    if (!trace)
+        return -ENOMEM;
+    raw_display_info(rd, &trace->width, &trace->height, &trace->bpp,
+                     &trace->stride);
+    /* The shadow starts out blank, so the first comparison records
+     * whatever is in the frame already */
+    trace->shadow = calloc(trace->height, trace->stride);
+    trace->row = malloc(trace->width * sizeof(*trace->row));
+    if (!trace->shadow || !trace->row) {
+        free(trace->shadow);
+        free(trace->row);
+        free(trace);
+        return -ENOMEM;
+    }
+    trace->fp = fopen(filename, "wb");
+    if (!trace->fp) {
+        ret = -errno;
+        free(trace->shadow);
+        free(trace->row);
+        free(trace);
+        return ret;
+    }
+    setvbuf(trace->fp, NULL, _IOFBF, 1 << 20);
+
+    uint32_t header[4] = {RAW_DISPLAY_TRACE_MAGIC, RAW_DISPLAY_TRACE_VERSION,
+                          trace->width, trace->height};
+    fwrite(header, sizeof(header), 1, trace->fp);
+    trace->compare = true;
+    rd->draw.trace = trace;
+    return 0;
+}
+
+int raw_display_trace_stop(struct raw_display *rd)
+{
+    int ret;
+
+    if (!tracing(rd))
+        return -EINVAL;
+    /* Catch anything written directly since the last call */
+    trace_sync(rd, rd->draw.trace, true);
+    ret = trace_close(rd->draw.trace);
+    rd->draw.trace = NULL;
+    for (struct raw_display_surface *surface = rd->draw.surfaces; surface;
+         surface = surface->next) {
+        free(surface->trace_shadow);
+        surface->trace_shadow = NULL;
+    }
+    return ret;
+}
+
+/* Start tracing straight away if RAW_DISPLAY_TRACE names a file */
+static void trace_from_environment(struct raw_display *rd)
+{
+    const char *filename = getenv("RAW_DISPLAY_TRACE");
+
+    if (rd && filename && *filename &&
+        raw_display_trace_start(rd, filename) < 0)
+        fprintf(stderr, "Unable to trace to %s\n", filename);
+}
+
+/**
+ * 8x8 monochrome bitmap fonts for rendering
+ * Author: Daniel Hepper <daniel@hepper.net>
+ *
+ * License: Public Domain
+ *
+ * Based on:
+ * // Summary: font8x8.h
+ * // 8x8 monochrome bitmap fonts for rendering
+ * //
+ * // Author:
+ * //     Marcel Sondaar
+ * //     International Business Machines (public domain VGA fonts)
+ * //
+ * // License:
+ * //     Public Domain
+ *
+ * Fetched from:
+ *http://dimensionalrift.homelinux.net/combuster/mos3/?p=viewsource&file=/modules/gfx/font8_8.asm
+ **/
+
+// Constant: font8x8_basic
+// Contains an 8x8 font map for unicode points U+0020 - U+007F (basic latin)
+static const uint8_t font8x8[96][8] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+0020 (space)
+    {0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00}, // U+0021 (!)
+    {0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+0022 (")
+    {0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00}, // U+0023 (#)
+    {0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00}, // U+0024 ($)
+    {0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00}, // U+0025 (%)
+    {0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00}, // U+0026 (&)
+    {0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+0027 (')
+    {0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00}, // U+0028 (()
+    {0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00}, // U+0029 ())
+    {0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00}, // U+002A (*)
+    {0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00}, // U+002B (+)
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06}, // U+002C (,)
+    {0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00}, // U+002D (-)
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00}, // U+002E (.)
+    {0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00}, // U+002F (/)
+    {0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00}, // U+0030 (0)
+    {0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00}, // U+0031 (1)
+    {0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00}, // U+0032 (2)
+    {0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00}, // U+0033 (3)
+    {0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00}, // U+0034 (4)
+    {0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00}, // U+0035 (5)
+    {0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00}, // U+0036 (6)
+    {0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00}, // U+0037 (7)
+    {0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00}, // U+0038 (8)
+    {0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00}, // U+0039 (9)
+    {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00}, // U+003A (:)
+    {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06}, // U+003B (;)
+    {0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00}, // U+003C (<)
+    {0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00}, // U+003D (=)
+    {0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00}, // U+003E (>)
+    {0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00}, // U+003F (?)
+    {0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00}, // U+0040 (@)
+    {0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00}, // U+0041 (A)
+    {0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00}, // U+0042 (B)
+    {0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00}, // U+0043 (C)
+    {0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00}, // U+0044 (D)
+    {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00}, // U+0045 (E)
+    {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00}, // U+0046 (F)
+    {0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00}, // U+0047 (G)
+    {0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00}, // U+0048 (H)
+    {0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // U+0049 (I)
+    {0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00}, // U+004A (J)
+    {0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00}, // U+004B (K)
+    {0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00}, // U+004C (L)
+    {0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00}, // U+004D (M)
+    {0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00}, // U+004E (N)
+    {0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00}, // U+004F (O)
+    {0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00}, // U+0050 (P)
+    {0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00}, // U+0051 (Q)
+    {0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00}, // U+0052 (R)
+    {0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00}, // U+0053 (S)
+    {0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // U+0054 (T)
+    {0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00}, // U+0055 (U)
+    {0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00}, // U+0056 (V)
+    {0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00}, // U+0057 (W)
+    {0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00}, // U+0058 (X)
+    {0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00}, // U+0059 (Y)
+    {0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00}, // U+005A (Z)
+    {0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00}, // U+005B ([)
+    {0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00}, // U+005C (\)
+    {0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00}, // U+005D (])
+    {0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00}, // U+005E (^)
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF}, // U+005F (_)
+    {0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+0060 (`)
+    {0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00}, // U+0061 (a)
+    {0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00}, // U+0062 (b)
+    {0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00}, // U+0063 (c)
+    {0x38, 0x30, 0x30, 0x3e, 0x33, 0x33, 0x6E, 0x00}, // U+0064 (d)
+    {0x00, 0x00, 0x1E, 0x33, 0x3f, 0x03, 0x1E, 0x00}, // U+0065 (e)
+    {0x1C, 0x36, 0x06, 0x0f, 0x06, 0x06, 0x0F, 0x00}, // U+0066 (f)
+    {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F}, // U+0067 (g)
+    {0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00}, // U+0068 (h)
+    {0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // U+0069 (i)
+    {0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E}, // U+006A (j)
+    {0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00}, // U+006B (k)
+    {0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // U+006C (l)
+    {0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00}, // U+006D (m)
+    {0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00}, // U+006E (n)
+    {0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00}, // U+006F (o)
+    {0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F}, // U+0070 (p)
+    {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78}, // U+0071 (q)
+    {0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00}, // U+0072 (r)
+    {0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00}, // U+0073 (s)
+    {0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00}, // U+0074 (t)
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00}, // U+0075 (u)
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00}, // U+0076 (v)
+    {0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00}, // U+0077 (w)
+    {0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00}, // U+0078 (x)
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F}, // U+0079 (y)
+    {0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00}, // U+007A (z)
+    {0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00}, // U+007B ({)
+    {0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00}, // U+007C (|)
+    {0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00}, // U+007D (})
+    {0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+007E (~)
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}  // U+007F
+};
+
+// https://github.com/PinguinoIDE/pinguino-libraries/blob/master/p8/include/pinguino/libraries/fonts/font16x16.h
+static const uint8_t
+    font16x16[96]
+             [32] = {
+                 {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, //  <Space>
                  {0x00, 0x00, 0x00, 0x00, 0x07, 0x00, 0x0F, 0x80,
                   0x0F, 0x80, 0x0F, 0x80, 0x0F, 0x80, 0x0F, 0x80,
                   0x07, 0x00, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -1408,267 +5283,3076 @@ static const uint8_t
                   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00} // ~
 };
 
-static int blit_char(struct raw_display *rd, int size, int x0, int y0,
-                     char ch, uint32_t colour)
+/**
+ * Work out which of the built-in fonts to draw a size with, and how much
+ * to enlarge it by. Multiples of 16 use the 16x16 font, as its glyphs are
+ * more detailed
+ * @return Enlargement factor, 0 if the size isn't supported
+ */
+static int font_scale(int size, int *base)
+{
+    *base = size > 0 && size % 16 == 0 ? 16 : 8;
+    if (size <= 0 || size % *base)
+        return 0;
+    return size / *base;
+}
+
+/* Width in pixels of each character of the built-in fonts */
+static int font_advance(int size)
+{
+    int base, scale = font_scale(size, &base);
+
+    return base == 16 ? 12 * scale : size;
+}
+
+/* Mirror a word, so a bitmap row with the leftmost pixel in the top bit
+ * becomes a mask with bit x set for column x */
+static inline uint32_t reverse_bits(uint32_t v)
+{
+    v = (v >> 1 & 0x55555555) | (v & 0x55555555) << 1;
+    v = (v >> 2 & 0x33333333) | (v & 0x33333333) << 2;
+    v = (v >> 4 & 0x0f0f0f0f) | (v & 0x0f0f0f0f) << 4;
+    v = (v >> 8 & 0x00ff00ff) | (v & 0x00ff00ff) << 8;
+    return v >> 16 | v << 16;
+}
+
+/* Row of a glyph, unscaled, as a mask with bit x set for column x */
+static uint32_t glyph_row(int base, char ch, int y)
+{
+    if (ch < 32 || (int)ch >= 128)
+        return 0;
+    if (base == 8)
+        return font8x8[ch - 32][y];
+
+    /* The 16x16 font has the leftmost pixel in the top bit */
+    const uint8_t *row = &font16x16[ch - 32][y * 2];
+    return reverse_bits(row[0] << 24 | row[1] << 16);
+}
+
+/**
+ * Draw a glyph given as one mask per row, with bit x set for column x.
+ * Each row is broken into runs of set pixels, which are enlarged and
+ * filled as spans, so the cost goes with the number of runs rather than
+ * the number of pixels
+ */
+static void blit_glyph(const struct draw_target *target, int x0, int y0,
+                       const uint32_t *rows, int width, int height,
+                       int scale, uint32_t pixel)
+{
+    if (x0 >= target->clip_x1 || x0 + width * scale <= target->clip_x0 ||
+        y0 >= target->clip_y1 || y0 + height * scale <= target->clip_y0)
+        return;
+
+    for (int y = 0; y < height; y++) {
+        uint32_t mask = rows[y];
+        int ya = max(y0 + y * scale, target->clip_y0);
+        int yb = min(y0 + (y + 1) * scale, target->clip_y1);
+
+        if (ya >= yb)
+            continue;
+        while (mask) {
+            int start = __builtin_ctz(mask);
+            uint32_t run = ~(mask >> start);
+            int end = start + (run ? __builtin_ctz(run) : 32 - start);
+            int xa = max(x0 + start * scale, target->clip_x0);
+            int xb = min(x0 + end * scale, target->clip_x1);
+
+            /* Glyphs can be 32 pixels wide, so a run can reach the top */
+            mask = end < 32 ? mask & ~0u << end : 0;
+            if (xa >= xb)
+                continue;
+            for (int row = ya; row < yb; row++)
+                fill_span(pixel_address(target, xa, row), target->bpp,
+                          xb - xa, pixel);
+        }
+    }
+}
+
+/**
+ * Draw one character of the built-in fonts
+ * @return Number of pixels to advance by
+ */
+static int blit_char(const struct draw_target *target, int size, int x0,
+                     int y0, char ch, uint32_t pixel)
+{
+    int base, scale = font_scale(size, &base);
+    uint32_t rows[16];
+
+    if (!scale)
+        return size;
+    if (x0 < target->clip_x1 && x0 + size > target->clip_x0 &&
+        y0 < target->clip_y1 && y0 + size > target->clip_y0) {
+        for (int y = 0; y < base; y++)
+            rows[y] = glyph_row(base, ch, y);
+        blit_glyph(target, x0, y0, rows, base, base, scale, pixel);
+    }
+    return font_advance(size);
+}
+
+int raw_display_draw_string(struct raw_display *rd, int size, int x, int y,
+                            const char *string, uint32_t colour)
+{
+    struct draw_target target;
+    int x_orig = x;
+    uint32_t pixel;
+
+    int base;
+
+    if (!font_scale(size, &base) || !get_draw_target(rd, &target))
+        return -EINVAL;
+    if (tracing(rd) && string)
+        fwrite(string, 1, strlen(string),
+               trace_call(rd, RAW_DISPLAY_TRACE_string, y, (int64_t)y + size,
+                          strlen(string), 4, size, x, y, colour));
+    /* blit_char clips each glyph, so strings can run off any edge */
+    pixel = native_colour(target.bpp, colour);
+    for (; string && *string; string++) {
+        x += blit_char(&target, size, x, y, *string, pixel);
+    }
+    trace_done(rd);
+    return x - x_orig;
+}
+
+struct raw_display_text {
+    int size;
+    int max_width;
+    enum raw_display_align align;
+    char *string; // Contents the bitmap was last laid out from
+
+    int width; // Size of the coverage bitmap, in pixels
+    int height;
+    int row_bytes;
+    uint8_t *bits; // One bit per pixel, least significant bit leftmost
+};
+
+struct raw_display_text *
+raw_display_text_create(int size, int max_width, enum raw_display_align align)
+{
+    struct raw_display_text *text;
+    int base;
+
+    if (!font_scale(size, &base) || max_width < 0)
+        return NULL;
+    text = calloc(sizeof(*text), 1);
+    if (!text)
+        return NULL;
+    text->size = size;
+    text->max_width = max_width;
+    text->align = align;
+    return text;
+}
+
+void raw_display_text_destroy(struct raw_display_text *text)
+{
+    if (!text)
+        return;
+    free(text->string);
+    free(text->bits);
+    free(text);
+}
+
+struct text_line {
+    const char *start;
+    int length;
+};
+
+/**
+ * Split the string into lines, at newlines and (if there is a maximum
+ * width) wrapping at spaces where possible
+ * @return Number of lines, with up to max_lines of them stored in lines
+ */
+static int text_layout(const struct raw_display_text *text,
+                       const char *string, struct text_line *lines,
+                       int max_lines)
+{
+    int per_line = text->max_width / font_advance(text->size);
+    int count = 0;
+
+    if (text->max_width && per_line < 1)
+        per_line = 1;
+
+    for (;;) {
+        const char *end = strchr(string, '\n');
+        int remaining = end ? end - string : (int)strlen(string);
+
+        do {
+            int length = remaining, skip = 0;
+
+            if (per_line && remaining > per_line) {
+                length = per_line;
+                for (int i = per_line; i > 0; i--) {
+                    if (string[i] == ' ') {
+                        length = i;
+                        skip = 1; // Drop the space the line broke at
+                        break;
+                    }
+                }
+            }
+            if (count < max_lines)
+                lines[count] = (struct text_line){string, length};
+            count++;
+            string += length + skip;
+            remaining -= length + skip;
+        } while (remaining > 0);
+
+        if (!end)
+            return count;
+        string = end + 1;
+    }
+}
+
+int raw_display_text_set(struct raw_display_text *text, const char *string)
+{
+    struct text_line *lines;
+    int count, width = 0, advance, extra, base;
+    int scale = font_scale(text ? text->size : 0, &base);
+    char *copy;
+
+    if (!text || !string)
+        return -EINVAL;
+    if (text->string && strcmp(text->string, string) == 0)
+        return 0;
+
+    copy = strdup(string);
+    if (!copy)
+        return -ENOMEM;
+    count = text_layout(text, copy, NULL, 0);
+    lines = malloc(count * sizeof(*lines));
+    if (!lines) {
+        free(copy);
+        return -ENOMEM;
+    }
+    text_layout(text, copy, lines, count);
+
+    advance = font_advance(text->size);
+    /* Room for the last glyph hanging over its advance */
+    extra = text->size - advance;
+    for (int i = 0; i < count; i++)
+        width = max(width, lines[i].length * advance);
+    if (text->max_width)
+        width = max(width, text->max_width);
+    width += extra;
+
+    free(text->bits);
+    text->row_bytes = (width + 7) / 8;
+    text->bits = calloc((size_t)text->row_bytes * count * text->size, 1);
+    if (!text->bits) {
+        free(lines);
+        free(copy);
+        free(text->string);
+        text->string = NULL;
+        text->width = text->height = 0;
+        return -ENOMEM;
+    }
+    text->width = width;
+    text->height = count * text->size;
+
+    for (int i = 0; i < count; i++) {
+        int pen = 0;
+        int slack = width - extra - lines[i].length * advance;
+
+        if (text->align == RAW_DISPLAY_ALIGN_centre)
+            pen = slack / 2;
+        else if (text->align == RAW_DISPLAY_ALIGN_right)
+            pen = slack;
+
+        for (int c = 0; c < lines[i].length; c++, pen += advance) {
+            for (int y = 0; y < text->size; y++) {
+                uint8_t *row = text->bits +
+                               (size_t)(i * text->size + y) * text->row_bytes;
+                uint32_t mask =
+                    glyph_row(base, lines[i].start[c], y / scale);
+
+                for (int x = 0; x < text->size; x++)
+                    if (mask & (1u << (x / scale)))
+                        row[(pen + x) / 8] |= 1 << ((pen + x) % 8);
+            }
+        }
+    }
+
+    free(lines);
+    free(text->string);
+    text->string = copy;
+    return 0;
+}
+
+void raw_display_text_info(const struct raw_display_text *text, int *width,
+                           int *height)
+{
+    if (width)
+        *width = text ? text->width : 0;
+    if (height)
+        *height = text ? text->height : 0;
+}
+
+/**
+ * Draw the set pixels of a row of the coverage bitmap, from column xa up
+ * to xb, with dst pointing to where column xa goes
+ */
+static void text_row_32(uint32_t *dst, const uint8_t *bits, int xa, int xb,
+                        uint32_t pixel)
+{
+    int x = xa;
+
+    for (; x < xb && (x % 8); x++)
+        if (bits[x / 8] & (1 << (x % 8)))
+            dst[x - xa] = pixel;
+
+#if defined(__SSE2__)
+    {
+        const __m128i colour = _mm_set1_epi32(pixel);
+        const __m128i lo_bits = _mm_set_epi32(8, 4, 2, 1);
+        const __m128i hi_bits = _mm_set_epi32(128, 64, 32, 16);
+
+        for (; x + 8 <= xb; x += 8) {
+            uint8_t byte = bits[x / 8];
+            __m128i *out = (__m128i *)(dst + x - xa);
+
+            if (!byte)
+                continue;
+            if (byte == 0xff) {
+                _mm_storeu_si128(out, colour);
+                _mm_storeu_si128(out + 1, colour);
+                continue;
+            }
+
+            /* Turn each bit into an all-ones or all-zeroes pixel mask */
+            __m128i all = _mm_set1_epi32(byte);
+            __m128i lo =
+                _mm_cmpeq_epi32(_mm_and_si128(all, lo_bits), lo_bits);
+            __m128i hi =
+                _mm_cmpeq_epi32(_mm_and_si128(all, hi_bits), hi_bits);
+            __m128i d0 = _mm_loadu_si128(out);
+            __m128i d1 = _mm_loadu_si128(out + 1);
+
+            _mm_storeu_si128(out, _mm_or_si128(_mm_and_si128(lo, colour),
+                                               _mm_andnot_si128(lo, d0)));
+            _mm_storeu_si128(out + 1,
+                             _mm_or_si128(_mm_and_si128(hi, colour),
+                                          _mm_andnot_si128(hi, d1)));
+        }
+    }
+#endif
+
+    for (; x < xb; x++)
+        if (bits[x / 8] & (1 << (x % 8)))
+            dst[x - xa] = pixel;
+}
+
+void raw_display_draw_text(struct raw_display *rd,
+                           const struct raw_display_text *text, int x, int y,
+                           uint32_t colour)
+{
+    struct draw_target target;
+    uint32_t pixel;
+    int xa, xb, ya, yb;
+
+    if (!text || !text->bits || !get_draw_target(rd, &target))
+        return;
+    if (tracing(rd)) {
+        FILE *trace = trace_call(rd, RAW_DISPLAY_TRACE_text, y,
+                                 (int64_t)y + text->height,
+                                 8 + strlen(text->string), 6, text->size,
+                                 text->max_width, text->align, x, y, colour);
+        trace_handle(trace, text);
+        fwrite(text->string, 1, strlen(text->string), trace);
+    }
+
+    /* Clip in the coordinates of the bitmap */
+    xa = max(target.clip_x0 - x, 0);
+    xb = min(target.clip_x1 - x, text->width);
+    ya = max(target.clip_y0 - y, 0);
+    yb = min(target.clip_y1 - y, text->height);
+    if (xa >= xb || ya >= yb)
+        return;
+
+    pixel = native_colour(target.bpp, colour);
+    for (int row = ya; row < yb; row++) {
+        const uint8_t *bits = text->bits + (size_t)row * text->row_bytes;
+
+        if (target.bpp == 32) {
+            text_row_32((uint32_t *)pixel_address(&target, x + xa, y + row),
+                        bits, xa, xb, pixel);
+            continue;
+        }
+        for (int col = xa; col < xb; col++)
+            if (bits[col / 8] & (1 << (col % 8)))
+                put_pixel(&target, x + col, y + row, pixel);
+    }
+    trace_done(rd);
+}
+
+#define PSF1_MAGIC 0x0436
+#define PSF1_MODE512 0x01
+#define PSF1_MODEHASTAB 0x02
+#define PSF1_MODEHASSEQ 0x04
+#define PSF2_MAGIC 0x864ab572
+#define PSF2_HAS_UNICODE_TABLE 0x01
+
+#define FONT_MAX_WIDTH 32  // Widest glyph blit_glyph can draw
+#define FONT_MAX_HEIGHT 64 // Tallest glyph kept on the stack when drawing
+#define FONT_PAGE_BITS 8   // Codepoints per lookup page, as a power of 2
+#define FONT_PAGE_SIZE (1 << FONT_PAGE_BITS)
+#define UNICODE_LIMIT 0x110000
+
+struct raw_display_font {
+    const uint8_t *data; // Whole file, either mapped or read in
+    size_t data_size;
+    bool mapped;
+
+    const uint8_t *glyphs; // Bitmap of the first glyph
+    int width;
+    int height;
+    int row_bytes;     // Bytes in each row of a glyph bitmap
+    size_t glyph_size; // Bytes between glyph bitmaps
+    unsigned int glyph_count;
+
+    /* Sparse codepoint to glyph table, NULL if the font has none.
+     * The directory has one entry per page of codepoints, holding 1 + the
+     * page's index, or 0 if no codepoint in the page has a glyph. Page
+     * entries are likewise 1 + the glyph index, or 0 if there's no glyph */
+    uint16_t *directory;
+    uint16_t (*pages)[FONT_PAGE_SIZE];
+    int page_count;
+    int page_capacity;
+    unsigned int fallback; // 1 + glyph shown for unknown codepoints, or 0
+    char *filename;        // Where the font was loaded from, for traces
+};
+
+static inline uint32_t read_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * Decode the next character of a UTF-8 string, advancing past it.
+ * Malformed sequences decode as U+FFFD, one byte at a time
+ */
+static uint32_t utf8_next(const char **string)
+{
+    const uint8_t *s = (const uint8_t *)*string;
+    static const uint32_t min_value[] = {0, 0x80, 0x800, 0x10000};
+    uint32_t value;
+    int extra;
+
+    if (s[0] < 0x80) {
+        *string += 1;
+        return s[0];
+    }
+    if (s[0] >= 0xc0 && s[0] < 0xe0) {
+        extra = 1;
+        value = s[0] & 0x1f;
+    } else if (s[0] >= 0xe0 && s[0] < 0xf0) {
+        extra = 2;
+        value = s[0] & 0x0f;
+    } else if (s[0] >= 0xf0 && s[0] < 0xf8) {
+        extra = 3;
+        value = s[0] & 0x07;
+    } else {
+        *string += 1;
+        return 0xfffd;
+    }
+    for (int i = 1; i <= extra; i++) {
+        if ((s[i] & 0xc0) != 0x80) {
+            *string += 1;
+            return 0xfffd;
+        }
+        value = value << 6 | (s[i] & 0x3f);
+    }
+    *string += 1;
+    if (value < min_value[extra] || value >= UNICODE_LIMIT ||
+        (value >= 0xd800 && value < 0xe000))
+        return 0xfffd;
+    *string += extra;
+    return value;
+}
+
+/* Record that a codepoint is drawn with a glyph */
+static int font_add_codepoint(struct raw_display_font *font,
+                              uint32_t codepoint, unsigned int glyph)
+{
+    uint32_t page = codepoint >> FONT_PAGE_BITS;
+
+    if (codepoint >= UNICODE_LIMIT)
+        return 0; // Not representable, so can never be looked up
+    if (!font->directory[page]) {
+        if (font->page_count == font->page_capacity) {
+            int capacity = max(font->page_capacity * 2, 16);
+            void *pages =
+                realloc(font->pages, capacity * sizeof(*font->pages));
+            if (!pages)
+                return -ENOMEM;
+            font->pages = pages;
+            font->page_capacity = capacity;
+        }
+        memset(font->pages[font->page_count], 0, sizeof(*font->pages));
+        font->directory[page] = ++font->page_count;
+    }
+    uint16_t *entry = &font->pages[font->directory[page] - 1]
+                                  [codepoint & (FONT_PAGE_SIZE - 1)];
+    /* The first glyph listed for a codepoint wins */
+    if (!*entry)
+        *entry = glyph + 1;
+    return 0;
+}
+
+/* @return 1 + the glyph for a codepoint, or 0 if the font has none */
+static unsigned int font_lookup(const struct raw_display_font *font,
+                                uint32_t codepoint)
+{
+    if (!font->directory)
+        return codepoint < font->glyph_count ? codepoint + 1 : 0;
+    if (codepoint >= UNICODE_LIMIT)
+        return 0;
+    unsigned int page = font->directory[codepoint >> FONT_PAGE_BITS];
+    if (!page)
+        return 0;
+    return font->pages[page - 1][codepoint & (FONT_PAGE_SIZE - 1)];
+}
+
+/**
+ * Build the codepoint table from a PSF1 table, which lists the UCS-2
+ * codepoints of each glyph in turn, each list ending with 0xffff.
+ * Multi-codepoint sequences (after 0xfffe) are skipped
+ */
+static int font_read_psf1_table(struct raw_display_font *font,
+                                const uint8_t *table, const uint8_t *end)
+{
+    for (unsigned int glyph = 0; glyph < font->glyph_count; glyph++) {
+        bool sequence = false;
+
+        for (;;) {
+            if (end - table < 2)
+                return -EINVAL;
+            uint32_t value = table[0] | table[1] << 8;
+            table += 2;
+            if (value == 0xffff)
+                break;
+            if (value == 0xfffe)
+                sequence = true;
+            else if (!sequence && font_add_codepoint(font, value, glyph) < 0)
+                return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Build the codepoint table from a PSF2 table, which lists the UTF-8
+ * encoded codepoints of each glyph in turn, each list ending with 0xff.
+ * Multi-codepoint sequences (after 0xfe) are skipped
+ */
+static int font_read_psf2_table(struct raw_display_font *font,
+                                const uint8_t *table, const uint8_t *end)
+{
+    for (unsigned int glyph = 0; glyph < font->glyph_count; glyph++) {
+        const uint8_t *list_end = memchr(table, 0xff, end - table);
+
+        if (!list_end)
+            return -EINVAL;
+        /* Neither terminator is valid UTF-8, so decoding stops at them */
+        while (*table != 0xff && *table != 0xfe) {
+            const char *pos = (const char *)table;
+            uint32_t codepoint = utf8_next(&pos);
+
+            /* Skip malformed bytes, rather than mapping them to U+FFFD */
+            if ((codepoint != 0xfffd || pos - (const char *)table == 3) &&
+                font_add_codepoint(font, codepoint, glyph) < 0)
+                return -ENOMEM;
+            table = (const uint8_t *)pos;
+        }
+        table = list_end + 1;
+    }
+    return 0;
+}
+
+/* Where Linux distributions keep their console fonts */
+static const char *const console_font_dirs[] = {
+    "/usr/share/consolefonts",
+    "/usr/share/kbd/consolefonts",
+};
+
+/**
+ * Map a font file into memory. On POSIX systems nothing is read until it
+ * is used, so only the glyphs actually drawn are ever paged in
+ */
+static int font_open(struct raw_display_font *font, const char *filename)
+{
+    free(font->filename);
+    font->filename = strdup(filename);
+    if (!font->filename)
+        return -ENOMEM;
+#if defined(_WIN32)
+    FILE *fp = fopen(filename, "rb");
+    long size;
+    uint8_t *data;
+
+    if (!fp)
+        return -errno;
+    if (fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) <= 0 ||
+        fseek(fp, 0, SEEK_SET) < 0 || !(data = malloc(size))) {
+        fclose(fp);
+        return -EINVAL;
+    }
+    if (fread(data, 1, size, fp) != (size_t)size) {
+        free(data);
+        fclose(fp);
+        return -EIO;
+    }
+    fclose(fp);
+    font->data = data;
+    font->data_size = size;
+    return 0;
+#else
+    struct stat st;
+    void *data;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -errno;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        close(fd);
+        return -EINVAL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -errno;
+    font->data = data;
+    font->data_size = st.st_size;
+    font->mapped = true;
+    return 0;
+#endif
+}
+
+/* Work out the layout of the font from its header, and read its table */
+static int font_parse(struct raw_display_font *font)
+{
+    const uint8_t *data = font->data;
+    uint32_t header_size, width, height, glyph_size, glyph_count;
+    bool psf1, has_table;
+
+    psf1 = font->data_size >= 4 && (data[0] | data[1] << 8) == PSF1_MAGIC;
+    if (psf1) {
+        header_size = 4;
+        width = 8;
+        height = glyph_size = data[3];
+        glyph_count = data[2] & PSF1_MODE512 ? 512 : 256;
+        has_table = data[2] & (PSF1_MODEHASTAB | PSF1_MODEHASSEQ);
+    } else if (font->data_size >= 32 && read_le32(data) == PSF2_MAGIC) {
+        header_size = read_le32(data + 8);
+        has_table = read_le32(data + 12) & PSF2_HAS_UNICODE_TABLE;
+        glyph_count = read_le32(data + 16);
+        glyph_size = read_le32(data + 20);
+        height = read_le32(data + 24);
+        width = read_le32(data + 28);
+        if (header_size < 32)
+            return -EINVAL;
+    } else {
+        return -EINVAL;
+    }
+
+    if (!width || width > FONT_MAX_WIDTH || !height ||
+        height > FONT_MAX_HEIGHT || !glyph_count ||
+        glyph_count > UINT16_MAX ||
+        glyph_size < height * ((width + 7) / 8) ||
+        header_size + (uint64_t)glyph_count * glyph_size > font->data_size)
+        return -EINVAL;
+
+    font->glyphs = data + header_size;
+    font->width = width;
+    font->height = height;
+    font->row_bytes = (width + 7) / 8;
+    font->glyph_size = glyph_size;
+    font->glyph_count = glyph_count;
+    if (!has_table)
+        return 0;
+
+    const uint8_t *table = font->glyphs + (size_t)glyph_count * glyph_size;
+    const uint8_t *end = data + font->data_size;
+    int ret;
+
+    font->directory =
+        calloc(UNICODE_LIMIT >> FONT_PAGE_BITS, sizeof(*font->directory));
+    if (!font->directory)
+        return -ENOMEM;
+    if (psf1)
+        ret = font_read_psf1_table(font, table, end);
+    else
+        ret = font_read_psf2_table(font, table, end);
+    if (ret < 0)
+        return ret;
+    font->fallback = font_lookup(font, 0xfffd);
+    if (!font->fallback)
+        font->fallback = font_lookup(font, '?');
+    return 0;
+}
+
+struct raw_display_font *raw_display_font_load(const char *filename)
+{
+    struct raw_display_font *font;
+    int ret;
+
+    if (!filename)
+        return NULL;
+    font = calloc(1, sizeof(*font));
+    if (!font)
+        return NULL;
+
+    ret = font_open(font, filename);
+    for (size_t i = 0; ret == -ENOENT && !strchr(filename, '/') &&
+                       i < sizeof(console_font_dirs) / sizeof(char *);
+         i++) {
+        char path[256];
+
+        snprintf(path, sizeof(path), "%s/%s", console_font_dirs[i],
+                 filename);
+        ret = font_open(font, path);
+    }
+    if (ret < 0 || font_parse(font) < 0) {
+        raw_display_font_destroy(font);
+        return NULL;
+    }
+#if defined(MADV_RANDOM)
+    /* Glyphs are drawn in no particular order, so reading ahead of the
+     * page that's needed would mostly be wasted */
+    madvise((void *)font->data, font->data_size, MADV_RANDOM);
+#endif
+    return font;
+}
+
+void raw_display_font_destroy(struct raw_display_font *font)
+{
+    if (!font)
+        return;
+#if !defined(_WIN32)
+    if (font->mapped)
+        munmap((void *)font->data, font->data_size);
+    else
+#endif
+        free((void *)font->data);
+    free(font->directory);
+    free(font->pages);
+    free(font->filename);
+    free(font);
+}
+
+void raw_display_font_info(const struct raw_display_font *font, int *width,
+                           int *height, int *glyphs)
+{
+    if (width)
+        *width = font ? font->width : 0;
+    if (height)
+        *height = font ? font->height : 0;
+    if (glyphs)
+        *glyphs = font ? font->glyph_count : 0;
+}
+
+/* Unpack a glyph's bitmap into a mask per row, as used by blit_glyph */
+static void font_glyph_rows(const struct raw_display_font *font,
+                            unsigned int glyph, uint32_t *rows)
+{
+    const uint8_t *bits = font->glyphs + glyph * font->glyph_size;
+    uint32_t mask = font->width == 32 ? ~0u : (1u << font->width) - 1;
+
+    for (int y = 0; y < font->height; y++, bits += font->row_bytes) {
+        uint32_t row = 0;
+
+        for (int i = 0; i < font->row_bytes; i++)
+            row |= (uint32_t)bits[i] << (24 - 8 * i);
+        rows[y] = reverse_bits(row) & mask;
+    }
+}
+
+int raw_display_draw_string_font(struct raw_display *rd,
+                                 const struct raw_display_font *font,
+                                 int scale, int x, int y, const char *string,
+                                 uint32_t colour)
+{
+    struct draw_target target;
+    uint32_t rows[FONT_MAX_HEIGHT];
+    uint32_t pixel;
+    int x_orig = x;
+
+    if (!font || scale <= 0 || !get_draw_target(rd, &target))
+        return -EINVAL;
+    if (tracing(rd) && string) {
+        size_t name = strlen(font->filename);
+        FILE *trace = trace_call(rd, RAW_DISPLAY_TRACE_string_font, y,
+                                 y + (int64_t)font->height * scale,
+                                 8 + name + strlen(string), 5, scale, x, y,
+                                 colour, (uint32_t)name);
+        trace_handle(trace, font);
+        fwrite(font->filename, 1, name, trace);
+        fwrite(string, 1, strlen(string), trace);
+    }
+    pixel = native_colour(target.bpp, colour);
+
+    int advance = font->width * scale;
+    bool visible_rows =
+        y < target.clip_y1 && y + font->height * scale > target.clip_y0;
+    while (string && *string) {
+        unsigned int glyph = font_lookup(font, utf8_next(&string));
+
+        if (!glyph)
+            glyph = font->fallback;
+        /* Only touch the bitmaps of glyphs that are on screen, so that
+         * the rest never need to be paged in */
+        if (glyph && visible_rows && x < target.clip_x1 &&
+            x + advance > target.clip_x0) {
+            font_glyph_rows(font, glyph - 1, rows);
+            blit_glyph(&target, x, y, rows, font->width, font->height,
+                       scale, pixel);
+        }
+        x += advance;
+    }
+    trace_done(rd);
+    return x - x_orig;
+}
+
+void raw_display_draw_rectangle(struct raw_display *rd, int x0, int y0,
+                                int x1, int y1, uint32_t colour,
+                                int border_width)
+{
+    struct draw_target target;
+    uint32_t pixel;
+
+    if (!get_draw_target(rd, &target))
+        return;
+    trace_call(rd, RAW_DISPLAY_TRACE_rectangle, min(y0, y1),
+               max(y0, y1) + (int64_t)1, 0, 6, x0, y0, x1, y1, colour,
+               border_width);
+
+    if (x0 > x1) {
+        int tmp = x1;
+        x1 = x0;
+        x0 = tmp;
+    }
+    if (y0 > y1) {
+        int tmp = y1;
+        y1 = y0;
+        y0 = tmp;
+    }
+    x0 = max(x0, target.clip_x0);
+    y0 = max(y0, target.clip_y0);
+    x1 = min(x1, target.clip_x1 - 1);
+    y1 = min(y1, target.clip_y1 - 1);
+    if (x0 > x1 || y0 > y1)
+        return;
+
+    pixel = native_colour(target.bpp, colour);
+    for (int y = y0; y <= y1; y++)
+        fill_span(pixel_address(&target, x0, y), target.bpp, x1 - x0 + 1,
+                  pixel);
+    trace_done(rd);
+}
+
+/* Fill rows [y0, y1) of the clip region of target */
+static void fill_clip_rows(const struct draw_target *target, int y0, int y1,
+                           uint32_t colour)
+{
+    uint32_t pixel = native_colour(target->bpp, colour);
+    int width = target->clip_x1 - target->clip_x0;
+    size_t span = (size_t)width * target->bpp / 8;
+    bool stream;
+
+    if (y0 >= y1)
+        return;
+    stream = span * (y1 - y0) >= STREAM_THRESHOLD;
+
+    if (target->bpp == 24) {
+        for (int y = y0; y < y1; y++)
+            fill_span(pixel_address(target, target->clip_x0, y), 24, width,
+                      pixel);
+        return;
+    }
+
+    if (target->bpp == 16)
+        pixel |= pixel << 16;
+
+    /* When whole rows are being filled the row padding can be filled too,
+     * so the whole lot is a single run */
+    if (width == target->width) {
+        kernels->fill(pixel_address(target, 0, y0),
+                      (size_t)target->stride * (y1 - y0 - 1) + span, pixel,
+                      stream);
+        return;
+    }
+    for (int y = y0; y < y1; y++)
+        kernels->fill(pixel_address(target, target->clip_x0, y), span,
+                      pixel, stream);
+}
+
+void raw_display_clear(struct raw_display *rd, uint32_t colour)
+{
+    struct draw_target target;
+
+    if (!get_draw_target(rd, &target))
+        return;
+    trace_call(rd, RAW_DISPLAY_TRACE_clear, target.clip_y0, target.clip_y1,
+               0, 1, colour);
+    fill_clip_rows(&target, target.clip_y0, target.clip_y1, colour);
+    trace_done(rd);
+}
+
+void raw_display_fill_rows(struct raw_display *rd, int y0, int y1,
+                           uint32_t colour)
+{
+    struct draw_target target;
+
+    if (!get_draw_target(rd, &target))
+        return;
+    trace_call(rd, RAW_DISPLAY_TRACE_fill_rows, min(y0, y1),
+               max(y0, y1) + (int64_t)1, 0, 3, y0, y1, colour);
+    if (y0 > y1) {
+        int tmp = y1;
+        y1 = y0;
+        y0 = tmp;
+    }
+    fill_clip_rows(&target, max(y0, target.clip_y0),
+                   min(y1 + 1, target.clip_y1), colour);
+    trace_done(rd);
+}
+
+enum {
+    OUTCODE_LEFT = 1,
+    OUTCODE_RIGHT = 2,
+    OUTCODE_TOP = 4,
+    OUTCODE_BOTTOM = 8,
+};
+
+static int outcode(double x, double y, double xmin, double ymin, double xmax,
+                   double ymax)
+{
+    int code = 0;
+
+    if (x < xmin)
+        code |= OUTCODE_LEFT;
+    else if (x > xmax)
+        code |= OUTCODE_RIGHT;
+    if (y < ymin)
+        code |= OUTCODE_TOP;
+    else if (y > ymax)
+        code |= OUTCODE_BOTTOM;
+    return code;
+}
+
+/**
+ * Cohen-Sutherland line clipping
+ * Trims the segment (x0, y0) - (x1, y1) to the given rectangle
+ * @return false if none of the segment lies within the rectangle
+ */
+static bool cohen_sutherland(double *x0, double *y0, double *x1, double *y1,
+                             double xmin, double ymin, double xmax,
+                             double ymax)
+{
+    int code0 = outcode(*x0, *y0, xmin, ymin, xmax, ymax);
+    int code1 = outcode(*x1, *y1, xmin, ymin, xmax, ymax);
+
+    for (;;) {
+        double x, y;
+        int code;
+
+        if (!(code0 | code1))
+            return true;
+        if (code0 & code1)
+            return false;
+
+        code = code0 ? code0 : code1;
+        if (code & OUTCODE_BOTTOM) {
+            x = *x0 + (*x1 - *x0) * (ymax - *y0) / (*y1 - *y0);
+            y = ymax;
+        } else if (code & OUTCODE_TOP) {
+            x = *x0 + (*x1 - *x0) * (ymin - *y0) / (*y1 - *y0);
+            y = ymin;
+        } else if (code & OUTCODE_RIGHT) {
+            y = *y0 + (*y1 - *y0) * (xmax - *x0) / (*x1 - *x0);
+            x = xmax;
+        } else {
+            y = *y0 + (*y1 - *y0) * (xmin - *x0) / (*x1 - *x0);
+            x = xmin;
+        }
+
+        if (code == code0) {
+            *x0 = x;
+            *y0 = y;
+            code0 = outcode(x, y, xmin, ymin, xmax, ymax);
+        } else {
+            *x1 = x;
+            *y1 = y;
+            code1 = outcode(x, y, xmin, ymin, xmax, ymax);
+        }
+    }
+}
+
+/**
+ * Work out which iterations of the line loop in raw_display_draw_line can
+ * put pixels inside the clip rectangle.
+ * Every pixel of a wide line is within wd of the ideal line, so the line is
+ * clipped against the clip rectangle grown by that much along the minor
+ * axis. Runs along the major axis extend forwards from the pixel that
+ * started them, so the start is backed off by the longest possible run.
+ * @return false if the line is entirely clipped
+ */
+static bool clip_line(const struct draw_target *target, int x0, int y0,
+                      int x1, int y1, int dx, int dy, float ed, float wd,
+                      int *first, int *last)
+{
+    bool x_major = dx >= dy;
+    int major = x_major ? dx : dy;
+    int minor = x_major ? dy : dx;
+    double band = major ? (wd + 1) * ed / major + 2 : wd + 2;
+    int run = minor ? (int)((wd + 1) * ed / minor) + 2 : 2;
+    double xmin = target->clip_x0, xmax = target->clip_x1 - 1;
+    double ymin = target->clip_y0, ymax = target->clip_y1 - 1;
+    double ax = x0, ay = y0, bx = x1, by = y1;
+    double a, b;
+
+    if (x_major) {
+        ymin -= band;
+        ymax += band;
+    } else {
+        xmin -= band;
+        xmax += band;
+    }
+    if (!cohen_sutherland(&ax, &ay, &bx, &by, xmin, ymin, xmax, ymax))
+        return false;
+
+    /* Convert the clipped end points into iteration numbers */
+    a = x_major ? fabs(ax - x0) : fabs(ay - y0);
+    b = x_major ? fabs(bx - x0) : fabs(by - y0);
+    *first = max((int)floor(fmin(a, b)) - 1 - run, 0);
+    *last = min((int)ceil(fmax(a, b)) + 1, major);
+    return *first <= *last;
+}
+
+void raw_display_draw_line(struct raw_display *rd, int x0, int y0, int x1,
+                           int y1, uint32_t colour, int line_width)
+{
+    /* See http://members.chello.at/%7Eeasyfilter/Bresenham.pdf for full
+     * details on this.
+     * Code there has been released under public domain:
+     *   - The programs have no copyright and could be used and modified by
+     * anyone as wanted.
+     */
+    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int err = dx - dy, e2, x2, y2; /* error value e_xy */
+    float ed = dx + dy == 0 ? 1 : sqrt((float)dx * dx + (float)dy * dy);
+    float wd = (line_width + 1) / 2;
+    struct draw_target target;
+    int step, last;
+    uint32_t pixel;
+
+    if (!get_draw_target(rd, &target))
+        return;
+    trace_call(rd, RAW_DISPLAY_TRACE_line, min(y0, y1) - (int64_t)wd - 1,
+               max(y0, y1) + (int64_t)wd + 2, 0, 6, x0, y0, x1, y1, colour,
+               line_width);
+    if (!clip_line(&target, x0, y0, x1, y1, dx, dy, ed, wd, &step, &last))
+        return;
+    pixel = native_colour(target.bpp, colour);
+
+    /* Jump straight to the first visible step. Along the major axis there is
+     * one step per iteration, and the minor axis follows the usual
+     * Bresenham rounding */
+    if (step > 0) {
+        if (dx >= dy) {
+            int m = (int)((2 * (int64_t)step + 1) * dy / (2 * (int64_t)dx));
+            err = dx - dy - step * dy + m * dx;
+            x0 += sx * step;
+            y0 += sy * m;
+        } else {
+            int m = (int)((2 * (int64_t)step + 1) * dx / (2 * (int64_t)dy));
+            err = dx - dy - m * dy + step * dx;
+            x0 += sx * m;
+            y0 += sy * step;
+        }
+    }
+
+    for (;; step++) { /* pixel loop */
+        plot_pixel(&target, x0, y0,
+                   pixel); // TODO: Antialiasing? -
+                           // max(0,255*(abs(err-dx+dy)/ed-wd+1)));
+        e2 = err;
+        x2 = x0;
+        if (2 * e2 >= -dx) { /* x step */
+            for (e2 += dy, y2 = y0; e2 < ed * wd && (y1 != y2 || dx > dy);
+                 e2 += dx) {
+                // TODO: Antialiasing? - max(0,255*(abs(e2)/ed-wd+1)));
+                plot_pixel(&target, x0, y2, pixel);
+                y2 += sy;
+            }
+            if (x0 == x1)
+                break;
+            e2 = err;
+            err -= dy;
+            x0 += sx;
+        }
+        if (2 * e2 <= dy) { /* y step */
+            for (e2 = dx - e2; e2 < ed * wd && (x1 != x2 || dx < dy);
+                 e2 += dy) {
+                // TODO: Antialiasing? - max(0,255*(abs(e2)/ed-wd+1)));
+                plot_pixel(&target, x2, y0, pixel);
+                x2 += sx;
+            }
+            if (y0 == y1)
+                break;
+            err += dx;
+            y0 += sy;
+        }
+        if (step == last)
+            break;
+    }
+    trace_done(rd);
+}
+
+static inline void xLine(const struct draw_target *target, int x0, int x1,
+                         int y, uint32_t pixel)
+{
+    // Clamp all the coordinates
+    if (x1 < x0) {
+        int tmp = x1;
+        x1 = x0;
+        x0 = tmp;
+    }
+    if (y < target->clip_y0 || y >= target->clip_y1)
+        return;
+    x0 = max(x0, target->clip_x0);
+    x1 = min(x1, target->clip_x1 - 1);
+    if (x0 <= x1)
+        fill_span(pixel_address(target, x0, y), target->bpp, x1 - x0 + 1,
+                  pixel);
+}
+
+static inline void yLine(const struct draw_target *target, int x, int y0,
+                         int y1, uint32_t pixel)
+{
+    // Reject invalid coordinates & clamp the remaining ones
+    if (y1 < y0) {
+        int tmp = y1;
+        y1 = y0;
+        y0 = tmp;
+    }
+    if (x < target->clip_x0 || x >= target->clip_x1)
+        return;
+    y0 = max(y0, target->clip_y0);
+    y1 = min(y1, target->clip_y1 - 1);
+    while (y0 <= y1)
+        put_pixel(target, x, y0++, pixel);
+}
+
+void raw_display_draw_circle(struct raw_display *rd, int xc, int yc,
+                             int radius, uint32_t colour, int border_width)
+{
+    int inner = radius - border_width + 1;
+    int outer = radius;
+    int xo = outer;
+    int xi = inner;
+    int y = 0;
+    int erro = 1 - xo;
+    int erri = 1 - xi;
+    int reach = max(outer, abs(inner));
+    struct draw_target target;
+    uint32_t pixel;
+
+    if (!get_draw_target(rd, &target))
+        return;
+    trace_call(rd, RAW_DISPLAY_TRACE_circle, yc - (int64_t)reach,
+               yc + (int64_t)reach + 1, 0, 5, xc, yc, radius, colour,
+               border_width);
+    if (xc + reach < target.clip_x0 || xc - reach >= target.clip_x1 ||
+        yc + reach < target.clip_y0 || yc - reach >= target.clip_y1)
+        return;
+    pixel = native_colour(target.bpp, colour);
+
+    while (xo >= y) {
+        xLine(&target, xc + xi, xc + xo, yc + y, pixel);
+        yLine(&target, xc + y, yc + xi, yc + xo, pixel);
+        xLine(&target, xc - xo, xc - xi, yc + y, pixel);
+        yLine(&target, xc - y, yc + xi, yc + xo, pixel);
+        xLine(&target, xc - xo, xc - xi, yc - y, pixel);
+        yLine(&target, xc - y, yc - xo, yc - xi, pixel);
+        xLine(&target, xc + xi, xc + xo, yc - y, pixel);
+        yLine(&target, xc + y, yc - xo, yc - xi, pixel);
+
+        y++;
+
+        if (erro < 0) {
+            erro += 2 * y + 1;
+        } else {
+            xo--;
+            erro += 2 * (y - xo) + 1;
+        }
+
+        if (y > inner) {
+            xi = y;
+        } else {
+            if (erri < 0) {
+                erri += 2 * y + 1;
+            } else {
+                xi--;
+                erri += 2 * (y - xi) + 1;
+            }
+        }
+    }
+    trace_done(rd);
+}
+
+#if CONFIG_RAW_DISPLAY_REFERENCE
+/*
+ * Reference versions of the drawing routines, which plot every pixel on
+ * its own and skip all of the clipping shortcuts above. They are slow, but
+ * simple enough to trust, so the optimised routines can be checked against
+ * them pixel for pixel (see raw_display_replay -c). Coordinates are only
+ * clamped to keep the loops bounded, and plot_pixel does the real clipping
+ */
+static int reference_clamp(int v, int limit)
+{
+    return max(-1, min(v, limit));
+}
+
+void raw_display_reference_draw_rectangle(struct raw_display *rd, int x0,
+                                          int y0, int x1, int y1,
+                                          uint32_t colour, int border_width)
+{
+    struct draw_target target;
+    uint32_t pixel;
+
+    if (!get_draw_target(rd, &target))
+        return;
+    pixel = native_colour(target.bpp, colour);
+    if (x0 > x1) {
+        int tmp = x1;
+        x1 = x0;
+        x0 = tmp;
+    }
+    if (y0 > y1) {
+        int tmp = y1;
+        y1 = y0;
+        y0 = tmp;
+    }
+    x0 = reference_clamp(x0, target.width);
+    x1 = reference_clamp(x1, target.width);
+    y0 = reference_clamp(y0, target.height);
+    y1 = reference_clamp(y1, target.height);
+    for (int y = y0; y <= y1; y++)
+        for (int x = x0; x <= x1; x++)
+            plot_pixel(&target, x, y, pixel);
+}
+
+void raw_display_reference_draw_line(struct raw_display *rd, int x0, int y0,
+                                     int x1, int y1, uint32_t colour,
+                                     int line_width)
+{
+    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int err = dx - dy, e2, x2, y2; /* error value e_xy */
+    float ed = dx + dy == 0 ? 1 : sqrt((float)dx * dx + (float)dy * dy);
+    float wd = (line_width + 1) / 2;
+    struct draw_target target;
+    uint32_t pixel;
+
+    if (!get_draw_target(rd, &target))
+        return;
+    pixel = native_colour(target.bpp, colour);
+
+    for (;;) { /* pixel loop */
+        plot_pixel(&target, x0, y0, pixel);
+        e2 = err;
+        x2 = x0;
+        if (2 * e2 >= -dx) { /* x step */
+            for (e2 += dy, y2 = y0; e2 < ed * wd && (y1 != y2 || dx > dy);
+                 e2 += dx) {
+                plot_pixel(&target, x0, y2, pixel);
+                y2 += sy;
+            }
+            if (x0 == x1)
+                break;
+            e2 = err;
+            err -= dy;
+            x0 += sx;
+        }
+        if (2 * e2 <= dy) { /* y step */
+            for (e2 = dx - e2; e2 < ed * wd && (x1 != x2 || dx < dy);
+                 e2 += dy) {
+                plot_pixel(&target, x2, y0, pixel);
+                x2 += sx;
+            }
+            if (y0 == y1)
+                break;
+            err += dx;
+            y0 += sy;
+        }
+    }
+}
+
+static void reference_span(const struct draw_target *target, int a, int b,
+                           int c, bool horizontal, uint32_t pixel)
+{
+    if (a > b) {
+        int tmp = b;
+        b = a;
+        a = tmp;
+    }
+    a = reference_clamp(a, horizontal ? target->width : target->height);
+    b = reference_clamp(b, horizontal ? target->width : target->height);
+    for (int i = a; i <= b; i++) {
+        if (horizontal)
+            plot_pixel(target, i, c, pixel);
+        else
+            plot_pixel(target, c, i, pixel);
+    }
+}
+
+void raw_display_reference_draw_circle(struct raw_display *rd, int xc,
+                                       int yc, int radius, uint32_t colour,
+                                       int border_width)
+{
+    int inner = radius - border_width + 1;
+    int xo = radius;
+    int xi = inner;
+    int y = 0;
+    int erro = 1 - xo;
+    int erri = 1 - xi;
+    struct draw_target target;
+    uint32_t pixel;
+
+    if (!get_draw_target(rd, &target))
+        return;
+    pixel = native_colour(target.bpp, colour);
+
+    while (xo >= y) {
+        reference_span(&target, xc + xi, xc + xo, yc + y, true, pixel);
+        reference_span(&target, yc + xi, yc + xo, xc + y, false, pixel);
+        reference_span(&target, xc - xo, xc - xi, yc + y, true, pixel);
+        reference_span(&target, yc + xi, yc + xo, xc - y, false, pixel);
+        reference_span(&target, xc - xo, xc - xi, yc - y, true, pixel);
+        reference_span(&target, yc - xo, yc - xi, xc - y, false, pixel);
+        reference_span(&target, xc + xi, xc + xo, yc - y, true, pixel);
+        reference_span(&target, yc - xo, yc - xi, xc + y, false, pixel);
+
+        y++;
+
+        if (erro < 0) {
+            erro += 2 * y + 1;
+        } else {
+            xo--;
+            erro += 2 * (y - xo) + 1;
+        }
+
+        if (y > inner) {
+            xi = y;
+        } else {
+            if (erri < 0) {
+                erri += 2 * y + 1;
+            } else {
+                xi--;
+                erri += 2 * (y - xi) + 1;
+            }
+        }
+    }
+}
+
+/* Whether pixel x of row y of a built-in glyph is set, straight from the
+ * font tables */
+static bool reference_glyph_pixel(int base, char ch, int x, int y)
+{
+    if (ch < 32 || (int)ch >= 128)
+        return false;
+    if (base == 8)
+        return font8x8[ch - 32][y] >> x & 1;
+    return font16x16[ch - 32][y * 2 + x / 8] >> (7 - x % 8) & 1;
+}
+
+int raw_display_reference_draw_string(struct raw_display *rd, int size,
+                                      int x, int y, const char *string,
+                                      uint32_t colour)
+{
+    struct draw_target target;
+    int base, scale = font_scale(size, &base);
+    int x_orig = x;
+    uint32_t pixel;
+
+    if (!scale || !get_draw_target(rd, &target))
+        return -EINVAL;
+    pixel = native_colour(target.bpp, colour);
+    for (; string && *string; string++) {
+        for (int gy = 0; gy < size; gy++)
+            for (int gx = 0; gx < size; gx++)
+                if (reference_glyph_pixel(base, *string, gx / scale,
+                                          gy / scale))
+                    plot_pixel(&target, x + gx, y + gy, pixel);
+        x += font_advance(size);
+    }
+    return x - x_orig;
+}
+#endif
+
+void raw_display_set_pixel(struct raw_display *rd, int x, int y,
+                           uint32_t colour)
+{
+    struct draw_target target;
+
+    if (!get_draw_target(rd, &target))
+        return;
+    trace_call(rd, RAW_DISPLAY_TRACE_pixel, y, y + (int64_t)1, 0, 3, x, y,
+               colour);
+    plot_pixel(&target, x, y, native_colour(target.bpp, colour));
+    trace_done(rd);
+}
+
+void raw_display_set_clip(struct raw_display *rd, int x0, int y0, int x1,
+                          int y1)
+{
+    if (!rd)
+        return;
+    trace_call(rd, RAW_DISPLAY_TRACE_clip, 0, 0, 0, 4, x0, y0, x1, y1);
+    rd->draw.clip_set = true;
+    rd->draw.clip_x0 = min(x0, x1);
+    rd->draw.clip_y0 = min(y0, y1);
+    rd->draw.clip_x1 = max(x0, x1);
+    rd->draw.clip_y1 = max(y0, y1);
+}
+
+void raw_display_reset_clip(struct raw_display *rd)
+{
+    if (!rd)
+        return;
+    trace_call(rd, RAW_DISPLAY_TRACE_reset_clip, 0, 0, 0, 0);
+    rd->draw.clip_set = false;
+}
+
+struct raw_display_surface *raw_display_surface_create(struct raw_display *rd,
+                                                       int width, int height,
+                                                       int bpp)
+{
+    struct raw_display_surface *surface, *best = NULL;
+    size_t stride, size;
+
+    if (!rd || width <= 0 || height <= 0)
+        return NULL;
+    if (!bpp)
+        raw_display_info(rd, NULL, NULL, &bpp, NULL);
+    if (bpp != 16 && bpp != 24 && bpp != 32)
+        return NULL;
+
+    stride = (size_t)width * bpp / 8;
+    size = stride * height;
+
+    /* Reuse the smallest released surface which is big enough */
+    for (surface = rd->draw.surfaces; surface; surface = surface->next) {
+        if (surface->in_use || surface->capacity < size)
+            continue;
+        if (!best || surface->capacity < best->capacity)
+            best = surface;
+    }
+
+    surface = best;
+    if (!surface) {
+        surface = calloc(sizeof(*surface), 1);
+        if (!surface)
+            return NULL;
+        surface->pixels = malloc(size);
+        if (!surface->pixels) {
+            free(surface);
+            return NULL;
+        }
+        surface->capacity = size;
+        surface->next = rd->draw.surfaces;
+        rd->draw.surfaces = surface;
+    }
+    if (tracing(rd)) {
+        /* The shadow matches the cleared surface */
+        if (surface->trace_shadow)
+            memset(surface->trace_shadow, 0, size);
+        else
+            surface->trace_shadow = calloc(surface->capacity, 1);
+        if (!surface->trace_shadow)
+            return NULL;
+    }
+
+    surface->width = width;
+    surface->height = height;
+    surface->stride = stride;
+    surface->bpp = bpp;
+    surface->in_use = true;
+    memset(surface->pixels, 0, size);
+    if (tracing(rd))
+        trace_handle(trace_call(rd, RAW_DISPLAY_TRACE_surface_create, 0, 0,
+                                8, 3, width, height, bpp),
+                     surface);
+
+    return surface;
+}
+
+void raw_display_surface_destroy(struct raw_display *rd,
+                                 struct raw_display_surface *surface)
+{
+    if (!rd || !surface)
+        return;
+    if (tracing(rd))
+        trace_handle(trace_call(rd, RAW_DISPLAY_TRACE_surface_destroy, 0, 0,
+                                8, 0),
+                     surface);
+    if (rd->draw.target == surface)
+        rd->draw.target = NULL;
+    surface->in_use = false;
+}
+
+void raw_display_surface_info(const struct raw_display_surface *surface,
+                              int *width, int *height, int *bpp, int *stride)
+{
+    if (!surface)
+        return;
+    if (width)
+        *width = surface->width;
+    if (height)
+        *height = surface->height;
+    if (bpp)
+        *bpp = surface->bpp;
+    if (stride)
+        *stride = surface->stride;
+}
+
+uint8_t *raw_display_surface_get_pixels(
+    const struct raw_display_surface *surface)
+{
+    return surface ? surface->pixels : NULL;
+}
+
+int raw_display_surface_get_view(const struct raw_display_surface *surface,
+                                 struct raw_display_view *view)
+{
+    if (!surface || !view)
+        return -EINVAL;
+    view->pixels = surface->pixels;
+    view->width = surface->width;
+    view->height = surface->height;
+    view->bpp = surface->bpp;
+    view->stride = surface->stride;
+    return 0;
+}
+
+int raw_display_get_view(const struct raw_display *rd,
+                         struct raw_display_view *view)
+{
+    if (!rd || !view)
+        return -EINVAL;
+    view->width = view->height = view->bpp = view->stride = 0;
+    raw_display_info(rd, &view->width, &view->height, &view->bpp,
+                     &view->stride);
+    view->pixels = raw_display_get_frame(rd);
+    return view->pixels ? 0 : -ENOENT;
+}
+
+void raw_display_set_target(struct raw_display *rd,
+                            struct raw_display_surface *surface)
+{
+    if (!rd)
+        return;
+    if (tracing(rd)) {
+        if (rd->draw.target)
+            trace_surface(rd, rd->draw.target, 0, rd->draw.target->height);
+        trace_handle(trace_call(rd, RAW_DISPLAY_TRACE_target, 0, 0, 8, 0),
+                     surface);
+    }
+    rd->draw.target = surface;
+    if (surface)
+        trace_surface(rd, surface, 0, surface->height);
+}
+
+/* Copy count pixels between formats, for the blits */
+static void convert_span(uint8_t *dst, int dst_bpp, const uint8_t *src,
+                         int src_bpp, int count)
+{
+    if (dst_bpp == src_bpp) {
+        memcpy(dst, src, (size_t)count * dst_bpp / 8);
+    } else if (dst_bpp == 16 && src_bpp == 32) {
+        kernels->convert_16((uint16_t *)dst, (const uint32_t *)src, count);
+    } else {
+        struct draw_target span = {.pixels = dst, .bpp = dst_bpp};
+        for (int i = 0; i < count; i++)
+            put_pixel(&span, i, 0,
+                      native_colour(dst_bpp,
+                                    read_colour(src + i * src_bpp / 8,
+                                                src_bpp)));
+    }
+}
+
+void raw_display_blit_surface(struct raw_display *rd,
+                              const struct raw_display_surface *surface,
+                              int x, int y)
+{
+    struct draw_target target;
+    int x0, y0, x1, y1;
+
+    if (!surface || surface == rd->draw.target ||
+        !get_draw_target(rd, &target))
+        return;
+    if (tracing(rd)) {
+        trace_surface(rd, (struct raw_display_surface *)surface, 0,
+                      surface->height);
+        trace_handle(trace_call(rd, RAW_DISPLAY_TRACE_blit_surface, y,
+                                (int64_t)y + surface->height, 8, 2, x, y),
+                     surface);
+    }
+
+    x0 = max(x, target.clip_x0);
+    y0 = max(y, target.clip_y0);
+    x1 = min(x + surface->width, target.clip_x1);
+    y1 = min(y + surface->height, target.clip_y1);
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    for (int row = y0; row < y1; row++) {
+        const uint8_t *src = surface->pixels +
+                             (size_t)(row - y) * surface->stride +
+                             (size_t)(x0 - x) * (surface->bpp / 8);
+        convert_span(pixel_address(&target, x0, row), target.bpp, src,
+                     surface->bpp, x1 - x0);
+    }
+    trace_done(rd);
+}
+
+#define ATLAS_WIDTH 1024
+#define ATLAS_INITIAL_HEIGHT 256
+
+/* Find room for a width x height sprite, growing the atlas if needed */
+static int atlas_allocate(struct sprite_atlas *atlas, int width, int height,
+                          int *x, int *y)
+{
+    if (width > atlas->width)
+        return -E2BIG;
+
+    if (atlas->shelf_x + width > atlas->width ||
+        height > atlas->shelf_height) {
+        /* Start a new shelf, unless the current one is still empty and
+         * just needs to be taller */
+        if (atlas->shelf_x > 0) {
+            atlas->shelf_y += atlas->shelf_height;
+            atlas->shelf_height = 0;
+            atlas->shelf_x = 0;
+        }
+        atlas->shelf_height = max(atlas->shelf_height, height);
+    }
+
+    if (atlas->shelf_y + atlas->shelf_height > atlas->height) {
+        int new_height = atlas->height;
+        uint8_t *pixels, *alpha;
+
+        while (atlas->shelf_y + atlas->shelf_height > new_height)
+            new_height *= 2;
+        pixels = realloc(atlas->pixels, (size_t)atlas->stride * new_height);
+        if (!pixels)
+            return -ENOMEM;
+        atlas->pixels = pixels;
+        alpha = realloc(atlas->alpha, (size_t)atlas->width * new_height);
+        if (!alpha)
+            return -ENOMEM;
+        atlas->alpha = alpha;
+        atlas->height = new_height;
+    }
+
+    *x = atlas->shelf_x;
+    *y = atlas->shelf_y;
+    atlas->shelf_x += width;
+    return 0;
+}
+
+int raw_display_sprite_load(struct raw_display *rd, const uint32_t *pixels,
+                            int width, int height, int stride)
+{
+    struct sprite_atlas *atlas = rd ? rd->draw.atlas : NULL;
+    struct sprite *sprite;
+    int x, y, ret;
+
+    if (!rd || !pixels || width <= 0 || height <= 0)
+        return -EINVAL;
+    if (!stride)
+        stride = width * 4;
+
+    if (!atlas) {
+        atlas = calloc(sizeof(*atlas), 1);
+        if (!atlas)
+            return -ENOMEM;
+        raw_display_info(rd, NULL, NULL, &atlas->bpp, NULL);
+        atlas->width = max(ATLAS_WIDTH, width);
+        atlas->height = ATLAS_INITIAL_HEIGHT;
+        atlas->stride = atlas->width * atlas->bpp / 8;
+        atlas->pixels = malloc((size_t)atlas->stride * atlas->height);
+        atlas->alpha = malloc((size_t)atlas->width * atlas->height);
+        if (!atlas->pixels || !atlas->alpha) {
+            free(atlas->pixels);
+            free(atlas->alpha);
+            free(atlas);
+            return -ENOMEM;
+        }
+        rd->draw.atlas = atlas;
+    }
+
+    if (atlas->sprite_count == atlas->sprite_capacity) {
+        int capacity = max(atlas->sprite_capacity * 2, 16);
+        struct sprite *sprites =
+            realloc(atlas->sprites, capacity * sizeof(*sprites));
+        if (!sprites)
+            return -ENOMEM;
+        atlas->sprites = sprites;
+        atlas->sprite_capacity = capacity;
+    }
+
+    ret = atlas_allocate(atlas, width, height, &x, &y);
+    if (ret < 0)
+        return ret;
+
+    /* Convert to the native format with premultiplied alpha now, so the
+     * draws are just copies & multiply-adds */
+    for (int row = 0; row < height; row++) {
+        const uint32_t *src =
+            (const uint32_t *)((const uint8_t *)pixels + row * stride);
+        uint8_t *dst = atlas->pixels + (size_t)(y + row) * atlas->stride +
+                       x * (atlas->bpp / 8);
+        uint8_t *alpha = atlas->alpha + (size_t)(y + row) * atlas->width + x;
+        struct draw_target span = {.pixels = dst, .bpp = atlas->bpp};
+
+        for (int col = 0; col < width; col++) {
+            uint32_t a = src[col] >> 24;
+            uint32_t r = ((src[col] >> 16 & 0xff) * a + 127) / 255;
+            uint32_t g = ((src[col] >> 8 & 0xff) * a + 127) / 255;
+            uint32_t b = ((src[col] & 0xff) * a + 127) / 255;
+
+            put_pixel(&span, col, 0,
+                      native_colour(atlas->bpp,
+                                    a << 24 | r << 16 | g << 8 | b));
+            alpha[col] = a;
+        }
+    }
+
+    sprite = &atlas->sprites[atlas->sprite_count];
+    sprite->x = x;
+    sprite->y = y;
+    sprite->width = width;
+    sprite->height = height;
+    sprite->keyed = false;
+    if (tracing(rd))
+        trace_rows(trace_call(rd, RAW_DISPLAY_TRACE_sprite_load, 0, 0,
+                              (size_t)width * height * 4, 3,
+                              atlas->sprite_count, width, height),
+                   pixels, (size_t)width * 4, height, stride);
+    return atlas->sprite_count++;
+}
+
+static struct sprite *find_sprite(const struct raw_display *rd, int sprite)
+{
+    const struct sprite_atlas *atlas = rd ? rd->draw.atlas : NULL;
+
+    if (!atlas || sprite < 0 || sprite >= atlas->sprite_count)
+        return NULL;
+    return &atlas->sprites[sprite];
+}
+
+int raw_display_sprite_set_colour_key(struct raw_display *rd, int sprite,
+                                      uint32_t colour)
+{
+    struct sprite *s = find_sprite(rd, sprite);
+
+    if (!s)
+        return -EINVAL;
+    trace_call(rd, RAW_DISPLAY_TRACE_sprite_colour_key, 0, 0, 0, 2, sprite,
+               colour);
+    s->keyed = true;
+    /* Only the RGB is compared, whatever the alpha of either */
+    s->key = native_colour(rd->draw.atlas->bpp, colour) & 0xffffff;
+    return 0;
+}
+
+static void blend_span(uint8_t *dst, const uint8_t *src,
+                       const uint8_t *alpha, int bpp, int count)
+{
+    switch (bpp) {
+    case 32:
+        kernels->blend((uint32_t *)dst, (const uint32_t *)src, alpha, count);
+        break;
+    case 24:
+    case 16:
+        for (int i = 0; i < count; i++) {
+            uint32_t inv = 255 - alpha[i];
+            uint32_t d = read_colour(dst + i * bpp / 8, bpp);
+            uint32_t p = read_colour(src + i * bpp / 8, bpp);
+            struct draw_target span = {.pixels = dst, .bpp = bpp};
+
+            if (!alpha[i])
+                continue;
+            put_pixel(&span, i, 0,
+                      native_colour(
+                          bpp, blend_channel(p >> 16 & 0xff, d >> 16 & 0xff,
+                                             inv) << 16 |
+                                   blend_channel(p >> 8 & 0xff,
+                                                 d >> 8 & 0xff, inv)
+                                       << 8 |
+                                   blend_channel(p & 0xff, d & 0xff, inv)));
+        }
+        break;
+    }
+}
+
+static void keyed_span(uint8_t *dst, const uint8_t *src, uint32_t key,
+                       int bpp, int count)
+{
+    switch (bpp) {
+    case 32:
+        kernels->copy_keyed((uint32_t *)dst, (const uint32_t *)src, key,
+                            count);
+        break;
+    case 16: {
+        uint16_t *dst16 = (uint16_t *)dst;
+        const uint16_t *src16 = (const uint16_t *)src;
+        for (int i = 0; i < count; i++)
+            dst16[i] = src16[i] != key ? src16[i] : dst16[i];
+        break;
+    }
+    case 24:
+        for (int i = 0; i < count; i++)
+            if ((src[i * 3] | src[i * 3 + 1] << 8 | src[i * 3 + 2] << 16) !=
+                key)
+                memcpy(dst + i * 3, src + i * 3, 3);
+        break;
+    }
+}
+
+static void draw_sprite(const struct draw_target *target,
+                        const struct sprite_atlas *atlas,
+                        const struct sprite *sprite, int x, int y,
+                        enum raw_display_sprite_mode mode)
+{
+    int x0 = max(x, target->clip_x0);
+    int y0 = max(y, target->clip_y0);
+    int x1 = min(x + sprite->width, target->clip_x1);
+    int y1 = min(y + sprite->height, target->clip_y1);
+    int bytes = atlas->bpp / 8;
+
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    for (int row = y0; row < y1; row++) {
+        int sx = sprite->x + x0 - x;
+        int sy = sprite->y + row - y;
+        const uint8_t *src =
+            atlas->pixels + (size_t)sy * atlas->stride + sx * bytes;
+        const uint8_t *alpha = atlas->alpha + (size_t)sy * atlas->width + sx;
+        uint8_t *dst = pixel_address(target, x0, row);
+
+        if (target->bpp != atlas->bpp) {
+            /* Only happens when drawing onto a surface in another format */
+            for (int i = 0; i < x1 - x0; i++) {
+                uint32_t colour = read_colour(src + i * bytes, atlas->bpp);
+                uint32_t inv = 255 - alpha[i];
+
+                if (mode == RAW_DISPLAY_SPRITE_colour_key && sprite->keyed &&
+                    (native_colour(atlas->bpp, colour) & 0xffffff) ==
+                        sprite->key)
+                    continue;
+                if (mode == RAW_DISPLAY_SPRITE_alpha && inv) {
+                    uint32_t d = read_colour(dst + i * target->bpp / 8,
+                                             target->bpp);
+                    colour =
+                        blend_channel(colour >> 16 & 0xff, d >> 16 & 0xff,
+                                      inv) << 16 |
+                        blend_channel(colour >> 8 & 0xff, d >> 8 & 0xff, inv)
+                            << 8 |
+                        blend_channel(colour & 0xff, d & 0xff, inv);
+                }
+                put_pixel(target, x0 + i, row,
+                          native_colour(target->bpp, colour));
+            }
+            continue;
+        }
+
+        switch (mode) {
+        case RAW_DISPLAY_SPRITE_copy:
+            memcpy(dst, src, (size_t)(x1 - x0) * bytes);
+            break;
+        case RAW_DISPLAY_SPRITE_colour_key:
+            if (sprite->keyed)
+                keyed_span(dst, src, sprite->key, atlas->bpp, x1 - x0);
+            else
+                memcpy(dst, src, (size_t)(x1 - x0) * bytes);
+            break;
+        case RAW_DISPLAY_SPRITE_alpha:
+            blend_span(dst, src, alpha, atlas->bpp, x1 - x0);
+            break;
+        }
+    }
+}
+
+void raw_display_draw_sprite(struct raw_display *rd, int sprite, int x, int y,
+                             enum raw_display_sprite_mode mode)
+{
+    const struct sprite *s = find_sprite(rd, sprite);
+    struct draw_target target;
+
+    if (!s || !get_draw_target(rd, &target))
+        return;
+    trace_call(rd, RAW_DISPLAY_TRACE_sprite, y, (int64_t)y + s->height, 0, 4,
+               sprite, x, y, mode);
+    draw_sprite(&target, rd->draw.atlas, s, x, y, mode);
+    trace_done(rd);
+}
+
+/* Batches at least this big are sorted before drawing */
+#define SPRITE_SORT_THRESHOLD 64
+
+/* Sort by band of destination rows, then by location in the atlas, so that
+ * both the frame and the atlas are walked roughly in order */
+static int compare_sprite_draws(const void *a, const void *b)
+{
+    const struct raw_display_sprite_draw *da = *(const void *const *)a;
+    const struct raw_display_sprite_draw *db = *(const void *const *)b;
+
+    if ((da->y >> 6) != (db->y >> 6))
+        return (da->y >> 6) < (db->y >> 6) ? -1 : 1;
+    if (da->sprite != db->sprite)
+        return da->sprite < db->sprite ? -1 : 1;
+    if (da->x != db->x)
+        return da->x < db->x ? -1 : 1;
+    return 0;
+}
+
+/* Record a batch of sprite draws, and the rows they cover */
+static void trace_sprites(struct raw_display *rd,
+                          const struct raw_display_sprite_draw *draws,
+                          size_t count)
+{
+    int64_t y0 = INT64_MAX, y1 = INT64_MIN;
+    FILE *trace;
+
+    for (size_t i = 0; i < count; i++) {
+        const struct sprite *s = find_sprite(rd, draws[i].sprite);
+        if (!s)
+            continue;
+        y0 = min(y0, (int64_t)draws[i].y);
+        y1 = max(y1, (int64_t)draws[i].y + s->height);
+    }
+    /* Nothing to draw, so no rows to follow */
+    if (y0 > y1)
+        y0 = y1 = 0;
+    trace = trace_call(rd, RAW_DISPLAY_TRACE_sprites, y0, y1,
+                       count * 4 * sizeof(uint32_t), 1, (uint32_t)count);
+    for (size_t i = 0; i < count; i++) {
+        uint32_t words[4] = {draws[i].sprite, draws[i].x, draws[i].y,
+                             draws[i].mode};
+        fwrite(words, sizeof(words), 1, trace);
+    }
+}
+
+void raw_display_draw_sprites(struct raw_display *rd,
+                              const struct raw_display_sprite_draw *draws,
+                              size_t count)
+{
+    const struct raw_display_sprite_draw **order = NULL;
+    struct draw_target target;
+
+    if (!draws || !get_draw_target(rd, &target))
+        return;
+    if (tracing(rd))
+        trace_sprites(rd, draws, count);
+
+    if (count >= SPRITE_SORT_THRESHOLD)
+        order = malloc(count * sizeof(*order));
+    if (order) {
+        for (size_t i = 0; i < count; i++)
+            order[i] = &draws[i];
+        qsort(order, count, sizeof(*order), compare_sprite_draws);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const struct raw_display_sprite_draw *draw =
+            order ? order[i] : &draws[i];
+        const struct sprite *s = find_sprite(rd, draw->sprite);
+        if (s)
+            draw_sprite(&target, rd->draw.atlas, s, draw->x, draw->y,
+                        draw->mode);
+    }
+    free(order);
+    trace_done(rd);
+}
+
+/* Don't bother splitting work into chunks smaller than this many
+ * destination pixels, as waking the threads would cost more */
+#define THREAD_MIN_PIXELS (32 * 1024)
+
+/* Rows are shared out in bands of about this many pixels, small enough to
+ * stay in the cache and for there to be plenty to balance between threads */
+#define BAND_PIXELS (16 * 1024)
+
+/* Fills destination rows [row0, row1), returning < 0 on failure. worker is
+ * the index (below split_workers) of the thread doing so, for picking out
+ * scratch space set up with the job */
+typedef int (*row_func)(void *arg, int worker, int row0, int row1);
+
+#if HAVE_THREADS
+/*
+ * A job for the thread pool. Each thread starts with an even share of the
+ * bands, which it takes from the front of, then once that runs out steals
+ * from the back of the others' shares. Each share is packed into a single
+ * word (next band in the low half, end in the high half) so that both ends
+ * can be taken from with a compare and swap
+ */
+struct band_job {
+    row_func func;
+    void *arg;
+    int row0;
+    int row1;
+    int band_rows;
+    int threads;      // Threads taking part, including the caller
+    uint64_t *shares; // Bands left for each thread
+    int ret;          // First failure, if any
+};
+
+struct pool_thread {
+    struct thread_pool *pool;
+    pthread_t id;
+    int index; // Share of each job to start on; the caller has 0
+};
+
+/* Worker threads kept for the life of the display, see split_rows */
+struct thread_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // Signalled when a job is posted, or to quit
+    pthread_cond_t idle; // Signalled when the last worker finishes a job
+    struct pool_thread *threads;
+    int count;           // Worker threads, not counting the caller
+    uint64_t generation; // Incremented as each job is posted
+    struct band_job *job;
+    int busy;     // Workers still on the current job
+    bool running; // A job is in progress, so any others must run inline
+    bool quit;
+};
+
+static inline uint64_t band_share(uint32_t next, uint32_t end)
+{
+    return (uint64_t)end << 32 | next;
+}
+
+/* Take a band from either end of a share, returning -1 if it is empty */
+static int take_band(uint64_t *share, bool back)
+{
+    uint64_t old = __atomic_load_n(share, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        uint32_t next = (uint32_t)old, end = (uint32_t)(old >> 32);
+        uint64_t taken =
+            back ? band_share(next, end - 1) : band_share(next + 1, end);
+
+        if (next >= end)
+            return -1;
+        if (__atomic_compare_exchange_n(share, &old, taken, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return back ? (int)end - 1 : (int)next;
+    }
+}
+
+static void run_bands(struct band_job *job, int self)
+{
+    for (;;) {
+        int band = take_band(&job->shares[self], false);
+        int row0, ret;
+
+        /* Shares only ever shrink, so once they are all empty there is
+         * nothing left to steal */
+        for (int i = 1; band < 0 && i < job->threads; i++)
+            band = take_band(&job->shares[(self + i) % job->threads], true);
+        if (band < 0)
+            return;
+
+        row0 = job->row0 + band * job->band_rows;
+        ret = job->func(job->arg, self, row0,
+                        min(row0 + job->band_rows, job->row1));
+        if (ret < 0) {
+            int none = 0;
+            __atomic_compare_exchange_n(&job->ret, &none, ret, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void *pool_thread(void *arg)
+{
+    struct pool_thread *thread = arg;
+    struct thread_pool *pool = thread->pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        struct band_job *job;
+
+        while (!pool->quit && pool->generation == seen)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->quit)
+            break;
+        seen = pool->generation;
+        job = pool->job;
+        pthread_mutex_unlock(&pool->lock);
+
+        /* Jobs too small to need every thread leave the rest idle */
+        if (thread->index < job->threads)
+            run_bands(job, thread->index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void thread_pool_destroy(struct thread_pool *pool)
+{
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->count; i++)
+        pthread_join(pool->threads[i].id, NULL);
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+static struct thread_pool *thread_pool_create(int count)
+{
+    struct thread_pool *pool = calloc(1, sizeof(*pool));
+
+    if (!pool)
+        return NULL;
+    pool->threads = calloc(count, sizeof(*pool->threads));
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    for (int i = 0; i < count; i++) {
+        pool->threads[i].pool = pool;
+        pool->threads[i].index = i + 1;
+        if (pthread_create(&pool->threads[i].id, NULL, pool_thread,
+                           &pool->threads[i]) != 0)
+            break;
+        pool->count++;
+    }
+    if (!pool->count) {
+        thread_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/**
+ * Run a job on the pool, with the calling thread taking part
+ * @return false if the pool is already running a job (such as when called
+ * from inside one), in which case nothing has been done
+ */
+static bool thread_pool_run(struct thread_pool *pool, struct band_job *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->running) {
+        pthread_mutex_unlock(&pool->lock);
+        return false;
+    }
+    pool->running = true;
+    pool->job = job;
+    pool->busy = pool->count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_bands(job, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pool->running = false;
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+#else
+static void thread_pool_destroy(struct thread_pool *pool)
+{
+    (void)pool;
+}
+#endif
+
+/* Number of threads split_rows may share a job's rows out across */
+static int split_workers(const struct raw_display *rd)
+{
+#if HAVE_THREADS
+    return max(rd->draw.threads, 1);
+#else
+    (void)rd;
+    return 1;
+#endif
+}
+
+/**
+ * Call func for rows [row0, row1), sharing them out in bands across the
+ * display's thread pool if it allows it and there are enough pixels to be
+ * worthwhile
+ */
+static int split_rows(struct raw_display *rd, int row0, int row1, int width,
+                      row_func func, void *arg)
+{
+#if HAVE_THREADS
+    int band_rows = max(BAND_PIXELS / max(width, 1), 1);
+    int bands = (row1 - row0 + band_rows - 1) / band_rows;
+    int threads =
+        min(rd->draw.threads,
+            (int)((int64_t)width * (row1 - row0) / THREAD_MIN_PIXELS));
+
+    threads = min(threads, bands);
+    if (threads > 1 && !rd->draw.pool)
+        rd->draw.pool = thread_pool_create(rd->draw.threads - 1);
+    if (threads > 1 && rd->draw.pool) {
+        uint64_t shares[rd->draw.pool->count + 1];
+        struct band_job job = {
+            .func = func,
+            .arg = arg,
+            .row0 = row0,
+            .row1 = row1,
+            .band_rows = band_rows,
+            .threads = min(threads, rd->draw.pool->count + 1),
+            .shares = shares,
+        };
+
+        for (int i = 0; i < job.threads; i++)
+            shares[i] = band_share((int64_t)bands * i / job.threads,
+                                   (int64_t)bands * (i + 1) / job.threads);
+        if (thread_pool_run(rd->draw.pool, &job))
+            return job.ret;
+    }
+#endif
+    return func(arg, 0, row0, row1);
+}
+
+int raw_display_set_threads(struct raw_display *rd, int threads)
+{
+    if (!rd || threads < 0)
+        return -EINVAL;
+#if HAVE_THREADS
+    /* The pool is started again with the new size when next needed */
+    if (rd->draw.pool && rd->draw.pool->count != threads - 1) {
+        thread_pool_destroy(rd->draw.pool);
+        rd->draw.pool = NULL;
+    }
+    rd->draw.threads = threads;
+#endif
+    return 0;
+}
+
+struct scale_job {
+    const struct draw_target *target;
+    const uint32_t *pixels;
+    int src_width;
+    int src_height;
+    int src_stride;
+    int y;      // Unclipped destination top
+    int height; // Unclipped destination height
+    int x0;     // Clipped destination columns
+    int x1;
+    enum raw_display_filter filter;
+    /* Source column(s) & blend fraction for each destination column */
+    const int *col0;
+    const int *col1;
+    const uint8_t *col_frac;
+    uint32_t *scratch; // SCALE_SCRATCH rows of x1 - x0 for each worker
+};
+
+/* Scratch rows for scale_rows: the output row (for 16 & 24bpp), then the
+ * two source rows scaled across */
+#define SCALE_SCRATCH 3
+
+/**
+ * Work out the source position for a destination offset, in 1/256ths of
+ * a pixel, sampling at the pixel centres
+ */
+static void scale_position(int dst, int dst_len, int src_len, int *idx0,
+                           int *idx1, uint8_t *frac)
 {
-    if (ch < 32 || (int)ch >= 128)
-        return size;
+    int64_t pos = ((int64_t)(2 * dst + 1) * src_len * 128) / dst_len - 128;
+
+    pos = max(pos, (int64_t)0);
+    *idx0 = pos >> 8;
+    *frac = pos & 0xff;
+    if (*idx0 >= src_len - 1) {
+        *idx0 = src_len - 1;
+        *frac = 0;
+    }
+    *idx1 = min(*idx0 + 1, src_len - 1);
+}
+
+static inline int nearest_position(int dst, int dst_len, int src_len)
+{
+    return ((int64_t)(2 * dst + 1) * src_len) / (2 * dst_len);
+}
 
-    if (size == 8) {
-        const uint8_t *val = font8x8[(uint8_t)ch - 32];
+static void store_colours(uint8_t *dst, int bpp, const uint32_t *colours,
+                          int count)
+{
+    struct draw_target span = {.pixels = dst, .bpp = bpp};
 
-        for (int y = 0; y < 8; y++) {
-            char v = val[y];
-            for (int x = 0; x < 8; x++) {
-                if (v & (1 << x)) {
-                    raw_display_set_pixel(rd, x0 + x, y0 + y, colour);
-                }
+    if (bpp == 16) {
+        kernels->convert_16((uint16_t *)dst, colours, count);
+        return;
+    }
+    for (int i = 0; i < count; i++)
+        put_pixel(&span, i, 0, native_colour(bpp, colours[i]));
+}
+
+static int scale_rows(void *arg, int worker, int row0, int row1)
+{
+    struct scale_job *job = arg;
+    const struct draw_target *target = job->target;
+    int count = job->x1 - job->x0;
+    size_t row_bytes = (size_t)count * target->bpp / 8;
+    uint32_t *scratch = job->scratch + (size_t)worker * SCALE_SCRATCH * count;
+    uint32_t *horiz[2] = {scratch + count, scratch + 2 * count};
+    int horiz_row[2] = {-1, -1};
+    const uint8_t *prev_dst = NULL;
+    int prev_row = -1;
+
+    for (int row = row0; row < row1; row++) {
+        uint8_t *dst = pixel_address(target, job->x0, row);
+        uint32_t *out = target->bpp == 32 ? (uint32_t *)dst : scratch;
+        int sy0, sy1;
+        uint8_t fy;
+
+        if (job->filter == RAW_DISPLAY_FILTER_nearest) {
+            sy0 = nearest_position(row - job->y, job->height,
+                                   job->src_height);
+            sy1 = sy0;
+            fy = 0;
+        } else {
+            scale_position(row - job->y, job->height, job->src_height, &sy0,
+                           &sy1, &fy);
+            if (!fy)
+                sy1 = sy0;
+        }
+
+        /* When enlarging, many destination rows come from the same source
+         * row(s), so just copy the one already done */
+        if (prev_dst && sy0 == sy1 && sy0 == prev_row) {
+            memcpy(dst, prev_dst, row_bytes);
+            continue;
+        }
+
+        if (job->filter == RAW_DISPLAY_FILTER_nearest) {
+            const uint32_t *src =
+                (const uint32_t *)((const uint8_t *)job->pixels +
+                                   (size_t)sy0 * job->src_stride);
+            kernels->gather(out, src, job->col0, count);
+        } else {
+            /* Scale the (at most two) source rows horizontally, keeping
+             * them around for the following destination rows */
+            int want[2] = {sy0, sy1};
+
+            if (horiz_row[1] == sy0) {
+                uint32_t *tmp = horiz[0];
+                horiz[0] = horiz[1];
+                horiz[1] = tmp;
+                horiz_row[0] = horiz_row[1];
+                horiz_row[1] = -1;
+            }
+            for (int r = 0; r < 2; r++) {
+                const uint32_t *src;
+
+                if (horiz_row[r] == want[r] || (r && sy1 == sy0))
+                    continue;
+                src = (const uint32_t *)((const uint8_t *)job->pixels +
+                                         (size_t)want[r] * job->src_stride);
+                kernels->lerp_columns(horiz[r], src, job->col0, job->col1,
+                                      job->col_frac, count);
+                horiz_row[r] = want[r];
+            }
+
+            if (sy1 == sy0) {
+                memcpy(out, horiz[0], count * sizeof(uint32_t));
+            } else {
+                kernels->lerp_rows(out, horiz[0], horiz[1], fy, count);
             }
         }
-    } else if (size == 16) {
-        const uint8_t *val = font16x16[(uint8_t)ch - 32];
 
-        for (int y = 0; y < 16; y++) {
-            for (int x = 0; x < 16; x++) {
-                int xoff = 15 - x;
-                char v = val[y * 2 + ((xoff >= 8) ? 0 : 1)];
-                if (v & (1 << (xoff % 8))) {
-                    raw_display_set_pixel(rd, x0 + x, y0 + y, colour);
-                }
+        if (target->bpp != 32)
+            store_colours(dst, target->bpp, scratch, count);
+        prev_dst = dst;
+        prev_row = sy1 == sy0 ? sy0 : -1;
+    }
+    return 0;
+}
+
+int raw_display_blit_scaled(struct raw_display *rd, const uint32_t *pixels,
+                            int src_width, int src_height, int src_stride,
+                            int x, int y, int width, int height,
+                            enum raw_display_filter filter)
+{
+    struct draw_target target;
+    struct scale_job job;
+    int x0, y0, x1, y1, count, ret;
+    int *cols;
+    uint8_t *fracs;
+    uint32_t *scratch;
+
+    if (!rd || !pixels || src_width <= 0 || src_height <= 0 || width <= 0 ||
+        height <= 0)
+        return -EINVAL;
+    if (filter != RAW_DISPLAY_FILTER_nearest &&
+        filter != RAW_DISPLAY_FILTER_bilinear)
+        return -EINVAL;
+    if (!src_stride)
+        src_stride = src_width * 4;
+    if (!get_draw_target(rd, &target))
+        return -EINVAL;
+    if (tracing(rd))
+        trace_rows(trace_call(rd, RAW_DISPLAY_TRACE_blit_scaled, y,
+                              (int64_t)y + height,
+                              (size_t)src_width * src_height * 4, 7,
+                              src_width, src_height, x, y, width, height,
+                              filter),
+                   pixels, (size_t)src_width * 4, src_height, src_stride);
+
+    x0 = max(x, target.clip_x0);
+    y0 = max(y, target.clip_y0);
+    x1 = min(x + width, target.clip_x1);
+    y1 = min(y + height, target.clip_y1);
+    if (x0 >= x1 || y0 >= y1)
+        return 0;
+    count = x1 - x0;
+
+    /* The column mapping is the same for every row, so work it out once */
+    cols = malloc(count * (2 * sizeof(int) + 1));
+    scratch = malloc((size_t)split_workers(rd) * SCALE_SCRATCH * count *
+                     sizeof(*scratch));
+    if (!cols || !scratch) {
+        free(cols);
+        free(scratch);
+        return -ENOMEM;
+    }
+    fracs = (uint8_t *)(cols + 2 * count);
+    for (int i = 0; i < count; i++) {
+        if (filter == RAW_DISPLAY_FILTER_nearest)
+            cols[i] = nearest_position(x0 + i - x, width, src_width);
+        else
+            scale_position(x0 + i - x, width, src_width, &cols[i],
+                           &cols[count + i], &fracs[i]);
+    }
+
+    job = (struct scale_job){
+        .target = &target,
+        .pixels = pixels,
+        .src_width = src_width,
+        .src_height = src_height,
+        .src_stride = src_stride,
+        .y = y,
+        .height = height,
+        .x0 = x0,
+        .x1 = x1,
+        .filter = filter,
+        .col0 = cols,
+        .col1 = cols + count,
+        .col_frac = fracs,
+        .scratch = scratch,
+    };
+
+    ret = split_rows(rd, y0, y1, count, scale_rows, &job);
+    free(cols);
+    free(scratch);
+    trace_done(rd);
+    return ret;
+}
+
+#if CONFIG_RAW_DISPLAY_REFERENCE
+/*
+ * Reference versions of the sprite & blit routines, in the same spirit as
+ * the ones for the drawing routines above: each pixel is worked out on its
+ * own in 0xAARRGGBB, with none of the pixel kernels
+ */
+void raw_display_reference_draw_sprite(struct raw_display *rd, int sprite,
+                                       int x, int y,
+                                       enum raw_display_sprite_mode mode)
+{
+    const struct sprite *s = find_sprite(rd, sprite);
+    const struct sprite_atlas *atlas;
+    struct draw_target target;
+    int bytes;
+
+    if (!s || !get_draw_target(rd, &target) ||
+        (mode != RAW_DISPLAY_SPRITE_copy &&
+         mode != RAW_DISPLAY_SPRITE_colour_key &&
+         mode != RAW_DISPLAY_SPRITE_alpha))
+        return;
+    atlas = rd->draw.atlas;
+    bytes = atlas->bpp / 8;
+    for (int row = 0; row < s->height; row++) {
+        for (int col = 0; col < s->width; col++) {
+            int px = x + col, py = y + row;
+            int sx = s->x + col, sy = s->y + row;
+            uint32_t colour = read_colour(
+                atlas->pixels + (size_t)sy * atlas->stride + sx * bytes,
+                atlas->bpp);
+            uint32_t inv =
+                255 - atlas->alpha[(size_t)sy * atlas->width + sx];
+
+            if (px < target.clip_x0 || px >= target.clip_x1 ||
+                py < target.clip_y0 || py >= target.clip_y1)
+                continue;
+            if (mode == RAW_DISPLAY_SPRITE_colour_key && s->keyed &&
+                (native_colour(atlas->bpp, colour) & 0xffffff) == s->key)
+                continue;
+            if (mode == RAW_DISPLAY_SPRITE_alpha && inv) {
+                uint32_t d =
+                    read_colour(pixel_address(&target, px, py), target.bpp);
+                colour = 0xff000000 |
+                         blend_channel(colour >> 16 & 0xff, d >> 16 & 0xff,
+                                       inv) << 16 |
+                         blend_channel(colour >> 8 & 0xff, d >> 8 & 0xff,
+                                       inv) << 8 |
+                         blend_channel(colour & 0xff, d & 0xff, inv);
             }
+            put_pixel(&target, px, py, native_colour(target.bpp, colour));
         }
-        size = 12; // The 16x16 font is only 12 pixels wide
     }
-    return size;
 }
 
-int raw_display_draw_string(struct raw_display *rd, int size, int x, int y,
-                            const char *string, uint32_t colour)
+void raw_display_reference_blit_surface(
+    struct raw_display *rd, const struct raw_display_surface *surface, int x,
+    int y)
 {
-    int width = 0, height = 0;
-    int x_orig = x;
+    struct draw_target target;
+
+    if (!surface || surface == rd->draw.target ||
+        !get_draw_target(rd, &target))
+        return;
+    for (int row = 0; row < surface->height; row++)
+        for (int col = 0; col < surface->width; col++)
+            plot_pixel(&target, x + col, y + row,
+                       native_colour(target.bpp,
+                                     read_colour(surface->pixels +
+                                                     (size_t)row *
+                                                         surface->stride +
+                                                     col * surface->bpp / 8,
+                                                 surface->bpp)));
+}
+
+/* A source pixel of raw_display_reference_blit_scaled */
+static uint32_t reference_source(const uint32_t *pixels, int stride, int x,
+                                 int y)
+{
+    return ((const uint32_t *)((const uint8_t *)pixels +
+                               (size_t)y * stride))[x];
+}
+
+int raw_display_reference_blit_scaled(struct raw_display *rd,
+                                      const uint32_t *pixels, int src_width,
+                                      int src_height, int src_stride, int x,
+                                      int y, int width, int height,
+                                      enum raw_display_filter filter)
+{
+    struct draw_target target;
 
-    raw_display_info(rd, &width, &height, NULL, NULL);
-    if (y < 0 || y >= height - size || x >= width)
+    if (!rd || !pixels || src_width <= 0 || src_height <= 0 || width <= 0 ||
+        height <= 0)
         return -EINVAL;
-    for (; string && *string; string++) {
-        x += blit_char(rd, size, x, y, *string, colour);
+    if (filter != RAW_DISPLAY_FILTER_nearest &&
+        filter != RAW_DISPLAY_FILTER_bilinear)
+        return -EINVAL;
+    if (!src_stride)
+        src_stride = src_width * 4;
+    if (!get_draw_target(rd, &target))
+        return -EINVAL;
+
+    /* Only the part on the target, so the loops stay bounded */
+    for (int row = max(y, 0); row < min((int64_t)y + height,
+                                        (int64_t)target.height);
+         row++) {
+        for (int col = max(x, 0);
+             col < min((int64_t)x + width, (int64_t)target.width); col++) {
+            int sx0, sx1, sy0, sy1;
+            uint8_t fx, fy;
+            uint32_t colour;
+
+            if (filter == RAW_DISPLAY_FILTER_nearest) {
+                colour = reference_source(
+                    pixels, src_stride,
+                    nearest_position(col - x, width, src_width),
+                    nearest_position(row - y, height, src_height));
+            } else {
+                scale_position(col - x, width, src_width, &sx0, &sx1, &fx);
+                scale_position(row - y, height, src_height, &sy0, &sy1,
+                               &fy);
+                colour = lerp_colour(
+                    lerp_colour(
+                        reference_source(pixels, src_stride, sx0, sy0),
+                        reference_source(pixels, src_stride, sx1, sy0), fx),
+                    lerp_colour(
+                        reference_source(pixels, src_stride, sx0, sy1),
+                        reference_source(pixels, src_stride, sx1, sy1), fx),
+                    fy);
+            }
+            plot_pixel(&target, col, row, native_colour(target.bpp, colour));
+        }
     }
-    return x - x_orig;
+    return 0;
 }
+#endif
 
-void raw_display_draw_rectangle(struct raw_display *rd, int x0, int y0,
-                                int x1, int y1, uint32_t colour,
-                                int border_width)
+/* Number of steps in each colour map, ie: the quantisation of the field */
+#define COLOURMAP_SIZE 4096
+#define COLOURMAP_COUNT (RAW_DISPLAY_COLOURMAP_jet + 1)
+
+/* A colour map, converted to the pixel format it was last used with */
+struct colourmap_lut {
+    int bpp; // 0 if not built yet
+    uint32_t pixels[COLOURMAP_SIZE];
+};
+
+/* Evenly spaced samples of matplotlib's viridis, interpolated between */
+static const uint32_t viridis_stops[] = {
+    0x440154, 0x472c7a, 0x3b518b, 0x2c718e, 0x21908d,
+    0x27ad81, 0x5cc863, 0xaadc32, 0xfde725,
+};
+
+static uint32_t colourmap_colour(enum raw_display_colourmap map, float t)
 {
-    int width = 0, height = 0;
-    raw_display_info(rd, &width, &height, NULL, NULL);
+    uint32_t r, g, b;
 
-    if (x0 > x1) {
-        int tmp = x1;
-        x1 = x0;
-        x0 = tmp;
+    switch (map) {
+    case RAW_DISPLAY_COLOURMAP_viridis: {
+        int count = sizeof(viridis_stops) / sizeof(viridis_stops[0]);
+        float pos = t * (count - 1);
+        int i = min((int)pos, count - 2);
+        uint32_t c0 = viridis_stops[i], c1 = viridis_stops[i + 1];
+        uint32_t frac = (pos - i) * 256 + 0.5f;
+
+        return 0xff000000 | (frac < 256 ? lerp_colour(c0, c1, frac) : c1);
     }
-    if (y0 > y1) {
-        int tmp = y1;
-        y1 = y0;
-        y0 = tmp;
+    case RAW_DISPLAY_COLOURMAP_jet:
+        /* Piecewise linear blue -> cyan -> yellow -> red */
+        r = fminf(fmaxf(1.5f - fabsf(4 * t - 3), 0), 1) * 255;
+        g = fminf(fmaxf(1.5f - fabsf(4 * t - 2), 0), 1) * 255;
+        b = fminf(fmaxf(1.5f - fabsf(4 * t - 1), 0), 1) * 255;
+        break;
+    case RAW_DISPLAY_COLOURMAP_grey:
+    default:
+        r = g = b = t * 255;
+        break;
+    }
+    return 0xff000000 | r << 16 | g << 8 | b;
+}
+
+static const uint32_t *get_colourmap(struct raw_display *rd,
+                                     enum raw_display_colourmap map, int bpp)
+{
+    struct colourmap_lut *lut;
+
+    if ((unsigned)map >= COLOURMAP_COUNT)
+        return NULL;
+    if (!rd->draw.colourmaps) {
+        rd->draw.colourmaps =
+            calloc(COLOURMAP_COUNT, sizeof(*rd->draw.colourmaps));
+        if (!rd->draw.colourmaps)
+            return NULL;
     }
-    if (x1 > width - 1)
-        x1 = width - 1;
-    if (y1 > height - 1)
-        y1 = height - 1;
-    if (x0 < 0)
-        x0 = 0;
-    if (y0 < 0)
-        y0 = 0;
 
-    for (int y = y0; y <= y1; y++) {
-        for (int x = x0; x <= x1; x++) {
-            raw_display_set_pixel(rd, x, y, colour);
-        }
+    lut = &rd->draw.colourmaps[map];
+    if (lut->bpp != bpp) {
+        for (int i = 0; i < COLOURMAP_SIZE; i++)
+            lut->pixels[i] = native_colour(
+                bpp, colourmap_colour(map, (float)i / (COLOURMAP_SIZE - 1)));
+        lut->bpp = bpp;
     }
+    return lut->pixels;
 }
 
-void raw_display_draw_line(struct raw_display *rd, int x0, int y0, int x1,
-                           int y1, uint32_t colour, int line_width)
+struct field_job {
+    const struct draw_target *target;
+    const float *data;
+    int stride;
+    int x; // Unclipped destination top-left
+    int y;
+    int x0; // Clipped destination columns
+    int x1;
+    float lo;
+    float scale; // Converts (value - lo) into a colour map index
+    const uint32_t *lut;
+};
+
+static inline int field_index(float value, float lo, float scale)
 {
-    /* See http://members.chello.at/%7Eeasyfilter/Bresenham.pdf for full
-     * details on this.
-     * Code there has been released under public domain:
-     *   - The programs have no copyright and could be used and modified by
-     * anyone as wanted.
-     */
-    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
-    int dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
-    int err = dx - dy, e2, x2, y2; /* error value e_xy */
-    float ed = dx + dy == 0 ? 1 : sqrt((float)dx * dx + (float)dy * dy);
+    float pos = (value - lo) * scale;
 
-    for (float wd = (line_width + 1) / 2;;) { /* pixel loop */
-        raw_display_set_pixel(
-            rd, x0, y0,
-            colour); // TODO: Antialiasing? -
-                     // max(0,255*(abs(err-dx+dy)/ed-wd+1)));
-        e2 = err;
-        x2 = x0;
-        if (2 * e2 >= -dx) { /* x step */
-            for (e2 += dy, y2 = y0; e2 < ed * wd && (y1 != y2 || dx > dy);
-                 e2 += dx) {
-                // TODO: Antialiasing? - max(0,255*(abs(e2)/ed-wd+1)));
-                raw_display_set_pixel(rd, x0, y2, colour);
-                y2 += sy;
-            }
-            if (x0 == x1)
-                break;
-            e2 = err;
-            err -= dy;
-            x0 += sx;
+    /* Written so that NaN ends up as 0 */
+    pos = pos >= 0 ? pos : 0;
+    pos = pos <= COLOURMAP_SIZE - 1 ? pos : COLOURMAP_SIZE - 1;
+    return (int)pos;
+}
+
+static int field_rows(void *arg, int worker, int row0, int row1)
+{
+    const struct field_job *job = arg;
+    const struct draw_target *target = job->target;
+    int count = job->x1 - job->x0;
+
+    (void)worker;
+    for (int row = row0; row < row1; row++) {
+        const float *src =
+            (const float *)((const uint8_t *)job->data +
+                            (size_t)(row - job->y) * job->stride) +
+            (job->x0 - job->x);
+        uint8_t *dst = pixel_address(target, job->x0, row);
+
+        switch (target->bpp) {
+        case 32: {
+            uint32_t *dst32 = (uint32_t *)dst;
+            for (int i = 0; i < count; i++)
+                dst32[i] = job->lut[field_index(src[i], job->lo, job->scale)];
+            break;
+        }
+        case 24:
+            for (int i = 0; i < count; i++)
+                store_24(dst + i * 3,
+                         job->lut[field_index(src[i], job->lo, job->scale)]);
+            break;
+        case 16: {
+            uint16_t *dst16 = (uint16_t *)dst;
+            for (int i = 0; i < count; i++)
+                dst16[i] = job->lut[field_index(src[i], job->lo, job->scale)];
+            break;
         }
-        if (2 * e2 <= dy) { /* y step */
-            for (e2 = dx - e2; e2 < ed * wd && (x1 != x2 || dx < dy);
-                 e2 += dy) {
-                // TODO: Antialiasing? - max(0,255*(abs(e2)/ed-wd+1)));
-                raw_display_set_pixel(rd, x2, y0, colour);
-                x2 += sx;
-            }
-            if (y0 == y1)
-                break;
-            err += dx;
-            y0 += sy;
         }
     }
+    return 0;
 }
 
-static inline void xLine(struct raw_display *rd, int x0, int x1, int y,
-                         uint32_t colour)
+int raw_display_blit_field(struct raw_display *rd, const float *data,
+                           int width, int height, int stride, int x, int y,
+                           float lo, float hi,
+                           enum raw_display_colourmap colourmap)
 {
-    int width = 0, height = 0;
-    raw_display_info(rd, &width, &height, NULL, NULL);
-    // Clamp all the coordinates
-    if (x1 < x0) {
-        int tmp = x1;
-        x1 = x0;
-        x0 = tmp;
+    struct draw_target target;
+    struct field_job job;
+    int x0, y0, x1, y1, ret;
+
+    if (!rd || !data || width <= 0 || height <= 0 || !(hi > lo))
+        return -EINVAL;
+    if (!stride)
+        stride = width * sizeof(float);
+    if (!get_draw_target(rd, &target))
+        return -EINVAL;
+    if (tracing(rd)) {
+        float range[2] = {lo, hi};
+        uint32_t map = colourmap;
+        FILE *trace = trace_call(rd, RAW_DISPLAY_TRACE_blit_field, y,
+                                 (int64_t)y + height,
+                                 sizeof(range) + sizeof(uint32_t) +
+                                     (size_t)width * height * sizeof(float),
+                                 4, width, height, x, y);
+        fwrite(range, sizeof(range), 1, trace);
+        fwrite(&map, sizeof(map), 1, trace);
+        trace_rows(trace, data, width * sizeof(float), height, stride);
     }
-    if (x1 < 0)
-        return;
-    if (x0 > width - 1)
-        return;
-    if (y < 0 || y > height - 1)
-        return;
-    x0 = max(x0, 0);
-    x1 = min(x1, width - 1);
-    y = max(min(y, height - 1), 0);
-    while (x0 <= x1)
-        raw_display_set_pixel(rd, x0++, y, colour);
+
+    job = (struct field_job){
+        .target = &target,
+        .data = data,
+        .stride = stride,
+        .x = x,
+        .y = y,
+        .lo = lo,
+        .scale = (COLOURMAP_SIZE - 1) / (hi - lo),
+        .lut = get_colourmap(rd, colourmap, target.bpp),
+    };
+    if (!job.lut)
+        return (unsigned)colourmap >= COLOURMAP_COUNT ? -EINVAL : -ENOMEM;
+
+    x0 = max(x, target.clip_x0);
+    y0 = max(y, target.clip_y0);
+    x1 = min(x + width, target.clip_x1);
+    y1 = min(y + height, target.clip_y1);
+    if (x0 >= x1 || y0 >= y1)
+        return 0;
+    job.x0 = x0;
+    job.x1 = x1;
+
+    ret = split_rows(rd, y0, y1, x1 - x0, field_rows, &job);
+    trace_done(rd);
+    return ret;
 }
 
-static inline void yLine(struct raw_display *rd, int x, int y0, int y1,
-                         uint32_t colour)
+struct shade_job {
+    const struct draw_target *target;
+    raw_display_shade_func func;
+    void *user;
+    int x0; // Clipped destination columns
+    int x1;
+    uint32_t *scratch; // A row for each worker, if not drawing at 32bpp
+};
+
+static int shade_rows(void *arg, int worker, int row0, int row1)
 {
-    // Reject invalid coordinates & clamp the remaining ones
-    if (y1 < y0) {
-        int tmp = y1;
-        y1 = y0;
-        y0 = tmp;
+    const struct shade_job *job = arg;
+    int count = job->x1 - job->x0;
+    uint32_t *scratch =
+        job->scratch ? job->scratch + (size_t)worker * count : NULL;
+
+    for (int y = row0; y < row1; y++) {
+        uint8_t *dst = pixel_address(job->target, job->x0, y);
+
+        job->func(job->user, scratch ? scratch : (uint32_t *)dst, job->x0,
+                  y, count);
+        if (scratch)
+            store_colours(dst, job->target->bpp, scratch, count);
     }
-    if (x < 0 || x > rd->width - 1)
-        return;
-    if (y0 > rd->height - 1)
-        return;
-    if (y1 < 0)
-        return;
-    y0 = max(y0, 0);
-    y1 = min(y1, rd->height - 1);
-    x = max(min(x, rd->width - 1), 0);
-    while (y0 <= y1)
-        raw_display_set_pixel(rd, x, y0++, colour);
+    return 0;
 }
 
-void raw_display_draw_circle(struct raw_display *rd, int xc, int yc,
-                             int radius, uint32_t colour, int border_width)
+int raw_display_shade(struct raw_display *rd, int x, int y, int width,
+                      int height, raw_display_shade_func func, void *user)
 {
-    int inner = radius - border_width + 1;
-    int outer = radius;
-    int xo = outer;
-    int xi = inner;
-    int y = 0;
-    int erro = 1 - xo;
-    int erri = 1 - xi;
+    struct draw_target target;
+    struct shade_job job;
+    bool trace_frame;
+    int y0, y1, ret;
 
-    while (xo >= y) {
-        xLine(rd, xc + xi, xc + xo, yc + y, colour);
-        yLine(rd, xc + y, yc + xi, yc + xo, colour);
-        xLine(rd, xc - xo, xc - xi, yc + y, colour);
-        yLine(rd, xc - y, yc + xi, yc + xo, colour);
-        xLine(rd, xc - xo, xc - xi, yc - y, colour);
-        yLine(rd, xc - y, yc - xo, yc - xi, colour);
-        xLine(rd, xc + xi, xc + xo, yc - y, colour);
-        yLine(rd, xc + y, yc - xo, yc - xi, colour);
+    if (!rd || !func || width < 0 || height < 0)
+        return -EINVAL;
+    if (!get_draw_target(rd, &target))
+        return -EINVAL;
 
-        y++;
+    job = (struct shade_job){
+        .target = &target,
+        .func = func,
+        .user = user,
+        .x0 = max(x, target.clip_x0),
+        .x1 = (int)min((int64_t)x + width, (int64_t)target.clip_x1),
+    };
+    y0 = max(y, target.clip_y0);
+    y1 = (int)min((int64_t)y + height, (int64_t)target.clip_y1);
+    if (job.x0 >= job.x1 || y0 >= y1)
+        return 0;
+    /* At 32bpp the callback can write straight into the target */
+    if (target.bpp != 32) {
+        job.scratch = malloc((size_t)split_workers(rd) * (job.x1 - job.x0) *
+                             sizeof(*job.scratch));
+        if (!job.scratch)
+            return -ENOMEM;
+    }
 
-        if (erro < 0) {
-            erro += 2 * y + 1;
-        } else {
-            xo--;
-            erro += 2 * (y - xo) + 1;
+    /* A trace can't replay the callback, so it records the pixels written
+     * instead, as if they had been written to the frame or surface
+     * directly */
+    trace_frame = tracing(rd) && !rd->draw.target;
+    if (trace_frame)
+        trace_sync(rd, rd->draw.trace, false);
+    ret = split_rows(rd, y0, y1, job.x1 - job.x0, shade_rows, &job);
+    free(job.scratch);
+    if (trace_frame)
+        rd->draw.trace->compare = true;
+    else if (rd->draw.target)
+        trace_surface(rd, rd->draw.target, 0, rd->draw.target->height);
+    return ret;
+}
+
+/* Number of points whose addresses are computed together before storing */
+#define POINT_BATCH 64
+
+static void draw_point_batch(const struct draw_target *target, const int *xs,
+                             const int *ys, const uint32_t *colours,
+                             size_t colour_count, int count, int size)
+{
+    int32_t offsets[POINT_BATCH];
+    int bytes = target->bpp / 8;
+
+    if (size > 1) {
+        for (int i = 0; i < count; i++) {
+            int x0 = max(xs[i] - size / 2, target->clip_x0);
+            int y0 = max(ys[i] - size / 2, target->clip_y0);
+            int x1 = min(xs[i] - size / 2 + size, target->clip_x1);
+            int y1 = min(ys[i] - size / 2 + size, target->clip_y1);
+            uint32_t pixel = native_colour(
+                target->bpp, colours[colour_count > 1 ? i : 0]);
+
+            for (int y = y0; y < y1; y++)
+                fill_span(pixel_address(target, x0, y), target->bpp,
+                          x1 - x0, pixel);
         }
+        return;
+    }
 
-        if (y > inner) {
-            xi = y;
+    /* Work out every address first, marking clipped points with -1, so this
+     * loop has no branches and can be vectorised */
+    for (int i = 0; i < count; i++) {
+        unsigned int x = xs[i] - target->clip_x0;
+        unsigned int y = ys[i] - target->clip_y0;
+        int inside = (x < (unsigned int)(target->clip_x1 - target->clip_x0)) &
+                     (y < (unsigned int)(target->clip_y1 - target->clip_y0));
+        offsets[i] = inside ? (int32_t)(ys[i] * target->stride +
+                                        xs[i] * bytes)
+                            : -1;
+    }
+
+    switch (target->bpp) {
+    case 32:
+        if (colour_count > 1) {
+            for (int i = 0; i < count; i++)
+                if (offsets[i] >= 0)
+                    *(uint32_t *)(target->pixels + offsets[i]) = colours[i];
         } else {
-            if (erri < 0) {
-                erri += 2 * y + 1;
-            } else {
-                xi--;
-                erri += 2 * (y - xi) + 1;
-            }
+            for (int i = 0; i < count; i++)
+                if (offsets[i] >= 0)
+                    *(uint32_t *)(target->pixels + offsets[i]) = colours[0];
         }
+        break;
+    case 24:
+        for (int i = 0; i < count; i++)
+            if (offsets[i] >= 0)
+                store_24(target->pixels + offsets[i],
+                         colours[colour_count > 1 ? i : 0]);
+        break;
+    case 16:
+        if (colour_count > 1) {
+            for (int i = 0; i < count; i++)
+                if (offsets[i] >= 0)
+                    *(uint16_t *)(target->pixels + offsets[i]) =
+                        colour_to_16(colours[i]);
+        } else {
+            uint16_t pixel = colour_to_16(colours[0]);
+            for (int i = 0; i < count; i++)
+                if (offsets[i] >= 0)
+                    *(uint16_t *)(target->pixels + offsets[i]) = pixel;
+        }
+        break;
     }
 }
 
-static uint16_t colour_to_16(uint32_t colour)
+/**
+ * Record a batch of points, in either pixel or world coordinates
+ * @param transform World to pixel mapping for RAW_DISPLAY_TRACE_points_f
+ */
+static void trace_points(struct raw_display *rd, enum raw_display_trace_op op,
+                         const void *xs, const void *ys,
+                         const uint32_t *colours, size_t colour_count,
+                         size_t count, int size,
+                         const struct raw_display_transform *transform)
 {
-    return ((colour & 0xf10000) >> 8) | ((colour & 0x00fc00) >> 5) |
-           ((colour & 0x0000ff) >> 3);
+    int64_t y0 = INT64_MIN, y1 = INT64_MAX;
+    FILE *trace;
+
+    /* The rows covered are only easy to find in pixel coordinates */
+    if (!count) {
+        y0 = y1 = 0;
+    } else if (!transform) {
+        y0 = INT64_MAX;
+        y1 = INT64_MIN;
+        for (size_t i = 0; i < count; i++) {
+            y0 = min(y0, (int64_t)((const int *)ys)[i]);
+            y1 = max(y1, (int64_t)((const int *)ys)[i]);
+        }
+        y0 -= size / 2 + 1;
+        y1 += size / 2 + 2;
+    }
+    trace = trace_call(rd, op, y0, y1,
+                       (transform ? sizeof(*transform) : 0) +
+                           (2 * count + colour_count) * 4,
+                       3, (uint32_t)count, (uint32_t)colour_count, size);
+    if (transform)
+        fwrite(transform, sizeof(*transform), 1, trace);
+    fwrite(xs, 4, count, trace);
+    fwrite(ys, 4, count, trace);
+    fwrite(colours, 4, colour_count, trace);
 }
 
-void raw_display_set_pixel(struct raw_display *rd, int x, int y,
-                           uint32_t colour)
+void raw_display_draw_points(struct raw_display *rd, const int *xs,
+                             const int *ys, const uint32_t *colours,
+                             size_t colour_count, size_t count, int size)
 {
-    int width = 0, height = 0, bpp = 0, stride = 0;
-    raw_display_info(rd, &width, &height, &bpp, &stride);
-    if (x < 0 || x >= width || y < 0 || y >= height)
-        return;
-    uint8_t *rgb = raw_display_get_frame(rd);
-    if (!rgb)
+    struct draw_target target;
+
+    if (!xs || !ys || !colours || !colour_count ||
+        !get_draw_target(rd, &target))
         return;
-    uint8_t *rgb_start = (rgb + y * stride + x * bpp / 8);
-    switch (bpp) {
-    case 32: {
-        uint32_t *pos32 = (uint32_t *)rgb_start;
-        *pos32 = colour;
-        break;
-    }
-    case 16: {
-        uint16_t *pos16 = (uint16_t *)rgb_start;
-        *pos16 = colour_to_16(colour);
-        break;
+    if (tracing(rd))
+        trace_points(rd, RAW_DISPLAY_TRACE_points, xs, ys, colours,
+                     colour_count, count, size, NULL);
+
+    for (size_t base = 0; base < count; base += POINT_BATCH) {
+        int n = min(count - base, (size_t)POINT_BATCH);
+        draw_point_batch(&target, xs + base, ys + base,
+                         colour_count > 1 ? colours + base : colours,
+                         colour_count, n, size);
     }
+    trace_done(rd);
+}
+
+/* Map a world coordinate onto a pixel, saturating anything wildly off
+ * screen (or NaN) so the integer conversion is always defined */
+static inline int world_to_pixel(float v, float scale, float offset)
+{
+    v = v * scale + offset;
+    if (!(v >= -1.0f))
+        v = -1.0f;
+    if (v > 1e9f)
+        v = 1e9f;
+    /* v + 1 is non-negative, so truncation is the same as floor() */
+    return (int)(v + 1.0f) - 1;
+}
+
+void raw_display_draw_points_f(struct raw_display *rd, const float *xs,
+                               const float *ys, const uint32_t *colours,
+                               size_t colour_count, size_t count, int size,
+                               const struct raw_display_transform *transform)
+{
+    struct raw_display_transform identity = {1.0f, 1.0f, 0.0f, 0.0f};
+    struct draw_target target;
+    int ixs[POINT_BATCH];
+    int iys[POINT_BATCH];
+
+    if (!xs || !ys || !colours || !colour_count ||
+        !get_draw_target(rd, &target))
+        return;
+    if (!transform)
+        transform = &identity;
+    if (tracing(rd))
+        trace_points(rd, RAW_DISPLAY_TRACE_points_f, xs, ys, colours,
+                     colour_count, count, size, transform);
+
+    for (size_t base = 0; base < count; base += POINT_BATCH) {
+        int n = min(count - base, (size_t)POINT_BATCH);
+        for (int i = 0; i < n; i++) {
+            ixs[i] = world_to_pixel(xs[base + i], transform->scale_x,
+                                    transform->offset_x);
+            iys[i] = world_to_pixel(ys[base + i], transform->scale_y,
+                                    transform->offset_y);
+        }
+        draw_point_batch(&target, ixs, iys,
+                         colour_count > 1 ? colours + base : colours,
+                         colour_count, n, size);
     }
+    trace_done(rd);
 }
 
 int raw_display_save_frame(const struct raw_display *rd, const char *filename)
 {
     FILE *fp;
-    uint32_t *rgb;
-    int width, height, stride;
+    uint8_t *rgb;
+    int width, height, bpp, stride;
 
     if (!rd || !filename)
         return -EINVAL;
-    raw_display_info(rd, &width, &height, NULL, &stride);
-    rgb = (uint32_t *)raw_display_get_frame(rd);
+    raw_display_info(rd, &width, &height, &bpp, &stride);
+    rgb = raw_display_get_frame(rd);
     if (!rgb)
         return -EINVAL;
     fp = fopen(filename, "wb");
@@ -1680,10 +8364,11 @@ int raw_display_save_frame(const struct raw_display *rd, const char *filename)
 
     for (int y = 0; y < height; y++) {
         for (int x = 0; x < width; x++) {
-            fprintf(fp, "%c%c%c", (rgb[x] >> 16) & 0xff, (rgb[x] >> 8) & 0xff,
-                    rgb[x] & 0xff);
+            uint32_t colour = read_colour(rgb + x * bpp / 8, bpp);
+            fprintf(fp, "%c%c%c", (colour >> 16) & 0xff,
+                    (colour >> 8) & 0xff, colour & 0xff);
         }
-        rgb += stride / 4;
+        rgb += stride;
     }
     fclose(fp);
     return 0;
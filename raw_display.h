@@ -16,6 +16,7 @@
  *  - 3 will select the Win32 implementation
  *  - 4 will select the MacOS/Cocoa implementation
  *  - 5 will select the dummy implementation, for off-screen drawing
+ *  - 6 will select the Linux/DRM (KMS) implementation
  */
 
 #define RAW_DISPLAY_MODE_LINUX_XCB 1 ///< Use the Linux X11/XCB backend
@@ -23,11 +24,16 @@
 #define RAW_DISPLAY_MODE_WIN32 3    ///< Use the Microsoft Windows backend
 #define RAW_DISPLAY_MODE_MACOS 4    ///< Use the MacOS Cocoa backend
 #define RAW_DISPLAY_MODE_DUMMY 5    ///< Use the dummy/offscreen backend
+#define RAW_DISPLAY_MODE_LINUX_DRM 6 ///< Use the Linux DRM/KMS backend
+
+#define RAW_DISPLAY_MAX_FRAMES 8 ///< Maximum number of frames in the ring
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct raw_display;
+struct raw_display_surface;
 
 /**
  * List of all of the types of events that @ref raw_display_event covers
@@ -69,7 +75,8 @@ struct raw_display_event {
 
 /**
  * Construct a new display buffer/window at a given width/height
- * Note: This can only be called once
+ * Note: This can only be called once. Use @ref raw_display_surface_create
+ * for additional off-screen images
  * @param title UTF-8 window title for display
  * @param width Width in pixels of the window
  * @param height Height in pixels of the window
@@ -78,6 +85,59 @@ struct raw_display_event {
 struct raw_display *raw_display_init(const char *title, int width,
                                      int height);
 
+/**
+ * Optional settings for @ref raw_display_init_config.
+ * Any field left as 0 uses the default
+ */
+struct raw_display_config {
+    /**
+     * Number of frames to cycle through (1 to @ref RAW_DISPLAY_MAX_FRAMES).
+     * 2 saves memory, larger values let drawing run further ahead of the
+     * display. Defaults to 3 (all that are available for framebuffer; if
+     * it only has room for 1, drawing happens in a shadow frame in RAM
+     * whose changes are copied onto the screen at each flip)
+     */
+    int frame_count;
+    /**
+     * Integer factor by which each pixel is enlarged when shown.
+     * The frames and all drawing use the size passed to
+     * @ref raw_display_init_config, while the window is scale times larger
+     * (on framebuffer & DRM the display size is divided by scale instead).
+     * Defaults to 1
+     */
+    int scale;
+    /**
+     * Split the frame into tiles of this many pixels square, and at each
+     * flip only send the tiles whose contents changed to the display.
+     * Worthwhile when the whole frame is redrawn each time, but little of
+     * it actually changes. Rounded up to a multiple of 16.
+     * Only used by X11 and the framebuffer's shadow frame (the dummy
+     * backend also compares the tiles, for the statistics). Defaults to 0
+     * (send the whole frame), or 64 for the shadow frame
+     */
+    int tile_size;
+    /**
+     * Clockwise rotation in degrees (0, 90, 180 or 270) of the frames when
+     * shown, for screens mounted on their side or upside down. Drawing
+     * stays the right way up, with the width & height swapped by a
+     * quarter turn. Only used by framebuffer. Defaults to 0
+     */
+    int rotation;
+};
+
+/**
+ * Construct a new display buffer/window, with additional settings
+ * Note: This can only be called once
+ * @param title UTF-8 window title for display
+ * @param width Width in pixels of the window
+ * @param height Height in pixels of the window
+ * @param config Settings for the display, or NULL for the defaults
+ * @return raw_display structure on success, NULL on failure
+ */
+struct raw_display *raw_display_init_config(
+    const char *title, int width, int height,
+    const struct raw_display_config *config);
+
 /**
  * Determine the characteristics of the raw display
  * @param rd Raw Display structure to get info from
@@ -107,6 +167,176 @@ uint8_t *raw_display_get_frame(const struct raw_display *rd);
 void raw_display_get_frame_details(const struct raw_display *rd,
                                    int *frame_index, int *frame_count);
 
+/**
+ * Determine how old the contents of the current off-screen frame are, in
+ * the style of EGL_EXT_buffer_age.
+ * This allows only the areas which have changed since the frame was last
+ * used to be redrawn.
+ * @param rd Raw display structure to query
+ * @return 0 if the contents of the frame are undefined (it has never been
+ * displayed), otherwise the number of flips since the frame was last
+ * displayed, i.e. 1 if it holds the last frame shown, 2 if it holds the
+ * frame before that, etc.
+ */
+int raw_display_get_buffer_age(const struct raw_display *rd);
+
+/**
+ * Where the pixels of a frame or surface are, for writing to them directly.
+ * Fetch one with @ref raw_display_get_view after each flip, then use the
+ * inline raw_display_row & raw_display_span_* helpers below, which need no
+ * calls into the library
+ */
+struct raw_display_view {
+    uint8_t *pixels; ///< height * stride bytes of pixel data
+    int width;       ///< Width in pixels
+    int height;      ///< Height in pixels
+    int bpp;         ///< Bits per pixel: 16 (RGB565), 24 or 32 (xRGB)
+    int stride;      ///< Bytes from the start of one row to the next
+};
+
+/**
+ * Describe the current off-screen frame, as @ref raw_display_get_frame and
+ * @ref raw_display_info would. The view is only valid until the next flip
+ * @param rd Raw display structure to get the frame of
+ * @param view Area to store the description in
+ * @return < 0 on failure, >= 0 on success
+ */
+int raw_display_get_view(const struct raw_display *rd,
+                         struct raw_display_view *view);
+
+/**
+ * Convert a 0xAARRGGBB colour into the value stored for a pixel, so it can
+ * be converted once and then written many times
+ * @param view Frame or surface the colour will be written to
+ * @param colour Colour to convert
+ * @return Pixel value, in the low view->bpp bits
+ */
+static inline uint32_t raw_display_native_colour(
+    const struct raw_display_view *view, uint32_t colour)
+{
+    switch (view->bpp) {
+    case 16:
+        return ((colour & 0xf80000) >> 8) | ((colour & 0x00fc00) >> 5) |
+               ((colour & 0x0000ff) >> 3);
+    case 24:
+        return colour & 0xffffff;
+    default:
+        return colour;
+    }
+}
+
+/**
+ * Find the start of a row of pixels. There is no bounds checking
+ * @param view Frame or surface to find the row in
+ * @param y Row to find, from 0 to view->height - 1
+ * @return Address of the first pixel of the row
+ */
+static inline uint8_t *raw_display_row(const struct raw_display_view *view,
+                                       int y)
+{
+    return view->pixels + (ptrdiff_t)y * view->stride;
+}
+
+/**
+ * Write count copies of a pixel value along a row. There is no clipping, so
+ * the span must lie within the view
+ * @param view Frame or surface to write to
+ * @param x Column of the first pixel
+ * @param y Row to write to
+ * @param count Number of pixels to write
+ * @param pixel Value from @ref raw_display_native_colour
+ */
+static inline void raw_display_span_fill(const struct raw_display_view *view,
+                                         int x, int y, int count,
+                                         uint32_t pixel)
+{
+    uint8_t *pos = raw_display_row(view, y) + (ptrdiff_t)x * (view->bpp / 8);
+
+    switch (view->bpp) {
+    case 32:
+        for (int i = 0; i < count; i++)
+            ((uint32_t *)pos)[i] = pixel;
+        break;
+    case 24:
+        for (int i = 0; i < count; i++) {
+            pos[i * 3] = (uint8_t)pixel;
+            pos[i * 3 + 1] = (uint8_t)(pixel >> 8);
+            pos[i * 3 + 2] = (uint8_t)(pixel >> 16);
+        }
+        break;
+    case 16:
+        for (int i = 0; i < count; i++)
+            ((uint16_t *)pos)[i] = (uint16_t)pixel;
+        break;
+    }
+}
+
+/**
+ * Copy count 0xAARRGGBB colours along a row, converting them to the
+ * view's format. There is no clipping, so the span must lie within the view
+ * @param view Frame or surface to write to
+ * @param x Column of the first pixel
+ * @param y Row to write to
+ * @param colours Colours to write
+ * @param count Number of pixels to write
+ */
+static inline void raw_display_span_copy(const struct raw_display_view *view,
+                                         int x, int y,
+                                         const uint32_t *colours, int count)
+{
+    uint8_t *pos = raw_display_row(view, y) + (ptrdiff_t)x * (view->bpp / 8);
+
+    switch (view->bpp) {
+    case 32:
+        for (int i = 0; i < count; i++)
+            ((uint32_t *)pos)[i] = colours[i];
+        break;
+    case 24:
+        for (int i = 0; i < count; i++) {
+            pos[i * 3] = (uint8_t)colours[i];
+            pos[i * 3 + 1] = (uint8_t)(colours[i] >> 8);
+            pos[i * 3 + 2] = (uint8_t)(colours[i] >> 16);
+        }
+        break;
+    case 16:
+        for (int i = 0; i < count; i++)
+            ((uint16_t *)pos)[i] =
+                (uint16_t)raw_display_native_colour(view, colours[i]);
+        break;
+    }
+}
+
+/**
+ * Counters of the work done presenting frames, since the display was
+ * created
+ */
+struct raw_display_stats {
+    unsigned long flips;         ///< Number of calls to raw_display_flip
+    unsigned long tiles;         ///< Tiles compared (see tile_size)
+    unsigned long tiles_skipped; ///< Tiles not sent, as they were unchanged
+    /**
+     * Vertical blanks which passed without a new frame being shown, once
+     * the first frame has been shown. This includes those spent waiting
+     * for the next frame to be drawn, so it grows by every vblank skipped
+     * when drawing at below the refresh rate (on purpose or not). Only
+     * known with the X11 Present extension and DRM
+     */
+    unsigned long missed_vblanks;
+    /**
+     * Time in microseconds (of the display server's clock) that the most
+     * recent frame was shown, or 0 if unknown
+     */
+    uint64_t present_time_us;
+};
+
+/**
+ * Retrieve the presentation statistics of the display
+ * @param rd Raw display structure to query
+ * @param stats Area to store the statistics in
+ */
+void raw_display_get_stats(const struct raw_display *rd,
+                           struct raw_display_stats *stats);
+
 /**
  * Save the currently available off-screen bitmap of the display to a
  * local ppm file.
@@ -147,17 +377,39 @@ void raw_display_shutdown(struct raw_display *rd);
  * Displays an ASCII string on the screen.
  * Note: Only ASCII characters 0 - 127 are supported
  * @param rd Raw display to draw the rectangle on
- * @param size Height of the font (only 8 & 16 are currently supported)
+ * @param size Height of the font: 8, 16 or a multiple of 8 for an enlarged
+ * copy of one of them (multiples of 16 enlarge the 16 pixel font, which is
+ * more detailed)
  * @param x X offset of the pixel at the top-left of the string
  * @param y Y offset of the pixel at the top-left of the string
  * @param string String to display
  * @param colour Colour to draw the string as
  * @return < 0 on failure, >= 0 on success (number of horizontal pixels
- * written)
+ * the string covers, including any parts which were clipped)
  */
 int raw_display_draw_string(struct raw_display *rd, int size, int x, int y,
                             const char *string, uint32_t colour);
 
+/**
+ * Fill the whole display (or the clip region, if one is set) with a colour.
+ * Large fills bypass the CPU cache, so this is considerably faster than
+ * drawing a filled rectangle over the display
+ * @param rd Raw display to clear
+ * @param colour Colour to fill the display with
+ */
+void raw_display_clear(struct raw_display *rd, uint32_t colour);
+
+/**
+ * Fill a range of complete rows of the display (limited to the clip region,
+ * if one is set) with a colour
+ * @param rd Raw display to fill
+ * @param y0 Pixel offset of the first row to fill
+ * @param y1 Pixel offset of the last row to fill (inclusive)
+ * @param colour Colour to fill the rows with
+ */
+void raw_display_fill_rows(struct raw_display *rd, int y0, int y1,
+                           uint32_t colour);
+
 /**
  * Draw a rectangle on the screen
  * @param rd Raw display to draw the rectangle on
@@ -208,4 +460,633 @@ void raw_display_draw_circle(struct raw_display *rd, int xc, int yc,
 void raw_display_set_pixel(struct raw_display *rd, int x, int y,
                            uint32_t colour);
 
+/**
+ * Restrict all drawing to a rectangular region of the display.
+ * Primitives are clipped against this region before they are rasterised,
+ * so anything outside of it costs very little
+ * @param rd Raw display to set the clip region on
+ * @param x0 Pixel offset of the left of the region
+ * @param y0 Pixel offset of the top of the region
+ * @param x1 Pixel offset of the right of the region (inclusive)
+ * @param y1 Pixel offset of the bottom of the region (inclusive)
+ */
+void raw_display_set_clip(struct raw_display *rd, int x0, int y0, int x1,
+                          int y1);
+
+/**
+ * Remove any clip region set by @ref raw_display_set_clip, so that the
+ * whole display can be drawn to again
+ * @param rd Raw display to reset the clip region on
+ */
+void raw_display_reset_clip(struct raw_display *rd);
+
+/**
+ * Draw a batch of points on the display
+ * This is considerably faster than calling @ref raw_display_set_pixel for
+ * each point
+ * @param rd Raw display to draw the points on
+ * @param xs Array of count X offsets
+ * @param ys Array of count Y offsets
+ * @param colours Colours to draw the points, either a single colour for
+ * every point or one per point
+ * @param colour_count Number of entries in colours (1 or count)
+ * @param count Number of points to draw
+ * @param size Width/height in pixels of the square drawn centred on each
+ * point (<= 1 for single pixels)
+ */
+void raw_display_draw_points(struct raw_display *rd, const int *xs,
+                             const int *ys, const uint32_t *colours,
+                             size_t colour_count, size_t count, int size);
+
+/**
+ * Mapping from world coordinates to pixel coordinates, as used by
+ * @ref raw_display_draw_points_f
+ * pixel_x = x * scale_x + offset_x, pixel_y = y * scale_y + offset_y
+ */
+struct raw_display_transform {
+    float scale_x;  ///< Pixels per world unit in X
+    float scale_y;  ///< Pixels per world unit in Y
+    float offset_x; ///< Pixel X offset of the world origin
+    float offset_y; ///< Pixel Y offset of the world origin
+};
+
+/**
+ * Draw a batch of points given in floating point world coordinates
+ * @param rd Raw display to draw the points on
+ * @param xs Array of count X world coordinates
+ * @param ys Array of count Y world coordinates
+ * @param colours Colours to draw the points, either a single colour for
+ * every point or one per point
+ * @param colour_count Number of entries in colours (1 or count)
+ * @param count Number of points to draw
+ * @param size Width/height in pixels of the square drawn centred on each
+ * point (<= 1 for single pixels)
+ * @param transform World to pixel mapping, or NULL to use the coordinates
+ * as pixels directly
+ */
+void raw_display_draw_points_f(struct raw_display *rd, const float *xs,
+                               const float *ys, const uint32_t *colours,
+                               size_t colour_count, size_t count, int size,
+                               const struct raw_display_transform *transform);
+
+/**
+ * Create an off-screen surface which can be drawn to with the
+ * raw_display_draw_* routines (see @ref raw_display_set_target) and then
+ * copied onto the display with @ref raw_display_blit_surface.
+ * The memory for destroyed surfaces is kept by the display and reused, so
+ * creating & destroying surfaces every frame is cheap
+ * @param rd Raw display the surface will be used with
+ * @param width Width in pixels of the surface
+ * @param height Height in pixels of the surface
+ * @param bpp Bits per pixel of the surface (16, 24 or 32), or 0 to match
+ * the display
+ * @return New surface, cleared to 0, on success. NULL on failure
+ */
+struct raw_display_surface *raw_display_surface_create(struct raw_display *rd,
+                                                       int width, int height,
+                                                       int bpp);
+
+/**
+ * Release a surface created by @ref raw_display_surface_create.
+ * All surfaces are released by @ref raw_display_shutdown
+ * @param rd Raw display the surface was created from
+ * @param surface Surface to release
+ */
+void raw_display_surface_destroy(struct raw_display *rd,
+                                 struct raw_display_surface *surface);
+
+/**
+ * Determine the characteristics of an off-screen surface
+ * @param surface Surface to get info from
+ * @param width Area to store width in pixels of the surface
+ * @param height Area to store the height in pixels of the surface
+ * @param bpp Area to store the bits-per-pixel of the surface
+ * @param stride Area to store the stride in bytes of the surface
+ */
+void raw_display_surface_info(const struct raw_display_surface *surface,
+                              int *width, int *height, int *bpp, int *stride);
+
+/**
+ * Retrieve the pixel data of an off-screen surface
+ * @param surface Surface to get the pixels of
+ * @return height * stride bytes of pixel data on success, NULL on failure
+ */
+uint8_t *raw_display_surface_get_pixels(
+    const struct raw_display_surface *surface);
+
+/**
+ * Describe a surface for writing to it directly, see
+ * @ref raw_display_view
+ * @param surface Surface to describe
+ * @param view Area to store the description in
+ * @return < 0 on failure, >= 0 on success
+ */
+int raw_display_surface_get_view(const struct raw_display_surface *surface,
+                                 struct raw_display_view *view);
+
+/**
+ * Redirect all of the raw_display_draw_* routines (and
+ * @ref raw_display_set_pixel) to draw into a surface instead of the frame.
+ * The clip region, if any, applies to the surface
+ * @param rd Raw display to change the drawing target of
+ * @param surface Surface to draw into, or NULL to draw into the frame again
+ */
+void raw_display_set_target(struct raw_display *rd,
+                            struct raw_display_surface *surface);
+
+/**
+ * Copy a surface onto the current drawing target (normally the frame),
+ * converting the pixel format if required
+ * @param rd Raw display to copy the surface on to
+ * @param surface Surface to copy
+ * @param x X offset of the top-left of the surface on the target
+ * @param y Y offset of the top-left of the surface on the target
+ */
+void raw_display_blit_surface(struct raw_display *rd,
+                              const struct raw_display_surface *surface,
+                              int x, int y);
+
+/**
+ * How @ref raw_display_draw_sprite combines a sprite with the display
+ */
+enum raw_display_sprite_mode {
+    RAW_DISPLAY_SPRITE_copy,       ///< Overwrite the display with the sprite
+    RAW_DISPLAY_SPRITE_colour_key, ///< Skip pixels matching the colour key
+    RAW_DISPLAY_SPRITE_alpha,      ///< Blend using the sprite's alpha channel
+};
+
+/**
+ * Add an image to the sprite atlas, so it can be drawn repeatedly with
+ * @ref raw_display_draw_sprite.
+ * The image is converted to the display's pixel format (with premultiplied
+ * alpha) once here, rather than on every draw.
+ * Sprites remain valid until @ref raw_display_shutdown
+ * @param rd Raw display to add the sprite to
+ * @param pixels Image data, as 0xAARRGGBB colours
+ * @param width Width in pixels of the image (at most 1024, unless this is
+ * the first sprite loaded)
+ * @param height Height in pixels of the image
+ * @param stride Number of bytes between rows of pixels, or 0 if they are
+ * tightly packed
+ * @return Sprite identifier (>= 0) on success, < 0 on failure
+ */
+int raw_display_sprite_load(struct raw_display *rd, const uint32_t *pixels,
+                            int width, int height, int stride);
+
+/**
+ * Set the colour which is treated as transparent when a sprite is drawn
+ * with RAW_DISPLAY_SPRITE_colour_key
+ * @param rd Raw display the sprite was loaded into
+ * @param sprite Sprite identifier from @ref raw_display_sprite_load
+ * @param colour Colour to skip. Only the red, green & blue are compared,
+ * so the alpha of neither it nor the sprite's pixels matters
+ * @return < 0 on failure, >= 0 on success
+ */
+int raw_display_sprite_set_colour_key(struct raw_display *rd, int sprite,
+                                      uint32_t colour);
+
+/**
+ * Draw a sprite from the atlas on the display
+ * @param rd Raw display to draw the sprite on
+ * @param sprite Sprite identifier from @ref raw_display_sprite_load
+ * @param x X offset of the top-left of the sprite
+ * @param y Y offset of the top-left of the sprite
+ * @param mode How to combine the sprite with what is already drawn
+ */
+void raw_display_draw_sprite(struct raw_display *rd, int sprite, int x, int y,
+                             enum raw_display_sprite_mode mode);
+
+/**
+ * A single sprite draw, for @ref raw_display_draw_sprites
+ */
+struct raw_display_sprite_draw {
+    int sprite;                         ///< Sprite identifier
+    int x;                              ///< X offset of the top-left
+    int y;                              ///< Y offset of the top-left
+    enum raw_display_sprite_mode mode; ///< How to combine the sprite
+};
+
+/**
+ * Draw a batch of sprites.
+ * Large batches are reordered so the display and atlas are accessed
+ * sequentially, so the result is only the same as drawing them one by one
+ * if overlapping sprites don't depend on the order they are drawn in
+ * @param rd Raw display to draw the sprites on
+ * @param draws Array of sprites to draw
+ * @param count Number of entries in draws
+ */
+void raw_display_draw_sprites(struct raw_display *rd,
+                              const struct raw_display_sprite_draw *draws,
+                              size_t count);
+
+/**
+ * How @ref raw_display_blit_scaled samples the source image
+ */
+enum raw_display_filter {
+    RAW_DISPLAY_FILTER_nearest,  ///< Use the closest source pixel
+    RAW_DISPLAY_FILTER_bilinear, ///< Blend the four closest source pixels
+};
+
+/**
+ * Draw an image onto the display, scaled to fit a destination rectangle.
+ * The result is clipped to the display (and any clip region)
+ * @param rd Raw display to draw on
+ * @param pixels Image data, as 0xAARRGGBB colours
+ * @param src_width Width in pixels of the image
+ * @param src_height Height in pixels of the image
+ * @param src_stride Number of bytes between rows of the image, or 0 if they
+ * are tightly packed
+ * @param x X offset of the top-left of the destination rectangle
+ * @param y Y offset of the top-left of the destination rectangle
+ * @param width Width of the destination rectangle
+ * @param height Height of the destination rectangle
+ * @param filter How to sample the image
+ * @return < 0 on failure, >= 0 on success
+ */
+int raw_display_blit_scaled(struct raw_display *rd, const uint32_t *pixels,
+                            int src_width, int src_height, int src_stride,
+                            int x, int y, int width, int height,
+                            enum raw_display_filter filter);
+
+/**
+ * Allow large drawing operations (such as @ref raw_display_blit_scaled and
+ * @ref raw_display_shade) to be split across several threads.
+ * The threads are started when first needed, and kept until the display is
+ * shut down or the number changes.
+ * Each call waits for all of its threads to finish before returning.
+ * Ignored on platforms without pthreads
+ * @param rd Raw display to configure
+ * @param threads Maximum number of threads to use, or 0/1 for none
+ * @return < 0 on failure, >= 0 on success
+ */
+int raw_display_set_threads(struct raw_display *rd, int threads);
+
+/**
+ * Name of the instruction set the pixel kernels (fills, sprite blending &
+ * format conversion) use: "scalar", "sse2", "avx2", "avx512" or "neon".
+ * The best one the CPU supports is picked when a display is created, unless
+ * the RAW_DISPLAY_ISA environment variable names another, which is useful
+ * for benchmarking each in turn
+ * @return Name of the instruction set
+ */
+const char *raw_display_isa(void);
+
+/**
+ * Colour maps for @ref raw_display_blit_field
+ */
+enum raw_display_colourmap {
+    RAW_DISPLAY_COLOURMAP_grey,    ///< Black to white
+    RAW_DISPLAY_COLOURMAP_viridis, ///< Perceptually uniform purple to yellow
+    RAW_DISPLAY_COLOURMAP_jet,     ///< Blue through cyan & yellow to red
+};
+
+/**
+ * Draw a 2D field of values onto the display, one pixel per value, shown
+ * through a colour map.
+ * Values are quantised into 4096 levels between lo & hi; anything
+ * outside that range (or NaN) is drawn as the nearest end of the map.
+ * The result is clipped to the display (and any clip region)
+ * @param rd Raw display to draw on
+ * @param data Field values
+ * @param width Number of values in each row of the field
+ * @param height Number of rows in the field
+ * @param stride Number of bytes between rows of the field, or 0 if they are
+ * tightly packed
+ * @param x X offset of the top-left of the field on the display
+ * @param y Y offset of the top-left of the field on the display
+ * @param lo Value shown as the start of the colour map
+ * @param hi Value shown as the end of the colour map
+ * @param colourmap Colour map to use
+ * @return < 0 on failure, >= 0 on success
+ */
+int raw_display_blit_field(struct raw_display *rd, const float *data,
+                           int width, int height, int stride, int x, int y,
+                           float lo, float hi,
+                           enum raw_display_colourmap colourmap);
+
+/**
+ * Callback for @ref raw_display_shade, which computes the colours of a run
+ * of pixels along one row.
+ * It is called from several threads at once, with the rows in no
+ * particular order, so must be safe to call that way
+ * @param user Pointer given to @ref raw_display_shade
+ * @param colours Area to store count 0xAARRGGBB colours in. For 32bpp
+ * targets this is the target's pixels themselves, so it can be written at
+ * full speed; otherwise its contents are undefined on entry
+ * @param x Column of the first pixel
+ * @param y Row of the pixels
+ * @param count Number of pixels
+ */
+typedef void (*raw_display_shade_func)(void *user, uint32_t *colours, int x,
+                                       int y, int count);
+
+/**
+ * Compute the colour of every pixel of a rectangle with a callback, which
+ * is called once for each row within the clip region.
+ * The rows are shared out across a pool of threads kept for the life of
+ * the display, up to the limit set by @ref raw_display_set_threads, in
+ * small bands which idle threads take from busy ones.
+ * Traces record the resulting pixels rather than the call
+ * @param rd Raw display to draw on
+ * @param x X offset of the top-left of the rectangle
+ * @param y Y offset of the top-left of the rectangle
+ * @param width Width of the rectangle
+ * @param height Height of the rectangle
+ * @param func Callback to compute each row's colours
+ * @param user Pointer passed to each call of func
+ * @return < 0 on failure, >= 0 on success
+ */
+int raw_display_shade(struct raw_display *rd, int x, int y, int width,
+                      int height, raw_display_shade_func func, void *user);
+
+/**
+ * How @ref raw_display_flip paces frames, once a target rate is set with
+ * @ref raw_display_set_target_fps
+ */
+enum raw_display_pacing {
+    /** Sleep until each frame is due, then show it */
+    RAW_DISPLAY_PACING_throughput,
+    /**
+     * As for throughput, but also delay returning from
+     * @ref raw_display_flip so that the next frame is finished just before
+     * it is due, based on how long recent frames took to draw.
+     * This minimises the time between drawing and showing a frame
+     */
+    RAW_DISPLAY_PACING_low_latency,
+};
+
+/**
+ * Limit the rate @ref raw_display_flip shows frames at.
+ * Frames are shown on a fixed schedule, so a late frame is followed by an
+ * early one, unless drawing falls more than a frame behind
+ * @param rd Raw display to pace
+ * @param fps Frames per second, or 0 to show frames as soon as possible
+ * @return < 0 on failure, >= 0 on success
+ */
+int raw_display_set_target_fps(struct raw_display *rd, double fps);
+
+/**
+ * Choose how frames are paced
+ * @param rd Raw display to configure
+ * @param mode Pacing strategy
+ * @param spin_us Number of microseconds before each deadline to stop
+ * sleeping and busy-wait instead. This trades CPU time for precision;
+ * 100-200 is usually enough on Linux, while Windows sleeps in whole
+ * milliseconds so needs more
+ * @return < 0 on failure, >= 0 on success
+ */
+int raw_display_set_pacing(struct raw_display *rd,
+                           enum raw_display_pacing mode, int spin_us);
+
+/**
+ * Horizontal alignment of the lines of a text block
+ */
+enum raw_display_align {
+    RAW_DISPLAY_ALIGN_left,
+    RAW_DISPLAY_ALIGN_centre,
+    RAW_DISPLAY_ALIGN_right,
+};
+
+/**
+ * A block of text which is laid out & rasterised once, then can be drawn
+ * repeatedly much more cheaply than @ref raw_display_draw_string
+ */
+struct raw_display_text;
+
+/**
+ * Create an (empty) text block
+ * @param size Height of the font, as for @ref raw_display_draw_string
+ * @param max_width Width in pixels to wrap lines at, or 0 to only break
+ * lines at newlines
+ * @param align How lines are aligned within the width of the block
+ * @return Text block on success, NULL on failure
+ */
+struct raw_display_text *
+raw_display_text_create(int size, int max_width,
+                        enum raw_display_align align);
+
+/**
+ * Release a text block
+ * @param text Text block to destroy
+ */
+void raw_display_text_destroy(struct raw_display_text *text);
+
+/**
+ * Change the contents of a text block. This does nothing if the string is
+ * the same as last time, so can be called every frame
+ * @param text Text block to change
+ * @param string ASCII text, with lines separated by '\n'
+ * @return < 0 on failure, >= 0 on success
+ */
+int raw_display_text_set(struct raw_display_text *text, const char *string);
+
+/**
+ * Determine the size of a text block
+ * @param text Text block to query
+ * @param width Area to store the width in pixels of the block
+ * @param height Area to store the height in pixels of the block
+ */
+void raw_display_text_info(const struct raw_display_text *text, int *width,
+                           int *height);
+
+/**
+ * Draw a text block, clipped to the display (and any clip region)
+ * @param rd Raw display to draw on
+ * @param text Text block to draw
+ * @param x X offset of the top-left of the block
+ * @param y Y offset of the top-left of the block
+ * @param colour Colour to draw the text as
+ */
+void raw_display_draw_text(struct raw_display *rd,
+                           const struct raw_display_text *text, int x, int y,
+                           uint32_t colour);
+
+/**
+ * A bitmap font loaded from a PC Screen Font (PSF1 or PSF2) file, as used
+ * by the Linux console
+ */
+struct raw_display_font;
+
+/**
+ * Load a PSF font. The file is mapped rather than read, so glyphs are only
+ * paged in once they are drawn, and fonts with many thousands of glyphs
+ * load quickly. Compressed (.psf.gz) fonts must be decompressed first.
+ * Glyphs may be up to 32 pixels wide & 64 pixels tall
+ * @param filename Font file to load. A bare file name that doesn't exist
+ * is also looked for in the console font directories
+ * (/usr/share/consolefonts & /usr/share/kbd/consolefonts)
+ * @return Font on success, NULL on failure
+ */
+struct raw_display_font *raw_display_font_load(const char *filename);
+
+/**
+ * Release a font loaded by @ref raw_display_font_load
+ * @param font Font to destroy
+ */
+void raw_display_font_destroy(struct raw_display_font *font);
+
+/**
+ * Determine the size of a font
+ * @param font Font to query
+ * @param width Area to store the width in pixels of each glyph
+ * @param height Area to store the height in pixels of each glyph
+ * @param glyphs Area to store the number of glyphs in the font
+ */
+void raw_display_font_info(const struct raw_display_font *font, int *width,
+                           int *height, int *glyphs);
+
+/**
+ * Draw a UTF-8 string using a loaded font, clipped to the display (and any
+ * clip region).
+ * Characters the font has no glyph for are drawn as U+FFFD or '?' if the
+ * font has either, and are otherwise left blank
+ * @param rd Raw display to draw on
+ * @param font Font to draw with
+ * @param scale Integer factor to enlarge each glyph by
+ * @param x X offset of the top-left of the string
+ * @param y Y offset of the top-left of the string
+ * @param string UTF-8 text to draw
+ * @param colour Colour to draw the text as
+ * @return < 0 on failure, otherwise the width in pixels of the string
+ */
+int raw_display_draw_string_font(struct raw_display *rd,
+                                 const struct raw_display_font *font,
+                                 int scale, int x, int y, const char *string,
+                                 uint32_t colour);
+
+/**
+ * Start recording every drawing call made on a display to a binary trace
+ * file, along with each flip and anything written directly to the frame.
+ * The trace can be replayed by the raw_display_replay tool, to reproduce
+ * and benchmark what an application drew.
+ * Tracing can also be started without changing an application, by setting
+ * the RAW_DISPLAY_TRACE environment variable to the file name.
+ * Direct writes are found by comparing the frame with a copy at the first
+ * call after each flip, at each flip, and over the rows each call is about
+ * to draw on, so they are replayed before the call which draws over them.
+ * Direct writes into a surface are found the same way, and also when it is
+ * made the target, stops being it or is blitted.
+ * Start tracing before loading sprites or creating surfaces, so the trace
+ * has everything needed to replay it
+ * @param rd Raw display to record
+ * @param filename File to write the trace to
+ * @return < 0 on failure, >= 0 on success
+ */
+int raw_display_trace_start(struct raw_display *rd, const char *filename);
+
+/**
+ * Finish recording a trace. This is also done by @ref raw_display_shutdown
+ * @param rd Raw display being recorded
+ * @return < 0 on failure (including failing to write the trace), >= 0 on
+ * success
+ */
+int raw_display_trace_stop(struct raw_display *rd);
+
+/** First word of a trace file ("RDTR") */
+#define RAW_DISPLAY_TRACE_MAGIC 0x52544452
+/** Second word of a trace file */
+#define RAW_DISPLAY_TRACE_VERSION 1
+
+/**
+ * Types of record in a trace file.
+ * A trace starts with 4 words: the magic number, the version and the width
+ * & height of the display. Each record is then a word holding its type, a
+ * word holding the number of bytes of arguments, and the arguments, padded
+ * with zeros to a whole number of words.
+ * Words are 32 bits, in the byte order of the machine that made the trace.
+ * Unless noted, the arguments are words, in the same order as those of the
+ * call. Handles take two words (low half first), and identify an object
+ * across records. Images and fields are tightly packed
+ */
+enum raw_display_trace_op {
+    RAW_DISPLAY_TRACE_flip = 1, ///< No arguments
+    /** y, rows, then width * rows 0xAARRGGBB colours written directly to
+     * the frame */
+    RAW_DISPLAY_TRACE_frame_rows,
+    RAW_DISPLAY_TRACE_clear,      ///< colour
+    RAW_DISPLAY_TRACE_fill_rows,  ///< y0, y1, colour
+    RAW_DISPLAY_TRACE_rectangle,  ///< x0, y0, x1, y1, colour, border_width
+    RAW_DISPLAY_TRACE_line,       ///< x0, y0, x1, y1, colour, line_width
+    RAW_DISPLAY_TRACE_circle,     ///< xc, yc, radius, colour, border_width
+    RAW_DISPLAY_TRACE_pixel,      ///< x, y, colour
+    RAW_DISPLAY_TRACE_string,     ///< size, x, y, colour, then the string
+    RAW_DISPLAY_TRACE_clip,       ///< x0, y0, x1, y1
+    RAW_DISPLAY_TRACE_reset_clip, ///< No arguments
+    /** count, colour_count, size, then xs, ys & colours */
+    RAW_DISPLAY_TRACE_points,
+    /** count, colour_count, size, then the transform (identity if none),
+     * xs, ys & colours. The transform, xs & ys are floats */
+    RAW_DISPLAY_TRACE_points_f,
+    /** Sprite identifier returned, width, height, then the image */
+    RAW_DISPLAY_TRACE_sprite_load,
+    RAW_DISPLAY_TRACE_sprite_colour_key, ///< sprite, colour
+    RAW_DISPLAY_TRACE_sprite,            ///< sprite, x, y, mode
+    /** count, then sprite, x, y & mode for each draw */
+    RAW_DISPLAY_TRACE_sprites,
+    /** src_width, src_height, x, y, width, height, filter, then the image */
+    RAW_DISPLAY_TRACE_blit_scaled,
+    /** width, height, x, y, min & max (floats), colourmap, then the field */
+    RAW_DISPLAY_TRACE_blit_field,
+    /** size, max_width, align, x, y, colour, the text block's handle, then
+     * its string */
+    RAW_DISPLAY_TRACE_text,
+    /** scale, x, y, colour, length of the font's file name, the font's
+     * handle, the file name, then the string */
+    RAW_DISPLAY_TRACE_string_font,
+    /** width, height, bpp, then the handle of the surface returned */
+    RAW_DISPLAY_TRACE_surface_create,
+    RAW_DISPLAY_TRACE_surface_destroy, ///< Surface handle
+    RAW_DISPLAY_TRACE_target,          ///< Surface handle, 0 for the frame
+    RAW_DISPLAY_TRACE_blit_surface,    ///< x, y, surface handle
+    /** x, y, width, rows, then width * rows 0xAARRGGBB colours written
+     * directly to the current target */
+    RAW_DISPLAY_TRACE_target_rows,
+};
+
+#if CONFIG_RAW_DISPLAY_REFERENCE
+/**
+ * Reference versions of @ref raw_display_draw_rectangle,
+ * @ref raw_display_draw_line, @ref raw_display_draw_circle and
+ * @ref raw_display_draw_string.
+ * These plot one pixel at a time with none of the clipping shortcuts, so
+ * are slow but should give exactly the same output. They exist to check the
+ * optimised routines against, and are only built when
+ * CONFIG_RAW_DISPLAY_REFERENCE is set to 1
+ */
+void raw_display_reference_draw_rectangle(struct raw_display *rd, int x0,
+                                          int y0, int x1, int y1,
+                                          uint32_t colour, int border_width);
+/** See @ref raw_display_reference_draw_rectangle */
+void raw_display_reference_draw_line(struct raw_display *rd, int x0, int y0,
+                                     int x1, int y1, uint32_t colour,
+                                     int line_width);
+/** See @ref raw_display_reference_draw_rectangle */
+void raw_display_reference_draw_circle(struct raw_display *rd, int xc,
+                                       int yc, int radius, uint32_t colour,
+                                       int border_width);
+/** See @ref raw_display_reference_draw_rectangle */
+int raw_display_reference_draw_string(struct raw_display *rd, int size,
+                                      int x, int y, const char *string,
+                                      uint32_t colour);
+/**
+ * Reference versions of @ref raw_display_draw_sprite,
+ * @ref raw_display_blit_surface and @ref raw_display_blit_scaled, which
+ * work out each pixel on its own without the SIMD pixel kernels, to check
+ * the kernels against
+ */
+void raw_display_reference_draw_sprite(struct raw_display *rd, int sprite,
+                                       int x, int y,
+                                       enum raw_display_sprite_mode mode);
+/** See @ref raw_display_reference_draw_sprite */
+void raw_display_reference_blit_surface(
+    struct raw_display *rd, const struct raw_display_surface *surface, int x,
+    int y);
+/** See @ref raw_display_reference_draw_sprite */
+int raw_display_reference_blit_scaled(struct raw_display *rd,
+                                      const uint32_t *pixels, int src_width,
+                                      int src_height, int src_stride, int x,
+                                      int y, int width, int height,
+                                      enum raw_display_filter filter);
+#endif
+
 #endif /* RAW_DISPLAY_H */
@@ -0,0 +1,1482 @@
+/*
+ * Replay a trace recorded with raw_display_trace_start against the dummy
+ * backend, as fast as possible, and report how long each type of call took.
+ * Usage: raw_display_replay [-n iterations] [-o frame.ppm] trace
+ *
+ * With -c, the trace is instead replayed twice side by side, once as normal
+ * and once with the reference (one pixel at a time) versions of the
+ * rectangle, line, circle, string, sprite & blit routines, and the results
+ * are compared after every record. With -r seed, a trace of -N random
+ * calls is made up to check, covering edges, off-screen coordinates, odd
+ * sizes, clipping, each sprite mode & filter and each surface format. On
+ * a mismatch the trace is cut down to as few records as still show it,
+ * which are listed and written to -m file.
+ * Usage: raw_display_replay -c [-m mismatch.rdt] trace
+ *        raw_display_replay -r seed [-N count] [-m mismatch.rdt]
+ *
+ * With -b, the bandwidth of clearing full HD frames with raw_display_clear
+ * & raw_display_fill_rows is measured instead, against memset over the
+ * same frames as the roofline.
+ * Usage: raw_display_replay -b [-n passes]
+ */
+#define _DEFAULT_SOURCE // clock_gettime & strdup
+#define CONFIG_RAW_DISPLAY_REFERENCE 1 // Declare the reference routines
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include "raw_display.h"
+
+#define OP_COUNT (RAW_DISPLAY_TRACE_target_rows + 1)
+
+static const char *const op_names[OP_COUNT] = {
+    [RAW_DISPLAY_TRACE_flip] = "flip",
+    [RAW_DISPLAY_TRACE_frame_rows] = "frame_rows",
+    [RAW_DISPLAY_TRACE_clear] = "clear",
+    [RAW_DISPLAY_TRACE_fill_rows] = "fill_rows",
+    [RAW_DISPLAY_TRACE_rectangle] = "rectangle",
+    [RAW_DISPLAY_TRACE_line] = "line",
+    [RAW_DISPLAY_TRACE_circle] = "circle",
+    [RAW_DISPLAY_TRACE_pixel] = "pixel",
+    [RAW_DISPLAY_TRACE_string] = "string",
+    [RAW_DISPLAY_TRACE_clip] = "clip",
+    [RAW_DISPLAY_TRACE_reset_clip] = "reset_clip",
+    [RAW_DISPLAY_TRACE_points] = "points",
+    [RAW_DISPLAY_TRACE_points_f] = "points_f",
+    [RAW_DISPLAY_TRACE_sprite_load] = "sprite_load",
+    [RAW_DISPLAY_TRACE_sprite_colour_key] = "sprite_colour_key",
+    [RAW_DISPLAY_TRACE_sprite] = "sprite",
+    [RAW_DISPLAY_TRACE_sprites] = "sprites",
+    [RAW_DISPLAY_TRACE_blit_scaled] = "blit_scaled",
+    [RAW_DISPLAY_TRACE_blit_field] = "blit_field",
+    [RAW_DISPLAY_TRACE_text] = "text",
+    [RAW_DISPLAY_TRACE_string_font] = "string_font",
+    [RAW_DISPLAY_TRACE_surface_create] = "surface_create",
+    [RAW_DISPLAY_TRACE_surface_destroy] = "surface_destroy",
+    [RAW_DISPLAY_TRACE_target] = "target",
+    [RAW_DISPLAY_TRACE_blit_surface] = "blit_surface",
+    [RAW_DISPLAY_TRACE_target_rows] = "target_rows",
+};
+
+/* An object created during the replay, keyed by its handle in the trace */
+struct object {
+    uint64_t handle;
+    void *object;
+    int size; // Text block settings, so a reused handle can be detected
+    int max_width;
+    int align;
+    char *filename; // Font file the object was loaded from
+};
+
+struct replay {
+    struct raw_display *rd;
+    int width;
+    int height;
+    bool reference; // Use the reference drawing routines
+
+    int *sprites; // Replayed sprite identifier for each one in the trace
+    int sprite_count;
+
+    struct object *surfaces;
+    int surface_count;
+    struct raw_display_surface *target; // Current target, NULL for the frame
+    struct object *texts;
+    int text_count;
+    struct object *fonts;
+    int font_count;
+
+    uint64_t calls[OP_COUNT];
+    int64_t time[OP_COUNT]; // Total time spent in each type of call, in ns
+};
+
+static int64_t now_ns(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER count, freq;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (int64_t)((double)count.QuadPart * 1e9 / freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint8_t *read_file(const char *filename, size_t *size)
+{
+    FILE *fp = fopen(filename, "rb");
+    uint8_t *data = NULL;
+    long length;
+
+    if (!fp)
+        return NULL;
+    if (fseek(fp, 0, SEEK_END) == 0 && (length = ftell(fp)) > 0 &&
+        fseek(fp, 0, SEEK_SET) == 0) {
+        data = malloc(length);
+        if (data && fread(data, 1, length, fp) != (size_t)length) {
+            free(data);
+            data = NULL;
+        }
+        *size = length;
+    }
+    fclose(fp);
+    return data;
+}
+
+static uint32_t word(const uint8_t *args, int index)
+{
+    uint32_t value;
+
+    memcpy(&value, args + index * 4, sizeof(value));
+    return value;
+}
+
+static float word_f(const uint8_t *args, int index)
+{
+    float value;
+
+    memcpy(&value, args + index * 4, sizeof(value));
+    return value;
+}
+
+static uint64_t handle(const uint8_t *args, int index)
+{
+    return word(args, index) | (uint64_t)word(args, index + 1) << 32;
+}
+
+static char *copy_string(const uint8_t *args, size_t length)
+{
+    char *copy = malloc(length + 1);
+
+    if (copy) {
+        memcpy(copy, args, length);
+        copy[length] = '\0';
+    }
+    return copy;
+}
+
+static struct object *find_object(struct object *objects, int count,
+                                  uint64_t handle)
+{
+    for (int i = 0; i < count; i++)
+        if (objects[i].handle == handle)
+            return &objects[i];
+    return NULL;
+}
+
+static struct object *add_object(struct object **objects, int *count,
+                                 uint64_t handle)
+{
+    struct object *object = find_object(*objects, *count, handle);
+
+    if (object)
+        return object;
+    object = realloc(*objects, (*count + 1) * sizeof(*object));
+    if (!object)
+        return NULL;
+    *objects = object;
+    object = &object[(*count)++];
+    memset(object, 0, sizeof(*object));
+    object->handle = handle;
+    return object;
+}
+
+static struct raw_display_surface *find_surface(struct replay *replay,
+                                                uint64_t handle)
+{
+    struct object *object =
+        find_object(replay->surfaces, replay->surface_count, handle);
+
+    return object ? object->object : NULL;
+}
+
+static int find_sprite(const struct replay *replay, uint32_t sprite)
+{
+    return sprite < (uint32_t)replay->sprite_count ? replay->sprites[sprite]
+                                                   : -1;
+}
+
+/* Get the text block for a handle, (re)creating it if needed */
+static struct raw_display_text *get_text(struct replay *replay,
+                                         uint64_t handle, int size,
+                                         int max_width, int align)
+{
+    struct object *object =
+        add_object(&replay->texts, &replay->text_count, handle);
+
+    if (!object)
+        return NULL;
+    if (object->object && (object->size != size ||
+                           object->max_width != max_width ||
+                           object->align != align)) {
+        raw_display_text_destroy(object->object);
+        object->object = NULL;
+    }
+    if (!object->object) {
+        object->object = raw_display_text_create(size, max_width, align);
+        object->size = size;
+        object->max_width = max_width;
+        object->align = align;
+    }
+    return object->object;
+}
+
+/* Get the font for a handle, loading it if needed */
+static struct raw_display_font *get_font(struct replay *replay,
+                                         uint64_t handle,
+                                         const char *filename)
+{
+    struct object *object =
+        add_object(&replay->fonts, &replay->font_count, handle);
+
+    if (!object)
+        return NULL;
+    if (object->filename && strcmp(object->filename, filename) == 0)
+        return object->object;
+    raw_display_font_destroy(object->object);
+    free(object->filename);
+    object->object = raw_display_font_load(filename);
+    object->filename = strdup(filename);
+    if (!object->object)
+        fprintf(stderr, "Unable to load font %s\n", filename);
+    return object->object;
+}
+
+/* Write rows of colours straight into a view, whatever the clip region
+ * is */
+static void replay_rows(const struct raw_display_view *view, int x, int y,
+                        int width, int rows, const uint8_t *colours)
+{
+    if (x < 0 || y < 0 || width < 0 || rows < 0 ||
+        (int64_t)x + width > view->width || (int64_t)y + rows > view->height)
+        return;
+    for (int row = 0; row < rows; row++) {
+        const uint8_t *src = colours + (size_t)row * width * 4;
+        if (view->bpp == 32) {
+            memcpy(raw_display_row(view, y + row) + (size_t)x * 4, src,
+                   (size_t)width * 4);
+            continue;
+        }
+        for (int i = 0; i < width; i++)
+            raw_display_span_fill(view, x + i, y + row, 1,
+                                  raw_display_native_colour(view,
+                                                            word(src, i)));
+    }
+}
+
+/* Straight into the frame, whatever the target is */
+static void replay_frame_rows(struct replay *replay, int y, int rows,
+                              const uint8_t *colours)
+{
+    struct raw_display_view view;
+
+    if (raw_display_get_view(replay->rd, &view) < 0)
+        return;
+    replay_rows(&view, 0, y, replay->width, rows, colours);
+}
+
+/**
+ * Make the call described by one record
+ * @return < 0 if the record is malformed
+ */
+static int replay_record(struct replay *replay, uint32_t op,
+                         const uint8_t *args, size_t size)
+{
+    static const int min_words[OP_COUNT] = {
+        [RAW_DISPLAY_TRACE_frame_rows] = 2,
+        [RAW_DISPLAY_TRACE_clear] = 1,
+        [RAW_DISPLAY_TRACE_fill_rows] = 3,
+        [RAW_DISPLAY_TRACE_rectangle] = 6,
+        [RAW_DISPLAY_TRACE_line] = 6,
+        [RAW_DISPLAY_TRACE_circle] = 5,
+        [RAW_DISPLAY_TRACE_pixel] = 3,
+        [RAW_DISPLAY_TRACE_string] = 4,
+        [RAW_DISPLAY_TRACE_clip] = 4,
+        [RAW_DISPLAY_TRACE_points] = 3,
+        [RAW_DISPLAY_TRACE_points_f] = 7,
+        [RAW_DISPLAY_TRACE_sprite_load] = 3,
+        [RAW_DISPLAY_TRACE_sprite_colour_key] = 2,
+        [RAW_DISPLAY_TRACE_sprite] = 4,
+        [RAW_DISPLAY_TRACE_sprites] = 1,
+        [RAW_DISPLAY_TRACE_blit_scaled] = 7,
+        [RAW_DISPLAY_TRACE_blit_field] = 7,
+        [RAW_DISPLAY_TRACE_text] = 8,
+        [RAW_DISPLAY_TRACE_string_font] = 7,
+        [RAW_DISPLAY_TRACE_surface_create] = 5,
+        [RAW_DISPLAY_TRACE_surface_destroy] = 2,
+        [RAW_DISPLAY_TRACE_target] = 2,
+        [RAW_DISPLAY_TRACE_blit_surface] = 4,
+        [RAW_DISPLAY_TRACE_target_rows] = 4,
+    };
+    struct raw_display *rd = replay->rd;
+    size_t words = size / 4;
+    void *temp = NULL;
+    char *s = NULL;
+    int ret = 0;
+
+    if (op == 0 || op >= OP_COUNT || words < (size_t)min_words[op])
+        return -EINVAL;
+
+    switch (op) {
+    case RAW_DISPLAY_TRACE_flip:
+        raw_display_flip(rd);
+        break;
+    case RAW_DISPLAY_TRACE_frame_rows: {
+        int rows = word(args, 1);
+
+        if (rows < 0 ||
+            size != 8 + (size_t)rows * replay->width * sizeof(uint32_t))
+            return -EINVAL;
+        replay_frame_rows(replay, word(args, 0), rows, args + 8);
+        break;
+    }
+    case RAW_DISPLAY_TRACE_clear:
+        raw_display_clear(rd, word(args, 0));
+        break;
+    case RAW_DISPLAY_TRACE_fill_rows:
+        raw_display_fill_rows(rd, word(args, 0), word(args, 1),
+                              word(args, 2));
+        break;
+    case RAW_DISPLAY_TRACE_rectangle:
+        (replay->reference ? raw_display_reference_draw_rectangle
+                           : raw_display_draw_rectangle)(
+            rd, word(args, 0), word(args, 1), word(args, 2), word(args, 3),
+            word(args, 4), word(args, 5));
+        break;
+    case RAW_DISPLAY_TRACE_line:
+        (replay->reference ? raw_display_reference_draw_line
+                           : raw_display_draw_line)(
+            rd, word(args, 0), word(args, 1), word(args, 2), word(args, 3),
+            word(args, 4), word(args, 5));
+        break;
+    case RAW_DISPLAY_TRACE_circle:
+        (replay->reference ? raw_display_reference_draw_circle
+                           : raw_display_draw_circle)(
+            rd, word(args, 0), word(args, 1), word(args, 2), word(args, 3),
+            word(args, 4));
+        break;
+    case RAW_DISPLAY_TRACE_pixel:
+        raw_display_set_pixel(rd, word(args, 0), word(args, 1),
+                              word(args, 2));
+        break;
+    case RAW_DISPLAY_TRACE_string:
+        s = copy_string(args + 16, size - 16);
+        (replay->reference ? raw_display_reference_draw_string
+                           : raw_display_draw_string)(
+            rd, word(args, 0), word(args, 1), word(args, 2), s,
+            word(args, 3));
+        break;
+    case RAW_DISPLAY_TRACE_clip:
+        raw_display_set_clip(rd, word(args, 0), word(args, 1), word(args, 2),
+                             word(args, 3));
+        break;
+    case RAW_DISPLAY_TRACE_reset_clip:
+        raw_display_reset_clip(rd);
+        break;
+    case RAW_DISPLAY_TRACE_points:
+    case RAW_DISPLAY_TRACE_points_f: {
+        size_t count = word(args, 0), colour_count = word(args, 1);
+        size_t offset = op == RAW_DISPLAY_TRACE_points_f ? 28 : 12;
+        struct raw_display_transform transform;
+        const uint32_t *colours;
+        const void *xs, *ys;
+
+        if (size != offset + (2 * count + colour_count) * 4)
+            return -EINVAL;
+        xs = args + offset;
+        ys = args + offset + count * 4;
+        colours = (const uint32_t *)(args + offset + count * 8);
+        if (op == RAW_DISPLAY_TRACE_points) {
+            raw_display_draw_points(rd, xs, ys, colours, colour_count, count,
+                                    word(args, 2));
+            break;
+        }
+        memcpy(&transform, args + 12, sizeof(transform));
+        raw_display_draw_points_f(rd, xs, ys, colours, colour_count, count,
+                                  word(args, 2), &transform);
+        break;
+    }
+    case RAW_DISPLAY_TRACE_sprite_load: {
+        uint32_t sprite = word(args, 0);
+        int width = word(args, 1), height = word(args, 2);
+
+        if (sprite > 1 << 20 || width <= 0 || height <= 0 ||
+            size != 12 + (size_t)width * height * 4)
+            return -EINVAL;
+        if (sprite >= (uint32_t)replay->sprite_count) {
+            int *sprites = realloc(replay->sprites,
+                                   (sprite + 1) * sizeof(*sprites));
+            if (!sprites)
+                return -ENOMEM;
+            for (uint32_t i = replay->sprite_count; i <= sprite; i++)
+                sprites[i] = -1;
+            replay->sprites = sprites;
+            replay->sprite_count = sprite + 1;
+        }
+        replay->sprites[sprite] = raw_display_sprite_load(
+            rd, (const uint32_t *)(args + 12), width, height, 0);
+        break;
+    }
+    case RAW_DISPLAY_TRACE_sprite_colour_key:
+        raw_display_sprite_set_colour_key(
+            rd, find_sprite(replay, word(args, 0)), word(args, 1));
+        break;
+    case RAW_DISPLAY_TRACE_sprite:
+        (replay->reference ? raw_display_reference_draw_sprite
+                           : raw_display_draw_sprite)(
+            rd, find_sprite(replay, word(args, 0)), word(args, 1),
+            word(args, 2), word(args, 3));
+        break;
+    case RAW_DISPLAY_TRACE_sprites: {
+        size_t count = word(args, 0);
+        struct raw_display_sprite_draw *draws;
+
+        if (size != 4 + count * 16)
+            return -EINVAL;
+        draws = temp = malloc((count ? count : 1) * sizeof(*draws));
+        if (!draws)
+            return -ENOMEM;
+        for (size_t i = 0; i < count; i++) {
+            draws[i].sprite = find_sprite(replay, word(args, 1 + i * 4));
+            draws[i].x = word(args, 2 + i * 4);
+            draws[i].y = word(args, 3 + i * 4);
+            draws[i].mode = word(args, 4 + i * 4);
+        }
+        if (!replay->reference)
+            raw_display_draw_sprites(rd, draws, count);
+        else
+            for (size_t i = 0; i < count; i++)
+                raw_display_reference_draw_sprite(rd, draws[i].sprite,
+                                                  draws[i].x, draws[i].y,
+                                                  draws[i].mode);
+        break;
+    }
+    case RAW_DISPLAY_TRACE_blit_scaled: {
+        int width = word(args, 0), height = word(args, 1);
+
+        if (width <= 0 || height <= 0 ||
+            size != 28 + (size_t)width * height * 4)
+            return -EINVAL;
+        (replay->reference ? raw_display_reference_blit_scaled
+                           : raw_display_blit_scaled)(
+            rd, (const uint32_t *)(args + 28), width, height, 0,
+            word(args, 2), word(args, 3), word(args, 4), word(args, 5),
+            word(args, 6));
+        break;
+    }
+    case RAW_DISPLAY_TRACE_blit_field: {
+        int width = word(args, 0), height = word(args, 1);
+
+        if (width <= 0 || height <= 0 ||
+            size != 28 + (size_t)width * height * 4)
+            return -EINVAL;
+        raw_display_blit_field(rd, (const float *)(args + 28), width,
+                               height, 0, word(args, 2),
+                               word(args, 3), word_f(args, 4),
+                               word_f(args, 5), word(args, 6));
+        break;
+    }
+    case RAW_DISPLAY_TRACE_text: {
+        struct raw_display_text *text =
+            get_text(replay, handle(args, 6), word(args, 0), word(args, 1),
+                     word(args, 2));
+
+        s = copy_string(args + 32, size - 32);
+        if (text && s && raw_display_text_set(text, s) >= 0)
+            raw_display_draw_text(rd, text, word(args, 3), word(args, 4),
+                                  word(args, 5));
+        break;
+    }
+    case RAW_DISPLAY_TRACE_string_font: {
+        size_t name = word(args, 4);
+        struct raw_display_font *font;
+
+        if (size < 28 + name)
+            return -EINVAL;
+        s = copy_string(args + 28, name);
+        font = s ? get_font(replay, handle(args, 5), s) : NULL;
+        free(s);
+        s = copy_string(args + 28 + name, size - 28 - name);
+        if (font && s)
+            raw_display_draw_string_font(rd, font, word(args, 0),
+                                         word(args, 1), word(args, 2), s,
+                                         word(args, 3));
+        break;
+    }
+    case RAW_DISPLAY_TRACE_surface_create: {
+        struct object *object = add_object(
+            &replay->surfaces, &replay->surface_count, handle(args, 3));
+
+        if (!object)
+            return -ENOMEM;
+        object->object = raw_display_surface_create(
+            rd, word(args, 0), word(args, 1), word(args, 2));
+        break;
+    }
+    case RAW_DISPLAY_TRACE_surface_destroy: {
+        struct object *object = find_object(
+            replay->surfaces, replay->surface_count, handle(args, 0));
+
+        if (object) {
+            if (replay->target == object->object)
+                replay->target = NULL;
+            raw_display_surface_destroy(rd, object->object);
+            object->object = NULL;
+        }
+        break;
+    }
+    case RAW_DISPLAY_TRACE_target:
+        replay->target = find_surface(replay, handle(args, 0));
+        raw_display_set_target(rd, replay->target);
+        break;
+    case RAW_DISPLAY_TRACE_blit_surface:
+        (replay->reference ? raw_display_reference_blit_surface
+                           : raw_display_blit_surface)(
+            rd, find_surface(replay, handle(args, 2)), word(args, 0),
+            word(args, 1));
+        break;
+    case RAW_DISPLAY_TRACE_target_rows: {
+        int width = word(args, 2), rows = word(args, 3);
+        struct raw_display_view view;
+
+        if (width < 0 || rows < 0 ||
+            size != 16 + (size_t)width * rows * sizeof(uint32_t))
+            return -EINVAL;
+        if ((replay->target
+                 ? raw_display_surface_get_view(replay->target, &view)
+                 : raw_display_get_view(rd, &view)) >= 0)
+            replay_rows(&view, word(args, 0), word(args, 1), width, rows,
+                        args + 16);
+        break;
+    }
+    }
+
+    free(temp);
+    free(s);
+    return ret;
+}
+
+/**
+ * Replay every record in a trace, timing each call
+ * @return < 0 if the trace is malformed
+ */
+static int replay_trace(struct replay *replay, const uint8_t *data,
+                        size_t size)
+{
+    size_t pos = 16;
+
+    while (pos < size) {
+        uint32_t op, length;
+        int64_t start;
+        int ret;
+
+        if (size - pos < 8)
+            return -EINVAL;
+        op = word(data + pos, 0);
+        length = word(data + pos, 1);
+        pos += 8;
+        if (length > size - pos)
+            return -EINVAL;
+
+        start = now_ns();
+        ret = replay_record(replay, op, data + pos, length);
+        if (ret < 0) {
+            fprintf(stderr, "Bad %s record at offset %zu\n",
+                    op < OP_COUNT && op_names[op] ? op_names[op] : "unknown",
+                    pos - 8);
+            return ret;
+        }
+        replay->time[op] += now_ns() - start;
+        replay->calls[op]++;
+        /* Records are padded to whole words, except perhaps the last */
+        pos += length + (-length & 3);
+    }
+    return 0;
+}
+
+static void print_report(const struct replay *replay, int64_t total)
+{
+    printf("Pixel kernels: %s\n", raw_display_isa());
+    printf("%-18s %10s %12s %12s %7s\n", "call", "count", "total ms",
+           "avg us", "share");
+    for (int op = 1; op < OP_COUNT; op++) {
+        if (!replay->calls[op])
+            continue;
+        printf("%-18s %10llu %12.3f %12.3f %6.1f%%\n", op_names[op],
+               (unsigned long long)replay->calls[op], replay->time[op] / 1e6,
+               replay->time[op] / 1e3 / replay->calls[op],
+               total ? replay->time[op] * 100.0 / total : 0.0);
+    }
+    printf("%-18s %10s %12.3f\n", "total", "", total / 1e6);
+}
+
+/* Free everything the replay made, including the display it drew on */
+static void free_replay(struct replay *replay)
+{
+    for (int i = 0; i < replay->text_count; i++)
+        raw_display_text_destroy(replay->texts[i].object);
+    for (int i = 0; i < replay->font_count; i++) {
+        raw_display_font_destroy(replay->fonts[i].object);
+        free(replay->fonts[i].filename);
+    }
+    free(replay->texts);
+    free(replay->fonts);
+    free(replay->surfaces);
+    free(replay->sprites);
+    if (replay->rd)
+        raw_display_shutdown(replay->rd);
+    replay->texts = replay->fonts = replay->surfaces = NULL;
+    replay->text_count = replay->font_count = replay->surface_count = 0;
+    replay->sprites = NULL;
+    replay->sprite_count = 0;
+    replay->rd = NULL;
+}
+
+/* One record of a trace, pointing into the trace's data */
+struct record {
+    uint32_t op;
+    uint32_t size;
+    const uint8_t *args;
+};
+
+/**
+ * Find the records in a trace
+ * @return Number of records, or < 0 if the trace is malformed
+ */
+static int index_trace(const uint8_t *data, size_t size,
+                       struct record **records)
+{
+    size_t pos = 16;
+    int count = 0, capacity = 0;
+
+    *records = NULL;
+    while (pos < size) {
+        uint32_t length;
+
+        if (size - pos < 8 || (length = word(data + pos, 1)) > size - pos - 8)
+            return -EINVAL;
+        if (count == capacity) {
+            struct record *grown;
+
+            capacity = capacity ? capacity * 2 : 256;
+            grown = realloc(*records, capacity * sizeof(*grown));
+            if (!grown)
+                return -ENOMEM;
+            *records = grown;
+        }
+        (*records)[count].op = word(data + pos, 0);
+        (*records)[count].size = length;
+        (*records)[count].args = data + pos + 8;
+        count++;
+        pos += 8 + length + (-length & 3);
+    }
+    return count;
+}
+
+static int write_trace(const char *filename, int width, int height,
+                       const struct record *records, int count)
+{
+    static const uint8_t padding[4];
+    uint32_t header[4] = {RAW_DISPLAY_TRACE_MAGIC, RAW_DISPLAY_TRACE_VERSION,
+                          width, height};
+    FILE *fp = fopen(filename, "wb");
+    int ret = 0;
+
+    if (!fp)
+        return -errno;
+    fwrite(header, sizeof(header), 1, fp);
+    for (int i = 0; i < count; i++) {
+        uint32_t words[2] = {records[i].op, records[i].size};
+
+        fwrite(words, sizeof(words), 1, fp);
+        fwrite(records[i].args, 1, records[i].size, fp);
+        fwrite(padding, 1, -records[i].size & 3, fp);
+    }
+    if (ferror(fp))
+        ret = -EIO;
+    if (fclose(fp) != 0)
+        ret = -EIO;
+    return ret;
+}
+
+static void print_record(const struct record *record)
+{
+    /* Number of words to show, and which one is a colour */
+    static const struct {
+        int words;
+        int colour;
+    } layouts[OP_COUNT] = {
+        [RAW_DISPLAY_TRACE_clear] = {1, 0},
+        [RAW_DISPLAY_TRACE_fill_rows] = {3, 2},
+        [RAW_DISPLAY_TRACE_rectangle] = {6, 4},
+        [RAW_DISPLAY_TRACE_line] = {6, 4},
+        [RAW_DISPLAY_TRACE_circle] = {5, 3},
+        [RAW_DISPLAY_TRACE_pixel] = {3, 2},
+        [RAW_DISPLAY_TRACE_string] = {4, 3},
+        [RAW_DISPLAY_TRACE_clip] = {4, -1},
+        [RAW_DISPLAY_TRACE_surface_create] = {4, -1},
+        [RAW_DISPLAY_TRACE_target] = {1, -1},
+        [RAW_DISPLAY_TRACE_blit_surface] = {3, -1},
+    };
+    uint32_t op = record->op < OP_COUNT ? record->op : 0;
+    int count = layouts[op].words;
+
+    if (count * 4 > (int)record->size)
+        count = 0;
+    printf("  %s", op_names[op] ? op_names[op] : "unknown");
+    for (int i = 0; i < count; i++) {
+        uint32_t value = word(record->args, i);
+
+        if (i == layouts[op].colour)
+            printf(" 0x%08x", value);
+        else
+            printf(" %d", (int32_t)value);
+    }
+    if (op == RAW_DISPLAY_TRACE_string) {
+        printf(" \"");
+        for (uint32_t i = 16; i < record->size; i++) {
+            uint8_t ch = record->args[i];
+            bool plain = ch >= 32 && ch < 127 && ch != '"' && ch != '\\';
+
+            printf(plain ? "%c" : "\\x%02x", ch);
+        }
+        printf("\"");
+    }
+    printf("\n");
+}
+
+/**
+ * Find the first pixel that differs between two blocks of pixels
+ * @return true if they differ
+ */
+static bool compare_pixels(const uint8_t *a, const uint8_t *b, int width,
+                           int height, int bpp, int stride, int *x, int *y)
+{
+    for (int row = 0; row < height; row++) {
+        const uint8_t *ra = a + (size_t)row * stride;
+        const uint8_t *rb = b + (size_t)row * stride;
+
+        if (memcmp(ra, rb, (size_t)width * bpp / 8) == 0)
+            continue;
+        for (*x = 0; !memcmp(ra + *x * bpp / 8, rb + *x * bpp / 8, bpp / 8);)
+            (*x)++;
+        *y = row;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Compare the frames, and each surface, of two replays of the same records
+ * @return true if they differ, with where in the remaining arguments
+ */
+static bool compare_replays(const struct replay *a, const struct replay *b,
+                            const char **where, int *x, int *y)
+{
+    int width, height, bpp, stride;
+
+    raw_display_info(a->rd, &width, &height, &bpp, &stride);
+    *where = "frame";
+    if (compare_pixels(raw_display_get_frame(a->rd),
+                       raw_display_get_frame(b->rd), width, height, bpp,
+                       stride, x, y))
+        return true;
+    for (int i = 0; i < a->surface_count && i < b->surface_count; i++) {
+        const struct raw_display_surface *sa = a->surfaces[i].object;
+        const struct raw_display_surface *sb = b->surfaces[i].object;
+
+        if (!sa || !sb)
+            continue;
+        raw_display_surface_info(sa, &width, &height, &bpp, &stride);
+        *where = bpp == 16 ? "16bpp surface"
+                           : bpp == 24 ? "24bpp surface" : "32bpp surface";
+        if (compare_pixels(raw_display_surface_get_pixels(sa),
+                           raw_display_surface_get_pixels(sb), width, height,
+                           bpp, stride, x, y))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Replay records with both the normal and the reference drawing routines,
+ * comparing the results after each one
+ * @param verbose Report the first difference found
+ * @return Index of the first record after which the results differ, count
+ * if they never do, or < 0 on error
+ */
+static int check_records(int width, int height, const struct record *records,
+                         int count, bool verbose)
+{
+    struct raw_display_config config = {.frame_count = 1};
+    struct replay normal = {.width = width, .height = height};
+    struct replay reference = {.width = width, .height = height};
+    int ret = count;
+
+    reference.reference = true;
+    normal.rd = raw_display_init_config("Check", width, height, &config);
+    reference.rd = raw_display_init_config("Reference", width, height,
+                                           &config);
+    if (!normal.rd || !reference.rd)
+        ret = -ENOMEM;
+    for (int i = 0; ret == count && i < count; i++) {
+        const char *where;
+        int x, y;
+
+        if (replay_record(&normal, records[i].op, records[i].args,
+                          records[i].size) < 0 ||
+            replay_record(&reference, records[i].op, records[i].args,
+                          records[i].size) < 0) {
+            ret = -EINVAL;
+        } else if (compare_replays(&normal, &reference, &where, &x, &y)) {
+            ret = i;
+            if (verbose)
+                printf("%s differs from the reference at %d,%d\n", where, x,
+                       y);
+        }
+    }
+
+    free_replay(&normal);
+    free_replay(&reference);
+    return ret;
+}
+
+/**
+ * Cut down a list of records that shows a mismatch, by repeatedly
+ * removing chunks of records while the mismatch remains, halving the
+ * chunk size whenever none can be removed
+ * @return Number of records left at the start of records
+ */
+static int minimise_records(int width, int height, struct record *records,
+                            int count)
+{
+    struct record *trial = malloc(count * sizeof(*trial));
+
+    if (!trial)
+        return count;
+    for (int chunk = count / 2; chunk >= 1;) {
+        bool removed = false;
+
+        for (int start = 0; start < count && count > 1;) {
+            int end = start + chunk < count ? start + chunk : count;
+            int kept = count - (end - start);
+            int ret;
+
+            memcpy(trial, records, start * sizeof(*trial));
+            memcpy(trial + start, records + end,
+                   (count - end) * sizeof(*trial));
+            ret = check_records(width, height, trial, kept, false);
+            if (ret >= 0 && ret < kept) {
+                /* Anything after the mismatch is irrelevant too */
+                count = ret + 1;
+                memcpy(records, trial, count * sizeof(*records));
+                removed = true;
+            } else {
+                start = end;
+            }
+        }
+        if (!removed)
+            chunk /= 2;
+        else if (chunk > count / 2)
+            chunk = count / 2 ? count / 2 : 1;
+    }
+    free(trial);
+    return count;
+}
+
+/* Growable buffer a random trace is written into */
+struct buffer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+};
+
+static int buffer_append(struct buffer *buffer, const void *data,
+                         size_t size)
+{
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        uint8_t *grown;
+
+        while (capacity < buffer->size + size)
+            capacity *= 2;
+        grown = realloc(buffer->data, capacity);
+        if (!grown)
+            return -ENOMEM;
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return 0;
+}
+
+/* Append a record of count words, followed by length bytes of data */
+static int append_record(struct buffer *buffer, uint32_t op,
+                         const int32_t *words, int count, const void *data,
+                         size_t length)
+{
+    static const uint8_t padding[4];
+    uint32_t header[2] = {op, count * 4 + length};
+    int ret;
+
+    ret = buffer_append(buffer, header, sizeof(header));
+    if (ret == 0)
+        ret = buffer_append(buffer, words, count * 4);
+    if (ret == 0 && length)
+        ret = buffer_append(buffer, data, length);
+    if (ret == 0)
+        ret = buffer_append(buffer, padding, -length & 3);
+    return ret;
+}
+
+/* xorshift64*, so a seed gives the same trace everywhere */
+static uint32_t random_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (uint32_t)((*state * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+/* Random number from lo to hi inclusive */
+static int random_range(uint64_t *state, int lo, int hi)
+{
+    return lo + (int)(random_next(state) % (uint32_t)(hi - lo + 1));
+}
+
+/**
+ * Random coordinate along an axis of limit pixels, mostly on screen but
+ * often on or just past an edge, or far off it. Coordinates stay within a
+ * few screens, so the reference routines don't take forever
+ */
+static int random_coordinate(uint64_t *state, int limit)
+{
+    switch (random_next(state) % 8) {
+    case 0: {
+        const int edges[] = {-1, 0, limit - 1, limit};
+        return edges[random_next(state) % 4];
+    }
+    case 1:
+        return random_range(state, -4 * limit, 5 * limit);
+    case 2:
+        return random_range(state, -limit / 4, limit + limit / 4);
+    default:
+        return random_range(state, 0, limit - 1);
+    }
+}
+
+/* Largest sprite, or source of a scaled blit, in a random trace */
+#define RANDOM_IMAGE_SIZE 32
+/* Most sprites in a random batch, few enough that they are drawn in order */
+#define RANDOM_BATCH 8
+/* Colour key of the random sprites, which some of their pixels have */
+#define RANDOM_KEY 0xffff00ff
+
+/* Random pixels, with plenty that are fully transparent, opaque or the
+ * colour key */
+static void random_pixels(uint64_t *state, uint32_t *pixels, int count)
+{
+    for (int i = 0; i < count; i++) {
+        uint32_t colour = random_next(state);
+
+        switch (random_next(state) % 4) {
+        case 0:
+            colour &= 0xffffff;
+            break;
+        case 1:
+            colour |= 0xff000000;
+            break;
+        case 2:
+            colour = RANDOM_KEY;
+            break;
+        }
+        pixels[i] = colour;
+    }
+}
+
+/* Load a random sprite, with a colour key set on every other one */
+static int random_sprite_load(struct buffer *buffer, uint64_t *state,
+                              int sprite)
+{
+    uint32_t pixels[RANDOM_IMAGE_SIZE * RANDOM_IMAGE_SIZE];
+    int32_t words[3] = {sprite, random_range(state, 1, RANDOM_IMAGE_SIZE),
+                        random_range(state, 1, RANDOM_IMAGE_SIZE)};
+    int ret;
+
+    random_pixels(state, pixels, words[1] * words[2]);
+    ret = append_record(buffer, RAW_DISPLAY_TRACE_sprite_load, words, 3,
+                        pixels, (size_t)words[1] * words[2] * 4);
+    if (ret == 0 && sprite % 2) {
+        /* Only the RGB of the key counts */
+        words[1] =
+            (random_next(state) & 0xff000000) | (RANDOM_KEY & 0xffffff);
+        ret = append_record(buffer, RAW_DISPLAY_TRACE_sprite_colour_key,
+                            words, 2, NULL, 0);
+    }
+    return ret;
+}
+
+/* Random draw of one of the sprites loaded, or now & then of one that
+ * isn't */
+static void random_sprite_draw(uint64_t *state, int32_t *words, int sprites,
+                               int width, int height)
+{
+    words[0] = random_next(state) % 16 ? random_range(state, 0, sprites - 1)
+                                       : random_range(state, -1, sprites);
+    words[1] = random_coordinate(state, width);
+    words[2] = random_coordinate(state, height);
+    words[3] = random_next(state) % 3;
+}
+
+/**
+ * Make up a trace of random calls to the routines that have reference
+ * versions, along with clipping, clearing, changes of target and sprite
+ * loads
+ * @return Trace data, which must be freed, or NULL on failure
+ */
+static uint8_t *random_trace(uint64_t seed, int count, int width, int height,
+                             size_t *size)
+{
+    /* Valid sizes are multiples of 8, but make sure the others fail the
+     * same way */
+    static const int sizes[] = {8, 8, 16, 16, 24, 32, 40, 48, 64, 0, 12, -8};
+    static const int bpps[] = {16, 24, 32};
+    uint32_t header[4] = {RAW_DISPLAY_TRACE_MAGIC, RAW_DISPLAY_TRACE_VERSION,
+                          width, height};
+    uint64_t state = seed * 2 + 1; // xorshift needs a non-zero state
+    struct buffer buffer = {0};
+    int ret = buffer_append(&buffer, header, sizeof(header));
+    int sprites = 0;
+
+    /* Surfaces of each format, with handles 1 to 3, to draw into as well
+     * as the frame. Making them a different size to the frame catches
+     * mixing up the two */
+    for (int i = 0; ret == 0 && i < 3; i++) {
+        int32_t words[] = {width - 7 + i * 5, height + 3 - i * 5, bpps[i],
+                           i + 1, 0};
+        ret = append_record(&buffer, RAW_DISPLAY_TRACE_surface_create, words,
+                            5, NULL, 0);
+    }
+    /* A few sprites to start with, and more loaded as it goes */
+    while (ret == 0 && sprites < 4)
+        ret = random_sprite_load(&buffer, &state, sprites++);
+
+    for (int i = 0; ret == 0 && i < count; i++) {
+        int choice = random_next(&state) % 100;
+        uint32_t colour = random_next(&state);
+        int32_t words[1 + 4 * RANDOM_BATCH];
+
+        if (choice < 20) {
+            int line_width = random_next(&state) % 3 == 0
+                                 ? random_range(&state, -2, 1)
+                                 : random_range(&state, 2, 30);
+            words[0] = random_coordinate(&state, width);
+            words[1] = random_coordinate(&state, height);
+            /* Plenty of horizontal, vertical & single pixel lines, and
+             * thick lines running just past an edge */
+            switch (random_next(&state) % 8) {
+            case 0:
+                words[2] = words[0];
+                words[3] = random_coordinate(&state, height);
+                break;
+            case 1:
+                words[2] = random_coordinate(&state, width);
+                words[3] = words[1];
+                break;
+            case 2:
+                words[2] = words[0] + random_range(&state, -2, 2);
+                words[3] = words[1] + random_range(&state, -2, 2);
+                break;
+            case 3:
+                words[1] = random_range(&state, -abs(line_width), 1);
+                words[2] = random_coordinate(&state, width);
+                words[3] = words[1] + random_range(&state, -3, 3);
+                break;
+            case 4:
+                words[0] =
+                    width - 1 + random_range(&state, -1, abs(line_width));
+                words[2] = words[0] + random_range(&state, -3, 3);
+                words[3] = random_coordinate(&state, height);
+                break;
+            default:
+                words[2] = random_coordinate(&state, width);
+                words[3] = random_coordinate(&state, height);
+                break;
+            }
+            words[4] = colour;
+            words[5] = line_width;
+            ret = append_record(&buffer, RAW_DISPLAY_TRACE_line, words, 6,
+                                NULL, 0);
+        } else if (choice < 36) {
+            int radius = random_next(&state) % 4 == 0
+                             ? random_range(&state, -3, 3)
+                             : random_range(&state, 0, 2 * width);
+            words[0] = random_coordinate(&state, width);
+            words[1] = random_coordinate(&state, height);
+            /* Often just touching, or just missing, an edge */
+            if (random_next(&state) % 4 == 0)
+                words[0] = (random_next(&state) % 2 ? -radius
+                                                    : width - 1 + radius) +
+                           random_range(&state, -1, 1);
+            if (random_next(&state) % 4 == 0)
+                words[1] = (random_next(&state) % 2 ? -radius
+                                                    : height - 1 + radius) +
+                           random_range(&state, -1, 1);
+            words[2] = radius;
+            words[3] = colour;
+            /* Borders thicker than the radius fill the middle */
+            words[4] = random_next(&state) % 4 == 0
+                           ? random_range(&state, -2, 1)
+                           : random_range(&state, 1, radius + 5);
+            ret = append_record(&buffer, RAW_DISPLAY_TRACE_circle, words, 5,
+                                NULL, 0);
+        } else if (choice < 52) {
+            words[0] = random_coordinate(&state, width);
+            words[1] = random_coordinate(&state, height);
+            words[2] = random_coordinate(&state, width);
+            words[3] = random_coordinate(&state, height);
+            words[4] = colour;
+            words[5] = random_range(&state, -1, 10);
+            ret = append_record(&buffer, RAW_DISPLAY_TRACE_rectangle, words,
+                                6, NULL, 0);
+        } else if (choice < 68) {
+            char string[16];
+            int length = random_range(&state, 0, sizeof(string) - 1);
+
+            /* Mostly printable, with some characters the fonts lack */
+            for (int c = 0; c < length; c++)
+                string[c] = random_next(&state) % 8
+                                ? random_range(&state, 32, 126)
+                                : random_range(&state, 1, 255);
+            string[length] = '\0';
+            words[0] = sizes[random_next(&state) % 12];
+            words[1] = random_coordinate(&state, width);
+            words[2] = random_coordinate(&state, height);
+            words[3] = colour;
+            ret = append_record(&buffer, RAW_DISPLAY_TRACE_string, words, 4,
+                                string, strlen(string));
+        } else if (choice < 76) {
+            random_sprite_draw(&state, words, sprites, width, height);
+            ret = append_record(&buffer, RAW_DISPLAY_TRACE_sprite, words, 4,
+                                NULL, 0);
+        } else if (choice < 80) {
+            int draws = random_range(&state, 0, RANDOM_BATCH);
+
+            words[0] = draws;
+            for (int d = 0; d < draws; d++)
+                random_sprite_draw(&state, words + 1 + d * 4, sprites, width,
+                                   height);
+            ret = append_record(&buffer, RAW_DISPLAY_TRACE_sprites, words,
+                                1 + draws * 4, NULL, 0);
+        } else if (choice < 81) {
+            ret = random_sprite_load(&buffer, &state, sprites++);
+        } else if (choice < 86) {
+            /* Any of the surfaces, including the target, which is left
+             * alone */
+            words[0] = random_coordinate(&state, width);
+            words[1] = random_coordinate(&state, height);
+            words[2] = random_range(&state, 1, 3);
+            words[3] = 0;
+            ret = append_record(&buffer, RAW_DISPLAY_TRACE_blit_surface,
+                                words, 4, NULL, 0);
+        } else if (choice < 91) {
+            uint32_t pixels[RANDOM_IMAGE_SIZE * RANDOM_IMAGE_SIZE];
+
+            /* Shrinking as well as enlarging, by all sorts of factors */
+            words[0] = random_range(&state, 1, RANDOM_IMAGE_SIZE);
+            words[1] = random_range(&state, 1, RANDOM_IMAGE_SIZE);
+            words[2] = random_coordinate(&state, width);
+            words[3] = random_coordinate(&state, height);
+            words[4] = random_range(&state, 1, width);
+            words[5] = random_range(&state, 1, height);
+            words[6] = random_next(&state) % 2 ? RAW_DISPLAY_FILTER_bilinear
+                                               : RAW_DISPLAY_FILTER_nearest;
+            random_pixels(&state, pixels, words[0] * words[1]);
+            ret = append_record(&buffer, RAW_DISPLAY_TRACE_blit_scaled,
+                                words, 7, pixels,
+                                (size_t)words[0] * words[1] * 4);
+        } else if (choice < 95) {
+            words[0] = random_coordinate(&state, width);
+            words[1] = random_coordinate(&state, height);
+            words[2] = random_coordinate(&state, width);
+            words[3] = random_coordinate(&state, height);
+            ret = append_record(&buffer, RAW_DISPLAY_TRACE_clip, words, 4,
+                                NULL, 0);
+        } else if (choice < 96) {
+            ret = append_record(&buffer, RAW_DISPLAY_TRACE_reset_clip, words,
+                                0, NULL, 0);
+        } else if (choice < 97) {
+            words[0] = colour;
+            ret = append_record(&buffer, RAW_DISPLAY_TRACE_clear, words, 1,
+                                NULL, 0);
+        } else {
+            /* Surface handles are 1 to 3, and 0 is the frame */
+            words[0] = random_range(&state, 0, 3);
+            words[1] = 0;
+            ret = append_record(&buffer, RAW_DISPLAY_TRACE_target, words, 2,
+                                NULL, 0);
+        }
+    }
+
+    if (ret < 0) {
+        free(buffer.data);
+        return NULL;
+    }
+    *size = buffer.size;
+    return buffer.data;
+}
+
+/**
+ * Check a trace against the reference routines, and if there is a mismatch
+ * cut it down and write it to a file
+ * @return 0 if there is no mismatch, 1 if there is, < 0 on error
+ */
+static int check_trace(const uint8_t *data, size_t size, const char *output)
+{
+    int width = word(data, 2), height = word(data, 3);
+    struct record *records;
+    int count = index_trace(data, size, &records);
+    int ret = count;
+
+    if (count >= 0)
+        ret = check_records(width, height, records, count, false);
+    if (ret < 0) {
+        fprintf(stderr, "Unable to check the trace: %s\n", strerror(-ret));
+    } else if (ret == count) {
+        printf("%d records match the reference\n", count);
+        ret = 0;
+    } else {
+        printf("Mismatch after record %d (%s), minimising\n", ret,
+               op_names[records[ret].op]);
+        count = minimise_records(width, height, records, ret + 1);
+        check_records(width, height, records, count, true);
+        printf("%d records reproduce it:\n", count);
+        for (int i = 0; i < count; i++)
+            print_record(&records[i]);
+        if (write_trace(output, width, height, records, count) < 0)
+            fprintf(stderr, "Unable to write %s\n", output);
+        else
+            printf("Written to %s\n", output);
+        ret = 1;
+    }
+    free(records);
+    return ret;
+}
+
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_FILLS 3
+
+/**
+ * Time clearing each frame of a display in turn, one way
+ * @param how 0 for memset, 1 for raw_display_clear, 2 for
+ * raw_display_fill_rows
+ * @return Bytes written per nanosecond, or GB/s
+ */
+static double bench_fill(struct raw_display *rd, int how, int passes)
+{
+    int64_t total = 0;
+    size_t bytes = 0;
+    int height, stride, frames;
+
+    raw_display_info(rd, NULL, &height, NULL, &stride);
+    raw_display_get_frame_details(rd, NULL, &frames);
+    /* Warm up, so each frame is mapped in before timing starts */
+    for (int i = 0; i < frames; i++) {
+        raw_display_clear(rd, 0);
+        raw_display_flip(rd);
+    }
+    for (int pass = 0; pass < passes; pass++) {
+        for (int i = 0; i < frames; i++) {
+            uint32_t colour = 0xff000000 | (pass * frames + i) * 0x10101;
+            int64_t start = now_ns();
+
+            switch (how) {
+            case 0:
+                memset(raw_display_get_frame(rd), colour & 0xff,
+                       (size_t)stride * height);
+                break;
+            case 1:
+                raw_display_clear(rd, colour);
+                break;
+            case 2:
+                raw_display_fill_rows(rd, 0, height - 1, colour);
+                break;
+            }
+            total += now_ns() - start;
+            bytes += (size_t)stride * height;
+            raw_display_flip(rd);
+        }
+    }
+    return total ? (double)bytes / total : 0;
+}
+
+/* Compare clearing the frames against memset, the fastest they could be */
+static int bench(int passes)
+{
+    static const char *const names[BENCH_FILLS] = {
+        "memset", "raw_display_clear", "raw_display_fill_rows"};
+    struct raw_display *rd;
+    double rate[BENCH_FILLS];
+    int bpp, stride, frames;
+
+    rd = raw_display_init("Bench", BENCH_WIDTH, BENCH_HEIGHT);
+    if (!rd) {
+        fprintf(stderr, "Unable to create a %dx%d display\n", BENCH_WIDTH,
+                BENCH_HEIGHT);
+        return -ENOMEM;
+    }
+    raw_display_info(rd, NULL, NULL, &bpp, &stride);
+    raw_display_get_frame_details(rd, NULL, &frames);
+    printf("Clearing %d %dx%d %dbpp frames (%.1f MB each) in turn, %d "
+           "times\n",
+           frames, BENCH_WIDTH, BENCH_HEIGHT, bpp,
+           (double)stride * BENCH_HEIGHT / 1e6, passes);
+    printf("Pixel kernels: %s\n", raw_display_isa());
+    printf("%-22s %10s %9s\n", "fill", "GB/s", "memset");
+    for (int how = 0; how < BENCH_FILLS; how++) {
+        rate[how] = bench_fill(rd, how, passes);
+        printf("%-22s %10.2f %8.0f%%\n", names[how], rate[how],
+               rate[0] ? rate[how] * 100 / rate[0] : 0.0);
+    }
+    raw_display_shutdown(rd);
+    return 0;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-n iterations] [-o frame.ppm] trace\n"
+            "       %s -c [-m mismatch.rdt] trace\n"
+            "       %s -r seed [-N count] [-m mismatch.rdt]\n"
+            "       %s -b [-n passes]\n",
+            program, program, program, program);
+}
+
+int main(int argc, char **argv)
+{
+    /* A single frame, so each frame starts with the previous one's
+     * contents, as the trace expects */
+    struct raw_display_config config = {.frame_count = 1};
+    struct replay replay = {0};
+    const char *output = NULL, *filename = NULL;
+    const char *mismatch = "mismatch.rdt";
+    bool check = false, generate = false, bandwidth = false;
+    unsigned long long seed = 0;
+    int iterations = 0, count = 10000;
+    int64_t start, total = 0;
+    uint8_t *data;
+    size_t size = 0;
+    int ret = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0) {
+            check = true;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            bandwidth = true;
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            generate = true;
+            seed = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-N") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            mismatch = argv[++i];
+        } else if (argv[i][0] != '-' && !filename) {
+            filename = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (bandwidth) {
+        if (filename || iterations < 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        return bench(iterations ? iterations : 100) < 0 ? 1 : 0;
+    }
+    if (!iterations)
+        iterations = 1;
+    if (generate) {
+        /* An odd size, so rows are not a whole number of words at 16 &
+         * 24bpp */
+        if (filename || count < 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        data = random_trace(seed, count, 321, 243, &size);
+        if (!data)
+            return 1;
+        ret = check_trace(data, size, mismatch);
+        free(data);
+        return ret == 0 ? 0 : 1;
+    }
+    if (!filename || iterations < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    data = read_file(filename, &size);
+    if (!data) {
+        fprintf(stderr, "Unable to read %s\n", filename);
+        return 1;
+    }
+    if (size < 16 || word(data, 0) != RAW_DISPLAY_TRACE_MAGIC ||
+        word(data, 1) != RAW_DISPLAY_TRACE_VERSION) {
+        fprintf(stderr, "%s is not a version %d trace\n", filename,
+                RAW_DISPLAY_TRACE_VERSION);
+        free(data);
+        return 1;
+    }
+    if (check) {
+        ret = check_trace(data, size, mismatch);
+        free(data);
+        return ret == 0 ? 0 : 1;
+    }
+    replay.width = word(data, 2);
+    replay.height = word(data, 3);
+
+    for (int i = 0; i < iterations && ret >= 0; i++) {
+        /* Each pass starts from scratch, so the surfaces & sprite atlas
+         * are the same as they were for the first */
+        if (replay.rd)
+            free_replay(&replay);
+        replay.rd = raw_display_init_config("Replay", replay.width,
+                                            replay.height, &config);
+        if (!replay.rd) {
+            fprintf(stderr, "Unable to create a %dx%d display\n",
+                    replay.width, replay.height);
+            free(data);
+            return 1;
+        }
+        start = now_ns();
+        ret = replay_trace(&replay, data, size);
+        total += now_ns() - start;
+    }
+    if (ret >= 0) {
+        print_report(&replay, total);
+        if (output && raw_display_save_frame(replay.rd, output) < 0) {
+            fprintf(stderr, "Unable to save %s\n", output);
+            ret = -EIO;
+        }
+    }
+
+    free_replay(&replay);
+    free(data);
+    return ret < 0 ? 1 : 0;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #define _XOPEN_SOURCE 500
 #include <unistd.h>
 #include <string.h>
@@ -33,12 +34,185 @@ static void draw_clock(struct raw_display *rd, int x, int y, int radius)
 	raw_display_draw_line(rd, x, y, x + minute_x, y + minute_y, colour, 3);
 }
 
+/* Where the font checks write cut down copies of the fonts */
+#define FONT_SCRATCH "font_check.psf"
+
+/* A string to draw with a font, and the glyph it should come out as */
+struct font_case {
+	const char *string;
+	int glyph;
+};
+
+/*
+ * Work out which of the test fonts' glyphs was drawn at x, y. Each of their
+ * 8x8 glyphs has its index as the first row and a solid second row.
+ * Returns -1 if no glyph was drawn there
+ */
+static int drawn_glyph(struct raw_display *rd, int x, int y)
+{
+	uint8_t *frame = raw_display_get_frame(rd);
+	int width, height, bpp, stride;
+	int rows[2] = {0, 0};
+
+	raw_display_info(rd, &width, &height, &bpp, &stride);
+	if (!frame || bpp != 32)
+		return -1;
+	for (int row = 0; row < 2; row++) {
+		uint32_t *pixels = (uint32_t *)(frame + (y + row) * stride);
+		for (int col = 0; col < 8; col++)
+			if (pixels[x + col] & 0xffffff)
+				rows[row] |= 0x80 >> col;
+	}
+	return rows[1] == 0xff ? rows[0] : -1;
+}
+
+/* Load a font, and check its size and the glyph each case draws */
+static int check_font(struct raw_display *rd, const char *filename,
+		int glyphs, const struct font_case *cases, int count)
+{
+	struct raw_display_font *font = raw_display_font_load(filename);
+	int width, height, font_glyphs, failures = 0;
+
+	if (!font) {
+		printf("%s: failed to load\n", filename);
+		return 1;
+	}
+	raw_display_font_info(font, &width, &height, &font_glyphs);
+	if (width != 8 || height != 8 || font_glyphs != glyphs) {
+		printf("%s: %dx%d with %d glyphs, not 8x8 with %d\n", filename,
+			width, height, font_glyphs, glyphs);
+		failures++;
+	}
+	for (int i = 0; i < count; i++) {
+		raw_display_clear(rd, 0xff000000);
+		if (raw_display_draw_string_font(rd, font, 1, 0, 0,
+				cases[i].string, 0xffffffff) != 8) {
+			printf("%s: \"%s\" is not one character wide\n",
+				filename, cases[i].string);
+			failures++;
+		}
+		int drawn = drawn_glyph(rd, 0, 0);
+		if (drawn != cases[i].glyph) {
+			printf("%s: \"%s\" drew glyph %d, not %d\n", filename,
+				cases[i].string, drawn, cases[i].glyph);
+			failures++;
+		}
+	}
+	raw_display_font_destroy(font);
+	return failures;
+}
+
+/*
+ * Check that every copy of a font cut short, from an empty file to one
+ * missing the last byte of its table, is rejected
+ */
+static int check_truncated(const char *filename)
+{
+	FILE *fp = fopen(filename, "rb");
+	uint8_t data[4096];
+	size_t size;
+	int failures = 0;
+
+	if (!fp) {
+		printf("%s: unable to read\n", filename);
+		return 1;
+	}
+	size = fread(data, 1, sizeof(data), fp);
+	fclose(fp);
+	for (size_t length = 0; length < size; length++) {
+		fp = fopen(FONT_SCRATCH, "wb");
+		if (!fp || fwrite(data, 1, length, fp) != length) {
+			printf("Unable to write %s\n", FONT_SCRATCH);
+			if (fp)
+				fclose(fp);
+			failures++;
+			break;
+		}
+		fclose(fp);
+		struct raw_display_font *font = raw_display_font_load(FONT_SCRATCH);
+		if (font) {
+			printf("%s: loaded when cut to %zu of %zu bytes\n",
+				filename, length, size);
+			raw_display_font_destroy(font);
+			failures++;
+		}
+	}
+	remove(FONT_SCRATCH);
+	return failures;
+}
+
+/*
+ * Check the PSF font loader against the test fonts in dir (tests/fonts).
+ * psf1.psf has 256 glyphs, each listed in its table for the codepoint of
+ * its index, with U+263A for glyph 1 too and the sequence 'A' U+0300 for
+ * glyph 2. psf2.psf has 4 glyphs, listed as '?'; 'A', U+00E9 and the
+ * sequence 'e' U+0301; 'B' and the sequences 'A' U+030A & "xy"; and
+ * U+1F600 & 'e'. Codepoints only listed in sequences must get the fallback
+ * glyph ('?'), rather than the glyph of the sequence
+ */
+static int check_fonts(const char *dir)
+{
+	static const struct font_case psf1_cases[] = {
+		{"A", 'A'}, {"\x01", 1}, {"\xe2\x98\xba", 1},
+		{"\xc3\xa9", 0xe9}, {"\xcc\x80", '?'}, {"\xe2\x98\xbb", '?'},
+	};
+	static const struct font_case psf2_cases[] = {
+		{"?", 0}, {"A", 1}, {"\xc3\xa9", 1}, {"B", 2}, {"e", 3},
+		{"\xf0\x9f\x98\x80", 3}, {"\xcc\x81", 0}, {"\xcc\x8a", 0},
+		{"x", 0}, {"y", 0},
+	};
+	struct raw_display_config config = {.frame_count = 1};
+	char psf1[256], psf2[256], missing[256];
+	// Names without a directory are also looked for in the console font
+	// directories
+	const char *missing_names[] = {missing, "raw_display_missing.psf"};
+	int failures = 0;
+
+	snprintf(psf1, sizeof(psf1), "%s/psf1.psf", dir);
+	snprintf(psf2, sizeof(psf2), "%s/psf2.psf", dir);
+	snprintf(missing, sizeof(missing), "%s/missing.psf", dir);
+	struct raw_display *rd = raw_display_init_config("Fonts", 16, 8, &config);
+	if (!rd) {
+		fprintf(stderr, "Unable to open display\n");
+		return -1;
+	}
+	failures += check_font(rd, psf1, 256, psf1_cases,
+		sizeof(psf1_cases) / sizeof(psf1_cases[0]));
+	failures += check_font(rd, psf2, 4, psf2_cases,
+		sizeof(psf2_cases) / sizeof(psf2_cases[0]));
+	failures += check_truncated(psf1);
+	failures += check_truncated(psf2);
+	for (int i = 0; i < 2; i++) {
+		struct raw_display_font *font =
+			raw_display_font_load(missing_names[i]);
+		if (font) {
+			printf("%s: loaded, but doesn't exist\n", missing_names[i]);
+			raw_display_font_destroy(font);
+			failures++;
+		}
+	}
+	raw_display_shutdown(rd);
+
+	if (failures) {
+		printf("%d font checks failed\n", failures);
+		return -1;
+	}
+	printf("The fonts in %s load & draw as expected\n", dir);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	struct raw_display *rd;
 	int frame_count = 1000;
 	int fps = 0;
 
+	// raw_display_test -f tests/fonts checks the PSF font loader instead
+	if (argc > 2 && strcmp(argv[1], "-f") == 0)
+		return check_fonts(argv[2]);
+	if (argc > 1)
+		frame_count = atoi(argv[1]);
+
 	printf("raw display test\n");
 
 	rd = raw_display_init("Demo app", 1024, 768);
@@ -49,6 +223,13 @@ int main(int argc, char **argv)
 	int width, height, bpp, stride;
 	raw_display_info(rd, &width, &height, &bpp, &stride);
 	printf("Info: %dx%d@%d (stride=%d)\n", width, height, bpp, stride);
+	uint32_t *line = malloc(width * sizeof(*line));
+	if (!line) {
+		fprintf(stderr, "Unable to allocate a line\n");
+		return -1;
+	}
+	raw_display_set_target_fps(rd, 60);
+	raw_display_set_pacing(rd, RAW_DISPLAY_PACING_low_latency, 200);
 
 	int clock_x = 400;
 	int clock_y = 400;
@@ -68,14 +249,16 @@ int main(int argc, char **argv)
 
 		if (1) {
 			char buffer[20];
+			struct raw_display_view view;
+			raw_display_get_view(rd, &view);
 			for (int y = 0; y < height; y++) {
 				for (int x = 0; x < width; x++) {
-					uint32_t *pos = (uint32_t *)(frame + y * stride + x * bpp / 8);
 					uint8_t green = ((float)y) / height * 256;
 					uint8_t red = ((float)x) / width * 256;
 					uint8_t blue = (i * 10) & 0xff;
-					*pos = 0xff000000 | red << 16 | green << 8 | blue;
+					line[x] = 0xff000000 | red << 16 | green << 8 | blue;
 				}
+				raw_display_span_copy(&view, 0, y, line, width);
 			}
 
 			sprintf(buffer, "%d fps=%d", i % 1000, fps);
@@ -107,7 +290,6 @@ int main(int argc, char **argv)
 			}
 			// do something with the event
 		}
-		//usleep(500 * 1000);
 		int duration = (int)(time(NULL) - start);
 		fps = duration ? (i / duration) : -1;
 	}
@@ -116,6 +298,7 @@ int main(int argc, char **argv)
 	printf("Took %d seconds to do %d frames. %.2f fps\n",
 		duration, frame_count, duration ? ((float)frame_count) / duration : -1);
 	raw_display_shutdown(rd);
+	free(line);
 
 
 	return 0;